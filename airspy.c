@@ -311,40 +311,17 @@ static int rx_callback(airspy_transfer *transfer){
   }
   if(transfer->dropped_samples){
     fprintf(stdout,"dropped %'lld\n",(long long)transfer->dropped_samples);
+    health_drop(frontend,transfer->dropped_samples);
   }
   assert(transfer->sample_type == AIRSPY_SAMPLE_RAW);
   int const sampcount = transfer->sample_count;
-  float * wptr = frontend->in.input_write_pointer.r;
-  uint32_t const *up = (uint32_t *)transfer->samples;
+  health_input(frontend,sampcount);
+  float * const wptr = frontend->in.input_write_pointer.r;
+  uint32_t const * const up = (uint32_t *)transfer->samples;
   assert(wptr != NULL);
   assert(up != NULL);
-  float in_energy = 0;
-  // Libairspy could do this for us, but this minimizes mem copies
-  // This could probably be vectorized someday
-  for(int i=0; i < sampcount; i+= 8){ // assumes multiple of 8
-    int s[8];
-    s[0] =  up[0] >> 20;
-    s[1] =  up[0] >> 8;
-    s[2] =  (up[0] << 4) | (up[1] >> 28);
-    s[3] =  up[1] >> 16;
-    s[4] =  up[1] >> 4;
-    s[5] =  (up[1] << 8) | (up[2] >> 24);
-    s[6] =  up[2] >> 12;
-    s[7] =  up[2];
-    for(int j=0; j < 8; j++){
-      int const x = (s[j] & 0xfff) - 2048; // mask not actually necessary for s[0]
-      if(x == 2047 || x <= -2047){
-	frontend->overranges++;
-	frontend->samp_since_over = 0;
-      } else {
-	frontend->samp_since_over++;
-      }
-      wptr[j] = sdr->scale * x;
-      in_energy += x * x;
-    }
-    wptr += 8;
-    up += 3;
-  }
+  // Libairspy could unpack for us, but this minimizes mem copies
+  float const in_energy = convert_packed12(frontend,wptr,up,sampcount,sdr->scale);
   frontend->samples += sampcount;
   frontend->timestamp = gps_time_ns();
   write_rfilter(&frontend->in,NULL,sampcount); // Update write pointer, invoke FFT
@@ -232,8 +232,10 @@ static int rx_callback(airspyhf_transfer_t *transfer){
   }
   if(transfer->dropped_samples){
     fprintf(stdout,"dropped %'lld\n",(long long)transfer->dropped_samples);
+    health_drop(frontend,transfer->dropped_samples);
   }
   int const sampcount = transfer->sample_count;
+  health_input(frontend,sampcount);
   float complex * const wptr = frontend->in.input_write_pointer.c;
   float complex const * const up = (float complex *)transfer->samples;
   assert(wptr != NULL);
@@ -243,6 +245,7 @@ static int rx_callback(airspyhf_transfer_t *transfer){
     in_energy += cnrmf(up[i]);
     wptr[i] = up[i];
   }
+  iq_correct(frontend,wptr,sampcount); // Optional, usually unnecessary with lib-dsp on
   frontend->samples += sampcount;
   frontend->timestamp = gps_time_ns();
   write_cfilter(&frontend->in,NULL,sampcount); // Update write pointer, invoke FFT
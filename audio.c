@@ -73,6 +73,8 @@ int send_output(struct channel * restrict const chan,float const * restrict buff
   rtp.type = chan->output.rtp.type;
   rtp.ssrc = chan->output.rtp.ssrc;
   rtp.marker = chan->output.silent; // set when transitioning from silent to not silent
+  if(chan->output.silent && chan->output.capture)
+    capture_trigger(chan->frontend,chan->output.rtp.ssrc,0); // Squelch just opened; save the raw input around it
   chan->output.silent = false;
   useconds_t pacing = 0;
   if(chan->output.pacing)
@@ -1,11 +1,45 @@
-// Brand new version that just forks and execs the commands 'avahi-browse' or 'avahi-publish'
+// Brand new version that just spawns the commands 'avahi-browse' or 'avahi-publish'
 // Using the Avahi API is a nightmare; it's a twisted mess of callbacks between "callbacks", "services", "resolvers", etc.
 // March 2024, Phil Karn KA9Q
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include "avahi.h"
 
+extern char **environ;
+
+// Publishers we've started, so they can be withdrawn when a stream goes away
+// Only radiod does that, from its main thread; there's no locking
+struct publisher {
+  struct publisher *next;
+  pid_t pid;
+  char *service_name;
+  char *dns_name;
+};
+static struct publisher *Publishers;
+
+static void remember(pid_t pid,char const *service_name,char const *dns_name){
+  struct publisher * const pp = calloc(1,sizeof(*pp));
+  if(pp == NULL)
+    return; // It'll just keep running
+  pp->pid = pid;
+  pp->service_name = strdup(service_name);
+  pp->dns_name = strdup(dns_name);
+  if(pp->service_name == NULL || pp->dns_name == NULL){
+    free(pp->service_name);
+    free(pp->dns_name);
+    free(pp);
+    return;
+  }
+  pp->next = Publishers;
+  Publishers = pp;
+}
+
 int avahi_start(char const *service_name,char const *service_type,int const service_port,char const *dns_name,int address,char const *description,void *sock,int *socksize){
   if(sock != NULL && socksize != NULL){
     // Return sockaddr structure
@@ -18,56 +52,60 @@ int avahi_start(char const *service_name,char const *service_type,int const serv
     } else
       *socksize = 0;
   }
-  int pid = getpid(); // Advertise the parent's pid, not the child's
-  if(fork() == 0){
-#if 0
-    fprintf(stdout,"avahi-publish-service child pid %d\n",getpid());
-#endif
-    // run "avahi-publish-service --no-fail --host=dns_name service_name service_type service_port description pid hostname" in subprocess
-    // No need to free the asprintf-allocated strings, we're calling exec anyway
-    // Turn off warnings about unused return values from asprintf generated by some compilers
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result" 
-    char *port_string = NULL;
-    asprintf(&port_string, "%d", service_port);
-
-    char *host_string = NULL;
-    asprintf(&host_string, "--host=%s",dns_name);
+  // Build the argument strings here; the children just exec
+  // Forking a big multithreaded process like radiod, then calling malloc in the child, is both slow and unsafe
+  char port_string[16];
+  snprintf(port_string,sizeof(port_string),"%d",service_port);
+  char host_string[1024];
+  snprintf(host_string,sizeof(host_string),"--host=%s",dns_name);
+  char pid_string[32];
+  snprintf(pid_string,sizeof(pid_string),"pid=%d",getpid()); // Advertise the parent's pid, not the child's
+  char hostname[sysconf(_SC_HOST_NAME_MAX)+1];
+  gethostname(hostname,sizeof(hostname));
+  char source_string[sizeof(hostname)+10];
+  snprintf(source_string,sizeof(source_string),"source=%s",hostname);
+  char ip_address_string[INET_ADDRSTRLEN];
+  snprintf(ip_address_string,sizeof(ip_address_string),"%d.%d.%d.%d",(address >> 24) & 0xff, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff);
 
-    char *pid_string = NULL;
-    asprintf(&pid_string, "pid=%d", pid);
-
-    char hostname[sysconf(_SC_HOST_NAME_MAX)];
-    gethostname(hostname,sizeof(hostname));
-    char *source_string = NULL;
-    asprintf(&source_string, "source=%s", hostname);
-#pragma GCC diagnostic pop
-
-#if 0
-    fprintf(stdout,"%s %s %s %s %s %s %s %s %s %s\n",
-	    "avahi-publish-service", "avahi-publish-service", "--no-fail", host_string, service_name, service_type, port_string, description, pid_string, hostname);
-#endif
-    execlp("avahi-publish-service", "avahi-publish-service", "--no-fail", host_string, service_name, service_type, port_string, description, pid_string, source_string, NULL);
-    perror("exec avahi publish service");
+  // run "avahi-publish-service --no-fail --host=dns_name service_name service_type service_port description pid hostname" in subprocess
+  // They register in the background; the caller already has its socket and can start sending
+  char * const service_args[] = {"avahi-publish-service", "--no-fail", host_string, (char *)service_name, (char *)service_type,
+				  port_string, (char *)description, pid_string, source_string, NULL};
+  pid_t child;
+  int r = posix_spawnp(&child,"avahi-publish-service",NULL,NULL,service_args,environ);
+  if(r != 0){
+    fprintf(stdout,"spawn avahi-publish-service: %s\n",strerror(r));
     return -1;
   }
-  if(fork() == 0){
-    // run "avahi-publish-address dns_name address"
-    char *ip_address_string = NULL;    // No need to free, we're calling exec
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result" 
-    asprintf(&ip_address_string,"%d.%d.%d.%d",(address >> 24) & 0xff, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff);
-#pragma GCC diagnostic pop
-#if 0
-    fprintf(stdout,"avahi start: ip address string = %s\n",ip_address_string);
-    fprintf(stdout,"avahi-publish-address child pid %d\n",getpid());
-    fprintf(stdout,"%s %s %s %s\n",
-	    "avahi-publish-address", "avahi-publish-address",dns_name,ip_address_string);
-#endif
-    execlp("avahi-publish-address", "avahi-publish-address",dns_name,ip_address_string, NULL);
-    perror("exec avahi publish address");
+  remember(child,service_name,dns_name);
+  // run "avahi-publish-address dns_name address"
+  char * const address_args[] = {"avahi-publish-address", (char *)dns_name, ip_address_string, NULL};
+  r = posix_spawnp(&child,"avahi-publish-address",NULL,NULL,address_args,environ);
+  if(r != 0){
+    fprintf(stdout,"spawn avahi-publish-address: %s\n",strerror(r));
     return -1;
   }
-
+  remember(child,service_name,dns_name);
   return 0;
 }
+
+// Stop the publishers started by avahi_start() with this service name and DNS name
+// Returns the number stopped
+int avahi_stop(char const *service_name,char const *dns_name){
+  int count = 0;
+  for(struct publisher **ppp = &Publishers; *ppp != NULL;){
+    struct publisher * const pp = *ppp;
+    if(strcmp(pp->service_name,service_name) != 0 || strcmp(pp->dns_name,dns_name) != 0){
+      ppp = &pp->next;
+      continue;
+    }
+    *ppp = pp->next;
+    kill(pp->pid,SIGTERM); // The avahi daemon withdraws its records when it exits
+    waitpid(pp->pid,NULL,0);
+    free(pp->service_name);
+    free(pp->dns_name);
+    free(pp);
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,195 @@
+// Micro-benchmark for the audio-rate DSP in libradio: the broadcast FM multiplex decoder
+// (fmbcast, as used by radiod's wfm demodulator, stereod and rdsd) and the polyphase
+// resampler monitor uses to bring streams to the sound card rate
+//
+// Input is synthetic: a stereo multiplex with pilot and noise, or gaussian noise for the resampler,
+// generated with a fixed seed and replayed every block.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <locale.h>
+#include <sysexits.h>
+#include <fftw3.h>
+
+#include "misc.h"
+#include "filter.h"
+#include "fmbcast.h"
+#include "resample.h"
+#include "bench.h"
+
+char const *App_path;
+int Verbose;
+
+static int Blocks = 500;
+static float Blocktime = 20.0;          // ms, radiod default
+static int Composite_samprate = 384000; // wfm
+static int Audio_samprate = 48000;
+static float Kaiser_beta = 3.0;
+static unsigned int Seed = 1;
+
+// Rate pairs monitor commonly sees: narrowband and wideband streams to a 48 kHz or 44.1 kHz card
+static struct {
+  int in_rate;
+  int out_rate;
+  int channels;
+} const Conversions[] = {
+  {12000, 48000, 1},
+  {24000, 48000, 1},
+  {16000, 44100, 1},
+  {48000, 44100, 2},
+  {0, 0, 0},
+};
+
+static void bench_fmbcast(FILE *results,int flags);
+static void bench_resample(FILE *results,int in_rate,int out_rate,int channels);
+
+int main(int argc,char * const argv[]){
+  App_path = argv[0];
+  setlocale(LC_ALL,getenv("LANG"));
+
+  char const *results_file = NULL;
+  int c;
+  while((c = getopt(argc,argv,"b:ef:n:S:vW:")) != -1){
+    switch(c){
+    case 'b':
+      Blocktime = strtof(optarg,NULL);
+      break;
+    case 'e':
+      FFTW_planning_level = FFTW_ESTIMATE;
+      break;
+    case 'f':
+      results_file = optarg;
+      break;
+    case 'n':
+      Blocks = strtol(optarg,NULL,0);
+      break;
+    case 'S':
+      Seed = strtoul(optarg,NULL,0);
+      break;
+    case 'v':
+      Verbose++;
+      break;
+    case 'W':
+      Wisdom_file = optarg;
+      break;
+    default:
+      fprintf(stderr,"Usage: %s [-b blocktime_ms] [-n blocks] [-e] [-W wisdom_file] [-f results_file]\n",argv[0]);
+      exit(EX_USAGE);
+    }
+  }
+  if(Blocks < 2 || Blocktime <= 0){
+    fprintf(stderr,"Need at least 2 blocks and a positive block time\n");
+    exit(EX_USAGE);
+  }
+  FILE *results = stdout;
+  if(results_file != NULL && (results = fopen(results_file,"a")) == NULL){
+    fprintf(stderr,"Can't append to %s: %s\n",results_file,strerror(errno));
+    exit(EX_CANTCREAT);
+  }
+  bench_header(results,argc,argv);
+
+  bench_fmbcast(results,0);
+  bench_fmbcast(results,FMBCAST_STEREO);
+  bench_fmbcast(results,FMBCAST_STEREO|FMBCAST_RDS);
+  for(int i = 0; Conversions[i].in_rate != 0; i++)
+    bench_resample(results,Conversions[i].in_rate,Conversions[i].out_rate,Conversions[i].channels);
+
+  if(results != stdout)
+    fclose(results);
+  exit(EX_OK);
+}
+
+// One block of composite in, one block of audio out, as wfm.c does it
+static void bench_fmbcast(FILE *results,int flags){
+  struct fmbcast fb;
+  if(fmbcast_init(&fb,Composite_samprate,Audio_samprate,Blocktime,Kaiser_beta,flags) != 0){
+    fprintf(stderr,"fmbcast_init(%d,%d,%.3f) failed\n",Composite_samprate,Audio_samprate,Blocktime);
+    return;
+  }
+  int const L = fb.composite_L;
+
+  // 1 kHz left, 3 kHz right, 9% pilot, noise 40 dB down
+  // The pilot frequency must be an exact number of cycles per block so the replayed block is continuous
+  bench_seed(Seed);
+  float *composite = malloc(sizeof(*composite) * L);
+  assert(composite != NULL);
+  for(int i = 0; i < L; i++){
+    double const t = (double)i / Composite_samprate;
+    float const left = 0.4 * sin(2 * M_PI * 1000 * t);
+    float const right = 0.4 * sin(2 * M_PI * 3000 * t);
+    double const pilot = 2 * M_PI * 19000 * t;
+    composite[i] = 0.45 * (left + right) + 0.45 * (left - right) * sin(2 * pilot)
+      + 0.09 * sin(pilot) + 0.01 * bench_gaussian();
+  }
+  float *audio = malloc(sizeof(*audio) * 2 * fb.audio_L);
+  assert(audio != NULL);
+
+  struct bench_stats stats;
+  bench_stats_init(&stats,Blocks);
+  int channels = 0;
+  for(int block = 0; block < Blocks; block++){
+    int64_t const start = bench_clock();
+    fmbcast_write(&fb,composite,L);
+    channels = fmbcast_decode(&fb,audio,1.0);
+    if(block > 0) // Skip first-touch page faults
+      bench_stats_add(&stats,bench_clock() - start);
+  }
+  char params[256];
+  snprintf(params,sizeof(params),"mode=%s composite_samprate=%d audio_samprate=%d blocktime_ms=%g L=%d",
+	   (flags & FMBCAST_RDS) ? "stereo+rds" : (flags & FMBCAST_STEREO) ? "stereo" : "mono",
+	   Composite_samprate,Audio_samprate,Blocktime,L);
+  double const mean = bench_mean(&stats);
+  char extra[128];
+  snprintf(extra,sizeof(extra),"channels_out=%d streams_per_core=%.1f",channels,mean > 0 ? Blocktime * 1e6 / mean : 0);
+  bench_report(results,"fmbcast",params,&stats,L,"samples",extra);
+
+  bench_stats_free(&stats);
+  FREE(audio);
+  FREE(composite);
+  fmbcast_free(&fb);
+}
+
+// One radiod output packet's worth of frames per call
+static void bench_resample(FILE *results,int in_rate,int out_rate,int channels){
+  struct resampler rs;
+  if(resampler_init(&rs,in_rate,out_rate,channels) != 0){
+    fprintf(stderr,"resampler_init(%d,%d,%d) failed\n",in_rate,out_rate,channels);
+    return;
+  }
+  int const frames = lround(in_rate * Blocktime / 1000.0);
+  bench_seed(Seed);
+  float *input = malloc(sizeof(*input) * frames * channels);
+  float *output = malloc(sizeof(*output) * resample_max_output(&rs,frames) * channels);
+  assert(input != NULL && output != NULL);
+  for(int i = 0; i < frames * channels; i++)
+    input[i] = 0.1 * bench_gaussian();
+
+  struct bench_stats stats;
+  bench_stats_init(&stats,Blocks);
+  for(int block = 0; block < Blocks; block++){
+    int64_t const start = bench_clock();
+    resample(&rs,output,input,frames);
+    if(block > 0)
+      bench_stats_add(&stats,bench_clock() - start);
+  }
+  char params[256];
+  snprintf(params,sizeof(params),"in_samprate=%d out_samprate=%d channels=%d frames=%d taps=%d phases=%u",
+	   in_rate,out_rate,channels,frames,rs.bank->taps,rs.bank->phases);
+  double const mean = bench_mean(&stats);
+  char extra[128];
+  snprintf(extra,sizeof(extra),"streams_per_core=%.1f",mean > 0 ? Blocktime * 1e6 / mean : 0);
+  bench_report(results,"resample",params,&stats,frames,"frames",extra);
+
+  bench_stats_free(&stats);
+  FREE(input);
+  FREE(output);
+  resampler_free(&rs);
+}
@@ -0,0 +1,385 @@
+// Benchmark for radiod's channel demodulators: linear.c and fm.c run as radiod runs them, each on a
+// struct channel bound to a synthetic front end, with the real send_output() in audio.c sending RTP
+// to a loopback socket that nobody reads. As in golden.c, send_radio_status() is replaced to pace
+// the front end, so every block is processed and none is dropped however long it takes.
+//
+// Per-block latency runs from the front end releasing a block to the demod asking for the next one,
+// so it includes the forward FFT, downconvert(), the demod itself and send_output().
+// send_output() is also timed alone for each output encoding.
+//
+// Input is synthetic: noise plus AM, FM and SSB carriers, generated once with a fixed seed and
+// replayed every block.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <locale.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <fftw3.h>
+
+#include "misc.h"
+#include "filter.h"
+#include "multicast.h"
+#include "radio.h"
+#include "bench.h"
+
+extern int N_worker_threads; // owned by filter.c
+
+char const *App_path;
+int Verbose;
+
+// Normally in main.c; radio.c, audio.c and the demodulators use them
+float Blocktime = 20.0;          // ms, radiod default
+struct channel Template;
+int Output_fd = -1;
+int Mcast_ttl;
+struct sockaddr_storage Metadata_dest_socket;
+int Overlap = 5;                 // radiod default
+
+static int Blocks = 500;
+static int Samprate = 2048000;   // rtlsdr default
+static bool Isreal;
+static unsigned int Seed = 1;
+static int const Timeout = 60;   // sec to wait for a demodulator to ask for its next block; FFTW planning can be slow
+
+// Carriers as fractions of the front end sample rate above its frequency, so real front ends see them too
+static double const AM_freq = 0.05;
+static double const FM_freq = 0.1;
+static double const USB_freq = 0.15;
+
+static struct frontend Frontend;
+static struct channel Channel;
+static struct sockaddr_storage Sink; // Loopback address of the socket nobody reads
+
+// State shared with the send_radio_status() replacement
+static pthread_mutex_t Run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Run_cond = PTHREAD_COND_INITIALIZER;
+static struct {
+  int64_t *poll_time;  // When each poll came in
+  int polls;           // send_radio_status() calls so far
+} Run;
+
+// With status.output_interval = 1, rearming the output status timer here makes downconvert() call this
+// once per block just before it waits for the block, muted or not, so it marks the end of the previous block's work
+int send_radio_status(struct sockaddr const *sock,struct frontend const *frontend,struct channel *chan){
+  (void)sock;
+  (void)frontend;
+  int64_t const now = bench_clock();
+  chan->status.output_timer = 1; // downconvert() holds chan->status.lock; it only rearms it when not silent
+  pthread_mutex_lock(&Run_mutex);
+  int const poll = Run.polls++;
+  if(poll <= Blocks + 1)
+    Run.poll_time[poll] = now;
+  if(Run.polls == Blocks + 2)
+    chan->terminate = true; // Seen on the next pass, after this poll has timed the last block
+  pthread_cond_broadcast(&Run_cond);
+  pthread_mutex_unlock(&Run_mutex);
+  return 0;
+}
+
+int reset_radio_status(struct channel *chan){
+  (void)chan;
+  return 0;
+}
+
+bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length){
+  (void)chan;
+  (void)buffer;
+  (void)length;
+  return false;
+}
+
+// No raw capture here; audio.c calls this when a squelch opens
+int capture_trigger(struct frontend *frontend,uint32_t ssrc,float post){
+  (void)frontend;
+  (void)ssrc;
+  (void)post;
+  return 0;
+}
+
+static void usage(char const *name){
+  fprintf(stderr,"Usage: %s [-r samprate [-R]] [-b blocktime_ms] [-o overlap] [-n blocks] [-t fft_threads] [-e] [-W wisdom_file] [-f results_file]\n",name);
+  exit(EX_USAGE);
+}
+
+static int sink_open(void);
+static void run_demod(FILE *results,char const *name,void *(*demod)(void *),double offset,int samprate,float low,float high,bool env);
+static void run_send(FILE *results,enum encoding encoding,int samprate,int channels);
+
+int main(int argc,char * const argv[]){
+  App_path = argv[0];
+  setlocale(LC_ALL,getenv("LANG"));
+
+  char const *results_file = NULL;
+  int c;
+  while((c = getopt(argc,argv,"b:ef:n:o:r:RS:t:vW:")) != -1){
+    switch(c){
+    case 'b':
+      Blocktime = strtof(optarg,NULL);
+      break;
+    case 'e':
+      FFTW_planning_level = FFTW_ESTIMATE; // Quick, but not what radiod would run
+      break;
+    case 'f':
+      results_file = optarg;
+      break;
+    case 'n':
+      Blocks = strtol(optarg,NULL,0);
+      break;
+    case 'o':
+      Overlap = strtol(optarg,NULL,0);
+      break;
+    case 'r':
+      Samprate = strtol(optarg,NULL,0);
+      break;
+    case 'R':
+      Isreal = true;
+      break;
+    case 'S':
+      Seed = strtoul(optarg,NULL,0);
+      break;
+    case 't':
+      N_worker_threads = strtol(optarg,NULL,0);
+      break;
+    case 'v':
+      Verbose++;
+      break;
+    case 'W':
+      Wisdom_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(Blocks < 2 || Overlap < 2 || Blocktime <= 0 || Samprate <= 0 || N_worker_threads < 1)
+    usage(argv[0]);
+
+  if(sink_open() != 0)
+    exit(EX_OSERR);
+  FILE *results = stdout;
+  if(results_file != NULL && (results = fopen(results_file,"a")) == NULL){
+    fprintf(stderr,"Can't append to %s: %s\n",results_file,strerror(errno));
+    exit(EX_CANTCREAT);
+  }
+  bench_header(results,argc,argv);
+
+  // The demods as the default presets set them up
+  run_demod(results,"linear_usb",demod_linear,USB_freq,12000,+100,+3000,false);
+  run_demod(results,"linear_am",demod_linear,AM_freq,12000,-5000,+5000,true);
+  run_demod(results,"fm",demod_fm,FM_freq,24000,-8000,+8000,false);
+
+  run_send(results,S16BE,12000,1);
+  run_send(results,S16BE,48000,2);
+  run_send(results,F32LE,12000,1);
+  run_send(results,OPUS,12000,1);
+
+  if(results != stdout)
+    fclose(results);
+  exit(EX_OK);
+}
+
+// An unread UDP socket on loopback stands in for the multicast group; once its receive
+// queue fills the kernel drops what's sent, as it would for a group nobody has joined
+static int sink_open(void){
+  int const fd = socket(AF_INET,SOCK_DGRAM,0);
+  struct sockaddr_in sin = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t len = sizeof(sin);
+  if(fd == -1 || bind(fd,(struct sockaddr *)&sin,sizeof(sin)) != 0 || getsockname(fd,(struct sockaddr *)&sin,&len) != 0){
+    fprintf(stderr,"Can't create loopback sink: %s\n",strerror(errno));
+    return -1;
+  }
+  memcpy(&Sink,&sin,sizeof(sin));
+  if((Output_fd = socket(AF_INET,SOCK_DGRAM,0)) == -1){
+    fprintf(stderr,"Can't create output socket: %s\n",strerror(errno));
+    return -1;
+  }
+  return 0; // The sink stays open until exit
+}
+
+// Channel set up as radiod's defaults do, offset (a fraction of the front end rate) from the front end frequency
+static struct channel *channel_init(double offset,int samprate,float low,float high){
+  struct channel * const chan = &Channel;
+  memset(chan,0,sizeof(*chan));
+  set_defaults(chan);
+  chan->frontend = &Frontend;
+  chan->tune.freq = Frontend.frequency + offset * Frontend.samprate;
+  chan->output.rtp.ssrc = 1;
+  chan->output.samprate = samprate;
+  chan->filter.min_IF = low;
+  chan->filter.max_IF = high;
+  chan->status.output_interval = 1;
+  chan->status.output_timer = 1;
+  memcpy(&chan->output.dest_socket,&Sink,sizeof(Sink));
+  return chan;
+}
+
+// Wait until the demod has polled for status 'count' times
+static int wait_polls(int count){
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME,&deadline);
+  deadline.tv_sec += Timeout;
+  pthread_mutex_lock(&Run_mutex);
+  while(Run.polls < count){
+    if(pthread_cond_timedwait(&Run_cond,&Run_mutex,&deadline) == ETIMEDOUT)
+      break;
+  }
+  bool const ready = Run.polls >= count;
+  pthread_mutex_unlock(&Run_mutex);
+  return ready ? 0 : -1;
+}
+
+// One demodulator on a front end sized as main.c sizes it
+static void run_demod(FILE *results,char const *name,void *(*demod)(void *),double offset,int samprate,float low,float high,bool env){
+  struct frontend * const frontend = &Frontend;
+  memset(frontend,0,sizeof(*frontend));
+  frontend->samprate = Samprate;
+  frontend->isreal = Isreal;
+  frontend->frequency = 10e6; // Arbitrary
+  frontend->min_IF = Isreal ? 0 : -Samprate / 2;
+  frontend->max_IF = Samprate / 2;
+  int const L = frontend->L = lround(Samprate * Blocktime / 1000.0);
+  int const M = frontend->M = L / (Overlap - 1) + 1;
+  int const olen = lround(samprate * Blocktime / 1000.0);
+  if(L <= 0 || olen <= 0 || (long long)olen * Samprate != (long long)L * samprate){
+    fprintf(stderr,"%s: output rate %d doesn't divide input rate %d in a %.3f ms block\n",name,samprate,Samprate,Blocktime);
+    return;
+  }
+  if(create_filter_input(&frontend->in,L,M,Isreal ? REAL : COMPLEX) == NULL){
+    fprintf(stderr,"create_filter_input(%d,%d) failed\n",L,M);
+    return;
+  }
+  pthread_mutex_init(&frontend->status_mutex,NULL);
+  pthread_cond_init(&frontend->status_cond,NULL);
+
+  // Noise 50 dB down, an AM carrier, an FM carrier with 5 kHz deviation and a USB tone
+  bench_seed(Seed);
+  float *rinput = NULL;
+  complex float *cinput = NULL;
+  if(Isreal)
+    rinput = malloc(sizeof(*rinput) * L);
+  else
+    cinput = malloc(sizeof(*cinput) * L);
+  double fm_phase = 0;
+  float energy = 0;
+  for(int i = 0; i < L; i++){
+    double const t = (double)i / Samprate;
+    double const mod = sin(2 * M_PI * 1000 * t);
+    fm_phase += 2 * M_PI * 5000 * mod / Samprate;
+    complex double const s = 0.1 * (1 + 0.5 * mod) * cispi(2 * AM_freq * Samprate * t)
+      + 0.05 * cispi(2 * FM_freq * Samprate * t + fm_phase / M_PI)
+      + 0.05 * cispi(2 * (USB_freq * Samprate + 1500) * t);
+    if(Isreal){
+      rinput[i] = creal(s) + 0.003 * bench_gaussian();
+      energy += rinput[i] * rinput[i];
+    } else {
+      cinput[i] = s + 0.003 * M_SQRT1_2 * bench_complex_gaussian();
+      energy += cnrmf(cinput[i]);
+    }
+  }
+  frontend->if_power_instant = frontend->if_power = energy / L;
+
+  struct channel * const chan = channel_init(offset,samprate,low,high);
+  chan->linear.env = env;
+  Run.poll_time = calloc(Blocks + 2,sizeof(*Run.poll_time));
+  int64_t *release = calloc(Blocks + 2,sizeof(*release));
+  assert(Run.poll_time != NULL && release != NULL);
+  Run.polls = 0;
+  pthread_t thread;
+  if(pthread_create(&thread,NULL,demod,chan) != 0){
+    fprintf(stderr,"%s: can't start demodulator\n",name);
+    exit(EX_OSERR);
+  }
+  for(int block = 0; block <= Blocks + 1; block++){
+    if(wait_polls(block + 1) != 0){
+      // The thread is stuck with our state, so there's no safe way to go on
+      fprintf(stderr,"%s: demodulator stalled at block %d\n",name,block);
+      exit(EX_SOFTWARE);
+    }
+    release[block] = bench_clock();
+    if(Isreal)
+      write_rfilter(&frontend->in,rinput,L);
+    else
+      write_cfilter(&frontend->in,cinput,L);
+  }
+  pthread_join(thread,NULL);
+
+  // Poll n+1 comes when block n is done
+  struct bench_stats stats;
+  bench_stats_init(&stats,Blocks);
+  for(int block = 1; block <= Blocks; block++) // Skip first-touch page faults
+    bench_stats_add(&stats,Run.poll_time[block + 1] - release[block]);
+
+  double const block_ns = Blocktime * 1e6;
+  double const mean = bench_mean(&stats);
+  char params[512];
+  snprintf(params,sizeof(params),"samprate=%d type=%s blocktime_ms=%g overlap=%d L=%d M=%d fft_threads=%d out_samprate=%d olen=%d encoding=%s",
+	   Samprate,Isreal ? "real" : "complex",Blocktime,Overlap,L,M,N_worker_threads,samprate,olen,encoding_string(chan->output.encoding));
+  char extra[256];
+  snprintf(extra,sizeof(extra),"realtime_x=%.3g packets=%llu drops=%d",mean > 0 ? block_ns / mean : 0,
+	   (unsigned long long)chan->output.rtp.packets,chan->filter.out.block_drops);
+  bench_report(results,name,params,&stats,olen * chan->output.channels,"samples",extra);
+
+  bench_stats_free(&stats);
+  delete_filter_output(&chan->filter.out);
+  FREE(chan->filter.energies);
+  FREE(chan->status.command);
+  FREE(chan->spectrum.bin_data);
+  delete_filter_input(&frontend->in);
+  pthread_mutex_destroy(&chan->status.lock);
+  pthread_mutex_destroy(&frontend->status_mutex);
+  pthread_cond_destroy(&frontend->status_cond);
+  FREE(Run.poll_time);
+  FREE(release);
+  FREE(rinput);
+  FREE(cinput);
+}
+
+// send_output() alone, one block at a time from this thread
+static void run_send(FILE *results,enum encoding encoding,int samprate,int channels){
+  int const frames = lround(samprate * Blocktime / 1000.0);
+  struct channel * const chan = channel_init(0,samprate,0,0);
+  chan->output.encoding = encoding;
+  chan->output.channels = channels;
+  bench_seed(Seed);
+  float *audio = malloc(sizeof(*audio) * frames * channels);
+  assert(audio != NULL);
+  for(int i = 0; i < frames * channels; i++)
+    audio[i] = 0.1 * bench_gaussian();
+
+  struct bench_stats stats;
+  bench_stats_init(&stats,Blocks);
+  for(int block = 0; block <= Blocks; block++){
+    int64_t const start = bench_clock();
+    send_output(chan,audio,frames,false);
+    if(block > 0) // The Opus encoder is created on the first call
+      bench_stats_add(&stats,bench_clock() - start);
+  }
+  char params[256];
+  snprintf(params,sizeof(params),"encoding=%s blocktime_ms=%g out_samprate=%d channels=%d frames=%d",
+	   encoding_string(encoding),Blocktime,samprate,channels,frames);
+  char extra[128];
+  snprintf(extra,sizeof(extra),"packets=%llu bytes=%llu",
+	   (unsigned long long)chan->output.rtp.packets,(unsigned long long)chan->output.rtp.bytes);
+  bench_report(results,"send_output",params,&stats,frames * channels,"samples",extra);
+
+  bench_stats_free(&stats);
+  if(chan->output.opus != NULL)
+    opus_encoder_destroy(chan->output.opus);
+  FREE(audio);
+}
@@ -0,0 +1,294 @@
+// Micro-benchmark for the radiod channelizer: the front end's forward FFT (execute_filter_input),
+// each channel's downconversion (execute_filter_output, fine tuning and energy, as in downconvert())
+// and filter response changes (set_filter), at front end and channel parameters typical of real configs
+//
+// Input is synthetic, in the style of sig_gen: gaussian noise plus a carrier, generated once
+// with a fixed seed and replayed every block.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <getopt.h>
+#include <locale.h>
+#include <sysexits.h>
+#include <fftw3.h>
+
+#include "misc.h"
+#include "filter.h"
+#include "osc.h"
+#include "bench.h"
+
+extern int N_worker_threads; // owned by filter.c
+
+// Front ends as radiod configures them by default
+static struct preset {
+  char const *name;
+  int samprate;
+  bool isreal;
+} const Presets[] = {
+  {"rx888", 64800000, true},
+  {"airspy", 20000000, true},
+  {"airspyhf", 912000, false},
+  {"rtlsdr", 2048000, false},
+  {"funcube", 192000, false},
+  {NULL, 0, false},
+};
+
+char const *App_path;
+int Verbose;
+
+static int Blocks = 100;
+static float Blocktime = 20.0;     // ms, radiod default
+static int Overlap = 5;            // radiod default
+static int Out_samprate = 12000;   // Typical linear/FM channel
+static float Kaiser_beta = 11.0;
+static float Noise = -30;          // dBFS
+static float Carrier = -10;        // dBFS
+static unsigned int Seed = 1;
+
+struct chan {
+  struct filter_out out;
+  struct osc fine;
+  int shift;
+  float bb_power;
+};
+
+static void usage(char const *name){
+  fprintf(stderr,"Usage: %s [-p rx888|airspy|airspyhf|rtlsdr|funcube] [-r samprate [-R]] [-b blocktime_ms] [-o overlap] [-c channels[,channels...]] [-s out_samprate] [-n blocks] [-t fft_threads] [-e] [-W wisdom_file] [-f results_file]\n",name);
+  exit(EX_USAGE);
+}
+
+static void run(FILE *results,char const *preset,int samprate,bool isreal,int nchans);
+
+int main(int argc,char * const argv[]){
+  App_path = argv[0];
+  setlocale(LC_ALL,getenv("LANG"));
+
+  struct preset const *pp = &Presets[0];
+  int samprate = 0;
+  bool isreal = false;
+  bool real_set = false;
+  char const *channel_list = "1,10,100";
+  char const *results_file = NULL;
+  int c;
+  while((c = getopt(argc,argv,"b:c:ef:n:o:p:r:Rs:S:t:vW:")) != -1){
+    switch(c){
+    case 'b':
+      Blocktime = strtof(optarg,NULL);
+      break;
+    case 'c':
+      channel_list = optarg;
+      break;
+    case 'e':
+      FFTW_planning_level = FFTW_ESTIMATE; // Quick, but not what radiod would run
+      break;
+    case 'f':
+      results_file = optarg;
+      break;
+    case 'n':
+      Blocks = strtol(optarg,NULL,0);
+      break;
+    case 'o':
+      Overlap = strtol(optarg,NULL,0);
+      break;
+    case 'p':
+      for(pp = Presets; pp->name != NULL; pp++)
+	if(strcasecmp(pp->name,optarg) == 0)
+	  break;
+      if(pp->name == NULL){
+	fprintf(stderr,"Unknown preset %s\n",optarg);
+	usage(argv[0]);
+      }
+      break;
+    case 'r':
+      samprate = strtol(optarg,NULL,0);
+      break;
+    case 'R':
+      isreal = real_set = true;
+      break;
+    case 's':
+      Out_samprate = strtol(optarg,NULL,0);
+      break;
+    case 'S':
+      Seed = strtoul(optarg,NULL,0);
+      break;
+    case 't':
+      N_worker_threads = strtol(optarg,NULL,0);
+      break;
+    case 'v':
+      Verbose++;
+      break;
+    case 'W':
+      Wisdom_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(Blocks < 2 || Overlap < 2 || Blocktime <= 0 || Out_samprate <= 0 || N_worker_threads < 1)
+    usage(argv[0]);
+
+  char const *preset = pp->name;
+  if(samprate == 0){
+    samprate = pp->samprate;
+    isreal = pp->isreal;
+  } else {
+    preset = "custom";
+    if(!real_set)
+      isreal = false;
+  }
+  FILE *results = stdout;
+  if(results_file != NULL && (results = fopen(results_file,"a")) == NULL){
+    fprintf(stderr,"Can't append to %s: %s\n",results_file,strerror(errno));
+    exit(EX_CANTCREAT);
+  }
+  bench_header(results,argc,argv);
+
+  char *list = strdup(channel_list);
+  char *saveptr = NULL;
+  for(char const *tok = strtok_r(list,",",&saveptr); tok != NULL; tok = strtok_r(NULL,",",&saveptr)){
+    int const nchans = strtol(tok,NULL,0);
+    if(nchans > 0)
+      run(results,preset,samprate,isreal,nchans);
+  }
+  FREE(list);
+  if(results != stdout)
+    fclose(results);
+  exit(EX_OK);
+}
+
+// One front end with nchans channels spread across it
+static void run(FILE *results,char const *preset,int samprate,bool isreal,int nchans){
+  // Same block and filter sizes as radiod's main.c
+  int const L = lround(samprate * Blocktime / 1000.0);
+  int const M = L / (Overlap - 1) + 1;
+  int const N = L + M - 1;
+  int const olen = lround(Out_samprate * Blocktime / 1000.0);
+  if(L <= 0 || olen <= 0 || (long long)olen * samprate != (long long)L * Out_samprate){
+    fprintf(stderr,"%s: output rate %d doesn't divide input rate %d in a %.3f ms block\n",preset,Out_samprate,samprate,Blocktime);
+    return;
+  }
+  struct filter_in in = {0};
+  if(create_filter_input(&in,L,M,isreal ? REAL : COMPLEX) == NULL){
+    fprintf(stderr,"create_filter_input(%d,%d) failed\n",L,M);
+    return;
+  }
+  // Synthetic front end input: noise plus one carrier at 1/7 of the sample rate
+  bench_seed(Seed);
+  float const noise = dB2voltage(Noise);
+  float const carrier = dB2voltage(Carrier);
+  float *rinput = NULL;
+  complex float *cinput = NULL;
+  if(isreal){
+    rinput = malloc(sizeof(*rinput) * L);
+    for(int i = 0; i < L; i++)
+      rinput[i] = noise * M_SQRT1_2 * bench_gaussian() + carrier * cosf(2 * M_PI * i / 7.0);
+  } else {
+    cinput = malloc(sizeof(*cinput) * L);
+    for(int i = 0; i < L; i++)
+      cinput[i] = noise * M_SQRT1_2 * bench_complex_gaussian() + carrier * cispi(2.0f * i / 7.0f);
+  }
+  // Channels evenly spread over the usable band, off bin centers so the fine oscillator does real work
+  struct chan *chans = calloc(nchans,sizeof(*chans));
+  assert(chans != NULL);
+  double const hzperbin = (double)samprate / N;
+  double const span = isreal ? samprate / 2.0 : samprate;
+  double const low = isreal ? 0 : -samprate / 2.0;
+
+  struct bench_stats set_stats;
+  bench_stats_init(&set_stats,nchans);
+  for(int i = 0; i < nchans; i++){
+    struct chan * const cp = &chans[i];
+    double const freq = low + span * (i + 0.5) / nchans + 0.37 * hzperbin;
+    cp->shift = lround(freq / hzperbin);
+    double const remainder = freq - cp->shift * hzperbin;
+    create_filter_output(&cp->out,&in,NULL,olen,COMPLEX);
+    int64_t const start = bench_clock();
+    set_filter(&cp->out,-5000.0f / Out_samprate,+5000.0f / Out_samprate,Kaiser_beta);
+    bench_stats_add(&set_stats,bench_clock() - start);
+    set_osc(&cp->fine,remainder / Out_samprate,0);
+  }
+  struct bench_stats in_stats,out_stats,block_stats;
+  bench_stats_init(&in_stats,Blocks);
+  bench_stats_init(&out_stats,Blocks * nchans);
+  bench_stats_init(&block_stats,Blocks);
+
+  for(int block = 0; block < Blocks; block++){
+    // The forward FFT runs on filter.c's worker thread(s); wait for it the same way execute_filter_output does
+    unsigned int const jobnum = in.next_jobnum;
+    int64_t const block_start = bench_clock();
+    if(isreal)
+      write_rfilter(&in,rinput,L);
+    else
+      write_cfilter(&in,cinput,L);
+    pthread_mutex_lock(&in.filter_mutex);
+    while((int)(jobnum - in.completed_jobs[jobnum % ND]) > 0)
+      pthread_cond_wait(&in.filter_cond,&in.filter_mutex);
+    pthread_mutex_unlock(&in.filter_mutex);
+    int64_t const fft_done = bench_clock();
+
+    for(int i = 0; i < nchans; i++){
+      // The per-block work in radio.c:downconvert()
+      struct chan * const cp = &chans[i];
+      int64_t const start = bench_clock();
+      execute_filter_output(&cp->out,-cp->shift);
+      complex float * const buffer = cp->out.output.c;
+      float energy = 0;
+      for(int n = 0; n < olen; n++){
+	buffer[n] *= step_osc(&cp->fine);
+	energy += cnrmf(buffer[n]);
+      }
+      cp->bb_power = energy / olen;
+      if(block > 0) // Skip first-touch page faults
+	bench_stats_add(&out_stats,bench_clock() - start);
+    }
+    int64_t const block_end = bench_clock();
+    if(block == 0)
+      continue;
+    bench_stats_add(&in_stats,fft_done - block_start);
+    bench_stats_add(&block_stats,block_end - block_start);
+  }
+  // Channels one core could keep up with, once the front end FFT is paid for
+  double const block_ns = Blocktime * 1e6;
+  double const fft_mean = bench_mean(&in_stats);
+  double const chan_mean = bench_mean(&out_stats);
+  double const chans_per_core = (chan_mean > 0 && fft_mean < block_ns) ? (block_ns - fft_mean) / chan_mean : 0;
+
+  char params[512];
+  snprintf(params,sizeof(params),"preset=%s samprate=%d type=%s blocktime_ms=%g overlap=%d L=%d M=%d N=%d fft_threads=%d",
+	   preset,samprate,isreal ? "real" : "complex",Blocktime,Overlap,L,M,N,N_worker_threads);
+  char extra[256];
+  snprintf(extra,sizeof(extra),"realtime_x=%.3g",fft_mean > 0 ? block_ns / fft_mean : 0);
+  bench_report(results,"filter_input",params,&in_stats,L,"samples",extra);
+
+  char cparams[768];
+  snprintf(cparams,sizeof(cparams),"%s channels=%d out_samprate=%d olen=%d",params,nchans,Out_samprate,olen);
+  snprintf(extra,sizeof(extra),"channels_per_core=%.1f",chans_per_core);
+  bench_report(results,"downconvert",cparams,&out_stats,olen,"samples",extra);
+  bench_report(results,"set_filter",cparams,&set_stats,1,"calls",NULL);
+  snprintf(extra,sizeof(extra),"load=%.3g",bench_mean(&block_stats) / block_ns);
+  bench_report(results,"block",cparams,&block_stats,L,"samples",extra);
+
+  int drops = 0;
+  for(int i = 0; i < nchans; i++){
+    drops += chans[i].out.block_drops;
+    delete_filter_output(&chans[i].out);
+  }
+  if(drops != 0)
+    fprintf(stderr,"%s: %d channel blocks dropped\n",preset,drops);
+  delete_filter_input(&in);
+  bench_stats_free(&set_stats);
+  bench_stats_free(&in_stats);
+  bench_stats_free(&out_stats);
+  bench_stats_free(&block_stats);
+  FREE(chans);
+  FREE(rinput);
+  FREE(cinput);
+}
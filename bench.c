@@ -0,0 +1,135 @@
+// Helpers shared by the bench-* DSP micro-benchmarks
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "misc.h"
+#include "bench.h"
+
+int bench_stats_init(struct bench_stats *st,int size){
+  assert(st != NULL);
+  memset(st,0,sizeof(*st));
+  if(size <= 0)
+    return -1;
+  st->samples = calloc(size,sizeof(*st->samples));
+  if(st->samples == NULL)
+    return -1;
+  st->size = size;
+  return 0;
+}
+
+void bench_stats_free(struct bench_stats *st){
+  if(st == NULL)
+    return;
+  FREE(st->samples);
+  st->count = st->size = 0;
+}
+
+void bench_stats_add(struct bench_stats *st,int64_t ns){
+  assert(st != NULL);
+  if(st->count < st->size)
+    st->samples[st->count++] = ns;
+}
+
+double bench_mean(struct bench_stats const *st){
+  if(st == NULL || st->count == 0)
+    return 0;
+  double sum = 0;
+  for(int i = 0; i < st->count; i++)
+    sum += st->samples[i];
+  return sum / st->count;
+}
+
+static int compare_ns(void const *a,void const *b){
+  int64_t const x = *(int64_t const *)a;
+  int64_t const y = *(int64_t const *)b;
+  return x < y ? -1 : x > y ? +1 : 0;
+}
+
+// Nearest-rank percentile; samples must be sorted
+static double percentile(struct bench_stats const *st,double p){
+  if(st->count == 0)
+    return 0;
+  int i = (int)ceil(p / 100. * st->count) - 1;
+  if(i < 0)
+    i = 0;
+  if(i >= st->count)
+    i = st->count - 1;
+  return st->samples[i];
+}
+
+// Describe the machine and command line, so saved results say where they came from
+void bench_header(FILE *fp,int argc,char * const argv[]){
+  fprintf(fp,"#");
+  for(int i = 0; i < argc; i++)
+    fprintf(fp," %s",argv[i]);
+  fprintf(fp,"\n");
+
+  struct utsname un;
+  if(uname(&un) == 0)
+    fprintf(fp,"# host %s %s %s %s\n",un.nodename,un.sysname,un.release,un.machine);
+  fprintf(fp,"# cpus %ld\n",sysconf(_SC_NPROCESSORS_ONLN));
+
+  FILE *cpuinfo = fopen("/proc/cpuinfo","r"); // Linux only; just skipped elsewhere
+  if(cpuinfo != NULL){
+    char *line = NULL;
+    size_t linesize = 0;
+    while(getline(&line,&linesize,cpuinfo) > 0){
+      if(strncmp(line,"model name",10) == 0){
+	char const *cp = strchr(line,':');
+	if(cp != NULL)
+	  fprintf(fp,"# cpu%s",cp+1);
+	break;
+      }
+    }
+    FREE(line);
+    fclose(cpuinfo);
+  }
+  fflush(fp);
+}
+
+// One result line. 'items' is the work done per timed call (samples, blocks...) in units of 'unit'
+// Sorts the samples in place
+void bench_report(FILE *fp,char const *name,char const *params,struct bench_stats *st,double items,char const *unit,char const *extra){
+  assert(fp != NULL && st != NULL);
+  double const mean = bench_mean(st);
+  qsort(st->samples,st->count,sizeof(*st->samples),compare_ns);
+  fprintf(fp,"%s %s calls=%d mean_us=%.2f p50_us=%.2f p90_us=%.2f p99_us=%.2f max_us=%.2f",
+	  name,params,st->count,
+	  mean * 1e-3,
+	  percentile(st,50) * 1e-3,
+	  percentile(st,90) * 1e-3,
+	  percentile(st,99) * 1e-3,
+	  percentile(st,100) * 1e-3);
+  if(items > 0 && unit != NULL && mean > 0)
+    fprintf(fp," %s_per_sec=%.6g",unit,items * 1e9 / mean);
+  if(extra != NULL && strlen(extra) > 0)
+    fprintf(fp," %s",extra);
+  fprintf(fp,"\n");
+  fflush(fp);
+}
+
+// Synthetic input comes from random(), so fix the seed for repeatable runs
+void bench_seed(unsigned int seed){
+  srandom(seed);
+}
+
+// Box-Mueller, as in sig_gen.c
+complex float bench_complex_gaussian(void){
+  float u = (float)random() / (float)INT32_MAX;
+  float const v = (float)random() / (float)INT32_MAX;
+  if(u <= 0)
+    u = 1e-30; // avoid log(0)
+  float const s = sqrtf(-2 * logf(u));
+  return s * (cosf(2 * M_PI * v) + I * sinf(2 * M_PI * v));
+}
+
+float bench_gaussian(void){
+  return crealf(bench_complex_gaussian());
+}
@@ -0,0 +1,43 @@
+// Helpers shared by the bench-* DSP micro-benchmarks
+//
+// Each benchmark writes one line per measurement:
+//   name key=value key=value ...
+// with the parameters first and the results last, so runs on different commits
+// (or machines) can be compared with diff, join or a short awk script.
+// Lines starting with '#' are comments describing the run.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#ifndef _BENCH_H
+#define _BENCH_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <complex.h>
+#include <time.h>
+
+// Per-call latencies for one measurement, in nanoseconds
+struct bench_stats {
+  int64_t *samples;
+  int count;
+  int size;
+};
+
+// Timing uses the monotonic clock so NTP slews don't show up as latency
+static inline int64_t bench_clock(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int bench_stats_init(struct bench_stats *st,int size);
+void bench_stats_free(struct bench_stats *st);
+void bench_stats_add(struct bench_stats *st,int64_t ns);
+double bench_mean(struct bench_stats const *st);
+void bench_header(FILE *fp,int argc,char * const argv[]);
+void bench_report(FILE *fp,char const *name,char const *params,struct bench_stats *st,double items,char const *unit,char const *extra);
+void bench_seed(unsigned int seed);
+float bench_gaussian(void);
+complex float bench_complex_gaussian(void);
+
+#endif
@@ -0,0 +1,307 @@
+// Triggered capture of raw front end input to disk in SigMF format
+// for the ka9q-radio 'radiod' program
+//
+// The mirrored input ring of each front end filter (frontend->in) is enlarged at startup
+// to hold a configurable window of recent A/D samples. When a capture is triggered, either
+// by command or by a channel's squelch opening, a separate thread copies the window preceding
+// the trigger plus a post-trigger interval out of the ring into a .sigmf-data file and then
+// writes the matching .sigmf-meta file. The front end thread never waits for the disk;
+// if the writer falls so far behind that the ring wraps, the lost samples are written as zeroes
+// so the file stays time-aligned, and the loss is logged.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <iniparser/iniparser.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+
+#include "conf.h"
+#include "misc.h"
+#include "config.h"
+#include "radio.h"
+
+static float const DEFAULT_CAPTURE_POST = 5.0; // seconds
+static float const Chunk_time = 0.1;           // seconds of samples copied out of the ring at a time
+
+struct capture {
+  struct frontend *frontend;
+  char dir[PATH_MAX];
+  int64_t window;            // Pre-trigger samples kept in ring
+  int64_t post;              // Default post-trigger samples
+  int64_t ring_samples;      // Total samples in (primary copy of) ring
+  int64_t guard;             // Samples at the head of the ring that may be in the process of being written or FFTed
+  size_t samplesize;         // bytes per (real or complex) sample
+  void *bounce;              // Copy of current chunk, so the ring can't change under fwrite()
+  int64_t chunk;             // bounce buffer size, samples
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool triggered;            // Capture requested or in progress
+  uint64_t trigger_sample;   // Value of frontend->samples at trigger
+  int64_t trigger_time;      // frontend->timestamp at trigger, GPS ns
+  uint64_t end_sample;       // Stop when frontend->samples reaches this; retriggers extend it
+  uint32_t ssrc;             // Channel that triggered, or sent the command
+
+  uint64_t captures;         // Completed captures
+  uint64_t lost;             // Samples overwritten before they could be saved
+  pthread_t thread;
+};
+
+static void *capture_thread(void *arg);
+static int write_meta(struct capture const *cap,char const *path,uint64_t count,uint64_t pre,int64_t start_time,uint64_t lost);
+
+// Read capture settings from the front end's config section, falling back to [global], and allocate state
+// Returns the number of samples the front end input ring must hold, or 0 if capturing is disabled
+// Must be called after the front end's setup routine (which sets the sample rate) and before
+// the front end input filter is created
+size_t capture_setup(struct frontend * const frontend,dictionary const * const table,char const * const section){
+  assert(frontend != NULL);
+  char const * const global = "global";
+  float const window = config2_getfloat(table,table,global,section,"capture-window",0);
+  if(window <= 0)
+    return 0;
+
+  assert(frontend->samprate != 0);
+  struct capture * const cap = calloc(1,sizeof(*cap));
+  assert(cap != NULL);
+  cap->frontend = frontend;
+  strlcpy(cap->dir,config2_getstring(table,table,global,section,"capture-dir",VARDIR "/captures"),sizeof(cap->dir));
+  cap->window = (int64_t)(window * frontend->samprate);
+  cap->post = (int64_t)(fabsf(config2_getfloat(table,table,global,section,"capture-post",DEFAULT_CAPTURE_POST)) * frontend->samprate);
+  cap->samplesize = frontend->isreal ? sizeof(float) : sizeof(complex float);
+  cap->chunk = Chunk_time * frontend->samprate;
+  cap->bounce = malloc(cap->chunk * cap->samplesize);
+  assert(cap->bounce != NULL);
+  pthread_mutex_init(&cap->mutex,NULL);
+  pthread_cond_init(&cap->cond,NULL);
+
+  // Leave room beyond the window for the FFT input blocks and one bounce buffer of writer latency
+  double const eL = frontend->samprate * Blocktime / 1000.0;
+  cap->guard = ND * (int64_t)(2 * eL) + cap->chunk;
+  size_t const ring = cap->window + cap->guard;
+  fprintf(stdout,"Raw capture: %.1f sec window, %.1f sec post-trigger, ring %'llu samples (%'llu bytes) to %s\n",
+	  window,(double)cap->post / frontend->samprate,
+	  (unsigned long long)ring,(unsigned long long)(ring * cap->samplesize),cap->dir);
+  frontend->capture = cap;
+  return ring;
+}
+
+// Start the writer thread once the front end input ring exists
+int capture_start(struct frontend * const frontend){
+  struct capture * const cap = frontend->capture;
+  if(cap == NULL)
+    return -1;
+  if(frontend->in.input_buffer == NULL){
+    fprintf(stdout,"Raw capture: no input ring, disabled\n");
+    frontend->capture = NULL;
+    return -1;
+  }
+  cap->ring_samples = frontend->in.input_buffer_size / cap->samplesize;
+  if(mkdir(cap->dir,0775) != 0 && errno != EEXIST)
+    fprintf(stdout,"Raw capture: can't create %s: %s\n",cap->dir,strerror(errno));
+
+  pthread_create(&cap->thread,NULL,capture_thread,cap);
+  return 0;
+}
+
+// Request a capture, or extend one in progress
+// post = post-trigger seconds; <= 0 selects the configured default
+// Cheap and non-blocking apart from a short mutex hold, so it can be called from demod threads
+int capture_trigger(struct frontend * const frontend,uint32_t const ssrc,float const post){
+  struct capture * const cap = frontend->capture;
+  if(cap == NULL)
+    return -1;
+
+  uint64_t const now = frontend->samples;
+  uint64_t const end = now + (post > 0 ? (int64_t)(post * frontend->samprate) : cap->post);
+  pthread_mutex_lock(&cap->mutex);
+  if(cap->triggered){
+    if(end > cap->end_sample)
+      cap->end_sample = end;
+  } else {
+    cap->triggered = true;
+    cap->trigger_sample = now;
+    cap->trigger_time = frontend->timestamp;
+    cap->end_sample = end;
+    cap->ssrc = ssrc;
+    pthread_cond_signal(&cap->cond);
+  }
+  pthread_mutex_unlock(&cap->mutex);
+  return 0;
+}
+
+// Pointer into the mirrored input ring for absolute sample number n
+// The filter starts writing at offset L, and the front ends count every sample they write into frontend->samples
+static inline void const *ring_pointer(struct capture const *cap,uint64_t n){
+  struct filter_in const * const in = &cap->frontend->in;
+  return (uint8_t const *)in->input_buffer + ((n + in->ilen) % cap->ring_samples) * cap->samplesize;
+}
+
+static void *capture_thread(void *arg){
+  struct capture * const cap = arg;
+  struct frontend * const frontend = cap->frontend;
+  pthread_setname("capture");
+
+  while(true){
+    pthread_mutex_lock(&cap->mutex);
+    while(!cap->triggered)
+      pthread_cond_wait(&cap->cond,&cap->mutex);
+    uint64_t const trigger_sample = cap->trigger_sample;
+    int64_t const trigger_time = cap->trigger_time;
+    uint32_t const ssrc = cap->ssrc;
+    pthread_mutex_unlock(&cap->mutex);
+
+    // Back up by the window, but not past the oldest sample still in the ring
+    uint64_t start = trigger_sample > (uint64_t)cap->window ? trigger_sample - cap->window : 0;
+    {
+      uint64_t const now = frontend->samples;
+      uint64_t const oldest = now > (uint64_t)(cap->ring_samples - cap->guard) ? now - (cap->ring_samples - cap->guard) : 0;
+      if(start < oldest)
+	start = oldest;
+    }
+    int64_t const start_time = trigger_time - (int64_t)(BILLION * (double)(trigger_sample - start) / frontend->samprate);
+
+    char base[PATH_MAX];
+    int base_len;
+    {
+      time_t const t = start_time / BILLION + (UNIX_EPOCH - GPS_UTC_OFFSET);
+      struct tm tm;
+      gmtime_r(&t,&tm);
+      base_len = snprintf(base,sizeof(base),"%s/%04d%02d%02dT%02d%02d%02dZ_%u",cap->dir,
+			  tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec,ssrc);
+    }
+    char data_path[PATH_MAX+20];
+    snprintf(data_path,sizeof(data_path),"%s.sigmf-data",base);
+    FILE *fp = NULL;
+    // Still drain the ring below when there's no file, so the trigger is consumed
+    if(base_len < 0 || base_len >= (int)sizeof(base))
+      fprintf(stdout,"Raw capture: directory name %s too long\n",cap->dir);
+    else if((fp = fopen(data_path,"w")) == NULL)
+      fprintf(stdout,"Raw capture: can't create %s: %s\n",data_path,strerror(errno));
+    else if(Verbose)
+      fprintf(stdout,"Raw capture triggered by ssrc %u: writing %s\n",ssrc,data_path);
+
+    uint64_t next = start;
+    uint64_t lost = 0;
+    while(true){
+      pthread_mutex_lock(&cap->mutex);
+      uint64_t const end = cap->end_sample;
+      pthread_mutex_unlock(&cap->mutex);
+      if(next >= end)
+	break;
+
+      uint64_t const avail = frontend->samples;
+      if(avail <= next){
+	// Caught up with the front end; wait about one block for more
+	usleep((useconds_t)(1000 * Blocktime));
+	continue;
+      }
+      int64_t count = min(avail,end) - next;
+      count = min(count,cap->chunk);
+      memcpy(cap->bounce,ring_pointer(cap,next),count * cap->samplesize); // mirror makes this contiguous
+      // Did the front end overwrite any of it while we were copying?
+      uint64_t const after = frontend->samples;
+      uint64_t const oldest = after > (uint64_t)(cap->ring_samples - cap->guard) ? after - (cap->ring_samples - cap->guard) : 0;
+      if(next < oldest){
+	int64_t const bad = min((int64_t)(oldest - next),count);
+	memset(cap->bounce,0,bad * cap->samplesize);
+	lost += bad;
+      }
+      if(fp != NULL && fwrite(cap->bounce,cap->samplesize,count,fp) != (size_t)count){
+	fprintf(stdout,"Raw capture: write to %s failed: %s\n",data_path,strerror(errno));
+	fclose(fp);
+	fp = NULL;
+      }
+      next += count;
+    }
+    pthread_mutex_lock(&cap->mutex);
+    cap->triggered = false;
+    cap->captures++;
+    cap->lost += lost;
+    pthread_mutex_unlock(&cap->mutex);
+
+    if(fp != NULL){
+      fclose(fp);
+      char meta_path[PATH_MAX+20];
+      snprintf(meta_path,sizeof(meta_path),"%s.sigmf-meta",base);
+      write_meta(cap,meta_path,next - start,trigger_sample - start,start_time,lost);
+      if(Verbose)
+	fprintf(stdout,"Raw capture %s complete: %'llu samples (%.1f sec)\n",base,
+		(unsigned long long)(next - start),(double)(next - start) / frontend->samprate);
+    }
+    if(lost != 0)
+      fprintf(stdout,"Raw capture %s: %'llu samples lost to ring overrun (disk too slow?)\n",base,(unsigned long long)lost);
+  }
+  return NULL;
+}
+
+// Write a string as a JSON string literal
+static void json_string(FILE *fp,char const *s){
+  fputc('"',fp);
+  for(; s != NULL && *s != '\0'; s++){
+    if(*s == '"' || *s == '\\')
+      fprintf(fp,"\\%c",*s);
+    else if((unsigned char)*s < 0x20)
+      fprintf(fp,"\\u%04x",*s);
+    else
+      fputc(*s,fp);
+  }
+  fputc('"',fp);
+}
+
+// Write the SigMF metadata describing a completed capture
+static int write_meta(struct capture const * const cap,char const * const path,uint64_t const count,uint64_t const pre,int64_t const start_time,uint64_t const lost){
+  struct frontend const * const frontend = cap->frontend;
+  FILE * const fp = fopen(path,"w");
+  if(fp == NULL){
+    fprintf(stdout,"Raw capture: can't create %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  char datetime[100];
+  {
+    lldiv_t const ut = lldiv(start_time + BILLION * (UNIX_EPOCH - GPS_UTC_OFFSET),BILLION);
+    time_t const t = ut.quot;
+    struct tm tm;
+    gmtime_r(&t,&tm);
+    snprintf(datetime,sizeof(datetime),"%04d-%02d-%02dT%02d:%02d:%02d.%06lldZ",
+	     tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec,ut.rem / 1000);
+  }
+  char comment[200];
+  snprintf(comment,sizeof(comment),"trigger ssrc %u; samples scaled to dBFS with analog gain correction; %llu samples lost and zero-filled",
+	   cap->ssrc,(unsigned long long)lost);
+
+  fprintf(fp,"{\n  \"global\": {\n");
+  fprintf(fp,"    \"core:datatype\": \"%s\",\n",frontend->isreal ? "rf32_le" : "cf32_le");
+  fprintf(fp,"    \"core:sample_rate\": %d,\n",frontend->samprate);
+  fprintf(fp,"    \"core:version\": \"1.0.0\",\n");
+  fprintf(fp,"    \"core:recorder\": \"ka9q-radio radiod\",\n");
+  fprintf(fp,"    \"core:hw\": ");
+  json_string(fp,frontend->description);
+  fprintf(fp,",\n    \"core:description\": ");
+  json_string(fp,comment);
+  fprintf(fp,"\n  },\n");
+  fprintf(fp,"  \"captures\": [\n    {\n");
+  fprintf(fp,"      \"core:sample_start\": 0,\n");
+  fprintf(fp,"      \"core:frequency\": %.3lf,\n",frontend->frequency);
+  fprintf(fp,"      \"core:datetime\": \"%s\"\n",datetime);
+  fprintf(fp,"    }\n  ],\n");
+  fprintf(fp,"  \"annotations\": [\n    {\n");
+  fprintf(fp,"      \"core:sample_start\": %llu,\n",(unsigned long long)pre);
+  fprintf(fp,"      \"core:sample_count\": %llu,\n",(unsigned long long)(count - pre));
+  fprintf(fp,"      \"core:label\": \"trigger\"\n");
+  fprintf(fp,"    }\n  ]\n}\n");
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,232 @@
+// Snapshot and restore of radiod's dynamic channels
+//
+// Channels created on demand by tune, control, etc exist only in memory, so after a restart every
+// client would have to notice and recreate its channels at once. Instead the dynamic channel
+// table is written periodically (and at exit) to a state file in the same ini format as the
+// config and presets files, one section per SSRC, with keys loadpreset() understands.
+// At startup the channels are recreated from it in one pass, before the command listener starts,
+// so clients find their channels already running.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <iniparser/iniparser.h>
+#if defined(linux)
+#include <bsd/string.h>
+#endif
+
+#include "conf.h"
+#include "misc.h"
+#include "config.h"
+#include "multicast.h"
+#include "radio.h"
+
+static int const DEFAULT_STATE_INTERVAL = 10; // seconds
+
+static char State_file[PATH_MAX];
+static int State_interval;        // seconds; 0 disables
+static char *Last_state;          // Contents of the last write, to skip rewriting an unchanged file
+static pthread_mutex_t State_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t State_thread;
+
+static void *chanstate_thread(void *);
+
+// Read 'state-file' and 'state-interval' from the given config section
+// The default file is named after the instance, e.g., /var/lib/ka9q-radio/radiod-hf.state
+int chanstate_setup(dictionary const *table,char const *section,char const *name){
+  State_interval = config_getint(table,section,"state-interval",DEFAULT_STATE_INTERVAL);
+  if(State_interval <= 0){
+    State_interval = 0;
+    return 0;
+  }
+  char default_file[PATH_MAX];
+  {
+    // Without -N, the name is the whole config file pathname
+    char const *cp = strrchr(name,'/');
+    snprintf(default_file,sizeof(default_file),"%s/radiod-%s.state",VARDIR,cp != NULL ? cp + 1 : name);
+  }
+  strlcpy(State_file,config_getstring(table,section,"state-file",default_file),sizeof(State_file));
+  return 0;
+}
+
+// Recreate the dynamic channels listed in the state file, then start saving them periodically
+// Static channels should already exist; a saved channel whose SSRC is now taken is dropped
+int chanstate_restore(void){
+  if(State_interval == 0)
+    return 0;
+
+  int count = 0;
+  dictionary * const table = iniparser_load(State_file);
+  if(table == NULL){
+    if(access(State_file,F_OK) == 0)
+      fprintf(stdout,"Can't read channel state file %s\n",State_file);
+  } else {
+    int const nsect = iniparser_getnsec(table);
+    for(int sect = 0; sect < nsect; sect++){
+      char const * const sname = iniparser_getsecname(table,sect);
+      uint32_t const ssrc = strtoul(sname,NULL,0);
+      if(ssrc == 0)
+	continue;
+
+      double const freq = config_getdouble(table,sname,"freq",0);
+      if(freq == 0)
+	continue; // Would expire anyway
+
+      struct channel * const chan = create_chan(ssrc);
+      if(chan == NULL){
+	if(Verbose)
+	  fprintf(stdout,"saved ssrc %u not restored: already in use\n",ssrc);
+	continue;
+      }
+      // Starts as a copy of Template, like any other dynamic channel
+      char const *preset = config_getstring(table,sname,"preset","");
+      strlcpy(chan->preset,preset,sizeof(chan->preset));
+      loadpreset(chan,table,sname);
+      chan->spectrum.bin_count = config_getint(table,sname,"bin-count",chan->spectrum.bin_count);
+      chan->spectrum.bin_bw = config_getfloat(table,sname,"bin-bw",chan->spectrum.bin_bw);
+      chan->status.output_interval = config_getint(table,sname,"update",chan->status.output_interval);
+      chan->output.rtp.type = pt_from_info(chan->output.samprate,chan->output.channels,chan->output.encoding);
+      {
+	char const *hw = config_getstring(table,sname,"hardware",NULL);
+	struct frontend * const frontend = hw != NULL ? lookup_frontend(hw) : NULL;
+	chan->frontend = frontend != NULL ? frontend : select_frontend(chan,freq);
+      }
+      set_freq(chan,freq);
+      start_demod(chan);
+      count++;
+    }
+    iniparser_freedict(table);
+    fprintf(stdout,"%d dynamic channels restored from %s\n",count,State_file);
+  }
+  pthread_create(&State_thread,NULL,chanstate_thread,NULL);
+  return count;
+}
+
+static char const *yesno(bool x){
+  return x ? "yes" : "no";
+}
+
+// One state file section
+static void write_chan(FILE *fp,struct channel const *chan){
+  fprintf(fp,"[%u]\n",chan->output.rtp.ssrc);
+  fprintf(fp,"freq = %.3lf\n",chan->tune.freq);
+  if(chan->frontend != NULL && chan->frontend->name != NULL)
+    fprintf(fp,"hardware = %s\n",chan->frontend->name);
+  if(strlen(chan->preset) > 0)
+    fprintf(fp,"preset = %s\n",chan->preset);
+  char const *demod = demod_name_from_type(chan->demod_type);
+  if(demod != NULL)
+    fprintf(fp,"demod = %s\n",demod);
+  fprintf(fp,"samprate = %d\n",chan->output.samprate);
+  fprintf(fp,"channels = %d\n",chan->output.channels);
+  fprintf(fp,"encoding = %s\n",encoding_string(chan->output.encoding));
+  fprintf(fp,"bitrate = %d\n",chan->output.opus_bitrate);
+  fprintf(fp,"pacing = %s\n",yesno(chan->output.pacing));
+  fprintf(fp,"update = %d\n",chan->status.output_interval);
+  // In the units loadpreset() expects: Hz, dB, seconds
+  fprintf(fp,"low = %.1f\n",chan->filter.min_IF);
+  fprintf(fp,"high = %.1f\n",chan->filter.max_IF);
+  fprintf(fp,"kaiser-beta = %.3f\n",chan->filter.kaiser_beta);
+  fprintf(fp,"shift = %.3lf\n",chan->tune.shift);
+  fprintf(fp,"gain = %.2f\n",voltage2dB(chan->output.gain));
+  fprintf(fp,"headroom = %.2f\n",voltage2dB(chan->output.headroom));
+  fprintf(fp,"agc = %s\n",yesno(chan->linear.agc));
+  fprintf(fp,"threshold = %.2f\n",voltage2dB(chan->linear.threshold));
+  fprintf(fp,"recovery-rate = %.3f\n",voltage2dB(chan->linear.recovery_rate) / (.001f * Blocktime));
+  fprintf(fp,"hang-time = %.3f\n",chan->linear.hangtime * .001f * Blocktime);
+  fprintf(fp,"envelope = %s\n",yesno(chan->linear.env));
+  fprintf(fp,"pll = %s\n",yesno(chan->linear.pll));
+  fprintf(fp,"square = %s\n",yesno(chan->linear.square));
+  fprintf(fp,"pll-bw = %.3f\n",chan->linear.loop_bw);
+  fprintf(fp,"squelch-open = %.2f\n",power2dB(chan->fm.squelch_open));
+  fprintf(fp,"squelch-close = %.2f\n",power2dB(chan->fm.squelch_close));
+  fprintf(fp,"squelch-tail = %d\n",chan->fm.squelch_tail);
+  fprintf(fp,"threshold-extend = %s\n",yesno(chan->fm.threshold));
+  fprintf(fp,"tone = %.1f\n",chan->fm.tone_freq);
+  if(chan->fm.rate > 0 && chan->fm.rate < 1 && chan->output.samprate > 0){
+    // Invert the coefficient computed in loadpreset(); microseconds
+    fprintf(fp,"deemph-tc = %.1f\n",-1e6 / (chan->output.samprate * log1p(-chan->fm.rate)));
+    fprintf(fp,"deemph-gain = %.2f\n",voltage2dB(chan->fm.gain));
+  }
+  if(chan->demod_type == SPECT_DEMOD){
+    fprintf(fp,"bin-count = %d\n",chan->spectrum.bin_count);
+    fprintf(fp,"bin-bw = %.3f\n",chan->spectrum.bin_bw);
+  }
+  fprintf(fp,"\n");
+}
+
+// Write the dynamic channel table to the state file
+// The file is replaced atomically and only when something has changed
+int chanstate_save(void){
+  if(State_interval == 0)
+    return 0;
+
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *mp = open_memstream(&buffer,&size);
+  if(mp == NULL)
+    return -1;
+  fprintf(mp,"# radiod dynamic channels, restored at startup. Delete this file to start without them\n");
+  int count = 0;
+  // Format into memory under the lock so channel creation isn't held up by the disk
+  pthread_mutex_lock(&Channel_list_mutex);
+  for(int i=0; i < Channel_list_length; i++){
+    struct channel const * const chan = &Channel_list[i];
+    if(!chan->inuse || strlen(chan->config.section) > 0 || chan->tune.freq == 0 || chan->terminate)
+      continue; // Static, or on its way out
+    write_chan(mp,chan);
+    count++;
+  }
+  pthread_mutex_unlock(&Channel_list_mutex);
+  fclose(mp);
+
+  pthread_mutex_lock(&State_mutex);
+  int r = 0;
+  if(Last_state == NULL || strcmp(Last_state,buffer) != 0){
+    char tempfile[PATH_MAX+5]; // Room for the suffix on the longest State_file
+    snprintf(tempfile,sizeof(tempfile),"%s.tmp",State_file);
+    FILE *fp = fopen(tempfile,"w");
+    if(fp == NULL){
+      fprintf(stdout,"Can't write channel state file %s: %s\n",tempfile,strerror(errno));
+      r = -1;
+    } else {
+      fwrite(buffer,1,size,fp);
+      if(fclose(fp) != 0 || rename(tempfile,State_file) != 0){
+	fprintf(stdout,"Can't write channel state file %s: %s\n",State_file,strerror(errno));
+	unlink(tempfile);
+	r = -1;
+      } else {
+	if(Verbose > 1)
+	  fprintf(stdout,"%d dynamic channels saved to %s\n",count,State_file);
+	FREE(Last_state);
+	Last_state = buffer;
+	buffer = NULL;
+      }
+    }
+  }
+  pthread_mutex_unlock(&State_mutex);
+  FREE(buffer);
+  return r;
+}
+
+static void *chanstate_thread(void *arg){
+  (void)arg;
+  pthread_setname("chanstate");
+  pthread_detach(pthread_self());
+  while(true){
+    sleep(State_interval);
+    chanstate_save();
+  }
+  return NULL;
+}
@@ -4,6 +4,10 @@
 
 #include <iniparser/iniparser.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
 #include "config.h"
 
 int config_getint(dictionary const *d,char const *section,char const *key,int def){
@@ -97,4 +101,44 @@ int config2_getboolean(dictionary const *d1,dictionary const *d2,char const *sec
   return def;
 }
 
-  
+// Fingerprint of everything in a section, so a reloaded config file can be compared with the running one
+// Key order doesn't matter. Keys in the NULL-terminated 'skip' list (without section: prefix) are ignored
+// Chain several sections by passing the previous result as 'hash'
+uint32_t config_hash(dictionary const *d,char const *section,char const * const *skip,uint32_t hash){
+  if(d == NULL || section == NULL)
+    return hash;
+  int const nkeys = iniparser_getsecnkeys(d,section);
+  if(nkeys <= 0)
+    return hash;
+  char const **keys = calloc(nkeys,sizeof(*keys));
+  if(keys == NULL)
+    return hash;
+  iniparser_getseckeys(d,section,keys);
+  uint32_t sum = 0;
+  int used = 0;
+  for(int i=0; i < nkeys; i++){
+    char const *key = strchr(keys[i],':');
+    key = key != NULL ? key + 1 : keys[i];
+    bool skipped = false;
+    for(int j=0; skip != NULL && skip[j] != NULL; j++){
+      if(strcasecmp(key,skip[j]) == 0){
+	skipped = true;
+	break;
+      }
+    }
+    if(skipped)
+      continue;
+    // FNV-1a over key=value; summing the per-key results makes the order irrelevant
+    uint32_t h = 2166136261u;
+    for(char const *cp = keys[i]; *cp != '\0'; cp++)
+      h = (h ^ (uint8_t)*cp) * 16777619u;
+    h = (h ^ '=') * 16777619u;
+    char const *value = iniparser_getstring(d,keys[i],"");
+    for(char const *cp = value != NULL ? value : ""; *cp != '\0'; cp++)
+      h = (h ^ (uint8_t)*cp) * 16777619u;
+    sum += h;
+    used++;
+  }
+  free(keys);
+  return (hash ^ sum) * 16777619u + (uint32_t)used;
+}
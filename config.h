@@ -4,6 +4,8 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H 1
 
+#include <stdint.h>
+
 int config_getint(dictionary const *d,char const *section,char const *key,int def);
 double config_getdouble(dictionary const *d,char const *section,char const *key,double def);
 float config_getfloat(dictionary const *d,char const *section,char const *key,float def);
@@ -15,5 +17,6 @@ double config2_getdouble(dictionary const *d1,dictionary const *d2,char const *s
 float config2_getfloat(dictionary const *d1,dictionary const *d2,char const *sec1,char const *sec2,char const *key,float def);
 int config2_getboolean(dictionary const *d1,dictionary const *d2,char const *sec1,char const *sec2,char const *key,int def);
 char const * config2_getstring(dictionary const *d1,dictionary const *d2,char const *sec1,char const *sec2,char const *key,char const *def);
+uint32_t config_hash(dictionary const *d,char const *section,char const * const *skip,uint32_t hash);
 
 #endif
@@ -0,0 +1,89 @@
+// A/D sample conversion for the front end drivers in 'radiod'
+// Each routine turns one transfer of raw samples into floats in the filter input buffer,
+// counts full scale samples and returns the sum of the squared raw samples (A/D units)
+// for the caller's power measurement. Kept apart from the drivers so 'golden' can check them
+// without hardware.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <complex.h>
+#include <iniparser/iniparser.h>
+
+#include "misc.h"
+#include "radio.h"
+
+static inline void count_overrange(struct frontend * const frontend,bool over){
+  if(over){
+    frontend->overranges++;
+    frontend->samp_since_over = 0;
+  } else
+    frontend->samp_since_over++;
+}
+
+// 16-bit real, e.g., rx888
+// With the A/D's randomizer on, every bit but the LSB is XORed with the LSB
+float convert_s16(struct frontend * const frontend,float * restrict const out,int16_t const * restrict const in,int const n,float const scale,bool const randomized){
+  float energy = 0;
+  if(randomized){
+    for(int i=0; i < n; i++){
+      int32_t s = in[i];
+      s ^= (s << 31) >> 30; // Put LSB in sign bit, then shift back by one less bit to make ..ffffe or 0
+      count_overrange(frontend,s == 32767 || s <= -32767);
+      energy += s * s;
+      out[i] = s * scale;
+    }
+  } else {
+    for(int i=0; i < n; i++){
+      count_overrange(frontend,in[i] == 32767 || in[i] <= -32767);
+      out[i] = scale * in[i];
+      energy += in[i] * in[i];
+    }
+  }
+  return energy;
+}
+
+// 12-bit offset binary real packed 8 samples to 3 words, e.g., airspy raw mode
+// n must be a multiple of 8
+float convert_packed12(struct frontend * const frontend,float * restrict out,uint32_t const * restrict up,int const n,float const scale){
+  assert((n % 8) == 0);
+  float energy = 0;
+  for(int i=0; i < n; i+= 8){
+    int s[8];
+    s[0] =  up[0] >> 20;
+    s[1] =  up[0] >> 8;
+    s[2] =  (up[0] << 4) | (up[1] >> 28);
+    s[3] =  up[1] >> 16;
+    s[4] =  up[1] >> 4;
+    s[5] =  (up[1] << 8) | (up[2] >> 24);
+    s[6] =  up[2] >> 12;
+    s[7] =  up[2];
+    for(int j=0; j < 8; j++){
+      int const x = (s[j] & 0xfff) - 2048; // mask not actually necessary for s[0]
+      count_overrange(frontend,x == 2047 || x <= -2047);
+      out[j] = scale * x;
+      energy += x * x;
+    }
+    out += 8;
+    up += 3;
+  }
+  return energy;
+}
+
+// 8-bit excess-128 I/Q pairs, e.g., rtlsdr
+float convert_u8_iq(struct frontend * const frontend,complex float * restrict const out,uint8_t const * restrict const in,int const n,float const scale){
+  float energy = 0;
+  for(int i=0; i < n; i++){
+    count_overrange(frontend,in[2*i] == 0 || in[2*i] == 255);
+    count_overrange(frontend,in[2*i+1] == 0 || in[2*i+1] == 255);
+    complex float samp;
+    __real__ samp = (int)in[2*i] - 128; // Excess-128
+    __imag__ samp = (int)in[2*i+1] - 128;
+    energy += cnrmf(samp);
+    out[i] = scale * samp;
+  }
+  return energy;
+}
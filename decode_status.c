@@ -253,6 +253,34 @@ int decode_radio_status(struct frontend *frontend,struct channel *channel,uint8_
     case RF_LEVEL_CAL:
       frontend->rf_level_cal = decode_float(cp,optlen);
       break;
+    case DC_I_OFFSET:
+      frontend->iq.enable = true; // only sent when correction is on
+      __real__ frontend->iq.DC = decode_float(cp,optlen);
+      break;
+    case DC_Q_OFFSET:
+      __imag__ frontend->iq.DC = decode_float(cp,optlen);
+      break;
+    case IQ_IMBALANCE:
+      frontend->iq.imbalance = dB2power(decode_float(cp,optlen));
+      break;
+    case IQ_PHASE:
+      frontend->iq.sinphi = decode_float(cp,optlen);
+      break;
+    case INPUT_SAMPRATE_MEASURED:
+      frontend->health.rate = decode_double(cp,optlen);
+      break;
+    case INPUT_GAPS:
+      frontend->health.gaps = decode_int64(cp,optlen);
+      break;
+    case INPUT_GAP_SAMPLES:
+      frontend->health.gap_samples = decode_int64(cp,optlen);
+      break;
+    case INPUT_FILL_SAMPLES:
+      frontend->health.fill_samples = decode_int64(cp,optlen);
+      break;
+    case INPUT_TIMING_ERROR:
+      frontend->health.timing_error = decode_float(cp,optlen);
+      break;
     case BLOCKS_SINCE_POLL:
       channel->status.blocks_since_poll = decode_int64(cp,optlen);
       break;
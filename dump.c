@@ -338,6 +338,24 @@ void dump_metadata(FILE *fp,uint8_t const * const buffer,int length,bool newline
     case RF_AGC:
       fprintf(fp,"rf agc %s",decode_int(cp,optlen) ? "enabled" : "disabled");
       break;
+    case INPUT_SAMPRATE_MEASURED:
+      fprintf(fp,"measured samprate %'.1lf Hz",decode_double(cp,optlen));
+      break;
+    case INPUT_GAPS:
+      fprintf(fp,"input gaps %'llu",(long long unsigned)decode_int64(cp,optlen));
+      break;
+    case INPUT_GAP_SAMPLES:
+      fprintf(fp,"gap samples %'llu",(long long unsigned)decode_int64(cp,optlen));
+      break;
+    case INPUT_FILL_SAMPLES:
+      fprintf(fp,"fill samples %'llu",(long long unsigned)decode_int64(cp,optlen));
+      break;
+    case INPUT_TIMING_ERROR:
+      fprintf(fp,"timing error %.3f ms",1000 * decode_float(cp,optlen));
+      break;
+    case CAPTURE_TRIGGER:
+      fprintf(fp,"capture trigger %.1f sec",decode_float(cp,optlen));
+      break;
     case BIN_DATA:
       {
 	fprintf(fp,"fft bins:");
@@ -109,6 +109,12 @@ static void suggest(int level,int size,int dir,int clex);
 
 // Set up input (master) half of filter
 struct filter_in *create_filter_input(struct filter_in *master,int const L,int const M, enum filtertype const in_type){
+  return create_filter_input_ring(master,L,M,in_type,0);
+}
+
+// Same, but make the mirrored input ring hold at least ring_samples samples instead of the usual ND blocks
+// Used by radiod to keep a window of raw front end input for triggered capture (see capture.c)
+struct filter_in *create_filter_input_ring(struct filter_in *master,int const L,int const M, enum filtertype const in_type,size_t ring_samples){
   assert(L > 0);
   assert(M > 0);
   int const N = L + M - 1;
@@ -180,7 +186,7 @@ struct filter_in *create_filter_input(struct filter_in *master,int const L,int c
     return NULL;
   case CROSS_CONJ:
   case COMPLEX:
-    master->input_buffer_size = round_to_page(ND * N * sizeof(complex float));
+    master->input_buffer_size = round_to_page(max((size_t)ND * N,ring_samples) * sizeof(complex float));
     // Allocate input_buffer_size bytes immediately followed by its mirror
     master->input_buffer = mirror_alloc(master->input_buffer_size);
     master->input_read_pointer.c = master->input_buffer;
@@ -194,7 +200,7 @@ struct filter_in *create_filter_input(struct filter_in *master,int const L,int c
     }
     break;
   case REAL:
-    master->input_buffer_size = round_to_page(ND * N * sizeof(float));
+    master->input_buffer_size = round_to_page(max((size_t)ND * N,ring_samples) * sizeof(float));
     master->input_buffer = mirror_alloc(master->input_buffer_size);
     master->input_read_pointer.r = master->input_buffer;
     master->input_write_pointer.r = master->input_read_pointer.r + L; // start writing here
@@ -277,16 +283,18 @@ struct filter_out *create_filter_output(struct filter_out *slave,struct filter_i
   case REAL:
     {
       slave->olen = len;
-      slave->bins = ceilf(len * overlap) / 2 + 1;
+      int const points = ceilf(len * overlap); // Total time-domain FFT points including overlap
+      slave->bins = points / 2 + 1;
       slave->fdomain = lmalloc(sizeof(complex float) * slave->bins);
       assert(slave->fdomain != NULL);
-      slave->output_buffer.r = lmalloc(sizeof(float) * slave->bins);
+      // The c2r IFFT is 'points' long, not 'bins' (set_filter() assumes the same)
+      slave->output_buffer.r = lmalloc(sizeof(float) * points);
       assert(slave->output_buffer.r != NULL);
       slave->output_buffer.c = NULL;
-      slave->output.r = slave->output_buffer.r + slave->bins - len;
-      if((slave->rev_plan = fftwf_plan_dft_c2r_1d(slave->bins,slave->fdomain,slave->output_buffer.r,FFTW_WISDOM_ONLY|FFTW_planning_level)) == NULL){
-	suggest(FFTW_planning_level,slave->bins,FFTW_BACKWARD,REAL);
-	slave->rev_plan = fftwf_plan_dft_c2r_1d(slave->bins,slave->fdomain,slave->output_buffer.r,FFTW_MEASURE);
+      slave->output.r = slave->output_buffer.r + points - len;
+      if((slave->rev_plan = fftwf_plan_dft_c2r_1d(points,slave->fdomain,slave->output_buffer.r,FFTW_WISDOM_ONLY|FFTW_planning_level)) == NULL){
+	suggest(FFTW_planning_level,points,FFTW_BACKWARD,REAL);
+	slave->rev_plan = fftwf_plan_dft_c2r_1d(points,slave->fdomain,slave->output_buffer.r,FFTW_MEASURE);
       }
     }
     if(fftwf_export_wisdom_to_filename(Wisdom_file) == 0)
@@ -925,16 +933,20 @@ int set_filter(struct filter_out * const slave,float low,float high,float const
   complex float * const response = lmalloc(sizeof(complex float) * slave->bins);
   memset(response,0,slave->bins * sizeof(response[0]));
   assert(malloc_usable_size(response) >= (slave->bins) * sizeof(*response));
+  // Compare in bins, with a little slop: whether an edge that falls right on a bin gets the -3 dB point
+  // shouldn't depend on how the compiler rounds the divisions
+  float const low_bin = low * N;
+  float const high_bin = high * N;
   for(int n=0; n < slave->bins; n++){
-    float const f = n < N/2 ? (float)n / N : (float)(n - N) / N; // neg frequency
-    if(f == low || f == high)
+    int const bin = n < N/2 ? n : n - N; // neg frequency
+    if(fabsf(bin - low_bin) < 1e-3f || fabsf(bin - high_bin) < 1e-3f)
       response[n] = gain * M_SQRT1_2; // -3dB
-    else if(f > low && f < high)
+    else if(bin > low_bin && bin < high_bin)
       response[n] = gain;
     else
       response[n] = 0;
 #if 0
-    fprintf(stderr,"f = %.3f response[%d] = %.1f\n",f,n,10*log10f(crealf(response[n])));
+    fprintf(stderr,"f = %.3f response[%d] = %.1f\n",(float)bin / N,n,10*log10f(crealf(response[n])));
 #endif
   }
 
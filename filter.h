@@ -79,6 +79,7 @@ int window_filter(int L,int M,complex float * restrict response,float beta);
 int window_rfilter(int L,int M,complex float * restrict response,float beta);
 
 struct filter_in *create_filter_input(struct filter_in *,int const L,int const M, enum filtertype const in_type);
+struct filter_in *create_filter_input_ring(struct filter_in *,int const L,int const M, enum filtertype const in_type,size_t ring_samples);
 struct filter_out *create_filter_output(struct filter_out *slave,struct filter_in * restrict master,complex float * restrict response,int olen, enum filtertype out_type);
 int execute_filter_input(struct filter_in * restrict);
 int execute_filter_output(struct filter_out * restrict ,int);
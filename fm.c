@@ -38,7 +38,7 @@ void *demod_fm(void *arg){
 
   int const blocksize = chan->output.samprate * Blocktime / 1000;
   delete_filter_output(&chan->filter.out);
-  create_filter_output(&chan->filter.out,&Frontend.in,NULL,blocksize,COMPLEX);
+  create_filter_output(&chan->filter.out,&chan->frontend->in,NULL,blocksize,COMPLEX);
   pthread_mutex_unlock(&chan->status.lock);
 
   set_filter(&chan->filter.out,
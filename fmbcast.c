@@ -0,0 +1,375 @@
+// Broadcast FM composite (multiplex) decoder: pilot PLL, stereo matrix, de-emphasis, RDS
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include "misc.h"
+#include "filter.h"
+#include "fmbcast.h"
+
+static double const Pilot_freq = 19000;
+static float const Pilot_bw = 20;         // Pilot filter, +/- Hz. FCC says +/- 2 Hz, with +/- 20 Hz protected (73.322)
+static float const Pll_bw = 5;            // Pilot PLL natural frequency, Hz
+static float const Pilot_floor = 1e-6;    // Minimum pilot power, empirical (same constant wfm always used)
+static float const Pilot_smooth = 0.1;    // Per block smoothing of the lock detector powers
+static float const Rds_bw = 2400;         // RDS occupies +/- 2.4 kHz around 57 kHz
+static float const Rds_carrier_smooth = 0.05; // Per block smoothing of the RDS carrier phase estimate
+static float const Rds_clock_gain = 0.05; // Chip clock recovery loop gain
+static int const Rds_max_errors = 8;      // Consecutive bad blocks before sync is dropped
+
+// Rotation (in FFT bins) that brings freq down to 0 Hz. It must be a multiple of N/(M-1)
+// to keep the phase continuous from one overlap-save block to the next
+static int subcarrier_shift(int N,int M,int samprate,double freq){
+  double const hzperbin = (double)samprate / N;
+  int const quantum = N / (M - 1);
+  int const shift = quantum * (int)round(freq / (hzperbin * quantum));
+  if(fabs(freq - shift * hzperbin) > Pilot_bw / 2 || shift > N/2)
+    return -1; // Block size doesn't suit the subcarrier
+  return shift;
+}
+
+int fmbcast_init(struct fmbcast *fb,int composite_samprate,int audio_samprate,float blocktime,float kaiser_beta,int flags){
+  assert(fb != NULL);
+  memset(fb,0,sizeof(*fb));
+  fb->flags = flags;
+  fb->composite_samprate = composite_samprate;
+  fb->audio_samprate = audio_samprate;
+
+  // At Blocktime = 5ms and 384 kHz, L = 1920, M = 1921, N = 3840
+  int const L = roundf(composite_samprate * blocktime * .001);
+  int const M = L + 1; // 2:1 overlap (50%)
+  int const N = L + M - 1;
+  int const audio_L = roundf(audio_samprate * blocktime * .001);
+  if(L < audio_L || audio_L <= 0)
+    return -1; // Composite rate too low - should probably fix filter to allow interpolation
+  fb->composite_L = L;
+  fb->audio_L = audio_L;
+
+  // The subcarriers are exact multiples of the pilot, so spin them down by multiples of its rotation;
+  // any residual offset is then common to all three and is taken out by the PLL
+  fb->pilot_shift = subcarrier_shift(N,M,composite_samprate,Pilot_freq);
+  if(fb->pilot_shift < 0 || 3 * fb->pilot_shift > N/2)
+    return -1;
+  fb->subc_shift = 2 * fb->pilot_shift;
+  fb->rds_shift = 3 * fb->pilot_shift;
+
+  if(create_filter_input(&fb->composite,L,M,REAL) == NULL)
+    return -1;
+
+  float const fs = audio_samprate;
+  // Composite 50 Hz - 15 kHz contains mono (L+R) signal
+  create_filter_output(&fb->mono,&fb->composite,NULL,audio_L,REAL);
+  set_filter(&fb->mono,50.0/fs,15000.0/fs,kaiser_beta);
+
+  // Narrow filter at 19 kHz for stereo pilot
+  create_filter_output(&fb->pilot,&fb->composite,NULL,audio_L,COMPLEX);
+  set_filter(&fb->pilot,-Pilot_bw/fs,Pilot_bw/fs,kaiser_beta);
+
+  // Stereo difference (L-R) information on DSBSC carrier at 38 kHz
+  // Extends +/- 15 kHz around 38 kHz
+  create_filter_output(&fb->lminusr,&fb->composite,NULL,audio_L,COMPLEX);
+  set_filter(&fb->lminusr,-15000./fs,15000./fs,kaiser_beta);
+
+  // RDS on a BPSK subcarrier at 57 kHz = 19 kHz * 3
+  create_filter_output(&fb->rds,&fb->composite,NULL,audio_L,COMPLEX);
+  set_filter(&fb->rds,-Rds_bw/fs,Rds_bw/fs,kaiser_beta);
+
+  // Second order loop, damping 1/sqrt(2)
+  float const wn = 2 * M_PI * Pll_bw / fs;
+  fb->pll_alpha = M_SQRT2 * wn;
+  fb->pll_beta = wn * wn;
+
+  fb->cos_pilot = malloc(sizeof(*fb->cos_pilot) * audio_L);
+  fb->sin_pilot = malloc(sizeof(*fb->sin_pilot) * audio_L);
+  fb->left = malloc(sizeof(*fb->left) * audio_L);
+  fb->right = malloc(sizeof(*fb->right) * audio_L);
+  fb->rds_baseband = malloc(sizeof(*fb->rds_baseband) * audio_L);
+  if(fb->cos_pilot == NULL || fb->sin_pilot == NULL || fb->left == NULL || fb->right == NULL || fb->rds_baseband == NULL){
+    fmbcast_free(fb);
+    return -1;
+  }
+  fb->rds_state.chips_per_sample = 2 * RDS_BITRATE / fs;
+  fb->rds_state.block = -1;
+  return 0;
+}
+
+void fmbcast_free(struct fmbcast *fb){
+  if(fb == NULL)
+    return;
+  delete_filter_output(&fb->mono);
+  delete_filter_output(&fb->pilot);
+  delete_filter_output(&fb->lminusr);
+  delete_filter_output(&fb->rds);
+  delete_filter_input(&fb->composite);
+  FREE(fb->cos_pilot);
+  FREE(fb->sin_pilot);
+  FREE(fb->left);
+  FREE(fb->right);
+  FREE(fb->rds_baseband);
+}
+
+// Add composite samples, stopping at the end of a block. Returns the number taken;
+// fb->ready is then set if a block is complete, and fmbcast_decode() must be called before writing more
+// As with write_rfilter(), input == NULL means the samples were already written at fb->composite.input_write_pointer.r
+int fmbcast_write(struct fmbcast *fb,float const *input,int count){
+  assert(fb != NULL);
+  if(fb->ready)
+    return 0;
+  int const n = min(count,fb->composite.ilen - fb->composite.wcnt);
+  if(n <= 0)
+    return 0;
+  if(write_rfilter(&fb->composite,input,n) < 0)
+    return -1;
+  if(fb->composite.wcnt == 0)
+    fb->ready = true; // write_rfilter() just executed the block
+  return n;
+}
+
+// Track the pilot, leaving the reference phase for each output sample in cos_pilot[] and sin_pilot[]
+static void track_pilot(struct fmbcast *fb){
+  complex float const * const restrict x = fb->pilot.output.c;
+  float phase = fb->pll_phase;
+  float freq = fb->pll_freq;
+  float const limit = 2 * M_PI * Pilot_bw / fb->audio_samprate; // Don't wander outside the filter
+  float inphase = 0;
+  float quadrature = 0;
+
+  for(int n = 0; n < fb->audio_L; n++){
+    float const c = cosf(phase);
+    float const s = sinf(phase);
+    fb->cos_pilot[n] = c;
+    fb->sin_pilot[n] = s;
+    complex float const e = x[n] * CMPLXF(c,-s);
+    inphase += __real__ e * __real__ e;
+    quadrature += __imag__ e * __imag__ e;
+    float const err = cargf(e); // defined as 0 for 0 input, so silence can't make a NAN
+    freq += fb->pll_beta * err;
+    freq = freq > limit ? limit : freq < -limit ? -limit : freq;
+    phase += freq + fb->pll_alpha * err;
+  }
+  fb->pll_phase = remainderf(phase,2 * M_PI);
+  fb->pll_freq = freq;
+
+  // Lock detector: a real pilot is nearly all in phase with the loop; noise is spread evenly
+  inphase /= fb->audio_L;
+  quadrature /= fb->audio_L;
+  fb->pilot_inphase += Pilot_smooth * (inphase - fb->pilot_inphase);
+  fb->pilot_quadrature += Pilot_smooth * (quadrature - fb->pilot_quadrature);
+  if(fb->pilot_lock)
+    fb->pilot_lock = fb->pilot_inphase > Pilot_floor / 2 && fb->pilot_inphase > 2 * fb->pilot_quadrature;
+  else
+    fb->pilot_lock = fb->pilot_inphase > Pilot_floor && fb->pilot_inphase > 4 * fb->pilot_quadrature;
+}
+
+// RDS check word for a 16-bit information word: g(x) = x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1
+static unsigned int rds_check(unsigned int data){
+  uint32_t r = (uint32_t)data << 10;
+  for(int i = 25; i >= 10; i--)
+    if(r & (1U << i))
+      r ^= 0x5b9U << (i - 10);
+  return r & 0x3ff;
+}
+
+// Which block (0-3 for A-D, C' counts as C) a 26-bit word is, or -1 if it's not valid
+static int block_type(uint32_t reg){
+  switch(rds_check(reg >> 10) ^ (reg & 0x3ff)){ // The offset word added to the check word
+  case 0x0fc:
+    return 0;
+  case 0x198:
+    return 1;
+  case 0x168: // C
+  case 0x350: // C'
+    return 2;
+  case 0x1b4:
+    return 3;
+  default:
+    return -1;
+  }
+}
+
+static void rds_bit(struct rds_decoder *rs,int bit){
+  rs->reg = ((rs->reg << 1) | bit) & 0x3ffffff;
+  if(++rs->bits < 26)
+    return;
+
+  int const type = block_type(rs->reg);
+  if(rs->block < 0){
+    // Searching bit by bit; the first valid block of any type gives sync
+    if(type < 0)
+      return;
+    rs->block = type;
+    rs->errors = 0;
+    rs->valid = 0;
+  }
+  rs->bits = 0;
+  int const expected = rs->block;
+  if(type == expected){
+    rs->group[expected] = rs->reg >> 10;
+    rs->valid |= 1 << expected;
+    rs->errors = 0;
+    if(expected == 0)
+      rs->pi = rs->group[0];
+  } else {
+    rs->bad_blocks++;
+    if(++rs->errors > Rds_max_errors){
+      rs->block = -1; // Lost it; go back to searching
+      return;
+    }
+  }
+  if(expected == 3){
+    if(rs->valid == 0xf){
+      rs->group_ready = true;
+      rs->groups++;
+    }
+    rs->valid = 0;
+  }
+  rs->block = (expected + 1) & 3;
+}
+
+// Recover RDS bits from the 57 kHz subcarrier
+// It's differentially coded biphase at 1187.5 bits/sec: each bit is a pair of opposite 'chips' at 2375 Hz
+static void rds_demod(struct fmbcast *fb){
+  struct rds_decoder * const rs = &fb->rds_state;
+  int const N = fb->audio_L;
+  complex float const * const restrict x = fb->rds.output.c;
+  complex float * const restrict d = fb->rds_baseband;
+  float const * const restrict c = fb->cos_pilot;
+  float const * const restrict s = fb->sin_pilot;
+
+  // Spin down by three times the pilot phase
+  for(int n = 0; n < N; n++){
+    float const c3 = c[n] * (c[n] * c[n] - 3 * s[n] * s[n]);
+    float const s3 = s[n] * (3 * c[n] * c[n] - s[n] * s[n]);
+    d[n] = x[n] * CMPLXF(c3,-s3);
+  }
+  // What's left is a fixed phase offset; squaring removes the BPSK modulation to find it
+  // The 180 degree ambiguity doesn't matter with differential coding
+  complex float sq = 0;
+  for(int n = 0; n < N; n++)
+    sq += d[n] * d[n];
+  rs->carrier += Rds_carrier_smooth * (sq / N - rs->carrier);
+  complex float ref = csqrtf(rs->carrier);
+  float const mag = cabsf(ref);
+  if(mag == 0)
+    return;
+  ref = conjf(ref) / mag;
+
+  for(int n = 0; n < N; n++){
+    float const y = __real__ (d[n] * ref);
+    rs->acc += y;
+    rs->mid_acc += y;
+    rs->phase += rs->chips_per_sample;
+    if(!rs->mid_taken && rs->phase >= 0.5f){
+      rs->mid = rs->mid_acc; // Spans the boundary between the last chip and this one
+      rs->mid_acc = 0;
+      rs->mid_taken = true;
+    }
+    if(rs->phase < 1)
+      continue;
+
+    // End of chip
+    rs->phase -= 1;
+    rs->mid_taken = false;
+    float const chip = rs->acc;
+    rs->acc = 0;
+    // Timing error: the integral across a transition is zero when centered, and takes the sign
+    // of the new chip when we're late. Normalized, it's the error as a fraction of a chip
+    float const diff = rs->last_chip - chip;
+    float const norm = (fabsf(rs->last_chip) + fabsf(chip)) * (fabsf(rs->last_chip) + fabsf(chip));
+    if(norm > 0)
+      rs->phase -= Rds_clock_gain * rs->mid * diff / norm;
+
+    // Only one way of pairing chips into bits always has a transition in the middle
+    int const parity = rs->chips++ & 1;
+    rs->energy[parity] += 0.01f * (fabsf(diff) - rs->energy[parity]);
+    rs->last_chip = chip;
+    if(parity != (rs->energy[1] > rs->energy[0]))
+      continue;
+
+    float const symbol = diff; // First half minus second half
+    rds_bit(rs,(symbol > 0) != (rs->last_symbol > 0));
+    rs->last_symbol = symbol;
+  }
+}
+
+// Decode the block made ready by fmbcast_write(). output gets audio_L frames, interleaved if stereo
+// gain is applied after de-emphasis. Returns the number of channels written, 0 if no block was ready
+int fmbcast_decode(struct fmbcast *fb,float *output,float gain){
+  assert(fb != NULL && output != NULL);
+  if(!fb->ready)
+    return 0;
+  fb->ready = false;
+  fb->rds_state.group_ready = false;
+  int const N = fb->audio_L;
+
+  execute_filter_output(&fb->mono,0);    // L+R composite at 48 kHz
+  if(fb->flags & (FMBCAST_STEREO|FMBCAST_RDS)){
+    // shift signs for pilot and subcarriers don't matter because the filters are real input with symmetric spectra
+    execute_filter_output(&fb->pilot,fb->pilot_shift); // pilot spun to 0 Hz, 48 kHz rate
+    track_pilot(fb);
+  } else
+    fb->pilot_lock = false;
+
+  if((fb->flags & FMBCAST_RDS) && fb->pilot_lock){
+    execute_filter_output(&fb->rds,fb->rds_shift);
+    rds_demod(fb);
+  }
+  float const * const restrict mono = fb->mono.output.r;
+  float const rate = fb->deemph_rate;
+  float const dgain = fb->deemph_gain;
+
+  if(!(fb->flags & FMBCAST_STEREO) || !fb->pilot_lock){
+    if(rate != 0){
+      float state = fb->mono_deemph;
+      for(int n = 0; n < N; n++){
+	state += rate * (dgain * mono[n] - state);
+	output[n] = gain * state;
+      }
+      fb->mono_deemph = state;
+    } else {
+      for(int n = 0; n < N; n++)
+	output[n] = gain * mono[n];
+    }
+    return 1;
+  }
+  // Stereo multiplex processing
+  execute_filter_output(&fb->lminusr,fb->subc_shift); // L-R composite spun down to 0 Hz, 48 kHz rate
+  complex float const * const restrict lminusr = fb->lminusr.output.c;
+  float const * const restrict c = fb->cos_pilot;
+  float const * const restrict s = fb->sin_pilot;
+  float * const restrict left = fb->left;
+  float * const restrict right = fb->right;
+  for(int n = 0; n < N; n++){
+    // Double the pilot phase to get the 38 kHz carrier, which is in quadrature with the modulation
+    float const c2 = c[n] * c[n] - s[n] * s[n];
+    float const s2 = 2 * c[n] * s[n];
+    // The complex filter passes only one sideband of the real composite, so it has sqrt(2) less gain than the real mono filter
+    float const diff = M_SQRT2 * (c2 * __imag__ lminusr[n] - s2 * __real__ lminusr[n]);
+    // demultiplex: 2L = (L+R) + (L-R); 2R = (L+R) - (L-R)
+    left[n] = mono[n] + diff;
+    right[n] = mono[n] - diff;
+  }
+  if(rate != 0){
+    float lstate = fb->left_deemph;
+    float rstate = fb->right_deemph;
+    for(int n = 0; n < N; n++){
+      lstate += rate * (dgain * left[n] - lstate);
+      rstate += rate * (dgain * right[n] - rstate);
+      output[2*n] = gain * lstate;
+      output[2*n+1] = gain * rstate;
+    }
+    fb->left_deemph = lstate;
+    fb->right_deemph = rstate;
+  } else {
+    for(int n = 0; n < N; n++){
+      output[2*n] = gain * left[n];
+      output[2*n+1] = gain * right[n];
+    }
+  }
+  return 2;
+}
@@ -0,0 +1,105 @@
+// Broadcast FM composite (multiplex) decoder
+// Shared by radiod's wfm demodulator and the standalone stereod and rdsd
+//
+// The composite baseband (typically 384 kHz) goes into one real overlap-save filter input;
+// separate filter outputs decimate the mono (L+R), 19 kHz pilot, 38 kHz L-R and 57 kHz RDS
+// components to the audio rate. A PLL on the pilot provides the stereo and RDS subcarrier
+// references and decides whether stereo is actually present.
+//
+// Work is done a block at a time. Stateless steps (stereo matrix, subcarrier mixing) are
+// separate passes over arrays so the compiler can vectorize them; only the PLL, de-emphasis
+// and RDS clock recovery run sample by sample.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#ifndef _FMBCAST_H
+#define _FMBCAST_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <complex.h>
+
+#include "filter.h"
+
+#define FMBCAST_STEREO 1  // Decode stereo when a pilot is present
+#define FMBCAST_RDS 2     // Recover RDS groups (needs a pilot)
+
+#define RDS_BITRATE 1187.5 // 57 kHz / 48
+
+struct rds_decoder {
+  complex float carrier;   // Smoothed square of the BPSK signal; half its angle is the carrier phase
+  float chips_per_sample;  // Biphase chip rate (2 * bit rate) / audio sample rate
+  float phase;             // Position within the current chip, 0-1
+  float acc;               // Integral over the current chip
+  float mid_acc;           // Integral from the middle of the previous chip
+  float mid;               // mid_acc captured at the middle of the current chip
+  bool mid_taken;
+  float last_chip;
+  float energy[2];         // Smoothed |chip difference| for each pairing of chips into bits
+  unsigned int chips;      // Chip counter, for pairing
+  float last_symbol;
+
+  uint32_t reg;            // Last 26 bits received
+  int bits;                // Bits since the last block boundary when synced, or since start of search
+  int block;               // Next expected block, 0-3 (A-D), or -1 when searching
+  int errors;              // Recent bad blocks; sync is dropped when this gets too high
+  uint16_t group[4];
+  unsigned int valid;      // Bitmap of good blocks in group[]
+
+  // Results
+  bool group_ready;        // group[] holds a complete group received during the last block
+  uint16_t pi;             // Program identification from the last good block A
+  unsigned long long groups;
+  unsigned long long bad_blocks;
+};
+
+struct fmbcast {
+  int flags;               // FMBCAST_STEREO | FMBCAST_RDS; may be changed between blocks
+  int composite_samprate;
+  int audio_samprate;
+  int composite_L;         // Composite samples per block
+  int audio_L;             // Audio frames per block
+  bool ready;              // A composite block has been filtered and awaits fmbcast_decode()
+
+  struct filter_in composite;
+  struct filter_out mono;
+  struct filter_out pilot;
+  struct filter_out lminusr;
+  struct filter_out rds;
+  int pilot_shift;         // Bin rotations for each subcarrier
+  int subc_shift;
+  int rds_shift;
+
+  // Pilot PLL
+  float pll_phase;         // Radians
+  float pll_freq;          // Radians/sample
+  float pll_alpha;         // Proportional gain
+  float pll_beta;          // Integral gain
+  float pilot_inphase;     // Smoothed power in phase with the PLL
+  float pilot_quadrature;  // and in quadrature with it
+  bool pilot_lock;
+
+  // De-emphasis, same form as the narrowband FM demodulator: s += rate * (gain * in - s)
+  // Set by the caller; rate == 0 disables it
+  float deemph_rate;
+  float deemph_gain;
+  float mono_deemph;
+  float left_deemph;
+  float right_deemph;
+
+  // Per block work areas, audio_L long
+  float *cos_pilot;
+  float *sin_pilot;
+  float *left;
+  float *right;
+  complex float *rds_baseband;  // RDS subcarrier spun down to 0 Hz using the pilot reference
+
+  struct rds_decoder rds_state;
+};
+
+int fmbcast_init(struct fmbcast *fb,int composite_samprate,int audio_samprate,float blocktime,float kaiser_beta,int flags);
+void fmbcast_free(struct fmbcast *fb);
+int fmbcast_write(struct fmbcast *fb,float const *input,int count);
+int fmbcast_decode(struct fmbcast *fb,float *output,float gain);
+
+#endif
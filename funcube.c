@@ -26,10 +26,6 @@ struct sdrstate {
 
   int number;
 
-  // Smoothed error estimates
-  complex float DC;      // DC offset
-  float sinphi;          // I/Q phase error
-  float imbalance;       // Ratio of I power to Q power
   double calibration;    // TCXO Offset (0 = on frequency)
 
   uint8_t bias_tee;
@@ -49,8 +45,6 @@ struct sdrstate {
 static float const AGC_upper = -15;
 static float const AGC_lower = -50;
 static int const ADC_samprate = 192000;
-static float const DC_alpha = 1.0e-6;  // high pass filter coefficient for DC offset estimates, per sample
-static float const Power_alpha = 1.0; // time constant (seconds) for smoothing power and I/Q imbalance estimates
 
 static float Power_smooth = 0.05; // Calculate this properly someday
 
@@ -91,6 +85,7 @@ int funcube_setup(struct frontend * const frontend, dictionary * const dictionar
   }
 
   frontend->isreal = false; // Complex sample stream
+  frontend->iq.enable = true; // The FCD needs DC and I/Q correction; default on (see iqcorr.c)
   frontend->bitspersample = 16;
   frontend->min_IF = LowerEdge;
   frontend->max_IF = UpperEdge;
@@ -186,14 +181,7 @@ void *proc_funcube(void *arg){
   struct frontend * const frontend = sdr->frontend;
   assert(frontend != NULL);
 
-  // Gain and phase corrections. These will be updated every block
-  float gain_q = 1;
-  float gain_i = 1;
-  float secphi = 1;
-  float tanphi = 0;
-
   frontend->timestamp = gps_time_ns();
-  float const rate_factor = Blocksize/(ADC_samprate * Power_alpha);
   int ConsecPaErrs = 0;
   int16_t * sampbuf = malloc(2 * Blocksize * sizeof(*sampbuf)); // complex samples have two integers
 
@@ -228,10 +216,8 @@ void *proc_funcube(void *arg){
     } else
       ConsecPaErrs = 0;
 
-    float i_energy=0, q_energy=0;
-    complex float samp_sum = 0;
-    float dotprod = 0;
-
+    float energy = 0;
+    health_input(frontend,Blocksize); // Catches samples lost to portaudio overflows
     complex float * wptr = frontend->in.input_write_pointer.c;
 
     for(int i=0; i<Blocksize; i++){
@@ -247,31 +233,15 @@ void *proc_funcube(void *arg){
       } else
 	frontend->samp_since_over++;
 
-      complex float samp = CMPLXF(sampbuf[2*i],sampbuf[2*i+1]);
-      samp_sum += samp; // Accumulate average DC values
-      samp -= sdr->DC;   // remove smoothed DC offset (which can be fractional)
-
-      // Must correct gain and phase before frequency shift
-      // accumulate I and Q energies before gain correction
-      i_energy += crealf(samp) * crealf(samp);
-      q_energy += cimagf(samp) * cimagf(samp);
-
-      // Balance gains, keeping constant total energy
-      __real__ samp *= gain_i;
-      __imag__ samp *= gain_q;
-
-      // Accumulate phase error
-      dotprod += crealf(samp) * cimagf(samp);
-
-      // Correct phase
-      __imag__ samp = secphi * cimagf(samp) - tanphi * crealf(samp);
-
+      complex float const samp = CMPLXF(sampbuf[2*i],sampbuf[2*i+1]);
+      energy += cnrmf(samp);
       wptr[i] = samp * sdr->scale;
     }
+    // Remove DC offset, correct gain and phase before the FFT
+    iq_correct(frontend,wptr,Blocksize);
     write_cfilter(&frontend->in,NULL,Blocksize); // Update write pointer, invoke FFT
     frontend->samples += Blocksize;
-    float const block_energy = i_energy + q_energy; // Normalize for complex pairs
-    frontend->if_power_instant = block_energy / Blocksize;
+    frontend->if_power_instant = energy / Blocksize;
     frontend->if_power += Power_smooth * (frontend->if_power_instant - frontend->if_power); // Average A/D output power per channel
 
 #if 1
@@ -283,18 +253,6 @@ void *proc_funcube(void *arg){
     frontend->timestamp += 1.e9 * Blocksize / ADC_samprate;
 #endif
 
-    // Update every block
-    // estimates of DC offset, signal powers and phase error
-    sdr->DC += DC_alpha * (samp_sum - Blocksize*sdr->DC);
-    if(block_energy > 0){ // Avoid divisions by 0, etc
-      sdr->imbalance += rate_factor * ((i_energy / q_energy) - sdr->imbalance);
-      float const dpn = 2 * dotprod / block_energy;
-      sdr->sinphi += rate_factor * (dpn - sdr->sinphi);
-      gain_q = sqrtf(0.5 * (1 + sdr->imbalance));
-      gain_i = sqrtf(0.5 * (1 + 1./sdr->imbalance));
-      secphi = 1/sqrtf(1 - sdr->sinphi * sdr->sinphi); // sec(phi) = 1/cos(phi)
-      tanphi = sdr->sinphi * secphi;      // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
-    }
     if(sdr->agc)
       do_fcd_agc(sdr);
   }
@@ -0,0 +1,683 @@
+// Golden-output regression check for radiod's demodulators and the DSP code they share
+//
+// Each case feeds a deterministic synthetic signal (seeded noise, CW, AM, FM and SSB carriers,
+// an FM stereo multiplex) through the same code the programs run, with no hardware or network,
+// and compares the output with a stored vector. The radiod cases quantize the signal to a front
+// end's raw A/D format, convert it with the driver's routine in convert.c into a struct frontend,
+// and run the real demodulator thread (linear.c, fm.c, wfm.c, spectrum.c) on a struct channel
+// bound to it, so radio.c:downconvert() does the tuning just as it does in radiod.
+// send_output() and send_radio_status() are replaced below to capture each block instead of sending it.
+// Floating point results legitimately differ a little with the FFTW plan, compiler and CPU,
+// so a case passes when its SNR against the golden vector (signal = golden, noise = difference)
+// is above a threshold rather than when it's bit exact.
+//
+//   golden [-d dir] [-s min_snr_db] [case...]   compare against dir/case.f32 (default golden-data)
+//   golden -w [-d dir] [case...]                 (re)write the golden vectors
+//   golden -l                                    list cases
+//
+// To check an optimization, either run it against the committed vectors or write a fresh set
+// with the reference build ("golden -w -d /tmp/ref") and compare the optimized build with -d /tmp/ref.
+//
+// Vectors are raw float32, little-endian on every host; complex values as I/Q pairs, stereo as L/R pairs.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <locale.h>
+#include <sysexits.h>
+#include <sys/socket.h>
+#include <fftw3.h>
+#include <iniparser/iniparser.h>
+
+#include "misc.h"
+#include "filter.h"
+#include "osc.h"
+#include "fmbcast.h"
+#include "resample.h"
+#include "multicast.h"
+#include "radio.h"
+
+char const *App_path;
+int Verbose;
+
+// Normally in main.c; radio.c and the demodulators use them
+float Blocktime = 20.0;          // ms, radiod default
+struct channel Template;
+int Output_fd = -1;
+int Mcast_ttl;
+struct sockaddr_storage Metadata_dest_socket;
+int Overlap = 5;                 // radiod default
+
+static int Blocks = 8;
+static double Min_snr = 70;      // dB; float32 FFT roundoff is well below this
+static int const Timeout = 60;   // sec to wait for a demodulator to ask for its next block; FFTW planning can be slow
+
+// Output vector being built by a case
+struct vec {
+  float *data;
+  size_t len;
+  size_t size;
+};
+
+static void vec_append(struct vec *v,float const *data,size_t count){
+  if(v->len + count > v->size){
+    v->size = 2 * (v->len + count);
+    v->data = realloc(v->data,sizeof(*v->data) * v->size);
+    assert(v->data != NULL);
+  }
+  memcpy(&v->data[v->len],data,sizeof(*data) * count);
+  v->len += count;
+}
+
+// The C library's random() and transcendentals differ between systems, so the input signals
+// use their own generator. xorshift32 is plenty for test noise
+static uint32_t Rand_state;
+
+static void golden_seed(uint32_t seed){
+  Rand_state = seed != 0 ? seed : 1;
+}
+
+static float uniform(void){
+  Rand_state ^= Rand_state << 13;
+  Rand_state ^= Rand_state >> 17;
+  Rand_state ^= Rand_state << 5;
+  return (Rand_state >> 8) * (1.0f / 16777216.0f); // [0,1)
+}
+
+static complex float gaussian(void){
+  float const u = 1.0f - uniform(); // (0,1]
+  float const v = uniform();
+  float const s = sqrtf(-2 * logf(u));
+  return s * cispi(2 * v);
+}
+
+// Front end test signal: noise 50 dB down plus a set of modulated carriers, in Hz from the front end's frequency.
+// Real front ends see the same carriers as cosines
+static double const CW_freq = 10000;
+static double const AM_freq = 30000;
+static double const FM_freq = -40000;  // Moved to the positive side on real front ends, see make_input()
+static double const USB_freq = 70000;
+static double const WFM_freq = 150000; // Broadcast FM carrier, alone; see make_wfm_input()
+
+static void *make_input(int samprate,bool isreal,long len){
+  golden_seed(12345);
+  double const noise = 0.003;
+  float *r = NULL;
+  complex float *c = NULL;
+  if(isreal)
+    r = malloc(sizeof(*r) * len);
+  else
+    c = malloc(sizeof(*c) * len);
+  double fm_phase = 0;
+  for(long i = 0; i < len; i++){
+    double const t = (double)i / samprate;
+    double const mod = sin(2 * M_PI * 1000 * t);                  // 1 kHz modulating tone
+    fm_phase += 2 * M_PI * 5000 * mod / samprate;                  // 5 kHz deviation
+    // For real input, fold the FM carrier to the positive side
+    double const fm_f = isreal ? -FM_freq + 100000 : FM_freq;
+    complex double s = 0.05 * cispi(2 * CW_freq * t)
+      + 0.1 * (1 + 0.5 * mod) * cispi(2 * AM_freq * t)
+      + 0.05 * cispi(2 * fm_f * t + fm_phase / M_PI)
+      + 0.05 * cispi(2 * (USB_freq + 1500) * t);                   // USB, 1500 Hz tone
+    if(isreal)
+      r[i] = creal(s) + noise * crealf(gaussian());
+    else
+      c[i] = s + noise * M_SQRT1_2 * gaussian();
+  }
+  return isreal ? (void *)r : (void *)c;
+}
+
+// Stereo multiplex with pilot: 1 kHz left, 3 kHz right
+static double multiplex(double t){
+  double const left = 0.4 * sin(2 * M_PI * 1000 * t);
+  double const right = 0.4 * sin(2 * M_PI * 3000 * t);
+  double const pilot = 2 * M_PI * 19000 * t;
+  return 0.45 * (left + right) + 0.45 * (left - right) * sin(2 * pilot) + 0.09 * sin(pilot);
+}
+
+// Broadcast FM carrier at WFM_freq, the multiplex at 75 kHz peak deviation; complex front ends only
+static void *make_wfm_input(int samprate,bool isreal,long len){
+  assert(!isreal);
+  golden_seed(24680);
+  complex float *c = malloc(sizeof(*c) * len);
+  double phase = 0;
+  for(long i = 0; i < len; i++){
+    double const t = (double)i / samprate;
+    phase += 2 * M_PI * 75000 * multiplex(t) / samprate;
+    c[i] = 0.3 * cispi(2 * WFM_freq * t + phase / M_PI) + 0.003 * M_SQRT1_2 * gaussian();
+  }
+  return c;
+}
+
+// The synthetic front end and channel of the radiod case being run
+enum fe_type {
+  RTLSDR,    // 8-bit excess-128 I/Q
+  RX888,     // 16-bit real, randomizer on
+  AIRSPY,    // 12-bit real, packed
+};
+
+static double const Tuned_freq = 10e6; // Front end frequency, arbitrary
+static struct frontend Frontend;
+static enum fe_type Fe_type;
+static float Scale;
+static struct channel Channel;
+
+// Sized and set up as main.c does for a real front end
+static struct frontend *frontend_init(enum fe_type type,int samprate){
+  struct frontend * const frontend = &Frontend;
+  memset(frontend,0,sizeof(*frontend));
+  Fe_type = type;
+  frontend->samprate = samprate;
+  frontend->isreal = type != RTLSDR;
+  frontend->bitspersample = type == RX888 ? 16 : type == AIRSPY ? 12 : 8;
+  frontend->frequency = Tuned_freq;
+  frontend->min_IF = frontend->isreal ? 0 : -samprate / 2;
+  frontend->max_IF = samprate / 2;
+  frontend->L = lround(samprate * Blocktime / 1000.0);
+  frontend->M = frontend->L / (Overlap - 1) + 1;
+  if(create_filter_input(&frontend->in,frontend->L,frontend->M,frontend->isreal ? REAL : COMPLEX) == NULL)
+    return NULL;
+  pthread_mutex_init(&frontend->status_mutex,NULL);
+  pthread_cond_init(&frontend->status_cond,NULL);
+  Scale = scale_AD(frontend);
+  return frontend;
+}
+
+static int quantize(float x,int full_scale){
+  long const s = lrintf(x * full_scale);
+  return s > full_scale ? full_scale : s < -full_scale ? -full_scale : s;
+}
+
+// Quantize one block of the test signal to the front end's raw A/D format and convert it into the
+// filter input as the driver's callback does
+static void frontend_write(void const *input,int block){
+  struct frontend * const frontend = &Frontend;
+  int const L = frontend->L;
+  float energy = 0;
+  switch(Fe_type){
+  case RX888:
+    {
+      float const * const x = (float const *)input + (long)block * L;
+      int16_t raw[L];
+      for(int i = 0; i < L; i++){
+	int const s = quantize(x[i],32767);
+	raw[i] = (s & 1) ? s ^ 0xfffe : s; // Randomized: all but the LSB flipped when it's set
+      }
+      energy = convert_s16(frontend,frontend->in.input_write_pointer.r,raw,L,Scale,true);
+    }
+    break;
+  case AIRSPY:
+    {
+      float const * const x = (float const *)input + (long)block * L;
+      uint32_t raw[3 * L / 8];
+      uint32_t *up = raw;
+      for(int i = 0; i < L; i += 8){
+	uint32_t u[8];
+	for(int j = 0; j < 8; j++)
+	  u[j] = quantize(x[i+j],2047) + 2048; // Offset binary
+	*up++ = (u[0] << 20) | (u[1] << 8) | (u[2] >> 4);
+	*up++ = (u[2] << 28) | (u[3] << 16) | (u[4] << 4) | (u[5] >> 8);
+	*up++ = (u[5] << 24) | (u[6] << 12) | u[7];
+      }
+      energy = convert_packed12(frontend,frontend->in.input_write_pointer.r,raw,L,Scale);
+    }
+    break;
+  case RTLSDR:
+    {
+      complex float const * const x = (complex float const *)input + (long)block * L;
+      uint8_t raw[2 * L];
+      for(int i = 0; i < L; i++){
+	raw[2*i] = 128 + quantize(crealf(x[i]),127);
+	raw[2*i+1] = 128 + quantize(cimagf(x[i]),127);
+      }
+      energy = convert_u8_iq(frontend,frontend->in.input_write_pointer.c,raw,L,Scale);
+    }
+    break;
+  }
+  // Unsmoothed, and set before the block is released so the demod's noise estimate sees this block's value
+  frontend->if_power_instant = frontend->if_power = energy / L;
+  if(frontend->isreal)
+    write_rfilter(&frontend->in,NULL,L);
+  else
+    write_cfilter(&frontend->in,NULL,L);
+}
+
+// State shared with the send_output() and send_radio_status() replacements, for the case being run
+static pthread_mutex_t Run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Run_cond = PTHREAD_COND_INITIALIZER;
+static struct {
+  struct vec *out;
+  int channels;      // Captured frame width; mono output is duplicated when 2
+  int skip;          // Blocks to let go by before capturing Blocks of them
+  int outputs;       // send_output() calls so far
+  int polls;         // send_radio_status() calls so far
+} Run;
+
+// With status.output_interval = 1 and output.silent clear, downconvert() calls this once per block just
+// before it waits for the block, which paces the front end here. The spectrum demod adds each block's
+// bin energies into bin_data after downconvert() returns, so poll n > 0 finds block n-1 there.
+int send_radio_status(struct sockaddr const *sock,struct frontend const *frontend,struct channel *chan){
+  (void)sock;
+  (void)frontend;
+  pthread_mutex_lock(&Run_mutex);
+  int const poll = Run.polls++;
+  if(chan->spectrum.bin_data != NULL){
+    if(poll > Run.skip && poll <= Run.skip + Blocks)
+      vec_append(Run.out,chan->spectrum.bin_data,chan->spectrum.bin_count);
+    memset(chan->spectrum.bin_data,0,chan->spectrum.bin_count * sizeof(*chan->spectrum.bin_data));
+  }
+  if(Run.polls == Run.skip + Blocks + 1)
+    chan->terminate = true; // Seen on the call after this one, so the demod takes one extra block
+  pthread_cond_broadcast(&Run_cond);
+  pthread_mutex_unlock(&Run_mutex);
+  return 0;
+}
+
+int reset_radio_status(struct channel *chan){
+  (void)chan;
+  return 0;
+}
+
+bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length){
+  (void)chan;
+  (void)buffer;
+  (void)length;
+  return false;
+}
+
+// Leaves chan->output.silent alone, so status keeps coming every block
+int send_output(struct channel * restrict chan,float const * restrict buffer,int frames,bool mute){
+  int const block = Run.outputs++;
+  if(block < Run.skip || block >= Run.skip + Blocks)
+    return frames; // Warming up, or the extra block
+  int const channels = chan->output.channels;
+  for(int i = 0; i < frames; i++){
+    float frame[2] = {0,0};
+    if(!mute && buffer != NULL){
+      if(channels == 1)
+	frame[0] = frame[1] = buffer[i];
+      else {
+	frame[0] = buffer[2*i];
+	frame[1] = buffer[2*i+1];
+      }
+    }
+    vec_append(Run.out,frame,Run.channels);
+  }
+  return frames;
+}
+
+static struct channel *channel_init(double offset){
+  struct channel * const chan = &Channel;
+  memset(chan,0,sizeof(*chan));
+  set_defaults(chan);
+  chan->frontend = &Frontend;
+  chan->tune.freq = Frontend.frequency + offset;
+  chan->output.rtp.ssrc = 1;
+  chan->status.output_interval = 1; // See send_radio_status()
+  chan->output.silent = false;
+  return chan;
+}
+
+// Wait until the demod has polled for status 'count' times
+static int wait_polls(int count){
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME,&deadline);
+  deadline.tv_sec += Timeout;
+  pthread_mutex_lock(&Run_mutex);
+  while(Run.polls < count){
+    if(pthread_cond_timedwait(&Run_cond,&Run_mutex,&deadline) == ETIMEDOUT)
+      break;
+  }
+  bool const ready = Run.polls >= count;
+  pthread_mutex_unlock(&Run_mutex);
+  return ready ? 0 : -1;
+}
+
+// Run 'demod' on the channel with the signal from 'make', capturing Blocks blocks of 'channels' wide frames after the first 'skip'
+// The front end writes each block only after the demod asks for it, so none is dropped however slow it is
+static int run_channel(struct vec *out,void *(*demod)(void *),void *(*make)(int,bool,long),int skip,int channels){
+  int const blocks = skip + Blocks;
+  struct frontend * const frontend = &Frontend;
+  struct channel * const chan = &Channel;
+  void *input = (*make)(frontend->samprate,frontend->isreal,(long)frontend->L * (blocks + 1));
+  Run.out = out;
+  Run.skip = skip;
+  Run.channels = channels;
+  Run.outputs = 0;
+  Run.polls = 0;
+  pthread_t thread;
+  if(pthread_create(&thread,NULL,demod,chan) != 0){
+    FREE(input);
+    return -1;
+  }
+  for(int block = 0; block <= blocks; block++){
+    if(wait_polls(block + 1) != 0){
+      // The thread is stuck with our state, so there's no safe way to go on to the next case
+      fprintf(stderr,"Demodulator stalled at block %d\n",block);
+      exit(EX_SOFTWARE);
+    }
+    frontend_write(input,block);
+  }
+  pthread_join(thread,NULL);
+  delete_filter_output(&chan->filter.out);
+  FREE(chan->filter.energies);
+  FREE(chan->status.command);
+  FREE(chan->spectrum.bin_data);
+  delete_filter_input(&frontend->in);
+  pthread_mutex_destroy(&chan->status.lock);
+  pthread_mutex_destroy(&frontend->status_mutex);
+  pthread_cond_destroy(&frontend->status_cond);
+  FREE(input);
+  return 0;
+}
+
+// AM on an rtlsdr: envelope detection and AGC in a 12 kHz channel
+static int linear_am(struct vec *out){
+  if(frontend_init(RTLSDR,192000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(AM_freq);
+  chan->output.samprate = 12000;
+  chan->filter.min_IF = -5000;
+  chan->filter.max_IF = +5000;
+  chan->linear.env = true;
+  return run_channel(out,demod_linear,make_input,0,1);
+}
+
+// USB on an rx888 (real front end, randomized A/D)
+static int linear_usb(struct vec *out){
+  if(frontend_init(RX888,768000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(USB_freq);
+  chan->output.samprate = 12000;
+  chan->filter.min_IF = +100;
+  chan->filter.max_IF = +3000;
+  return run_channel(out,demod_linear,make_input,0,1);
+}
+
+// Coherent I/Q on the CW carrier from an airspy (packed 12-bit real), PLL on, with a post-detection shift
+static int linear_pll(struct vec *out){
+  if(frontend_init(AIRSPY,768000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(CW_freq);
+  chan->output.samprate = 12000;
+  chan->output.channels = 2;
+  chan->filter.min_IF = -2000;
+  chan->filter.max_IF = +2000;
+  chan->linear.pll = true;
+  chan->tune.shift = 500;
+  // Output is muted until the lock detector has seen half a second of carrier, and just when that happens
+  // depends on how the loop pulls in, which is sensitive to roundoff. So skip past it
+  return run_channel(out,demod_linear,make_input,5 * Blocks,2);
+}
+
+// NBFM on an rtlsdr at the radiod fm default rate
+static int fm_channel(struct vec *out){
+  if(frontend_init(RTLSDR,192000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(FM_freq);
+  chan->output.samprate = 24000;
+  chan->filter.min_IF = -8000;
+  chan->filter.max_IF = +8000;
+  return run_channel(out,demod_fm,make_input,0,1);
+}
+
+// Broadcast FM stereo on an rtlsdr
+static int wfm_stereo(struct vec *out){
+  if(frontend_init(RTLSDR,768000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(WFM_freq);
+  // As the wfm preset sets it up, but stereo
+  chan->output.samprate = 384000;
+  chan->output.channels = 2;
+  chan->filter.min_IF = -100000;
+  chan->filter.max_IF = +100000;
+  chan->fm.rate = -expm1f(-1.0f / (75e-6f * chan->output.samprate));
+  return run_channel(out,demod_wfm,make_wfm_input,0,2);
+}
+
+// Bin energies around the AM carrier, as a spectrum channel reports them
+static int spectrum(struct vec *out){
+  if(frontend_init(RTLSDR,192000) == NULL)
+    return -1;
+  struct channel * const chan = channel_init(AM_freq);
+  chan->spectrum.bin_count = 64;
+  chan->spectrum.bin_bw = 2000;
+  return run_channel(out,demod_spectrum,make_input,0,0);
+}
+
+// Stereo multiplex with pilot through the wideband FM decoder alone
+static int fmbcast_stereo(struct vec *out){
+  int const composite_samprate = 384000;
+  struct fmbcast fb;
+  if(fmbcast_init(&fb,composite_samprate,48000,Blocktime,3.0,FMBCAST_STEREO) != 0)
+    return -1;
+  golden_seed(54321);
+  long const len = (long)fb.composite_L * Blocks;
+  float *composite = malloc(sizeof(*composite) * len);
+  for(long i = 0; i < len; i++)
+    composite[i] = multiplex((double)i / composite_samprate) + 0.001 * crealf(gaussian());
+
+  float *audio = malloc(sizeof(*audio) * 2 * fb.audio_L);
+  for(int block = 0; block < Blocks; block++){
+    fmbcast_write(&fb,composite + (long)block * fb.composite_L,fb.composite_L);
+    int const channels = fmbcast_decode(&fb,audio,1.0);
+    if(channels == 1){
+      // No stereo yet; store as stereo anyway so the vector length doesn't depend on lock time
+      for(int i = fb.audio_L - 1; i >= 0; i--)
+	audio[2*i] = audio[2*i+1] = audio[i];
+    }
+    vec_append(out,audio,2 * fb.audio_L);
+  }
+  FREE(audio);
+  FREE(composite);
+  fmbcast_free(&fb);
+  return 0;
+}
+
+static int resample_case(struct vec *out,int in_rate,int out_rate,int channels){
+  struct resampler rs;
+  if(resampler_init(&rs,in_rate,out_rate,channels) != 0)
+    return -1;
+  int const frames = lround(in_rate * Blocktime / 1000.0);
+  float *input = malloc(sizeof(*input) * frames * channels);
+  float *output = malloc(sizeof(*output) * resample_max_output(&rs,frames) * channels);
+  golden_seed(999);
+  long n = 0;
+  for(int block = 0; block < Blocks; block++){
+    for(int i = 0; i < frames; i++,n++)
+      for(int ch = 0; ch < channels; ch++)
+	input[i * channels + ch] = 0.3 * sin(2 * M_PI * (ch + 1) * 700.0 * n / in_rate) + 0.01 * crealf(gaussian());
+    int const count = resample(&rs,output,input,frames);
+    vec_append(out,output,(size_t)count * channels);
+  }
+  FREE(input);
+  FREE(output);
+  resampler_free(&rs);
+  return 0;
+}
+
+static int resample_up(struct vec *out){
+  return resample_case(out,12000,48000,1);
+}
+
+static int resample_down_stereo(struct vec *out){
+  return resample_case(out,48000,44100,2);
+}
+
+static struct {
+  char const *name;
+  int (*run)(struct vec *);
+} const Cases[] = {
+  {"linear_am", linear_am},
+  {"linear_usb", linear_usb},
+  {"linear_pll", linear_pll},
+  {"fm_channel", fm_channel},
+  {"wfm_stereo", wfm_stereo},
+  {"spectrum", spectrum},
+  {"fmbcast_stereo", fmbcast_stereo},
+  {"resample_up", resample_up},
+  {"resample_down_stereo", resample_down_stereo},
+  {NULL, NULL},
+};
+
+// The vector files are little-endian; swap in place on big-endian hosts
+static void swap_le(float *data,size_t count){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  for(size_t i = 0; i < count; i++){
+    uint32_t u;
+    memcpy(&u,&data[i],sizeof(u));
+    u = __builtin_bswap32(u);
+    memcpy(&data[i],&u,sizeof(u));
+  }
+#else
+  (void)data;
+  (void)count;
+#endif
+}
+
+static int write_golden(char const *path,struct vec const *v){
+  FILE *fp = fopen(path,"w");
+  if(fp == NULL){
+    fprintf(stderr,"Can't write %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  size_t n = 0;
+  float buffer[1024];
+  for(size_t i = 0; i < v->len; i += sizeof(buffer)/sizeof(*buffer)){
+    size_t const count = v->len - i < sizeof(buffer)/sizeof(*buffer) ? v->len - i : sizeof(buffer)/sizeof(*buffer);
+    memcpy(buffer,&v->data[i],sizeof(*buffer) * count);
+    swap_le(buffer,count);
+    n += fwrite(buffer,sizeof(*buffer),count,fp);
+  }
+  fclose(fp);
+  return n == v->len ? 0 : -1;
+}
+
+static int read_golden(char const *path,struct vec *v){
+  FILE *fp = fopen(path,"r");
+  if(fp == NULL){
+    fprintf(stderr,"Can't read %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  float buffer[1024];
+  size_t n;
+  while((n = fread(buffer,sizeof(*buffer),sizeof(buffer)/sizeof(*buffer),fp)) > 0){
+    swap_le(buffer,n);
+    vec_append(v,buffer,n);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Returns true if the case passes
+static bool compare(FILE *fp,char const *name,struct vec const *out,struct vec const *ref){
+  if(out->len != ref->len){
+    fprintf(fp,"%s samples=%zu golden_samples=%zu FAIL\n",name,out->len,ref->len);
+    return false;
+  }
+  double signal = 0,noise = 0,max_err = 0;
+  bool finite = true;
+  for(size_t i = 0; i < out->len; i++){
+    if(!isfinite(out->data[i]))
+      finite = false;
+    double const err = (double)out->data[i] - ref->data[i];
+    signal += (double)ref->data[i] * ref->data[i];
+    noise += err * err;
+    if(fabs(err) > max_err)
+      max_err = fabs(err);
+  }
+  double const snr = noise == 0 ? INFINITY : signal == 0 ? -INFINITY : 10 * log10(signal / noise);
+  bool const pass = finite && signal > 0 && snr >= Min_snr;
+  fprintf(fp,"%s samples=%zu snr_db=%.1f max_err=%.3g %s\n",name,out->len,snr,max_err,pass ? "PASS" : "FAIL");
+  return pass;
+}
+
+int main(int argc,char * const argv[]){
+  App_path = argv[0];
+  setlocale(LC_ALL,getenv("LANG"));
+
+  char const *dir = "golden-data";
+  bool write = false;
+  int c;
+  while((c = getopt(argc,argv,"d:els:vwW:")) != -1){
+    switch(c){
+    case 'd':
+      dir = optarg;
+      break;
+    case 'e':
+      FFTW_planning_level = FFTW_ESTIMATE;
+      break;
+    case 'l':
+      for(int i = 0; Cases[i].name != NULL; i++)
+	fprintf(stdout,"%s\n",Cases[i].name);
+      exit(EX_OK);
+    case 's':
+      Min_snr = strtod(optarg,NULL);
+      break;
+    case 'v':
+      Verbose++;
+      break;
+    case 'w':
+      write = true;
+      break;
+    case 'W':
+      Wisdom_file = optarg;
+      break;
+    default:
+      fprintf(stderr,"Usage: %s [-w] [-d dir] [-s min_snr_db] [-e] [-W wisdom_file] [-l] [case...]\n",argv[0]);
+      exit(EX_USAGE);
+    }
+  }
+  // filter.c logs its FFTW planning on stdout, so results go to stderr where they won't get mixed in
+  FILE * const results = stderr;
+  int failures = 0;
+  int ran = 0;
+  for(int i = 0; Cases[i].name != NULL; i++){
+    if(optind < argc){
+      bool wanted = false;
+      for(int j = optind; j < argc; j++)
+	if(strcmp(argv[j],Cases[i].name) == 0)
+	  wanted = true;
+      if(!wanted)
+	continue;
+    }
+    ran++;
+    char path[PATH_MAX];
+    snprintf(path,sizeof(path),"%s/%s.f32",dir,Cases[i].name);
+    struct vec out = {0};
+    if((*Cases[i].run)(&out) != 0){
+      fprintf(results,"%s setup FAIL\n",Cases[i].name);
+      failures++;
+    } else if(write){
+      if(write_golden(path,&out) != 0)
+	failures++;
+      else
+	fprintf(results,"%s samples=%zu written to %s\n",Cases[i].name,out.len,path);
+    } else {
+      struct vec ref = {0};
+      if(read_golden(path,&ref) != 0 || !compare(results,Cases[i].name,&out,&ref))
+	failures++;
+      FREE(ref.data);
+    }
+    FREE(out.data);
+  }
+  if(ran == 0){
+    fprintf(stderr,"No such case\n");
+    exit(EX_USAGE);
+  }
+  if(!write)
+    fprintf(results,"%d of %d cases passed\n",ran - failures,ran);
+  exit(failures == 0 ? EX_OK : EX_DATAERR);
+}
@@ -0,0 +1,123 @@
+// Front end sample continuity and timing health for 'radiod'
+//
+// Every front end callback reports how many new samples it is about to write. We compare
+// the running sample count against the count predicted from the system clock and a smoothed
+// estimate of the true A/D sample rate. A deficit larger than the gap threshold means samples
+// were lost (USB transfer failures, library overruns, audio overflows); drivers that know the
+// exact number lost (e.g., libairspy's dropped_samples) report it directly. Lost samples are
+// counted, and optionally replaced with zeroes so that everything downstream, including RTP
+// timestamps, stays aligned with real time.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <iniparser/iniparser.h>
+
+#include "misc.h"
+#include "config.h"
+#include "radio.h"
+
+static float const Gap_threshold = 10;    // Default: report deficits larger than this, milliseconds
+static float const Rate_interval = 10;    // Re-measure the sample rate this often, seconds
+static double const Rate_smooth = 0.1;    // Smoothing factor for sample rate estimates
+static double const Offset_smooth = 0.01; // Smoothing factor for callback jitter, per callback
+
+void health_setup(struct frontend * const frontend,dictionary const * const table,char const * const section){
+  assert(frontend != NULL);
+  struct fe_health * const h = &frontend->health;
+  memset(h,0,sizeof(*h));
+  h->zero_fill = config_getboolean(table,section,"zero-fill",false);
+  h->gap_threshold = config_getfloat(table,section,"gap-threshold",Gap_threshold);
+  h->rate = frontend->samprate;
+}
+
+// Write the pending zeroes into the input filter just ahead of the n live samples the callback is
+// about to write, so a gap comes out as one run of zeroes where the samples were lost.
+// The input filter keeps only ND blocks of spectrum for the channels to catch up on, so zeroes
+// that won't fit in ND-1 blocks along with the live samples are counted as missing instead
+static void zero_fill(struct frontend * const frontend,int const n){
+  struct filter_in * const f = &frontend->in;
+  struct fe_health * const h = &frontend->health;
+  int64_t const room = max((int64_t)(ND - 1) * f->ilen - n,(int64_t)0);
+  int64_t const fill = min(h->fill_pending,room);
+  h->missing += h->fill_pending - fill;
+  h->fill_pending = 0;
+  for(int64_t done = 0; done < fill;){
+    int const chunk = min(fill - done,(int64_t)f->ilen);
+    if(f->in_type == REAL){
+      memset(f->input_write_pointer.r,0,chunk * sizeof(float));
+      write_rfilter(f,NULL,chunk);
+    } else {
+      memset(f->input_write_pointer.c,0,chunk * sizeof(complex float));
+      write_cfilter(f,NULL,chunk);
+    }
+    done += chunk;
+  }
+  frontend->samples += fill;
+  h->fill_samples += fill;
+}
+
+// Account for samples the driver knows were lost
+// Call before health_input() for the next block; the zeroes are written from there
+void health_drop(struct frontend * const frontend,int64_t const n){
+  assert(frontend != NULL);
+  struct fe_health * const h = &frontend->health;
+  if(n <= 0)
+    return;
+  h->gaps++;
+  h->gap_samples += n;
+  if(h->zero_fill)
+    h->fill_pending += n;
+  else
+    h->missing += n;
+}
+
+// Call from each front end callback with the count of n new samples, before they're written
+// to frontend->in.input_write_pointer, since zero fill changes the write pointer
+void health_input(struct frontend * const frontend,int const n){
+  assert(frontend != NULL);
+  struct fe_health * const h = &frontend->health;
+  int64_t const now = gps_time_ns();
+  // Counting unfilled and not yet filled gaps keeps the comparison with elapsed time honest
+  int64_t const count = frontend->samples + h->missing + h->fill_pending + n;
+
+  if(h->anchor_time == 0){
+    // First call, start the clock
+    h->anchor_time = h->rate_time = now;
+    h->anchor_count = h->rate_count = count;
+    if(h->rate <= 0)
+      h->rate = frontend->samprate;
+    return;
+  }
+  double const expected = h->anchor_count + h->rate * (now - h->anchor_time) / BILLION;
+  double const error = expected - count; // Positive: fewer samples than the clock says we should have
+  double const threshold = h->gap_threshold * .001 * h->rate;
+  if(error - h->offset > threshold){
+    int64_t const lost = llround(error - h->offset);
+    if(Verbose)
+      fprintf(stdout,"[%s] input gap: %'lld samples (%.1f ms) missing\n",
+	      frontend->name ? frontend->name : "frontend",(long long)lost,1000. * lost / h->rate);
+    health_drop(frontend,lost);
+  } else {
+    // Ordinary scheduling jitter and clock drift
+    h->offset += Offset_smooth * (error - h->offset);
+  }
+  h->timing_error = h->offset / h->rate;
+
+  // Periodically re-measure the true sample rate against the system clock and restart the prediction
+  if(now - h->rate_time >= Rate_interval * BILLION){
+    int64_t const total = frontend->samples + h->missing + h->fill_pending + n;
+    double const rate = (double)BILLION * (total - h->rate_count) / (now - h->rate_time);
+    h->rate += Rate_smooth * (rate - h->rate);
+    h->rate_time = h->anchor_time = now;
+    h->rate_count = h->anchor_count = total;
+    h->offset = 0;
+  }
+  if(h->fill_pending > 0)
+    zero_fill(frontend,n);
+}
@@ -0,0 +1,116 @@
+// DC offset and I/Q gain/phase imbalance correction for complex (direct conversion) front ends
+// Shared by all complex front end drivers in 'radiod'; replaces the per-sample tracking loop
+// formerly in funcube.c
+//
+// The errors change slowly, so they're estimated on a decimated subset of each block and
+// smoothed over many blocks. The correction itself is a single affine transform per block:
+//   I' = a*I + b
+//   Q' = c*I + d*Q + e
+// which removes the DC offset, balances the I and Q gains (keeping total power constant)
+// and orthogonalizes Q against I. Written as a simple loop over interleaved floats so
+// the compiler can vectorize it.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <math.h>
+#include <complex.h>
+#include <iniparser/iniparser.h>
+
+#include "misc.h"
+#include "config.h"
+#include "radio.h"
+
+// Defaults, can be overridden in the hardware section of the config file
+static int const Iq_decimate = 16;     // Estimate errors on every 16th sample
+static float const Dc_tc = 5.0;        // DC offset smoothing time constant, sec
+static float const Iq_tc = 1.0;        // Gain and phase error smoothing time constant, sec
+
+// Read parameters from the hardware section and reset the estimates
+// Drivers that always want correction (e.g., funcube) set frontend->iq.enable before this is called
+void iq_corr_setup(struct frontend * const frontend,dictionary const * const table,char const * const section){
+  assert(frontend != NULL);
+  struct iq_corr * const iq = &frontend->iq;
+
+  iq->enable = config_getboolean(table,section,"iq-correct",iq->enable);
+  if(frontend->isreal)
+    iq->enable = false; // Meaningless on real input
+  iq->decimate = config_getint(table,section,"iq-decimate",Iq_decimate);
+  if(iq->decimate < 1)
+    iq->decimate = 1;
+  iq->dc_tc = config_getfloat(table,section,"dc-tc",Dc_tc);
+  iq->iq_tc = config_getfloat(table,section,"iq-tc",Iq_tc);
+  iq->DC = 0;
+  iq->imbalance = 1;
+  iq->sinphi = 0;
+  iq->gain_i = iq->gain_q = iq->secphi = 1;
+  iq->tanphi = 0;
+  if(iq->enable)
+    fprintf(stdout,"DC/IQ correction on: estimating on every %d samples, DC tc %.1f s, IQ tc %.1f s\n",
+	    iq->decimate,iq->dc_tc,iq->iq_tc);
+}
+
+// Correct a block of n complex samples in place, then update the error estimates
+// Call from the front end thread after writing to frontend->in.input_write_pointer
+// and before write_cfilter()
+void iq_correct(struct frontend * const frontend,complex float * const buf,int const n){
+  assert(frontend != NULL);
+  struct iq_corr * const iq = &frontend->iq;
+  if(!iq->enable || buf == NULL || n <= 0)
+    return;
+
+  // Estimate on the raw input, before correction
+  float i_sum = 0, q_sum = 0;
+  float i_energy = 0, q_energy = 0, dotprod = 0;
+  int count = 0;
+  float const dc_i = crealf(iq->DC);
+  float const dc_q = cimagf(iq->DC);
+  for(int i = 0; i < n; i += iq->decimate){
+    float const si = crealf(buf[i]);
+    float const sq = cimagf(buf[i]);
+    i_sum += si;
+    q_sum += sq;
+    float const ri = si - dc_i;
+    float const rq = sq - dc_q;
+    i_energy += ri * ri;
+    q_energy += rq * rq;
+    dotprod += ri * rq;
+    count++;
+  }
+  // Coefficients of the affine correction, from the current estimates
+  float const a = iq->gain_i;
+  float const b = -iq->gain_i * dc_i;
+  float const c = -iq->tanphi * iq->gain_i;
+  float const d = iq->secphi * iq->gain_q;
+  float const e = -(c * dc_i + d * dc_q);
+
+  float * const fp = (float *)buf; // Interleaved I,Q
+  for(int i = 0; i < 2*n; i += 2){
+    float const si = fp[i];
+    float const sq = fp[i+1];
+    fp[i] = a * si + b;
+    fp[i+1] = c * si + d * sq + e;
+  }
+  // Update the smoothed estimates for the next block
+  float const samprate = frontend->samprate;
+  if(samprate <= 0 || count == 0)
+    return;
+  float const dc_alpha = min(1.0f,iq->decimate / (iq->dc_tc * samprate)); // per estimated sample
+  iq->DC += dc_alpha * (CMPLXF(i_sum,q_sum) - count * iq->DC);
+
+  float const rate = min(1.0f,n / (iq->iq_tc * samprate)); // per block
+  if(i_energy > 0 && q_energy > 0){ // Avoid divisions by 0, etc
+    iq->imbalance += rate * ((i_energy / q_energy) - iq->imbalance);
+    // Phase error is measured after gain balancing, as before
+    float const gi = iq->gain_i, gq = iq->gain_q;
+    float const balanced = gi * gi * i_energy + gq * gq * q_energy;
+    float const dpn = 2 * gi * gq * dotprod / balanced;
+    iq->sinphi += rate * (dpn - iq->sinphi);
+    iq->sinphi = max(-0.5f,min(0.5f,iq->sinphi)); // Keep it sane if the input is garbage
+    iq->gain_q = sqrtf(0.5 * (1 + iq->imbalance));
+    iq->gain_i = sqrtf(0.5 * (1 + 1./iq->imbalance));
+    iq->secphi = 1/sqrtf(1 - iq->sinphi * iq->sinphi); // sec(phi) = 1/cos(phi)
+    iq->tanphi = iq->sinphi * iq->secphi;      // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
+  }
+}
@@ -26,11 +26,14 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <sysexits.h>
 
 #include "misc.h"
 #include "attr.h"
 #include "multicast.h"
+#include "occupancy.h"
 
 
 // size of stdio buffer for disk I/O
@@ -63,7 +66,7 @@ struct session {
   struct session *next;
   struct sockaddr sender;   // Sender's IP address and source port
 
-  char filename[PATH_MAX];
+  char filename[PATH_MAX];     // Clips in memory: the name the decoder will see
   struct wav header;
 
   uint32_t ssrc;               // RTP stream source ID
@@ -78,6 +81,7 @@ struct session {
 
   int64_t SamplesWritten;
   int64_t TotalFileSamples;
+  struct occupancy occupancy;  // Signal presence in the clip being recorded
 };
 
 char const *App_path;
@@ -85,17 +89,25 @@ int Verbose;
 bool Keep_wav;
 char PCM_mcast_address_text[256];
 char const *Recordings = ".";
+// Unless -k, clips are kept in memory (memfd) and the decoder opens a symlink to
+// /proc/self/fd/N in this tmpfs directory. The name still carries the date and time it parses
+char const *Clip_base = "/dev/shm";
+char *Clip_dir;
 
 struct {
   double cycle_time;
   double transmission_time;
   char const *decode;
+  float low;                   // Audio passband searched by the decoder, Hz
+  float high;
+  float width;                 // Bandwidth of one signal, Hz
 } Modetab[] = {
-  { 120, 114, "wsprd"},
-  { 15, 12.64, "decode_ft8"},
-  { 7.5, 4.48, "decode_ft8"},  
-  { 0, 0, NULL},
+  { 120, 114, "wsprd", 1400, 1600, 6},
+  { 15, 12.64, "decode_ft8", 200, 3000, 50},
+  { 7.5, 4.48, "decode_ft8", 200, 3000, 83},
+  { 0, 0, NULL, 0, 0, 0},
 };
+float Min_snr = -INFINITY;     // Clips with nothing this far above the noise aren't decoded (-g); 0.7 dB is below the weakest decodable readings in occupancy.h
 enum {
   WSPR,
   FT8,
@@ -107,14 +119,56 @@ struct sockaddr Input_mcast_sockaddr;
 int Input_fd;
 struct session *Sessions;
 
+// Decoder jobs. Closed files wait in a queue ordered by deadline; at most Max_jobs decoders run at once
+// A job still waiting when the next cycle's files are ready is stale and is dropped
+struct job {
+  struct job *next;
+  char filename[PATH_MAX];
+  char dir[PATH_MAX];          // Decoder's working directory
+  int fd;                      // In-memory clip, -1 when it's on disk
+  uint32_t ssrc;
+  int64_t cycle;               // Start of the cycle that was recorded, UTC ns
+  int64_t deadline;            // Must start by this time, UTC ns
+  float snr;                   // Peak to noise in passband, dB
+  int64_t queued;
+  int64_t started;
+  pid_t pid;
+};
+struct job *Pending;           // Sorted by deadline
+struct job *Running;
+int Max_jobs;                  // Default: number of CPUs
+char const *Status_file;       // Scheduler metrics, rewritten every cycle
+
+struct {
+  int pending;
+  int running;
+  int max_pending;             // Since last report
+  int64_t queued;              // All totals since startup
+  int64_t started;
+  int64_t completed;
+  int64_t failed;              // Nonzero exit or signal
+  int64_t dropped;             // Stale, never started
+  int64_t skipped;             // Nothing in the clip above -g threshold
+  int64_t late;                // Finished after the next cycle's files were ready
+  int64_t runtime;             // Total decoder runtime, ns
+  int64_t max_runtime;         // Since last report
+  int64_t wait;                // Total queue wait, ns
+  int64_t max_wait;            // Since last report
+  int64_t last_report;         // Cycle start of last report
+} Jobstats;
+
 void input_loop(void);
 void cleanup(void);
 struct session *init_session(struct session *sp,struct rtp_header *rtp,int size);
-void process_file(struct session *sp);
+void process_file(struct session *sp,int64_t cycle);
+static void remove_file(struct job *jp);
 void create_new_file(struct session *sp,time_t);
+void run_jobs(int64_t now);
+static void closedown(int a);
+static volatile sig_atomic_t Stop_signal; // Set by closedown(); input_loop() returns and exit() runs cleanup()
 
 void usage(){
-  fprintf(stdout,"Usage: %s [-L locale] [-v] [-k] [-d recording_dir] [-x <PATH_TO_JT9>] [-4|-8|-w] PCM_multicast_address\n",App_path);
+  fprintf(stdout,"Usage: %s [-L locale] [-v] [-k] [-d recording_dir] [-x <PATH_TO_JT9>] [-j max_decoders] [-s status_file] [-g min_snr_dB] [-t clip_link_dir] [-4|-8|-w] PCM_multicast_address\n",App_path);
   exit(EX_USAGE);
 }
 
@@ -126,7 +180,7 @@ int main(int argc,char *argv[]){
 
   // Defaults
   int c;
-  while((c = getopt(argc,argv,"w84d:L:vkVx:")) != EOF){
+  while((c = getopt(argc,argv,"w84d:L:vkVx:j:s:t:g:")) != EOF){
     switch(c){
     case 'x':
       Modetab[FT4].decode  = optarg;
@@ -153,6 +207,18 @@ int main(int argc,char *argv[]){
     case 'k':
       Keep_wav = true;
       break;
+    case 'j':
+      Max_jobs = strtol(optarg,NULL,0);
+      break;
+    case 's':
+      Status_file = optarg;
+      break;
+    case 't':
+      Clip_base = optarg;
+      break;
+    case 'g':
+      Min_snr = strtof(optarg,NULL);
+      break;
     case 'V':
       VERSION();
       exit(EX_OK);
@@ -161,6 +227,10 @@ int main(int argc,char *argv[]){
     }
   }
   setlocale(LC_ALL,locale);
+  if(Max_jobs <= 0){
+    long const ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    Max_jobs = ncpu > 0 ? ncpu : 1;
+  }
   // Stdout should already be in append mode, just make sure
   if(fcntl(1,F_SETFL,O_APPEND) == -1)
     fprintf(stdout,"fcntl of stdout to set O_APPEND failed: %s\n",strerror(errno));
@@ -182,6 +252,16 @@ int main(int argc,char *argv[]){
     fprintf(stdout,"Can't change to directory %s: %s, exiting\n",Recordings,strerror(errno));
     exit(EX_CANTCREAT);
   }
+#if defined(linux)
+  if(!Keep_wav){
+    char template[PATH_MAX];
+    snprintf(template,sizeof(template),"%s/jt-decoded.XXXXXX",Clip_base);
+    if(mkdtemp(template) != NULL)
+      Clip_dir = strdup(template);
+    else
+      fprintf(stdout,"can't create %s: %s, writing clips to disk\n",template,strerror(errno));
+  }
+#endif
 
   // Set up input socket for multicast data stream from front end
   {
@@ -198,27 +278,49 @@ int main(int argc,char *argv[]){
   int const n = 1 << 20; // 1 MB
   if(setsockopt(Input_fd,SOL_SOCKET,SO_RCVBUF,&n,sizeof(n)) == -1)
     perror("setsockopt");
-
+  {
+    // Keep the decoder queue moving even when no data arrives
+    struct timeval const tv = { 0, 200000 };
+    if(setsockopt(Input_fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv)) == -1)
+      perror("setsockopt");
+  }
   atexit(cleanup);
+  // So the clip directory gets removed
+  signal(SIGINT,closedown);
+  signal(SIGQUIT,closedown);
+  signal(SIGTERM,closedown);
 
-  input_loop();
+  input_loop(); // Returns on a signal
 
-  exit(EX_OK);
+  if(Verbose)
+    fprintf(stdout,"%s: caught signal %d: %s\n",App_path,(int)Stop_signal,strsignal(Stop_signal));
+  exit(EX_OK);  // Will call cleanup()
+}
+
+// Nothing here is safe to do in a signal handler; the receive timeout brings input_loop() around to check
+static void closedown(int a){
+  Stop_signal = a;
 }
 
 // Read from RTP network socket, assemble blocks of samples
 // As currently written, requires data from a new frame to flush out and execute finished ones
 // This doesn't seem like a big problem
 void input_loop(){
-  while(true){
+  while(Stop_signal == 0){
     uint8_t buffer[PKTSIZE];
     socklen_t socksize = sizeof(Sender);
     int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&Sender,&socksize);
     // stash time now in case we are slowed by the code below
     int64_t const now = utc_time_ns();
+    int const err = errno;
+
+    // Reap finished decoders, start queued ones, drop stale ones
+    run_jobs(now);
 
     if(size <= 0){    // ??
-      perror("recvfrom");
+      if(err == EAGAIN || err == EWOULDBLOCK || err == EINTR)
+	continue; // Receive timeout
+      fprintf(stdout,"recvfrom: %s\n",strerror(err));
       usleep(50000);
       continue;
     }
@@ -284,6 +386,10 @@ void input_loop(){
       
       // Remember the starting RTP timestamp
       sp->next_timestamp = rtp.timestamp;
+
+      if(sp->occupancy.plan == NULL)
+	occupancy_init(&sp->occupancy,sp->samprate,Modetab[Mode].low,Modetab[Mode].high,Modetab[Mode].width);
+      occupancy_reset(&sp->occupancy);
       
       // Write .wav header, skipping size fields
       memcpy(sp->header.ChunkID,"RIFF", 4);
@@ -316,6 +422,7 @@ void input_loop(){
 
     sp->TotalFileSamples += samp_count;
     sp->SamplesWritten += samp_count;
+    occupancy_s16be(&sp->occupancy,samples,samp_count,sp->channels);
 
     // Packet samples are in big-endian order; write to .wav file in little-endian order
     for(int n = 0; n < samp_count; n++){
@@ -325,17 +432,10 @@ void input_loop(){
     sp->next_timestamp = rtp.timestamp + samp_count / sp->channels;
     if(modtime >= Modetab[Mode].transmission_time * BILLION){
       // We've reached the end of the current transmission.
-      // Close current file, hand it to the decoder
-      process_file(sp);
+      // Close current file, queue it for the decoder
+      process_file(sp,now - modtime);
+      run_jobs(now);
     }
-    // Continuously reap children (decoders) at any time so they won't become zombies
-    // They can take tens of seconds and finish in any order
-    int status = 0;
-    int pid;
-    while((pid = waitpid(-1,&status,WNOHANG)) > 0)
-      ;
-    if(Verbose > 1 && pid > 0)
-      fprintf(stdout,"child %d wait status %d\n",pid,status);
   }
 }
 // Set up new file on session with name derived from start_time_sec
@@ -348,12 +448,21 @@ void create_new_file(struct session *sp,time_t start_time_sec){
     fprintf(stdout,"can't create directory %s: %s\n",dir,strerror(errno));
 
   // Try to create file in directory whether or not the mkdir succeeded
+  char const *prefix = Recordings;
+#if defined(linux)
+  if(Clip_dir != NULL){
+    snprintf(dir,sizeof(dir),"%s/%u",Clip_dir,sp->ssrc);
+    if(mkdir(dir,0700) == -1 && errno != EEXIST)
+      fprintf(stdout,"can't create directory %s: %s\n",dir,strerror(errno));
+    prefix = Clip_dir;
+  }
+#endif
   char filename[PATH_MAX];
   switch(Mode){
   case FT4:
   case FT8:
     snprintf(filename,sizeof(filename),"%s/%u/%02d%02d%02d_%02d%02d%02d.wav",
-	     Recordings,
+	     prefix,
 	     sp->ssrc,
 	     (tm->tm_year+1900) % 100,
 	     tm->tm_mon+1,
@@ -364,7 +473,7 @@ void create_new_file(struct session *sp,time_t start_time_sec){
     break;
   case WSPR:
     snprintf(filename,sizeof(filename),"%s/%u/%02d%02d%02d_%02d%02d.wav",
-	     Recordings,
+	     prefix,
 	     sp->ssrc,
 	     (tm->tm_year+1900) % 100,
 	     tm->tm_mon+1,
@@ -374,6 +483,11 @@ void create_new_file(struct session *sp,time_t start_time_sec){
     break;
   }    
   int fd = -1;
+#if defined(linux)
+  if(Clip_dir != NULL && (fd = memfd_create(basename(filename),MFD_CLOEXEC)) != -1){
+    strlcpy(sp->filename,filename,sizeof(sp->filename));
+  } else
+#endif
   if((fd = open(filename,O_RDWR|O_CREAT,0777)) != -1){
     strlcpy(sp->filename,filename,sizeof(sp->filename));
   } else {
@@ -407,21 +521,53 @@ void cleanup(void){
       Sessions->fp = NULL;
     }
     FREE(Sessions->iobuffer);
+    occupancy_free(&Sessions->occupancy);
     FREE(Sessions);
     Sessions = next_s;
   }
+  // Decoders already running finish on their own; their files stay behind
+  while(Pending){
+    struct job * const next_j = Pending->next;
+    if(Pending->fd != -1)
+      close(Pending->fd);
+    else if(!Keep_wav)
+      unlink(Pending->filename);
+    FREE(Pending);
+    Pending = next_j;
+  }
+  if(Clip_dir != NULL){
+    // Decoders have opened their clips by now; remove the links and the directory
+    for(struct job *jp = Running; jp != NULL; jp = jp->next)
+      unlink(jp->filename);
+    DIR *dirp = opendir(Clip_dir);
+    if(dirp != NULL){
+      struct dirent *dp;
+      while((dp = readdir(dirp)) != NULL){
+	if(dp->d_name[0] == '.')
+	  continue;
+	char path[PATH_MAX];
+	snprintf(path,sizeof(path),"%s/%s",Clip_dir,dp->d_name);
+	rmdir(path);
+      }
+      closedir(dirp);
+    }
+    rmdir(Clip_dir);
+    FREE(Clip_dir);
+  }
 }
 
-// Close and process file
-void process_file(struct session *sp){
+// Close file and queue it for decoding. cycle is the UTC start of the recorded cycle, ns
+void process_file(struct session *sp,int64_t cycle){
   assert(sp != NULL && sp->fp != NULL);
   if(sp == NULL || sp->fp == NULL)
     return;
 
+  float const snr = occupancy_snr(&sp->occupancy);
   if(Verbose)
-    fprintf(stdout,"closing %s %'.1f/%'.1f sec\n",sp->filename,
+    fprintf(stdout,"closing %s %'.1f/%'.1f sec, peak/noise %.1f dB\n",sp->filename,
 	    (float)sp->SamplesWritten / sp->samprate,
-	    (float)sp->TotalFileSamples / sp->samprate);
+	    (float)sp->TotalFileSamples / sp->samprate,
+	    snr);
   
   // Get final file size, write .wav header with sizes
   fflush(sp->fp);
@@ -432,6 +578,23 @@ void process_file(struct session *sp){
   rewind(sp->fp);
   fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
   fflush(sp->fp);
+  struct job *jp = calloc(1,sizeof(*jp));
+  if(jp == NULL)
+    exit(EX_TEMPFAIL);
+  jp->fd = -1;
+#if defined(linux)
+  if(Clip_dir != NULL && strncmp(sp->filename,Clip_dir,strlen(Clip_dir)) == 0){
+    // In memory; keep it open for the decoder. The decoder runs where its files would have gone
+    jp->fd = fcntl(fileno(sp->fp),F_DUPFD_CLOEXEC,0);
+    snprintf(jp->dir,sizeof(jp->dir),"%u",sp->ssrc);
+  }
+#endif
+  if(jp->fd == -1){
+    // dirname_r() is only available on MacOS, so we can't use it here
+    char *fname_dup = strdup(sp->filename); // in case dirname modifies its arg
+    strlcpy(jp->dir,dirname(fname_dup),sizeof(jp->dir));
+    FREE(fname_dup);
+  }
   fclose(sp->fp);
   sp->fp = NULL;
 
@@ -439,77 +602,233 @@ void process_file(struct session *sp){
   sp->TotalFileSamples = 0;
   sp->SamplesWritten = 0;
 
-  int child = fork();
-  if(child == 0){
-    // Double fork so we don't have to wait. Seems ugly, is there a better way??
-    int grandchild = fork();
-    if(grandchild == 0){
-      {
-	// set working directory to the one containing the file
-	// dirname_r() is only available on MacOS, so we can't use it here
-	char *fname_dup = strdup(sp->filename); // in case dirname modifies its arg
-	int r = chdir(dirname(fname_dup));
-	FREE(fname_dup);
-	
-	if(r != 0)
-	  perror("chdir");
-      }
-      char freq[100];
-      snprintf(freq,sizeof(freq),"%lf",(double)sp->ssrc * 1e-6);
-      
-      switch(Mode){
-      case WSPR:
-	if(Verbose)
-	  fprintf(stdout,"%s %s %s %s %s\n",Modetab[Mode].decode,"-f",freq,"-w",sp->filename);
-	
-	execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,"-w",sp->filename,(char *)NULL);
-	break;
-      case FT8:
-	// Note: requires my version of decode_ft8 that accepts -f basefreq
-	if(Verbose)
-	  fprintf(stdout,"%s -f %s %s\n",Modetab[Mode].decode,freq,sp->filename);
-	
-	execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,sp->filename,(char *)NULL);
-	break;
-      case FT4:
-	// Note: requires my version of decode_ft8 that accepts -f basefreq
-	if(Verbose)
-	  fprintf(stdout,"%s -f %s -4 %s\n",Modetab[Mode].decode,freq,sp->filename);
-	
-	execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,"-4",sp->filename,(char *)NULL);
-	break;
-      }
-      // Gets here only if exec fails
-      fprintf(stdout,"execlp(%s) returned errno %d (%s)\n",Modetab[Mode].decode,errno,strerror(errno));
-      exit(EX_SOFTWARE); // Exit from grandchild context
+  int64_t const cycle_ns = Modetab[Mode].cycle_time * BILLION;
+  strlcpy(jp->filename,sp->filename,sizeof(jp->filename));
+  jp->ssrc = sp->ssrc;
+  jp->snr = isnan(snr) ? INFINITY : snr; // Don't know, so don't skip
+  if(jp->snr < Min_snr){
+    if(Verbose)
+      fprintf(stdout,"skipping %s, peak/noise %.1f dB\n",jp->filename,jp->snr);
+    Jobstats.skipped++;
+    remove_file(jp);
+    FREE(jp);
+    return;
+  }
+  jp->cycle = cycle;
+  // Pointless to start after the next cycle's files are ready; they'd only make it later
+  jp->deadline = cycle + cycle_ns + (int64_t)(Modetab[Mode].transmission_time * BILLION);
+  jp->queued = utc_time_ns();
+
+  // Earliest deadline first; within a cycle, strongest signals first so the quietest clips
+  // are the ones dropped if we can't keep up
+  struct job **pp = &Pending;
+  while(*pp != NULL && ((*pp)->deadline < jp->deadline
+			|| ((*pp)->deadline == jp->deadline && (*pp)->snr >= jp->snr)))
+    pp = &(*pp)->next;
+  jp->next = *pp;
+  *pp = jp;
+
+  Jobstats.queued++;
+  Jobstats.pending++;
+  if(Jobstats.pending > Jobstats.max_pending)
+    Jobstats.max_pending = Jobstats.pending;
+}
+
+// Discard a job's clip
+static void remove_file(struct job *jp){
+  if(jp->fd != -1){
+    close(jp->fd); // Never started
+    jp->fd = -1;
+    return;
+  }
+  if(Keep_wav)
+    return;
+  if(Verbose)
+    fprintf(stdout,"unlink(%s)\n",jp->filename);
+  unlink(jp->filename); // File, or link to a clip in memory
+}
+
+// Fork and exec the decoder on a job's file
+static int start_job(struct job *jp){
+  if(jp->fd != -1){
+    // The decoder inherits the descriptor, so /proc/self/fd/N means the clip in its context too
+    char target[PATH_MAX];
+    snprintf(target,sizeof(target),"/proc/self/fd/%d",jp->fd);
+    unlink(jp->filename);
+    if(symlink(target,jp->filename) == -1){
+      fprintf(stdout,"symlink %s: %s\n",jp->filename,strerror(errno));
+      return -1;
     }
-    // In child context
-    if(Verbose > 1)
-      fprintf(stdout,"forked grandchild %d\n",grandchild);
-    // Wait for decoder to finish, then remove its input file
-    int status = 0;
-    if(waitpid(-1,&status,0) == -1){
-      fprintf(stdout,"error waiting for grandchild: errno %d (%s)\n",
-	      errno,strerror(errno));
-      exit(EXIT_FAILURE);
+  }
+  pid_t const child = fork();
+  if(child == -1){
+    fprintf(stdout,"fork: errno %d (%s)\n",errno,strerror(errno));
+    return -1;
+  }
+  if(child != 0){
+    jp->pid = child;
+    if(jp->fd != -1){
+      close(jp->fd); // Freed when the decoder exits
+      jp->fd = -1;
     }
     if(Verbose > 1)
-      fprintf(stdout,"grandchild %d waitpid status %d\n",grandchild,status);
-    
-    if(!WIFEXITED(status)){
-      if(Verbose > 1){
-	if(WIFSIGNALED(status))
-	  fprintf(stdout,"grandchild %d terminated by signal %d\n",grandchild,WTERMSIG(status));
-      }
+      fprintf(stdout,"spawned decoder %d for %s\n",child,jp->filename);
+    return 0;
+  }
+  // In child context
+  if(jp->fd != -1)
+    fcntl(jp->fd,F_SETFD,0); // Only this clip survives the exec
+
+  if(chdir(jp->dir) != 0)
+    perror("chdir");
+
+  char freq[100];
+  snprintf(freq,sizeof(freq),"%lf",(double)jp->ssrc * 1e-6);
+
+  switch(Mode){
+  case WSPR:
+    if(Verbose)
+      fprintf(stdout,"%s %s %s %s %s\n",Modetab[Mode].decode,"-f",freq,"-w",jp->filename);
+
+    execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,"-w",jp->filename,(char *)NULL);
+    break;
+  case FT8:
+    // Note: requires my version of decode_ft8 that accepts -f basefreq
+    if(Verbose)
+      fprintf(stdout,"%s -f %s %s\n",Modetab[Mode].decode,freq,jp->filename);
+
+    execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,jp->filename,(char *)NULL);
+    break;
+  case FT4:
+    // Note: requires my version of decode_ft8 that accepts -f basefreq
+    if(Verbose)
+      fprintf(stdout,"%s -f %s -4 %s\n",Modetab[Mode].decode,freq,jp->filename);
+
+    execlp(Modetab[Mode].decode,Modetab[Mode].decode,"-f",freq,"-4",jp->filename,(char *)NULL);
+    break;
+  }
+  // Gets here only if exec fails
+  fprintf(stdout,"execlp(%s) returned errno %d (%s)\n",Modetab[Mode].decode,errno,strerror(errno));
+  _exit(EX_SOFTWARE); // Don't run our atexit handlers in the child
+}
+
+// Write scheduler metrics to the status file (if any) and, when verbose, to the log
+// Called once per cycle
+static void report_jobs(int64_t now){
+  double const mean_runtime = Jobstats.completed > 0 ? (double)Jobstats.runtime / Jobstats.completed / BILLION : 0;
+  double const mean_wait = Jobstats.started > 0 ? (double)Jobstats.wait / Jobstats.started / BILLION : 0;
+
+  if(Verbose)
+    fprintf(stdout,"decoders: %d running %d pending (max %d), %'lld queued %'lld completed %'lld failed %'lld dropped %'lld skipped %'lld late, runtime mean %.2f max %.2f s, wait mean %.2f max %.2f s\n",
+	    Jobstats.running,Jobstats.pending,Jobstats.max_pending,
+	    (long long)Jobstats.queued,(long long)Jobstats.completed,(long long)Jobstats.failed,
+	    (long long)Jobstats.dropped,(long long)Jobstats.skipped,(long long)Jobstats.late,
+	    mean_runtime,(double)Jobstats.max_runtime / BILLION,
+	    mean_wait,(double)Jobstats.max_wait / BILLION);
+
+  if(Status_file != NULL){
+    // Write a temporary and rename it so readers never see a partial file
+    char tmp[PATH_MAX];
+    snprintf(tmp,sizeof(tmp),"%s.tmp",Status_file);
+    FILE *fp = fopen(tmp,"w");
+    if(fp == NULL){
+      fprintf(stdout,"can't write %s: %s\n",tmp,strerror(errno));
+    } else {
+      fprintf(fp,"time=%.3f\n",(double)now / BILLION);
+      fprintf(fp,"max_jobs=%d\n",Max_jobs);
+      fprintf(fp,"running=%d\n",Jobstats.running);
+      fprintf(fp,"pending=%d\n",Jobstats.pending);
+      fprintf(fp,"max_pending=%d\n",Jobstats.max_pending);
+      fprintf(fp,"queued=%lld\n",(long long)Jobstats.queued);
+      fprintf(fp,"started=%lld\n",(long long)Jobstats.started);
+      fprintf(fp,"completed=%lld\n",(long long)Jobstats.completed);
+      fprintf(fp,"failed=%lld\n",(long long)Jobstats.failed);
+      fprintf(fp,"dropped=%lld\n",(long long)Jobstats.dropped);
+      fprintf(fp,"skipped=%lld\n",(long long)Jobstats.skipped);
+      fprintf(fp,"late=%lld\n",(long long)Jobstats.late);
+      fprintf(fp,"mean_runtime=%.3f\n",mean_runtime);
+      fprintf(fp,"max_runtime=%.3f\n",(double)Jobstats.max_runtime / BILLION);
+      fprintf(fp,"mean_wait=%.3f\n",mean_wait);
+      fprintf(fp,"max_wait=%.3f\n",(double)Jobstats.max_wait / BILLION);
+      fclose(fp);
+      if(rename(tmp,Status_file) == -1)
+	fprintf(stdout,"can't rename %s to %s: %s\n",tmp,Status_file,strerror(errno));
     }
-    if(!Keep_wav){
-      if(Verbose)
-	fprintf(stdout,"unlink(%s)\n",sp->filename);
-      unlink(sp->filename);
-      sp->filename[0] = '\0';
+  }
+  // Peaks are per reporting interval
+  Jobstats.max_pending = Jobstats.pending;
+  Jobstats.max_runtime = 0;
+  Jobstats.max_wait = 0;
+}
+
+// Reap finished decoders, drop stale jobs, start as many as the limit allows
+// Cheap enough to call on every packet
+void run_jobs(int64_t now){
+  // Reap children (decoders) at any time so they won't become zombies
+  // They can take tens of seconds and finish in any order
+  int status = 0;
+  pid_t pid;
+  while((pid = waitpid(-1,&status,WNOHANG)) > 0){
+    struct job **pp = &Running;
+    while(*pp != NULL && (*pp)->pid != pid)
+      pp = &(*pp)->next;
+    struct job *jp = *pp;
+    if(jp == NULL)
+      continue; // Not ours?
+    *pp = jp->next;
+    Jobstats.running--;
+
+    int64_t const runtime = now - jp->started;
+    Jobstats.completed++;
+    Jobstats.runtime += runtime;
+    if(runtime > Jobstats.max_runtime)
+      Jobstats.max_runtime = runtime;
+    if(now > jp->deadline)
+      Jobstats.late++;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      Jobstats.failed++;
+
+    if(Verbose > 1){
+      if(WIFSIGNALED(status))
+	fprintf(stdout,"decoder %d terminated by signal %d\n",pid,WTERMSIG(status));
+      else
+	fprintf(stdout,"decoder %d wait status %d, %.2f sec\n",pid,status,(double)runtime / BILLION);
     }
-    exit(EX_OK); // child exits
+    remove_file(jp);
+    FREE(jp);
+  }
+  // Stale jobs can only be at the head of the queue
+  while(Pending != NULL && Pending->deadline <= now){
+    struct job *jp = Pending;
+    Pending = jp->next;
+    Jobstats.pending--;
+    Jobstats.dropped++;
+    if(Verbose)
+      fprintf(stdout,"dropping stale %s, %.1f sec past deadline\n",jp->filename,(double)(now - jp->deadline) / BILLION);
+    remove_file(jp);
+    FREE(jp);
+  }
+  while(Pending != NULL && Jobstats.running < Max_jobs){
+    struct job *jp = Pending;
+    jp->started = now;
+    if(start_job(jp) == -1)
+      break; // Try again later
+    Pending = jp->next;
+    Jobstats.pending--;
+    jp->next = Running;
+    Running = jp;
+    Jobstats.running++;
+    Jobstats.started++;
+    int64_t const wait = now - jp->queued;
+    Jobstats.wait += wait;
+    if(wait > Jobstats.max_wait)
+      Jobstats.max_wait = wait;
+  }
+  int64_t const cycle_ns = Modetab[Mode].cycle_time * BILLION;
+  int64_t const cycle = now - now % cycle_ns;
+  if(cycle != Jobstats.last_report){
+    if(Jobstats.last_report != 0)
+      report_jobs(now);
+    Jobstats.last_report = cycle;
   }
-  if(Verbose > 1)
-    fprintf(stdout,"spawned child %d\n",child);
 }
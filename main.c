@@ -86,10 +86,41 @@ struct sockaddr_storage Metadata_dest_socket;      // Dest of global metadata
 static char const *Metadata_dest_string; // DNS name of default multicast group for status/commands
 int Output_fd = -1; // Unconnected socket used for all multicast output
 
+// Running totals of what a config load did to the static channels
+struct load_stats {
+  int started;   // New channels
+  int kept;      // Unchanged
+  int retuned;   // Only the frequency changed
+  int restarted; // Other settings changed; closed and recreated
+};
+
+static unsigned int Config_generation; // Number of reloads
+static volatile sig_atomic_t Reload_requested;
+static volatile sig_atomic_t Exit_requested; // Signal number
+static volatile sig_atomic_t Main_loop;      // Main loop is running and will handle Exit_requested
+
+// Channel section keys that are handled without restarting a channel
+static char const *Freq_keys[] = {"freq","freq0","freq1","freq2","freq3","freq4","freq5","freq6","freq7","freq8","freq9",NULL};
+
+// [global] keys read only at startup
+static char const *Global_fixed_keys[] = {
+  "hardware","status","data","iface","tos","ttl","update","blocktime","overlap","fft-threads",
+  "fft-time-limit","fft-plan-level","wisdom-file","rtcp","sap",NULL};
+
 static void closedown(int);
+static void exit_radiod(int);
 static void verbosity(int);
+static void reload(int);
 static int loadconfig(char const *file);
-static int setup_hardware(char const *sname);
+static int reload_config(char const *file);
+static void template_preset(void);
+static int setup_channels(struct load_stats *stats);
+static int setup_section(char const *sname,struct load_stats *stats);
+static bool section_sockets(char const *sname,char const *data,struct sockaddr_storage *data_dest,struct sockaddr_storage *metadata_dest);
+static struct channel *claim_chan(char const *sname,uint32_t ssrc,int range);
+static int retune_chan(struct channel *chan,double f);
+static int terminate_chan(struct channel *chan);
+static int setup_hardware(char const *sname,struct frontend *frontend);
 static void *rtcp_send(void *);
 
 // In sdrplay.c (maybe someday)
@@ -199,6 +230,7 @@ int main(int argc,char *argv[]){
   signal(SIGPIPE,SIG_IGN);
   signal(SIGUSR1,verbosity);
   signal(SIGUSR2,verbosity);
+  signal(SIGHUP,reload);
 
   if(argc <= optind){
     fprintf(stdout,"Configtable file missing\n");
@@ -221,8 +253,21 @@ int main(int argc,char *argv[]){
   struct timespec last_realtime = start_realtime;
   struct timespec last_cputime = {0};
   int sleep_period = 60;
+  Main_loop = 1;
   while(true){
-    sleep(sleep_period);
+    // The signal may be taken by any thread, so poll for it rather than wait for sleep() to be interrupted
+    for(int i=0; i < sleep_period && !Reload_requested && !Exit_requested; i++)
+      sleep(1);
+    if(Exit_requested){
+      // Save the dynamic channels here rather than in the handler, which could interrupt a thread holding the locks
+      chanstate_save();
+      exit_radiod(Exit_requested);
+    }
+    if(Reload_requested){
+      Reload_requested = 0;
+      fprintf(stdout,"Reloading config file %s...\n",Config_file);
+      reload_config(Config_file);
+    }
     struct timespec new_realtime;
     clock_gettime(CLOCK_MONOTONIC,&new_realtime);
     double total_real = new_realtime.tv_sec - start_realtime.tv_sec
@@ -257,6 +302,7 @@ static int loadconfig(char const * const file){
   if(file == NULL || strlen(file) == 0)
     return -1;
 
+  int64_t const start = gps_time_ns(); // Startup timing, logged below
   Configtable = iniparser_load(file);
   if(Configtable == NULL)
     return -1;
@@ -359,24 +405,43 @@ static int loadconfig(char const * const file){
     fprintf(stdout,"'hardware = [sectionname]' now required to specify front end configuration\n");
     exit(EX_USAGE);
   }
-  // Look for specified hardware section
+  // Look for specified hardware section(s)
+  // More than one may be listed, e.g., "hardware = rx888 airspy"; the first is the default for dynamic channels
+  // They all share the FFT worker threads, the status/command stream and the output sockets
   {
-    int const nsect = iniparser_getnsec(Configtable);
-    int sect;
-    for(sect = 0; sect < nsect; sect++){
-      char const * const sname = iniparser_getsecname(Configtable,sect);
-      if(strcasecmp(sname,hardware) == 0){
-	if(setup_hardware(sname) != 0)
-	  exit(EX_NOINPUT);
-
-	break;
+    char *hw_list = strdup(hardware); // Need writeable copy for strtok
+    char *saveptr = NULL;
+    for(char const *tok = strtok_r(hw_list," \t,",&saveptr);
+	tok != NULL;
+	tok = strtok_r(NULL," \t,",&saveptr)){
+      if(Nfrontends == MAX_FRONTENDS){
+	fprintf(stdout,"Too many front ends, [%s] ignored\n",tok);
+	continue;
+      }
+      int const nsect = iniparser_getnsec(Configtable);
+      int sect;
+      for(sect = 0; sect < nsect; sect++){
+	char const * const sname = iniparser_getsecname(Configtable,sect);
+	if(strcasecmp(sname,tok) == 0){
+	  if(setup_hardware(sname,&Frontends[Nfrontends]) != 0)
+	    exit(EX_NOINPUT);
+	  Nfrontends++;
+	  break;
+	}
+      }
+      if(sect == nsect){
+	fprintf(stdout,"no hardware section [%s] found, please create it\n",tok);
+	exit(EX_USAGE);
       }
     }
-    if(sect == nsect){
-      fprintf(stdout,"no hardware section [%s] found, please create it\n",hardware);
+    FREE(hw_list);
+    if(Nfrontends == 0){
+      fprintf(stdout,"no front ends configured\n");
       exit(EX_USAGE);
     }
+    Template.frontend = &Frontends[0];
   }
+  int64_t const frontends_done = gps_time_ns();
   // Set up status/command stream, global for all receiver channels
   {
     // Form default status dns name
@@ -395,7 +460,7 @@ static int loadconfig(char const * const file){
     snprintf(ttlmsg,sizeof(ttlmsg),"TTL=%d",Mcast_ttl);
     int slen = sizeof(Metadata_dest_socket);
     uint32_t addr = make_maddr(Metadata_dest_string);
-    avahi_start(Frontend.description != NULL ? Frontend.description : Name,"_ka9q-ctl._udp",DEFAULT_STAT_PORT,Metadata_dest_string,addr,ttlmsg,&Metadata_dest_socket,&slen);
+    avahi_start(Frontends[0].description != NULL ? Frontends[0].description : Name,"_ka9q-ctl._udp",DEFAULT_STAT_PORT,Metadata_dest_string,addr,ttlmsg,&Metadata_dest_socket,&slen);
   }
   // avahi_start has resolved the target DNS name into Metadata_dest_socket and inserted the port number
   join_group(Output_fd,(struct sockaddr *)&Metadata_dest_socket,Iface,Mcast_ttl,IP_tos);
@@ -406,20 +471,54 @@ static int loadconfig(char const * const file){
     exit(EX_NOHOST);
   }
 
-  // Preset/mode must be specified to create a dynamic channel
-  // (Trying to switch from term "mode" to term "preset" as more descriptive)
+  template_preset();
+
+  // Process individual demodulator sections
+  struct load_stats stats = {0};
+  setup_channels(&stats);
+  int64_t const channels_done = gps_time_ns();
+
+  // Bring back the dynamic channels from before a restart, before clients can start asking for them again
+  chanstate_setup(Configtable,global,Name);
+  int const restored = chanstate_restore();
+  int64_t const restore_done = gps_time_ns();
+  fprintf(stdout,"Startup: front ends %.1lf ms, %d static channels %.1lf ms, %d dynamic channels %.1lf ms, total %.1lf ms\n",
+	  1e-6 * (frontends_done - start),
+	  stats.started,1e-6 * (channels_done - frontends_done),
+	  restored,1e-6 * (restore_done - channels_done),
+	  1e-6 * (restore_done - start));
+
+  // Start the status thread after all the receivers have been created so it doesn't contend for the chan list lock
+  if(Ctl_fd >= 3)
+    pthread_create(&Status_thread,NULL,radio_status,NULL);
+
+  // Configtable is kept so a reload can tell what changed
+  return stats.started;
+}
+
+// Preset/mode must be specified to create a dynamic channel
+// (Trying to switch from term "mode" to term "preset" as more descriptive)
+static void template_preset(void){
+  char const * const global = "global";
   char const * p = config_getstring(Configtable,global,"preset","am"); // Hopefully "am" is defined in presets.conf
   char const * preset = config_getstring(Configtable,global,"mode",p); // Must be specified to create a dynamic channel
   if(preset != NULL){
+    // create_chan() copies Template under this lock
+    pthread_mutex_lock(&Channel_list_mutex);
     if(loadpreset(&Template,Preset_table,preset) != 0)
       fprintf(stdout,"warning: loadpreset(%s,%s) in [global]\n",Preset_file,preset);
     strlcpy(Template.preset,preset,sizeof(Template.preset));
 
     loadpreset(&Template,Configtable,global); // Overwrite with other entries from this section, without overwriting those
+    pthread_mutex_unlock(&Channel_list_mutex);
   } else {
     fprintf(stdout,"No default mode for template\n");
   }
-  // Process individual demodulator sections
+}
+
+// Create (or on a reload, update) the static channels in every demodulator section of Configtable
+static int setup_channels(struct load_stats * const stats){
+  char const * const global = "global";
   int const nsect = iniparser_getnsec(Configtable);
   int nchans = 0;
   for(int sect = 0; sect < nsect; sect++){
@@ -432,171 +531,400 @@ static int loadconfig(char const * const file){
     if(config_getboolean(Configtable,sname,"disable",false))
 	continue; // section is disabled
 
-    fprintf(stdout,"Processing [%s]\n",sname); // log only if not disabled
-    // fall back to setting in [global] if parameter not specified in individual section
-    // Set parameters even when unused for the current demodulator in case the demod is changed later
-    char const * preset = config2_getstring(Configtable,Configtable,global,sname,"mode",NULL);
-    preset = config2_getstring(Configtable,Configtable,global,sname,"preset",preset);
-    if(preset == NULL || strlen(preset) == 0)
-      fprintf(stdout,"warning: preset/mode not specified in [%s] or [global], all parameters must be explicitly set\n",sname);
-
-    // Override [global] settings with section settings
-    char const *data = config_getstring(Configtable,sname,"data",Data);
-    // Override global defaults
-    int const ip_tos = config_getint(Configtable,sname,"tos",IP_tos);
-    char const *iface = config_getstring(Configtable,sname,"iface",Iface);
-    int const update = config_getint(Configtable,sname,"update",Update);
-
-    // data stream is shared by all channels in this section
-    // Now also used for per-channel status/control, with different port number
-    struct sockaddr_storage data_dest_socket;
-    struct sockaddr_storage metadata_dest_socket;
-
-    // There can be multiple senders to an output stream, so let avahi suppress the duplicate addresses
-    {
-      char ttlmsg[100];
-      snprintf(ttlmsg,sizeof(ttlmsg),"TTL=%d",Mcast_ttl);
+    nchans += setup_section(sname,stats);
+  }
+  return nchans;
+}
+
+// Set up the channels in one demodulator section
+// On a reload, existing channels from the same section are matched by ssrc. Unchanged ones are left alone,
+// one whose frequency alone changed is retuned through its command queue, and any other change closes
+// and recreates it. Returns the number of channels now running from this section
+static int setup_section(char const * const sname,struct load_stats * const stats){
+  char const * const global = "global";
+  bool const reloading = Config_generation != 0;
+  fprintf(stdout,"Processing [%s]\n",sname); // log only if not disabled
+  // fall back to setting in [global] if parameter not specified in individual section
+  // Set parameters even when unused for the current demodulator in case the demod is changed later
+  char const * preset = config2_getstring(Configtable,Configtable,global,sname,"mode",NULL);
+  preset = config2_getstring(Configtable,Configtable,global,sname,"preset",preset);
+  if(preset == NULL || strlen(preset) == 0)
+    fprintf(stdout,"warning: preset/mode not specified in [%s] or [global], all parameters must be explicitly set\n",sname);
+
+  // Override [global] settings with section settings
+  char const *data = config_getstring(Configtable,sname,"data",Data);
+  // Override global defaults
+  int const ip_tos = config_getint(Configtable,sname,"tos",IP_tos);
+  char const *iface = config_getstring(Configtable,sname,"iface",Iface);
+  int const update = config_getint(Configtable,sname,"update",Update);
+  // Bind this section's channels to a particular front end? Otherwise chosen by frequency
+  struct frontend *section_frontend = NULL;
+  {
+    char const * const hw = config_getstring(Configtable,sname,"hardware",NULL);
+    if(hw != NULL && (section_frontend = lookup_frontend(hw)) == NULL){
+      fprintf(stdout,"[%s] hardware = %s is not a configured front end, section ignored\n",sname,hw);
+      return 0;
+    }
+  }
+
+  // Fingerprint of everything else that goes into these channels, to spot changes on a reload
+  uint32_t hash = config_hash(Configtable,sname,Freq_keys,0);
+  if(preset != NULL){
+    hash = config_hash(Preset_table,preset,NULL,hash);
+    for(char const *cp = preset; *cp != '\0'; cp++)
+      hash = (hash ^ (uint8_t)*cp) * 16777619u;
+  }
+  // data stream is shared by all channels in this section
+  // Now also used for per-channel status/control, with different port number
+  struct sockaddr_storage data_dest_socket;
+  struct sockaddr_storage metadata_dest_socket;
+
+  // There can be multiple senders to an output stream, so let avahi suppress the duplicate addresses
+  // On a reload, reuse the sockets of a running channel with the same destination rather than announce it again
+  if(!reloading || !section_sockets(sname,data,&data_dest_socket,&metadata_dest_socket)){
+    char ttlmsg[100];
+    snprintf(ttlmsg,sizeof(ttlmsg),"TTL=%d",Mcast_ttl);
 
-      int slen = sizeof(data_dest_socket);
-      uint32_t addr = make_maddr(data);
-      avahi_start(sname,"_rtp._udp",DEFAULT_RTP_PORT,data,addr,ttlmsg,&data_dest_socket,&slen);
+    int slen = sizeof(data_dest_socket);
+    uint32_t addr = make_maddr(data);
+    avahi_start(sname,"_rtp._udp",DEFAULT_RTP_PORT,data,addr,ttlmsg,&data_dest_socket,&slen);
 #if 0
-      avahi_start(sname,"_ka9q-ctl._udp",DEFAULT_STAT_PORT,data,addr,ttlmsg,&metadata_dest_socket,&slen); // sockets are same size
+    avahi_start(sname,"_ka9q-ctl._udp",DEFAULT_STAT_PORT,data,addr,ttlmsg,&metadata_dest_socket,&slen); // sockets are same size
 #else
-      {
-	struct sockaddr_in *sin = (struct sockaddr_in *)&metadata_dest_socket;
-	sin->sin_family = AF_INET;
-	sin->sin_addr.s_addr = htonl(addr);
-	sin->sin_port = htons(DEFAULT_STAT_PORT);
-      }
-#endif
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *)&metadata_dest_socket;
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl(addr);
+      sin->sin_port = htons(DEFAULT_STAT_PORT);
     }
+#endif
     join_group(Output_fd,(struct sockaddr *)&data_dest_socket,iface,Mcast_ttl,ip_tos);
-    // No need to also join group for status socket, since the IP addresses are the same
-
-    // Process frequency/frequencies
-    // We need to do this first to ensure the resulting SSRCs are unique
-    // To work around iniparser's limited line length, we look for multiple keywords
-    // "freq", "freq0", "freq1", etc, up to "freq9"
-    int nfreq = 0;
-
-    for(int ff = -1; ff < 10; ff++){
-      char fname[10];
-      if(ff == -1)
-	snprintf(fname,sizeof(fname),"freq");
-      else
-	snprintf(fname,sizeof(fname),"freq%d",ff);
-
-      char const * const frequencies = config_getstring(Configtable,sname,fname,NULL);
-      if(frequencies == NULL)
-	continue; // none with this prefix; look for more
-
-      // Parse the frequency list(s)
-      char *freq_list = strdup(frequencies); // Need writeable copy for strtok
-      char *saveptr = NULL;
-      for(char const *tok = strtok_r(freq_list," \t",&saveptr);
-	  tok != NULL;
-	  tok = strtok_r(NULL," \t",&saveptr)){
-
-	double const f = parse_frequency(tok,true);
-	if(f < 0){
-	  fprintf(stdout,"can't parse frequency %s\n",tok);
-	  continue;
-	}
-	uint32_t ssrc = 0;
-	// Generate default ssrc from frequency string
-	for(char const *cp = tok ; cp != NULL && *cp != '\0' ; cp++){
-	  if(isdigit(*cp)){
-	    ssrc *= 10;
-	    ssrc += *cp - '0';
-	  }
+  }
+  // No need to also join group for status socket, since the IP addresses are the same
+
+  // Process frequency/frequencies
+  // We need to do this first to ensure the resulting SSRCs are unique
+  // To work around iniparser's limited line length, we look for multiple keywords
+  // "freq", "freq0", "freq1", etc, up to "freq9"
+  int nfreq = 0;
+
+  for(int ff = -1; ff < 10; ff++){
+    char fname[10];
+    if(ff == -1)
+      snprintf(fname,sizeof(fname),"freq");
+    else
+      snprintf(fname,sizeof(fname),"freq%d",ff);
+
+    char const * const frequencies = config_getstring(Configtable,sname,fname,NULL);
+    if(frequencies == NULL)
+      continue; // none with this prefix; look for more
+
+    // Parse the frequency list(s)
+    char *freq_list = strdup(frequencies); // Need writeable copy for strtok
+    char *saveptr = NULL;
+    for(char const *tok = strtok_r(freq_list," \t",&saveptr);
+	tok != NULL;
+	tok = strtok_r(NULL," \t",&saveptr)){
+
+      double const f = parse_frequency(tok,true);
+      if(f < 0){
+	fprintf(stdout,"can't parse frequency %s\n",tok);
+	continue;
+      }
+      uint32_t ssrc = 0;
+      // Generate default ssrc from frequency string
+      for(char const *cp = tok ; cp != NULL && *cp != '\0' ; cp++){
+	if(isdigit(*cp)){
+	  ssrc *= 10;
+	  ssrc += *cp - '0';
 	}
-	ssrc = config_getint(Configtable,sname,"ssrc",ssrc); // Explicitly set?
-	if(ssrc == 0)
-	  continue; // Reserved ssrc
-
-	struct channel *chan = NULL;
-	// Try to create it, incrementing in case of collision
-	int const max_collisions = 100;
-	for(int i=0; i < max_collisions; i++){
-	  chan = create_chan(ssrc+i);
-	  if(chan != NULL){
-	    ssrc += i;
-	    break;
+      }
+      ssrc = config_getint(Configtable,sname,"ssrc",ssrc); // Explicitly set?
+      if(ssrc == 0)
+	continue; // Reserved ssrc
+
+      int const max_collisions = 100;
+      bool restarting = false;
+      if(reloading){
+	struct channel * const old = claim_chan(sname,ssrc,max_collisions);
+	if(old != NULL){
+	  if(old->config.hash == hash){
+	    if(old->config.freq == f){
+	      stats->kept++;
+	      nfreq++;
+	      continue;
+	    }
+	    if(retune_chan(old,f) == 0){
+	      old->config.freq = f;
+	      stats->retuned++;
+	      nfreq++;
+	      continue;
+	    }
 	  }
+	  // Something else changed (or its command queue is busy): close it and start over on the same ssrc
+	  ssrc = old->output.rtp.ssrc;
+	  if(terminate_chan(old) != 0)
+	    continue;
+	  restarting = true;
 	}
-	if(chan == NULL){
-	  fprintf(stdout,"Can't allocate requested ssrc %u-%u\n",ssrc,ssrc + max_collisions);
-	  continue;
-	}
-	// Set reasonable compiled-in defaults just to keep things from blowing up
-	set_defaults(chan);
-	if(preset != NULL && loadpreset(chan,Preset_table,preset) != 0)
-	  fprintf(stdout,"warning: in [%s], loadpreset(%s,%s) failed; compiled-in defaults and local settings used\n",sname,Preset_file,preset);
-
-	strlcpy(chan->preset,preset,sizeof(chan->preset));
-	loadpreset(chan,Configtable,sname); // Overwrite with other entries from this section, without overwriting those
-
-	// Set up output stream (data + status)
-	// Data multicast group has already been joined
-	memcpy(&chan->output.dest_socket,&data_dest_socket,sizeof(chan->output.dest_socket));
-	strlcpy(chan->output.dest_string,data,sizeof(chan->output.dest_string));
-	memcpy(&chan->status.dest_socket,&metadata_dest_socket,sizeof(chan->status.dest_socket));
-
-	chan->output.rtp.type = pt_from_info(chan->output.samprate,chan->output.channels,chan->output.encoding);
-	chan->status.output_interval = update;
-
-	// Time to start it -- ssrc is stashed by create_chan()
-	set_freq(chan,f);
-	start_demod(chan);
-	nfreq++;
-	nchans++;
-
-	if(SAP_enable){
-	  // Highly experimental, off by default
-	  char sap_dest[] = "224.2.127.254:9875"; // sap.mcast.net
-	  resolve_mcast(sap_dest,&chan->sap.dest_socket,0,NULL,0,0);
-	  join_group(Output_fd,(struct sockaddr *)&chan->sap.dest_socket,iface,Mcast_ttl,ip_tos);
-	  pthread_create(&chan->sap.thread,NULL,sap_send,chan);
+      }
+      struct channel *chan = NULL;
+      // Try to create it, incrementing in case of collision
+      for(int i=0; i < max_collisions; i++){
+	chan = create_chan(ssrc+i);
+	if(chan != NULL){
+	  ssrc += i;
+	  break;
 	}
-	// RTCP Real Time Control Protocol daemon is optional
-	if(RTCP_enable){
-	  // Set the dest socket to the RTCP port on the output group
-	  // What messy code just to overwrite a structure field, eh?
-	  memcpy(&chan->rtcp.dest_socket,&chan->output.dest_socket,sizeof(chan->rtcp.dest_socket));
-	  switch(chan->rtcp.dest_socket.ss_family){
-	  case AF_INET:
-	    {
-	      struct sockaddr_in *sock = (struct sockaddr_in *)&chan->rtcp.dest_socket;
-	      sock->sin_port = htons(DEFAULT_RTCP_PORT);
-	    }
-	    break;
-	  case AF_INET6:
-	    {
-	      struct sockaddr_in6 *sock = (struct sockaddr_in6 *)&chan->rtcp.dest_socket;
-	      sock->sin6_port = htons(DEFAULT_RTCP_PORT);
-	    }
-	    break;
+      }
+      if(chan == NULL){
+	fprintf(stdout,"Can't allocate requested ssrc %u-%u\n",ssrc,ssrc + max_collisions);
+	continue;
+      }
+      // Set reasonable compiled-in defaults just to keep things from blowing up
+      set_defaults(chan);
+      if(preset != NULL && loadpreset(chan,Preset_table,preset) != 0)
+	fprintf(stdout,"warning: in [%s], loadpreset(%s,%s) failed; compiled-in defaults and local settings used\n",sname,Preset_file,preset);
+
+      strlcpy(chan->preset,preset,sizeof(chan->preset));
+      loadpreset(chan,Configtable,sname); // Overwrite with other entries from this section, without overwriting those
+
+      // Set up output stream (data + status)
+      // Data multicast group has already been joined
+      memcpy(&chan->output.dest_socket,&data_dest_socket,sizeof(chan->output.dest_socket));
+      strlcpy(chan->output.dest_string,data,sizeof(chan->output.dest_string));
+      memcpy(&chan->status.dest_socket,&metadata_dest_socket,sizeof(chan->status.dest_socket));
+
+      chan->output.rtp.type = pt_from_info(chan->output.samprate,chan->output.channels,chan->output.encoding);
+      chan->status.output_interval = update;
+
+      if(section_frontend != NULL){
+	chan->frontend = section_frontend;
+	chan->frontend_fixed = true;
+      } else
+	chan->frontend = select_frontend(chan,f);
+
+      // Time to start it -- ssrc is stashed by create_chan()
+      set_freq(chan,f);
+      strlcpy(chan->config.section,sname,sizeof(chan->config.section));
+      chan->config.hash = hash;
+      chan->config.freq = f;
+      chan->config.generation = Config_generation;
+      start_demod(chan);
+      nfreq++;
+      if(restarting)
+	stats->restarted++;
+      else
+	stats->started++;
+
+      if(SAP_enable){
+	// Highly experimental, off by default
+	char sap_dest[] = "224.2.127.254:9875"; // sap.mcast.net
+	resolve_mcast(sap_dest,&chan->sap.dest_socket,0,NULL,0,0);
+	join_group(Output_fd,(struct sockaddr *)&chan->sap.dest_socket,iface,Mcast_ttl,ip_tos);
+	pthread_create(&chan->sap.thread,NULL,sap_send,chan);
+      }
+      // RTCP Real Time Control Protocol daemon is optional
+      if(RTCP_enable){
+	// Set the dest socket to the RTCP port on the output group
+	// What messy code just to overwrite a structure field, eh?
+	memcpy(&chan->rtcp.dest_socket,&chan->output.dest_socket,sizeof(chan->rtcp.dest_socket));
+	switch(chan->rtcp.dest_socket.ss_family){
+	case AF_INET:
+	  {
+	    struct sockaddr_in *sock = (struct sockaddr_in *)&chan->rtcp.dest_socket;
+	    sock->sin_port = htons(DEFAULT_RTCP_PORT);
+	  }
+	  break;
+	case AF_INET6:
+	  {
+	    struct sockaddr_in6 *sock = (struct sockaddr_in6 *)&chan->rtcp.dest_socket;
+	    sock->sin6_port = htons(DEFAULT_RTCP_PORT);
 	  }
-	  pthread_create(&chan->rtcp.thread,NULL,rtcp_send,chan);
+	  break;
 	}
+	pthread_create(&chan->rtcp.thread,NULL,rtcp_send,chan);
       }
-      // Done processing frequency list(s) and creating chans
-      FREE(freq_list);
     }
-    fprintf(stdout,"[%s] %d channels started\n",sname,nfreq);
+    // Done processing frequency list(s) and creating chans
+    FREE(freq_list);
   }
-  // Start the status thread after all the receivers have been created so it doesn't contend for the chan list lock
-  if(Ctl_fd >= 3)
-    pthread_create(&Status_thread,NULL,radio_status,NULL);
+  fprintf(stdout,"[%s] %d channels %s\n",sname,nfreq,reloading ? "running" : "started");
+  return nfreq;
+}
+
 
+// Re-read the config file, e.g., on SIGHUP, and bring the static channels into line with it
+// The front ends, their FFTs, the status stream and any dynamic channels keep running
+// Changes that would need them restarted are only reported
+static int reload_config(char const * const file){
+  char const * const global = "global";
+  dictionary * const table = iniparser_load(file);
+  if(table == NULL){
+    fprintf(stdout,"Can't reload config file %s, keeping the running configuration\n",file);
+    return -1;
+  }
+  char preset_file[PATH_MAX];
+  {
+    char const *p = config_getstring(table,global,"mode-file","presets.conf");
+    p = config_getstring(table,global,"presets-file",p);
+    dist_path(preset_file,sizeof(preset_file),p);
+  }
+  dictionary * const presets = iniparser_load(preset_file);
+  if(presets == NULL){
+    fprintf(stdout,"Can't reload preset file %s, keeping the running configuration\n",preset_file);
+    iniparser_freedict(table);
+    return -1;
+  }
+  for(int i=0; Global_fixed_keys[i] != NULL; i++){
+    char const * const key = Global_fixed_keys[i];
+    if(strcmp(config_getstring(Configtable,global,key,""),config_getstring(table,global,key,"")) != 0)
+      fprintf(stdout,"[global] %s changed; restart radiod to apply\n",key);
+  }
+  for(int i=0; i < Nfrontends; i++){
+    char const * const sname = Frontends[i].name;
+    if(config_hash(Configtable,sname,NULL,0) != config_hash(table,sname,NULL,0))
+      fprintf(stdout,"front end [%s] changed; restart radiod to apply\n",sname);
+  }
+  // Channel threads execute PRESET commands against the table under this lock, so the old one can go now
+  pthread_mutex_lock(&Channel_list_mutex);
+  dictionary * const old_presets = Preset_table;
+  Preset_table = presets;
+  pthread_mutex_unlock(&Channel_list_mutex);
+  iniparser_freedict(old_presets);
+  strlcpy(Preset_file,preset_file,sizeof(Preset_file));
   iniparser_freedict(Configtable);
-  Configtable = NULL;
-  return nchans;
+  Configtable = table;
+  Config_generation++;
+
+  Verbose = config_getint(Configtable,global,"verbose",Verbose);
+  template_preset(); // For dynamic channels created from now on
+
+  // Note each section's output stream so the advertisements for any that disappear can be withdrawn
+  struct stream {
+    char section[sizeof(Channel_list[0].config.section)];
+    char data[sizeof(Channel_list[0].output.dest_string)];
+  } *streams = calloc(Channel_list_length,sizeof(*streams));
+  int nstreams = 0;
+  if(streams != NULL){
+    pthread_mutex_lock(&Channel_list_mutex);
+    for(int i=0; i < Channel_list_length; i++){
+      struct channel const * const chan = &Channel_list[i];
+      if(!chan->inuse || strlen(chan->config.section) == 0)
+	continue;
+      int j;
+      for(j=0; j < nstreams; j++)
+	if(strcmp(streams[j].section,chan->config.section) == 0 && strcmp(streams[j].data,chan->output.dest_string) == 0)
+	  break;
+      if(j == nstreams){
+	strlcpy(streams[nstreams].section,chan->config.section,sizeof(streams[nstreams].section));
+	strlcpy(streams[nstreams].data,chan->output.dest_string,sizeof(streams[nstreams].data));
+	nstreams++;
+      }
+    }
+    pthread_mutex_unlock(&Channel_list_mutex);
+  }
+  struct load_stats stats = {0};
+  setup_channels(&stats);
+
+  // Static channels not claimed above are gone from the config file (or their section is disabled)
+  // Tell them all to exit first, then wait, so they go away in parallel
+  int removed = 0;
+  pthread_mutex_lock(&Channel_list_mutex);
+  for(int i=0; i < Channel_list_length; i++){
+    struct channel * const chan = &Channel_list[i];
+    if(chan->inuse && strlen(chan->config.section) > 0 && chan->config.generation != Config_generation && !chan->terminate){
+      chan->terminate = true;
+      removed++;
+    }
+  }
+  pthread_mutex_unlock(&Channel_list_mutex);
+  for(int i=0; i < Channel_list_length; i++){
+    struct channel * const chan = &Channel_list[i];
+    if(chan->inuse && chan->terminate)
+      terminate_chan(chan);
+  }
+  // A section whose data group changed, or that's gone, no longer sends to its old stream
+  for(int i=0; i < nstreams; i++){
+    struct sockaddr_storage data_dest,metadata_dest;
+    if(!section_sockets(streams[i].section,streams[i].data,&data_dest,&metadata_dest)
+       && avahi_stop(streams[i].section,streams[i].data) > 0)
+      fprintf(stdout,"[%s] no longer advertising %s\n",streams[i].section,streams[i].data);
+  }
+  FREE(streams);
+  fprintf(stdout,"Reload: %d channels started, %d restarted, %d retuned, %d unchanged, %d removed\n",
+	  stats.started,stats.restarted,stats.retuned,stats.kept,removed);
+  return 0;
+}
+
+// Find the sockets already in use by a running channel of this section with the same data destination
+static bool section_sockets(char const * const sname,char const * const data,struct sockaddr_storage * const data_dest,struct sockaddr_storage * const metadata_dest){
+  bool found = false;
+  pthread_mutex_lock(&Channel_list_mutex);
+  for(int i=0; i < Channel_list_length; i++){
+    struct channel const * const chan = &Channel_list[i];
+    if(chan->inuse && strcmp(chan->config.section,sname) == 0 && strcmp(chan->output.dest_string,data) == 0){
+      memcpy(data_dest,&chan->output.dest_socket,sizeof(*data_dest));
+      memcpy(metadata_dest,&chan->status.dest_socket,sizeof(*metadata_dest));
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Channel_list_mutex);
+  return found;
+}
+
+// On a reload, find a running channel from section sname with ssrc in [ssrc, ssrc+range) that this reload
+// hasn't already matched to another frequency, and mark it as kept
+static struct channel *claim_chan(char const * const sname,uint32_t const ssrc,int const range){
+  for(int i=0; i < range; i++){
+    struct channel * const chan = lookup_chan(ssrc+i);
+    // The config fields are only touched by this thread
+    if(chan != NULL && !chan->terminate && chan->config.generation != Config_generation
+       && strcmp(chan->config.section,sname) == 0){
+      chan->config.generation = Config_generation;
+      return chan;
+    }
+  }
+  return NULL;
+}
+
+// Retune a running channel in place by queuing a command for it, just as the control program would
+static int retune_chan(struct channel * const chan,double const f){
+  uint8_t *cmd = malloc(PKTSIZE);
+  if(cmd == NULL)
+    return -1;
+  uint8_t *bp = cmd;
+  encode_double(&bp,RADIO_FREQUENCY,f);
+  encode_eol(&bp);
+
+  pthread_mutex_lock(&chan->status.lock);
+  bool const busy = chan->status.command != NULL; // Single-entry queue
+  if(!busy){
+    chan->status.command = cmd;
+    chan->status.length = bp - cmd;
+  }
+  pthread_mutex_unlock(&chan->status.lock);
+  if(busy)
+    FREE(cmd);
+  return busy ? -1 : 0;
+}
+
+// Have a channel close itself, and wait for it to finish so its ssrc can be reused
+static int terminate_chan(struct channel * const chan){
+  uint32_t const ssrc = chan->output.rtp.ssrc;
+  chan->terminate = true; // Seen by downconvert() on its next block
+  for(int i=0; i < 100; i++){
+    if(lookup_chan(ssrc) != chan)
+      return 0;
+    usleep(50000);
+  }
+  fprintf(stdout,"ssrc %u didn't exit after 5 seconds\n",ssrc);
+  return -1;
 }
 
 // Set up a local front end device
-static int setup_hardware(char const *sname){
+static int setup_hardware(char const *sname,struct frontend * const frontend){
   char const *device = config_getstring(Configtable,sname,"device",NULL);
   if(device == NULL){
     fprintf(stdout,"No device= entry in [%s]\n",sname);
@@ -605,50 +933,60 @@ static int setup_hardware(char const *sname){
   // Do we support it?
   // This should go into a table somewhere
   if(strcasecmp(device,"rx888") == 0){
-    Frontend.setup = rx888_setup;
-    Frontend.start = rx888_startup;
-    Frontend.tune = rx888_tune;
-    Frontend.gain = rx888_gain;
-    Frontend.atten = rx888_atten;
+    frontend->setup = rx888_setup;
+    frontend->start = rx888_startup;
+    frontend->tune = rx888_tune;
+    frontend->gain = rx888_gain;
+    frontend->atten = rx888_atten;
   } else if(strcasecmp(device,"airspy") == 0){
-    Frontend.setup = airspy_setup;
-    Frontend.start = airspy_startup;
-    Frontend.tune = airspy_tune;
+    frontend->setup = airspy_setup;
+    frontend->start = airspy_startup;
+    frontend->tune = airspy_tune;
   } else if(strcasecmp(device,"airspyhf") == 0){
-    Frontend.setup = airspyhf_setup;
-    Frontend.start = airspyhf_startup;
-    Frontend.tune = airspyhf_tune;
+    frontend->setup = airspyhf_setup;
+    frontend->start = airspyhf_startup;
+    frontend->tune = airspyhf_tune;
   } else if(strcasecmp(device,"funcube") == 0){
-    Frontend.setup = funcube_setup;
-    Frontend.start = funcube_startup;
-    Frontend.tune = funcube_tune;
+    frontend->setup = funcube_setup;
+    frontend->start = funcube_startup;
+    frontend->tune = funcube_tune;
   } else if(strcasecmp(device,"rtlsdr") == 0){
-    Frontend.setup = rtlsdr_setup;
-    Frontend.start = rtlsdr_startup;
-    Frontend.tune = rtlsdr_tune;
+    frontend->setup = rtlsdr_setup;
+    frontend->start = rtlsdr_startup;
+    frontend->tune = rtlsdr_tune;
   } else if(strcasecmp(device,"sig_gen") == 0){
-    Frontend.setup = sig_gen_setup;
-    Frontend.start = sig_gen_startup;
-    Frontend.tune = sig_gen_tune;
+    frontend->setup = sig_gen_setup;
+    frontend->start = sig_gen_startup;
+    frontend->tune = sig_gen_tune;
 #if 0
     // The sdrplay library is still proprietary and object-only, so I can't bundle it in ka9q-radio
     // Everything else either has a standard Debian package or I have information to program them directly.
     // To hell with vendors who deliberately make their products hard to use when they have plenty of competition.
   } else if(strcasecmp(device,"sdrplay") == 0){
-    Frontend.setup = sdrplay_setup;
-    Frontend.start = sdrplay_startup;
-    Frontend.tune = sdrplay_tune;
+    frontend->setup = sdrplay_setup;
+    frontend->start = sdrplay_startup;
+    frontend->tune = sdrplay_tune;
 #endif
   } else {
     fprintf(stdout,"device %s unrecognized\n",device);
     return -1;
   }
 
-  int r = (*Frontend.setup)(&Frontend,Configtable,sname);
+  frontend->name = strdup(sname);
+  int r = (*frontend->setup)(frontend,Configtable,sname);
   if(r != 0){
     fprintf(stdout,"device setup returned %d\n",r);
     return r;
   }
+  // Optional tuning range, used to pick a front end for a channel by frequency
+  {
+    char const *p = config_getstring(Configtable,sname,"min-freq",NULL);
+    frontend->min_freq = p != NULL ? parse_frequency(p,false) : 0;
+    p = config_getstring(Configtable,sname,"max-freq",NULL);
+    frontend->max_freq = p != NULL ? parse_frequency(p,false) : INFINITY;
+  }
+  // Shared DC offset and I/Q imbalance correction for complex front ends
+  iq_corr_setup(frontend,Configtable,sname);
 
   // Create input filter now that we know the parameters
   // FFT and filter sizes computed from specified block duration and sample rate
@@ -656,21 +994,26 @@ static int setup_hardware(char const *sname){
   // M = filter impulse response duration
   // N = FFT size = L + M - 1
   // Note: no checking that N is an efficient FFT blocksize; choose your parameters wisely
-  assert(Frontend.samprate != 0);
-  double const eL = Frontend.samprate * Blocktime / 1000.0; // Blocktime is in milliseconds
-  Frontend.L = lround(eL);
-  if(Frontend.L != eL)
+  assert(frontend->samprate != 0);
+  double const eL = frontend->samprate * Blocktime / 1000.0; // Blocktime is in milliseconds
+  frontend->L = lround(eL);
+  if(frontend->L != eL)
     fprintf(stdout,"Warning: non-integral samples in %.3f ms block at sample rate %d Hz: remainder %g\n",
-	    Blocktime,Frontend.samprate,eL-Frontend.L);
-
-  Frontend.M = Frontend.L / (Overlap - 1) + 1;
-  assert(Frontend.M != 0);
-  assert(Frontend.L != 0);
-  create_filter_input(&Frontend.in,Frontend.L,Frontend.M, Frontend.isreal ? REAL : COMPLEX);
-  pthread_mutex_init(&Frontend.status_mutex,NULL);
-  pthread_cond_init(&Frontend.status_cond,NULL);
-  if(Frontend.start){
-    int r = (*Frontend.start)(&Frontend);
+	    Blocktime,frontend->samprate,eL-frontend->L);
+
+  frontend->M = frontend->L / (Overlap - 1) + 1;
+  assert(frontend->M != 0);
+  assert(frontend->L != 0);
+  // Optionally enlarge the input ring to hold a pre-trigger window for raw captures
+  size_t const ring_samples = capture_setup(frontend,Configtable,sname);
+  create_filter_input_ring(&frontend->in,frontend->L,frontend->M, frontend->isreal ? REAL : COMPLEX,ring_samples);
+  if(ring_samples != 0)
+    capture_start(frontend);
+  health_setup(frontend,Configtable,sname);
+  pthread_mutex_init(&frontend->status_mutex,NULL);
+  pthread_cond_init(&frontend->status_cond,NULL);
+  if(frontend->start){
+    int r = (*frontend->start)(frontend);
     if(r != 0)
       fprintf(stdout,"Front end start returned %d\n",r);
 
@@ -756,6 +1099,13 @@ static void *rtcp_send(void *arg){
   }
 }
 static void closedown(int a){
+  if(Main_loop)
+    Exit_requested = a; // The main loop cleans up and exits
+  else
+    exit_radiod(a); // Still starting; nothing to save
+}
+
+static void exit_radiod(int a){
   fprintf(stdout,"Received signal %d, exiting\n",a);
   Stop_transfers = true;
   sleep(1); // pause for threads to see it
@@ -766,6 +1116,12 @@ static void closedown(int a){
     exit(EX_SOFTWARE);
 }
 
+// SIGHUP: re-read the config file (done by the main thread)
+static void reload(int a){
+  (void)a;
+  Reload_requested = 1;
+}
+
 // Increase or decrease logging level (thanks AI6VN for idea)
 static void verbosity(int a){
   if(a == SIGUSR1)
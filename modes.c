@@ -251,6 +251,7 @@ int loadpreset(struct channel *chan,dictionary const *table,char const *sname){
     chan->fm.tone_freq = 0;
   }
   chan->output.pacing = config_getboolean(table,sname,"pacing",chan->output.pacing);
+  chan->output.capture = config_getboolean(table,sname,"capture",chan->output.capture);
   {
     char const *cp = config_getstring(table,sname,"encoding","s16be");
     chan->output.encoding = parse_encoding(cp);
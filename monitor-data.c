@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <opus/opus.h>
 #include <portaudio.h>
@@ -29,6 +30,7 @@
 #include "multicast.h"
 #include "radio.h"
 #include "iir.h"
+#include "resample.h"
 #include "morse.h"
 #include "status.h"
 #include "monitor.h"
@@ -46,6 +48,9 @@ float PL_tones[] = {
     237.1, 241.8, 245.5, 250.3, 254.1
 };
 static float make_position(int x);
+static void jitter_put(struct session *sp,struct packet *pkt);
+static struct packet *jitter_take(struct session *sp,uint16_t seq);
+static void mix_written(struct session *sp,unsigned int wptr,int frames);
 
 
 // Receive from data multicast streams, multiplex to decoder threads
@@ -72,23 +77,18 @@ void *dataproc(void *arg){
   realtime();
   // Main loop begins here
   while(!Terminate){
-    // Need a new packet buffer?
-    if(!pkt)
-      pkt = malloc(sizeof(*pkt));
-    // Zero these out to catch any uninitialized derefs
-    pkt->next = NULL;
-    pkt->data = NULL;
-    pkt->len = 0;
+    // Return the last one to the pool if it wasn't queued
+    packet_free(&pkt);
 
     struct sockaddr_storage sender;
     socklen_t socksize = sizeof(sender);
-    int size = recvfrom(input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+    int size = packet_recv(input_fd,&pkt,(struct sockaddr *)&sender,&socksize);
     if(size == -1){
       if(errno != EINTR){ // Happens routinely, e.g., when window resized
 	perror("recvfrom");
 	usleep(1000);
       }
-      continue;  // Reuse current buffer
+      continue;
     }
     if(size <= RTP_MIN_SIZE)
       continue; // Must be big enough for RTP header and at least some data
@@ -122,6 +122,8 @@ void *dataproc(void *arg){
       sp->dest = mcast_address_text;
       sp->last_timestamp = pkt->rtp.timestamp;
       sp->rtp_state.seq = pkt->rtp.seq;
+      sp->jitter_next = pkt->rtp.seq;
+      sp->jitter_high = pkt->rtp.seq;
       sp->reset = true;
       sp->init = true;
 
@@ -131,34 +133,7 @@ void *dataproc(void *arg){
 	continue;
       }
     }
-    // Insert onto queue sorted by sequence number, wake up thread
-    struct packet *q_prev = NULL;
-    struct packet *qe = NULL;
-
-    int qlen = 0;
-    const int maxq = 500; // 10 seconds
-    pthread_mutex_lock(&sp->qmutex);
-    for(qe = sp->queue;
-	qe != NULL && qlen < maxq && pkt->rtp.seq >= qe->rtp.seq;
-	q_prev = qe,qe = qe->next,qlen++)
-      ;
-
-    if(qlen >= maxq){
-      // Queue has grown huge, blow it away. Seems to happen when a macos laptop is asleep
-      struct packet *qnext;
-      for(qe = sp->queue; qe != NULL; qe = qnext){
-	qnext = qe->next;
-	FREE(qe);
-      }
-      // queue now empty, can put new packet at head
-    }
-    if(qe)
-      sp->reseqs++;   // Not the last on the list
-    pkt->next = qe;
-    if(q_prev)
-      q_prev->next = pkt;
-    else
-      sp->queue = pkt; // Front of list
+    jitter_put(sp,pkt);
     pkt = NULL;        // force new packet to be allocated
     long long t = gps_time_ns();
     if(t - sp->last_active > BILLION){
@@ -166,9 +141,6 @@ void *dataproc(void *arg){
       sp->last_start = t;
     }
     sp->last_active = t;
-    // wake up decoder thread
-    pthread_cond_signal(&sp->qcond);
-    pthread_mutex_unlock(&sp->qmutex);
   }
   return NULL;
 }
@@ -183,10 +155,12 @@ void decode_task_cleanup(void *arg){
     opus_decoder_destroy(sp->opus);
     sp->opus = NULL;
   }
-  struct packet *pkt_next = NULL;
-  for(struct packet *pkt = sp->queue; pkt != NULL; pkt = pkt_next){
-    pkt_next = pkt->next;
-    FREE(pkt);
+  resampler_free(&sp->resampler);
+  FREE(sp->resample_buf);
+  mix_detach(sp);
+  for(int i = 0; i < JITTER_SLOTS; i++){
+    struct packet *pkt = atomic_exchange(&sp->jitter[i],NULL);
+    packet_free(&pkt);
   }
   struct frontend * const frontend = &sp->frontend;
   FREE(frontend->description);
@@ -218,40 +192,51 @@ void *decode_task(void *arg){
   // Main loop; run until asked to quit
   while(!sp->terminate && !Terminate){
     struct packet *pkt = NULL;
-    // Wait for packet to appear on queue
-    pthread_mutex_lock(&sp->qmutex);
-    while(!sp->queue){
-      int64_t const increment = 100000000; // 100 ms
-      // pthread_cond_timedwait requires UTC clock time! Undefined behavior around a leap second...
-      struct timespec ts;
-      ns2ts(&ts,utc_time_ns() + increment);
-      int r = pthread_cond_timedwait(&sp->qcond,&sp->qmutex,&ts); // Wait 100 ms max so we pick up terminates
-      if(r != 0){
-	if(r == EINVAL)
-	  Invalids++;
+    int const resync = atomic_exchange(&sp->jitter_resync,0);
+    if(resync != 0)
+      atomic_store(&sp->jitter_next,(uint16_t)(resync - 1));
+
+    uint16_t const next = atomic_load(&sp->jitter_next);
+    pkt = jitter_take(sp,next);
+    if(pkt == NULL){
+      uint16_t const high = atomic_load(&sp->jitter_high);
+      if(high == next){
+	// Jitter buffer empty, wait for dataproc to put something in it
+	pthread_mutex_lock(&sp->qmutex);
+	atomic_store(&sp->jitter_wait,true);
+	if(atomic_load(&sp->jitter_high) == next && atomic_load(&sp->jitter_resync) == 0){
+	  int64_t const increment = 100000000; // 100 ms
+	  // pthread_cond_timedwait requires UTC clock time! Undefined behavior around a leap second...
+	  struct timespec ts;
+	  ns2ts(&ts,utc_time_ns() + increment);
+	  int r = pthread_cond_timedwait(&sp->qcond,&sp->qmutex,&ts); // Wait 100 ms max so we pick up terminates
+	  if(r == EINVAL)
+	    Invalids++;
+	}
+	atomic_store(&sp->jitter_wait,false);
 	pthread_mutex_unlock(&sp->qmutex);
-	goto endloop;// restart loop, checking terminate flags
+	goto endloop; // restart loop, checking terminate flags
       }
-    }
-    // Peek at first packet on queue; is it in sequence?
-    if(sp->queue->rtp.seq != sp->rtp_state.seq){
-      // No. If we've got plenty in the playout buffer, sleep to allow some packet resequencing in the input thread.
+      // The next one in sequence is missing but later ones are here.
+      // If we've got plenty in the playout buffer, sleep to allow it to show up.
       // Strictly speaking, we will resequence ourselves below with the RTP timestamp. But that works properly only with stateless
       // formats like PCM. Opus is stateful, so it's better to resequence input packets (using the RTP sequence #) when possible.
       float queue = (float)modsub(sp->wptr,Rptr,BUFFERSIZE) / DAC_samprate;
       if(queue > Latency + 0.1){ // 100 ms for scheduling latency?
-	pthread_mutex_unlock(&sp->qmutex);
 	struct timespec ss;
 	ns2ts(&ss,(int64_t)(1e9 * (queue - (Latency + 0.1))));
 	nanosleep(&ss,NULL);
 	goto endloop;
       }
-      // else the playout queue is close to draining, accept out of sequence packet anyway
+      // else the playout queue is close to draining, give up on it and take the next one present
+      for(uint16_t seq = next + 1; seq != high && pkt == NULL; seq++)
+	pkt = jitter_take(sp,seq);
+      if(pkt == NULL){
+	atomic_store(&sp->jitter_next,high); // All lost
+	goto endloop;
+      }
     }
-    pkt = sp->queue;
-    sp->queue = pkt->next;
-    pkt->next = NULL;
-    pthread_mutex_unlock(&sp->qmutex);
+    atomic_store(&sp->jitter_next,(uint16_t)(pkt->rtp.seq + 1));
 
     sp->packets++; // Count all packets, regardless of type
     if((int16_t)(pkt->rtp.seq - sp->rtp_state.seq) > 0){ // Doesn't really handle resequencing
@@ -286,7 +271,7 @@ void *decode_task(void *arg){
     sp->channels = sp->pt_table[sp->type].channels; // channels in packet (not portaudio output buffer)
     if(sp->samprate <= 0 || sp->channels <= 0 || sp->channels > 2)
       goto endloop;
-    int upsample = DAC_samprate / samprate; // Upsample lower PCM samprates to output rate (should be cleaner; what about decimation?)
+    int ts_rate = samprate; // RTP timestamp clock rate
     sp->bandwidth = samprate / 2000;    // in kHz allowing for Nyquist
 
     // decode Opus or PCM into bounce buffer
@@ -308,8 +293,8 @@ void *decode_task(void *arg){
 	// Force Opus to decode to the local hardware settings, typically stereo @ 48 kHz
 	sp->channels = Channels;
 	sp->samprate = DAC_samprate;
-	upsample = 1;
 	// Opus RTP timestamps always referenced to 48 kHz
+	ts_rate = 48000;
 	int const r0 = opus_packet_get_nb_samples(pkt->data,pkt->len,48000);
 	if(r0 == OPUS_INVALID_PACKET || r0 == OPUS_BAD_ARG)
 	  goto endloop;
@@ -453,7 +438,7 @@ void *decode_task(void *arg){
 	goto endloop;
       // 3 or more consecutive lates triggers a reset, unless constant delay is selected
       reset_session(sp,pkt->rtp.timestamp);
-    } else if(modsub(sp->wptr,Rptr,BUFFERSIZE) > BUFFERSIZE/4){
+    } else if(modsub(sp->wptr,Rptr,BUFFERSIZE) > sp->mix_frames - MIX_MARGIN_MS * DAC_samprate / 1000){
       sp->earlies++;
       if(++consec_earlies < 3)
 	goto endloop;
@@ -464,10 +449,13 @@ void *decode_task(void *arg){
 
     // Normal packet, relative adjustment to write pointer
     // Can difference in timestamps be negative? Cast it anyway
-    // Opus always counts timestamps at 48 kHz so this breaks when DAC_samprate is not 48 kHz
-    // For opus, sp->wptr += (int32_t)(pkt->rtp.timestamp - sp->last_timestamp) * DAC_samprate / 48000;
-    sp->wptr += (int32_t)(pkt->rtp.timestamp - sp->last_timestamp) * upsample;
-    sp->wptr &= (BUFFERSIZE-1);
+    // Scale from the RTP clock to the output rate, carrying the fraction so non-integer ratios don't drift
+    {
+      int64_t const scaled = (int64_t)(int32_t)(pkt->rtp.timestamp - sp->last_timestamp) * DAC_samprate + sp->ts_remainder;
+      sp->wptr += scaled / ts_rate;
+      sp->wptr &= (BUFFERSIZE-1);
+      sp->ts_remainder = scaled % ts_rate;
+    }
     sp->last_timestamp = pkt->rtp.timestamp;
 
     vote();
@@ -477,6 +465,59 @@ void *decode_task(void *arg){
     if(sp->muted)
       goto endloop; // No more to do with this frame
 
+    // Remove PL tone at the stream's own rate, before resampling
+    if(sp->notch_enable && sp->notch_tone > 0){
+      if(sp->channels == 1){
+	for(int i=0; i < sp->frame_size; i++)
+	  bounce[i] = applyIIR(&sp->iir_left,bounce[i]);
+      } else {
+	for(int i=0; i < sp->frame_size; i++){
+	  bounce[2*i] = applyIIR(&sp->iir_left,bounce[2*i]);
+	  bounce[2*i+1] = applyIIR(&sp->iir_right,bounce[2*i+1]);
+	}
+      }
+    }
+    // Convert to the output rate. Filter banks are shared by all sessions at the same rate
+    float const *audio = bounce;
+    int frames = sp->frame_size;
+    unsigned int wptr = sp->wptr;
+    if(sp->samprate != DAC_samprate){
+      // PCM only; Opus is decoded at DAC_samprate, so here the RTP clock is the input sample rate
+      struct resampler * const rs = &sp->resampler;
+      if(rs->bank == NULL || rs->bank->in_rate != (unsigned int)sp->samprate || rs->channels != sp->channels){
+	resampler_free(rs);
+	if(resampler_init(rs,sp->samprate,DAC_samprate,sp->channels) != 0)
+	  goto endloop;
+	sp->resample_ts = pkt->rtp.timestamp;
+	sp->resample_wptr = wptr;
+      }
+      if(pkt->rtp.timestamp == sp->resample_ts){
+	// Picks up exactly where the last packet's output ended. Placing each packet by its scaled
+	// timestamp instead would be off by a frame whenever the rounding differs from the filter's phase
+	wptr = sp->resample_wptr;
+      } else {
+	// Gap or overlap: restart the filter at the timestamp position
+	resampler_reset(rs);
+      }
+      int const max = sp->channels * resample_max_output(rs,frames);
+      if(max > sp->resample_size){
+	float * const buf = realloc(sp->resample_buf,sizeof(*buf) * max);
+	if(buf == NULL)
+	  goto endloop;
+	sp->resample_buf = buf;
+	sp->resample_size = max;
+      }
+      frames = resample(rs,sp->resample_buf,bounce,frames);
+      audio = sp->resample_buf;
+      sp->resample_ts = pkt->rtp.timestamp + sp->frame_size;
+      sp->resample_wptr = (wptr + frames) & (BUFFERSIZE-1);
+    }
+    if(Voting && Best_session != sp)
+      goto endloop; // If voting, suppress all but best session
+
+    if(sp->mixbuf == NULL && mix_attach(sp) != 0)
+      goto endloop;
+
     if(Channels == 2){
       /* Compute gains and delays for stereo imaging
 	 Extreme gain differences can make the source sound like it's inside an ear
@@ -484,80 +525,67 @@ void *decode_task(void *arg){
 	 -6dB for each channel in the center
 	 when full to one side or the other, that channel is +6 dB and the other is -inf dB
       */
-      float const left_gain = sp->gain * (1 - sp->pan)/2;
-      float const right_gain = sp->gain * (1 + sp->pan)/2;
+      float const pan = sp->pan;
+      float const left_gain = sp->gain * (1 - pan)/2;
+      float const right_gain = sp->gain * (1 + pan)/2;
       /* Delay less favored channel 0 - 1.5 ms max (determined
 	 empirically) This is really what drives source localization
 	 in humans. The effect is so dramatic even with equal levels
 	 you have to remove one earphone to convince yourself that the
 	 levels really are the same!
       */
-      int const left_delay = (sp->pan > 0) ? round(sp->pan * .0015 * DAC_samprate) : 0; // Delay left channel
-      int const right_delay = (sp->pan < 0) ? round(-sp->pan * .0015 * DAC_samprate) : 0; // Delay right channel
+      int const left_delay = (pan > 0) ? round(pan * .0015 * DAC_samprate) : 0; // Delay left channel
+      int const right_delay = (pan < 0) ? round(-pan * .0015 * DAC_samprate) : 0; // Delay right channel
 
       assert(left_delay >= 0 && right_delay >= 0);
-
-      // Mix bounce buffer into output buffer read by portaudio callback
-      // Simplified by mirror buffer wrap
-      int left_index = 2 * (sp->wptr + left_delay);
-      int right_index = 2 * (sp->wptr + right_delay) + 1;
-
-      for(int i=0; i < sp->frame_size; i++){
-	float left,right;
-	if(sp->channels == 1){
-	  // Mono input, put on both channels
-	  left = bounce[i];
-	  if(sp->notch_enable && sp->notch_tone > 0)
-	    left = applyIIR(&sp->iir_left,left);
-	  right = left;
-	} else {
-	  // stereo input
-	  left = bounce[2*i];
-	  right = bounce[2*i+1];
-	  if(sp->notch_enable && sp->notch_tone > 0){
-	    left = applyIIR(&sp->iir_left,left);
-	    right = applyIIR(&sp->iir_right,right);
-	  }
-	}
-	if(!Voting || Best_session == sp){ // If voting, suppress all but best session
-	  // Not the cleanest way to upsample the sample rate, but it works
-	  for(int j=0; j < upsample; j++){
-	    Output_buffer[left_index] += left * left_gain;
-	    Output_buffer[right_index] += right * right_gain;
-	    left_index += 2;
-	    right_index += 2;
-	  }
-	  if(modsub(right_index/2,Wptr,BUFFERSIZE) > 0)
-	    Wptr = right_index / 2; // samples to frames; For verbose mode
-	}
+      int const ahead = modsub(wptr,Rptr,BUFFERSIZE);
+      int const span = frames + (left_delay > right_delay ? left_delay : right_delay);
+      if(ahead < 0 || ahead + span >= sp->mix_frames)
+	goto endloop; // Would land outside the live part of the staging buffer
+
+      // Our own staging buffer, so no other session writes it. Mirrored, so no wraparound checks
+      float * const left = &sp->mixbuf[2 * ((wptr + left_delay) & (sp->mix_frames-1))];
+      float * const right = &sp->mixbuf[2 * ((wptr + right_delay) & (sp->mix_frames-1)) + 1];
+      if(sp->channels == 1){
+	// Mono input, put on both channels
+	for(int i=0; i < frames; i++)
+	  left[2*i] += audio[i] * left_gain;
+	for(int i=0; i < frames; i++)
+	  right[2*i] += audio[i] * right_gain;
+      } else {
+	for(int i=0; i < frames; i++)
+	  left[2*i] += audio[2*i] * left_gain;
+	for(int i=0; i < frames; i++)
+	  right[2*i] += audio[2*i+1] * right_gain;
       }
+      mix_written(sp,wptr,span);
+      unsigned int const end = wptr + span;
+      if(modsub(end,Wptr,BUFFERSIZE) > 0)
+	Wptr = end & (BUFFERSIZE-1); // For verbose mode
     } else { // Channels == 1, no panning
-      int64_t index = sp->wptr;
-      for(int i=0; i < sp->frame_size; i++){
-	float s;
-	if(sp->channels == 1){
-	  s = bounce[i];
-	} else {
-	  // Downmix to mono
-	  s = 0.5 * (bounce[2*i] + bounce[2*i+1]);
-	}
-	if(sp->notch_enable && sp->notch_tone > 0)
-	  s = applyIIR(&sp->iir_left,s);
+      int const ahead = modsub(wptr,Rptr,BUFFERSIZE);
+      if(ahead < 0 || ahead + frames >= sp->mix_frames)
+	goto endloop;
 
-	if(!Voting || Best_session == sp){ // If voting, suppress all but best session
-	  // Not the cleanest way to upsample the sample rate, but it works
-	  for(int j=0; j < upsample; j++){
-	    Output_buffer[index++] += s * sp->gain;
-	  }
-	  if(modsub(index,Wptr,BUFFERSIZE) > 0)
-	    Wptr = index; // For verbose mode
-	}
+      float * const out = &sp->mixbuf[wptr & (sp->mix_frames-1)];
+      float const gain = sp->gain;
+      if(sp->channels == 1){
+	for(int i=0; i < frames; i++)
+	  out[i] += audio[i] * gain;
+      } else {
+	// Downmix to mono
+	for(int i=0; i < frames; i++)
+	  out[i] += (audio[2*i] + audio[2*i+1]) * 0.5f * gain;
       }
+      mix_written(sp,wptr,frames);
+      unsigned int const end = wptr + frames;
+      if(modsub(end,Wptr,BUFFERSIZE) > 0)
+	Wptr = end & (BUFFERSIZE-1); // For verbose mode
     } // Channels == 1
 
   endloop:;
     FREE(bounce);
-    FREE(pkt);
+    packet_free(&pkt);
   } // !sp->terminate
   pthread_cleanup_pop(1);
   return NULL;
@@ -569,8 +597,24 @@ void reset_session(struct session * const sp,uint32_t timestamp){
     opus_decoder_ctl(sp->opus,OPUS_RESET_STATE); // Reset decoder
   sp->reset = false;
   sp->last_timestamp = timestamp;
+  sp->ts_remainder = 0;
   sp->playout = Playout * DAC_samprate/1000;
   sp->wptr = (Rptr + sp->playout) & (BUFFERSIZE-1);
+  {
+    // Room for the playout delay, as much again for clock drift before the early limit, and the margin
+    int const need = 2 * max(sp->playout,0) + MIX_MARGIN_MS * DAC_samprate / 1000;
+    int size = 4096; // Keeps the mirrored mapping a whole number of pages
+    while(size < need)
+      size <<= 1;
+    if(size != sp->mix_frames){
+      mix_detach(sp); // Playout changed; mix_attach() maps the new size on the next packet
+      sp->mix_frames = size;
+    }
+  }
+  if(sp->resampler.bank != NULL)
+    resampler_reset(&sp->resampler); // Don't smear the old talk spurt into the new one
+  sp->resample_ts = timestamp;
+  sp->resample_wptr = sp->wptr;
 }
 // Start output stream if it was off; reset idle timeout on output audio stream activity
 // Return true if we (re)started it
@@ -627,3 +671,138 @@ static float make_position(int x){
   // Scale
   return 0.5 * (((float)y / 128) - 1);
 }
+
+// Called by dataproc to hand a packet to decode_task; takes ownership of pkt
+// O(1): the slot is picked by RTP sequence number, so duplicates and reordering cost nothing extra
+static void jitter_put(struct session *sp,struct packet *pkt){
+  uint16_t const seq = pkt->rtp.seq;
+  int const resync = atomic_load(&sp->jitter_resync);
+  uint16_t const base = resync != 0 ? (uint16_t)(resync - 1) : atomic_load(&sp->jitter_next);
+  int16_t const ahead = (int16_t)(seq - base);
+
+  if(ahead < 0 && ahead > -JITTER_SLOTS){
+    // decode_task has already given up on this one
+    sp->reseqs++;
+    packet_free(&pkt);
+    return;
+  }
+  if(ahead < 0 || ahead >= JITTER_SLOTS){
+    // Sender restarted, or we fell way behind (e.g., a macos laptop was asleep). Start over here
+    atomic_store(&sp->jitter_resync,seq + 1);
+    atomic_store(&sp->jitter_high,seq);
+  }
+  struct packet *old = atomic_exchange(&sp->jitter[seq & (JITTER_SLOTS-1)],pkt);
+  if(old != NULL){
+    if(old->rtp.seq == seq)
+      sp->rtp_state.dupes++;
+    // else left over from an earlier trip around the ring
+    packet_free(&old);
+  }
+  // Slot must be visible before jitter_high says it's there
+  uint16_t const high = atomic_load(&sp->jitter_high);
+  if((int16_t)(seq - high) >= 0)
+    atomic_store(&sp->jitter_high,seq + 1);
+  else
+    sp->reseqs++; // Arrived after a later one
+
+  // Wake up decoder thread only if it's waiting
+  if(atomic_load(&sp->jitter_wait)){
+    pthread_mutex_lock(&sp->qmutex);
+    pthread_cond_signal(&sp->qcond);
+    pthread_mutex_unlock(&sp->qmutex);
+  }
+}
+
+// Called by decode_task to remove the packet with the given sequence number, if present
+static struct packet *jitter_take(struct session *sp,uint16_t seq){
+  struct packet *pkt = atomic_exchange(&sp->jitter[seq & (JITTER_SLOTS-1)],NULL);
+  if(pkt != NULL && pkt->rtp.seq != seq)
+    packet_free(&pkt); // Stale, from an earlier trip around the ring
+  return pkt;
+}
+
+// Each session renders into its own staging buffer; pa_callback sums them here.
+// The list is scanned without locks. A session leaving waits for any pass in progress
+// before its buffer is unmapped, so the callback never blocks on a session thread
+//
+// Frames from Rptr up to Mix_claim belong to the callback: it reads them, then clears them for the
+// next trip around the buffer. A decode thread checks against Rptr before writing, but the callback
+// can claim the frames while the write is under way. So the writer checks Mix_claim again afterward
+// and clears whatever it wrote into claimed frames, rather than leave it to play a buffer later
+static struct session * _Atomic Mix_list[NSESSIONS];
+static _Atomic int Mix_high;        // One past the highest slot ever used
+static _Atomic bool Mixing;         // pa_callback is in mix_sessions()
+static _Atomic unsigned int Mix_passes;
+static _Atomic unsigned int Mix_claim; // End of the frames the callback is reading or has read
+
+static size_t mix_size(struct session const *sp){
+  return (size_t)sp->mix_frames * Channels * sizeof(float);
+}
+
+// Called by the session's decode thread
+int mix_attach(struct session *sp){
+  assert(sp != NULL && sp->mixbuf == NULL && sp->mix_frames > 0);
+  sp->mixbuf = mirror_alloc(mix_size(sp));
+  if(sp->mixbuf == NULL)
+    return -1;
+  memset(sp->mixbuf,0,mix_size(sp));
+  for(int i = 0; i < NSESSIONS; i++){
+    struct session *expected = NULL;
+    if(atomic_compare_exchange_strong(&Mix_list[i],&expected,sp)){
+      int high = atomic_load(&Mix_high);
+      while(high <= i && !atomic_compare_exchange_weak(&Mix_high,&high,i+1))
+	;
+      sp->mix_slot = i;
+      return 0;
+    }
+  }
+  mirror_free((void **)&sp->mixbuf,mix_size(sp));
+  return -1;
+}
+
+void mix_detach(struct session *sp){
+  assert(sp != NULL);
+  if(sp->mixbuf == NULL)
+    return;
+  atomic_store(&Mix_list[sp->mix_slot],NULL);
+  // Let any pass that might have picked it up finish
+  if(atomic_load(&Mixing)){
+    unsigned int const passes = atomic_load(&Mix_passes);
+    while(atomic_load(&Mixing) && atomic_load(&Mix_passes) == passes)
+      usleep(100);
+  }
+  mirror_free((void **)&sp->mixbuf,mix_size(sp));
+}
+
+// Called by the decode thread after adding 'frames' frames at wptr
+static void mix_written(struct session *sp,unsigned int wptr,int frames){
+  atomic_thread_fence(memory_order_seq_cst); // Pairs with the one in mix_sessions()
+  int late = modsub(atomic_load(&Mix_claim),wptr,BUFFERSIZE);
+  if(late <= 0)
+    return;
+  if(late > frames)
+    late = frames;
+  // Already played, or being played now. Either way it must not come around again
+  memset(&sp->mixbuf[Channels * (wptr & (sp->mix_frames-1))],0,late * Channels * sizeof(float));
+}
+
+// Called from pa_callback: add every session's samples for these frames into output and clear them
+void mix_sessions(float *output,unsigned int rptr,int frames){
+  atomic_store(&Mixing,true);
+  atomic_store(&Mix_claim,(rptr + frames) & (BUFFERSIZE-1));
+  atomic_thread_fence(memory_order_seq_cst); // Claim is visible before we touch the frames
+  int const count = frames * Channels;
+  int const high = atomic_load(&Mix_high);
+  for(int i = 0; i < high; i++){
+    struct session const * const sp = atomic_load(&Mix_list[i]);
+    if(sp == NULL)
+      continue;
+    float * const restrict in = &sp->mixbuf[Channels * (rptr & (sp->mix_frames-1))];
+    float * const restrict out = output;
+    for(int j = 0; j < count; j++) // Vectorizes
+      out[j] += in[j];
+    memset(in,0,count * sizeof(*in));
+  }
+  atomic_fetch_add(&Mix_passes,1);
+  atomic_store(&Mixing,false);
+}
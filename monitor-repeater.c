@@ -25,6 +25,7 @@
 #include "multicast.h"
 #include "radio.h"
 #include "iir.h"
+#include "resample.h"
 #include "morse.h"
 #include "status.h"
 #include "monitor.h"
@@ -28,6 +28,7 @@
 #include "multicast.h"
 #include "radio.h"
 #include "iir.h"
+#include "resample.h"
 #include "morse.h"
 #include "status.h"
 #include "monitor.h"
@@ -587,10 +588,13 @@ int pa_callback(void const *inputBuffer, void *outputBuffer,
   Portaudio_delay = 1000. * (timeInfo->outputBufferDacTime - timeInfo->currentTime);
 
   // Use mirror buffer to simplify wraparound. Count is in bytes = Channels * frames * sizeof(float)
+  // Output_buffer now carries only locally generated audio (e.g., repeater ID)
   int const bytecount = Channels * framesPerBuffer * sizeof(*Output_buffer);
   memcpy(outputBuffer,&Output_buffer[Channels*Rptr],bytecount);
   // Zero what we just copied
   memset(&Output_buffer[Channels*Rptr],0,bytecount);
+  // Add in the sessions
+  mix_sessions(outputBuffer,Rptr,framesPerBuffer);
   Rptr += framesPerBuffer;
   Rptr &= (BUFFERSIZE-1);
   Buffer_length -= framesPerBuffer;
@@ -1,8 +1,10 @@
 #define MAX_MCAST 20          // Maximum number of multicast addresses
 #define BUFFERSIZE (1<<19)    // about 10.92 sec at 48 kHz - must be power of 2 times page size (4k)!
+#define MIX_MARGIN_MS 122     // Staging room past the early limit: the longest (120 ms Opus) packet plus the pan delay
 extern float const Latency; // chunk size for audio output callback
 extern float const Tone_period; // PL tone integration period
 #define NSESSIONS 1500
+#define JITTER_SLOTS 512      // RTP packets in per-session jitter buffer, about 10 sec at 20 ms. Must be power of 2
 
 #define N_tones 55
 extern float PL_tones[N_tones];
@@ -90,8 +92,14 @@ struct session {
   char const *dest;
 
   pthread_t task;           // Thread reading from queue and running decoder
-  struct packet *queue;     // Incoming RTP packets
-  pthread_mutex_t qmutex;   // Mutex protecting packet queue
+  // Jitter buffer of incoming RTP packets, indexed by sequence number modulo JITTER_SLOTS
+  // Single producer (dataproc) and single consumer (decode_task); slots change hands with atomic exchange
+  struct packet * _Atomic jitter[JITTER_SLOTS];
+  _Atomic uint16_t jitter_next;   // Next sequence number wanted by decode_task; written only by it
+  _Atomic uint16_t jitter_high;   // One past highest sequence number queued; written only by dataproc
+  _Atomic int jitter_resync;      // Sequence number + 1 to restart at after a jump, 0 = none
+  _Atomic bool jitter_wait;       // decode_task is (about to be) asleep on qcond
+  pthread_mutex_t qmutex;   // Used only to sleep on qcond when the jitter buffer is empty
   pthread_cond_t qcond;     // Condition variable for arrival of new packet
 
   struct rtp_state rtp_state; // Incoming RTP session state
@@ -100,6 +108,7 @@ struct session {
   struct pt_table pt_table[128];     // convert a payload type to samplerate, channels, encoding type
 
   uint32_t last_timestamp;  // Last timestamp seen
+  int64_t ts_remainder;     // Fraction of an output frame left over when scaling timestamps to the output rate
   unsigned int wptr;        // current write index into output PCM buffer, *frames*
   int playout;              // Initial playout delay, frames
   long long last_active;    // GPS time last active with data traffic
@@ -108,6 +117,14 @@ struct session {
   float active;             // Seconds we've been active (only when queue has stuff)
 
   OpusDecoder *opus;        // Opus codec decoder handle, if needed
+  struct resampler resampler; // Stream rate to DAC_samprate, when they differ
+  uint32_t resample_ts;     // RTP timestamp just past the last frame fed to the resampler
+  unsigned int resample_wptr; // Where its next output frame goes, so a contiguous stream is placed by output count
+  float *resample_buf;      // Resampler output, reused for every packet
+  int resample_size;        // Samples allocated in resample_buf
+  float *mixbuf;            // Staging buffer summed by pa_callback, mix_frames frames, mirrored
+  int mix_frames;           // Power of 2, sized by reset_session() from the playout delay
+  int mix_slot;             // Index in mixer's list
   int frame_size;
   int bandwidth;            // Audio bandwidth
   struct goertzel tone_detector[N_tones];
@@ -156,6 +173,9 @@ void *repeater_ctl(void *arg);
 char const *lookupid(double freq);
 bool kick_output();
 void vote();
+int mix_attach(struct session *sp);
+void mix_detach(struct session *sp);
+void mix_sessions(float *output,unsigned int rptr,int frames);
 
 static inline int modsub(unsigned int const a, unsigned int const b, int const modulus){
   int diff = (int)a - (int)b;
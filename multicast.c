@@ -15,6 +15,9 @@
 #include <ifaddrs.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #if defined(linux)
 #include <linux/if_packet.h>
@@ -26,6 +29,7 @@
 #include <net/if_dl.h>
 #endif
 
+#include "conf.h"
 #include "multicast.h"
 #include "misc.h"
 
@@ -34,6 +38,19 @@ static int ipv6_join_group(int const fd,void const * const sock,char const * con
 static void set_local_options(int);
 static void set_ipv4_options(int fd,int mcast_ttl,int tos);
 static void set_ipv6_options(int const fd,int const mcast_ttl,int const tos);
+static int lookup_host(char const *host,char const *port,int flags,int tries,void *sock);
+static bool cache_lookup(char const *host,char *addr,int addrlen);
+static void cache_store(char const *host,char const *addr);
+static void *refresh_thread(void *);
+
+// Disk cache of resolved multicast names; see cache_lookup()
+#define NAME_CACHE VARDIR "/mcast-names"
+#define REFRESH_TRIES 6 // Background check of a cached name gives up after about a minute
+
+struct refresh {
+  char host[PATH_MAX+6];
+  char cached[INET6_ADDRSTRLEN];
+};
 
 struct pt_table PT_table[128] = {
 { 0, 0, 0 }, // 0
@@ -325,6 +342,10 @@ int listen_mcast(void const *s,char const *iface){
 // Resolve a multicast target string in the form "name[:port][,iface]"
 // If "name" is not qualified (no periods) then .local will be appended by default
 // If :port is not specified, port field in result will be zero
+// Names are looked up in a disk cache first and checked in the background, so startup
+// isn't held up by a slow or absent mDNS responder; see cache_lookup()
+// Limitation: a cached address that turns out to be stale stays in *sock. The background check
+// only updates the cache and logs the change, so the new address takes effect at the next restart
 int resolve_mcast(char const *target,void *sock,int default_port,char *iface,int iface_len,int tries){
   if(target == NULL || strlen(target) == 0 || sock == NULL)
     return -1;
@@ -350,8 +371,6 @@ int resolve_mcast(char const *target,void *sock,int default_port,char *iface,int
     *port++ = '\0';
   }
 
-  struct addrinfo *results;
-  int try;
   // If no domain zone is specified, assume .local (i.e., for multicast DNS)
   char full_host[PATH_MAX+6];
   if(strchr(host,'.') == NULL)
@@ -359,6 +378,49 @@ int resolve_mcast(char const *target,void *sock,int default_port,char *iface,int
   else
     strlcpy(full_host,host,sizeof(full_host));
 
+  // A literal address needs no lookup
+  if(lookup_host(host,port,AI_NUMERICHOST,1,sock) == 0)
+    goto done;
+
+  // Start with the address we got last time, if any, and check it in the background
+  // so a slow or missing mDNS responder doesn't hold up startup
+  {
+    char cached[INET6_ADDRSTRLEN];
+    if(cache_lookup(full_host,cached,sizeof(cached)) && lookup_host(cached,port,AI_NUMERICHOST,1,sock) == 0){
+      struct refresh *rp = calloc(1,sizeof(*rp));
+      if(rp != NULL){
+	strlcpy(rp->host,full_host,sizeof(rp->host));
+	strlcpy(rp->cached,cached,sizeof(rp->cached));
+	pthread_t thread;
+	if(pthread_create(&thread,NULL,refresh_thread,rp) != 0)
+	  FREE(rp);
+      }
+      goto done;
+    }
+  }
+  {
+    int64_t const start = gps_time_ns();
+    if(lookup_host(full_host,port,0,tries,sock) != 0)
+      return -1;
+    double const elapsed = 1e-9 * (gps_time_ns() - start);
+    if(elapsed >= 1.0)
+      fprintf(stderr,"resolve_mcast(%s) took %.1lf sec\n",full_host,elapsed);
+    char addr[INET6_ADDRSTRLEN];
+    cache_store(full_host,formataddr(addr,sizeof(addr),sock));
+  }
+ done:;
+  if(port == NULL){
+    // Insert default port
+    setportnumber(sock,default_port);
+  }
+  return 0;
+}
+
+// getaddrinfo() with retries; tries == 0 means forever
+// Only the address and port are copied into sock
+static int lookup_host(char const *host,char const *port,int flags,int tries,void *sock){
+  struct addrinfo *results = NULL;
+  int try;
   for(try=0;tries == 0 || try != tries;try++){
     results = NULL;
     struct addrinfo hints;
@@ -367,7 +429,7 @@ int resolve_mcast(char const *target,void *sock,int default_port,char *iface,int
     // Using hints.ai_family = AF_UNSPEC generates both A and AAAA queries
     // but even when the A query is answered the library times out and retransmits the AAAA
     // query several times. So do only an A (IPv4) query the first time
-    hints.ai_family = (try == 0) ? AF_INET : AF_UNSPEC;
+    hints.ai_family = (try == 0 && !(flags & AI_NUMERICHOST)) ? AF_INET : AF_UNSPEC;
 #else
     // using AF_INET often fails on loopback.
     // Did this get changed recently in getaddrinfo()?
@@ -375,31 +437,102 @@ int resolve_mcast(char const *target,void *sock,int default_port,char *iface,int
 #endif
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
-    hints.ai_flags = AI_ADDRCONFIG;
+    hints.ai_flags = AI_ADDRCONFIG | flags;
 
-    int const ecode = getaddrinfo(full_host,port,&hints,&results);
+    int const ecode = getaddrinfo(host,port,&hints,&results);
     if(ecode == 0)
       break;
+    if(flags & AI_NUMERICHOST)
+      return -1; // Not a literal; retrying won't help
     if(try == 0) // Don't pollute the syslog
-      fprintf(stderr,"resolve_mcast getaddrinfo(host=%s, port=%s): %s. Retrying.\n",full_host,port,gai_strerror(ecode));
-    sleep(10);
+      fprintf(stderr,"resolve_mcast getaddrinfo(host=%s, port=%s): %s. Retrying.\n",host,port,gai_strerror(ecode));
+    if(tries == 0 || try + 1 != tries)
+      sleep(10);
   }
   if(tries != 0 && try == tries)
     return -1;
   if(try > 0) // Don't leave them hanging: report success after failure
-    fprintf(stderr,"resolve_mcast getaddrinfo(host=%s, port=%s) succeeded\n",full_host,port);
+    fprintf(stderr,"resolve_mcast getaddrinfo(host=%s, port=%s) succeeded\n",host,port);
 
   // Use first entry on list -- much simpler
   // I previously tried each entry in turn until one succeeded, but with UDP sockets and
   // flags set to only return supported addresses, how could any of them fail?
   memcpy(sock,results->ai_addr,results->ai_addrlen);
-  if(port == NULL){
-    // Insert default port
-    setportnumber(sock,default_port);
-  }
   freeaddrinfo(results); results = NULL;
   return 0;
 }
+
+// Cache of multicast names resolved by resolve_mcast(), kept on disk so the next start of any
+// program on this host can use them without waiting for mDNS. One "name address" per line
+// Only programs with write access to the directory (i.e., in group radio) update it
+static pthread_mutex_t Name_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool cache_lookup(char const *host,char *addr,int addrlen){
+  bool found = false;
+  pthread_mutex_lock(&Name_cache_mutex);
+  FILE *fp = fopen(NAME_CACHE,"r");
+  if(fp != NULL){
+    char line[PATH_MAX+INET6_ADDRSTRLEN+10];
+    while(!found && fgets(line,sizeof(line),fp) != NULL){
+      char *saveptr = NULL;
+      char const *name = strtok_r(line," \t\n",&saveptr);
+      char const *a = strtok_r(NULL," \t\n",&saveptr);
+      if(name != NULL && a != NULL && strcasecmp(name,host) == 0){
+	strlcpy(addr,a,addrlen);
+	found = true;
+      }
+    }
+    fclose(fp);
+  }
+  pthread_mutex_unlock(&Name_cache_mutex);
+  return found;
+}
+
+// Add or replace an entry, rewriting the file atomically. Errors are ignored; it's only a cache
+static void cache_store(char const *host,char const *addr){
+  if(host == NULL || addr == NULL || strlen(addr) == 0)
+    return;
+  pthread_mutex_lock(&Name_cache_mutex);
+  char tempfile[PATH_MAX];
+  snprintf(tempfile,sizeof(tempfile),"%s.%d",NAME_CACHE,(int)getpid());
+  FILE *out = fopen(tempfile,"w");
+  if(out != NULL){
+    fprintf(out,"%s %s\n",host,addr);
+    FILE *in = fopen(NAME_CACHE,"r");
+    if(in != NULL){
+      char line[PATH_MAX+INET6_ADDRSTRLEN+10];
+      while(fgets(line,sizeof(line),in) != NULL){
+	size_t const len = strlen(host);
+	if(strncasecmp(line,host,len) == 0 && (line[len] == ' ' || line[len] == '\t'))
+	  continue; // Replaced above
+	fputs(line,out);
+      }
+      fclose(in);
+    }
+    if(fclose(out) != 0 || rename(tempfile,NAME_CACHE) != 0)
+      unlink(tempfile);
+  }
+  pthread_mutex_unlock(&Name_cache_mutex);
+}
+
+// Check a cached name in the background and update the cache
+// The caller is already using the cached address and keeps it until restart; this only fixes the cache and says so
+static void *refresh_thread(void *arg){
+  struct refresh *rp = arg;
+  pthread_detach(pthread_self());
+  pthread_setname("mcast-refresh");
+  struct sockaddr_storage sock;
+  if(lookup_host(rp->host,NULL,0,REFRESH_TRIES,&sock) == 0){
+    char addr[INET6_ADDRSTRLEN];
+    formataddr(addr,sizeof(addr),&sock);
+    if(strcmp(addr,rp->cached) != 0){
+      fprintf(stderr,"%s is now %s, not cached %s; restart to use it\n",rp->host,addr,rp->cached);
+      cache_store(rp->host,addr);
+    }
+  }
+  FREE(rp);
+  return NULL;
+}
 // Convert RTP header from network (wire) big-endian format to internal host structure
 // Written to be insensitive to host byte order and C structure layout and padding
 // Use of unsigned formats is important to avoid unwanted sign extension
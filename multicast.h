@@ -122,9 +122,17 @@ struct packet {
   struct rtp_header rtp;
   uint8_t const *data; // Don't modify a packet through this pointer
   int len;
-  uint8_t content[PKTSIZE];
+  int64_t arrival;     // Receive time, ns, for programs that track latency
+  int size;            // Space in content[]
+  uint8_t content[];
 };
 
+// Packets come from a shared pool of a few buffer sizes, recycled without locks
+// packet_recv() receives into a thread-local PKTSIZE buffer and copies out to the smallest fitting packet
+struct packet *packet_alloc(int size);
+void packet_free(struct packet **pkt);
+int packet_recv(int fd,struct packet **pkt,struct sockaddr *sender,socklen_t *socksize);
+
 
 
 // Convert between internal and wire representations of RTP header
@@ -0,0 +1,134 @@
+// Cheap spectral occupancy measure for recorded clips
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <math.h>
+#include <complex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fftw3.h>
+#include <netinet/in.h>
+
+#include "misc.h"
+#include "occupancy.h"
+
+static float const Bin_width = 5;          // Roughly; FT8 tones are 6.25 Hz apart, WSPR 1.46 Hz
+static double const Noise_quantile = 0.25; // Of passband bins, taken as the noise floor
+static int const Min_blocks = 4;           // Fewer than this and the estimate means nothing
+
+// low and high are the passband edges in Hz; width is the bandwidth of one signal, e.g., 50 Hz for FT8
+int occupancy_init(struct occupancy *occ,unsigned int samprate,float low,float high,float width){
+  assert(occ != NULL);
+  memset(occ,0,sizeof(*occ));
+  if(samprate == 0 || high <= low)
+    return -1;
+
+  // Power of 2 nearest the desired bin width
+  int n = 64;
+  while(n < samprate / Bin_width)
+    n <<= 1;
+  if(n - samprate / Bin_width > samprate / Bin_width - n/2)
+    n >>= 1;
+  occ->fftsize = n;
+  occ->low_bin = max(1,(int)(low * n / samprate));
+  occ->high_bin = min(n/2,(int)(high * n / samprate));
+  occ->width = max(1,(int)lrintf(width * n / samprate));
+  if(occ->high_bin - occ->low_bin + 1 < 2 * occ->width)
+    return -1;
+
+  occ->window = malloc(n * sizeof(*occ->window));
+  occ->samples = malloc(n * sizeof(*occ->samples));
+  occ->input = fftwf_alloc_real(n);
+  occ->output = (complex float *)fftwf_alloc_complex(n/2 + 1);
+  occ->power = calloc(n/2 + 1,sizeof(*occ->power));
+  if(occ->window == NULL || occ->samples == NULL || occ->input == NULL || occ->output == NULL || occ->power == NULL){
+    occupancy_free(occ);
+    return -1;
+  }
+  for(int i = 0; i < n; i++)
+    occ->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n); // Hann
+  occ->plan = fftwf_plan_dft_r2c_1d(n,occ->input,(fftwf_complex *)occ->output,FFTW_ESTIMATE);
+  return 0;
+}
+
+void occupancy_free(struct occupancy *occ){
+  if(occ == NULL)
+    return;
+  if(occ->plan != NULL)
+    fftwf_destroy_plan(occ->plan);
+  if(occ->input != NULL)
+    fftwf_free(occ->input);
+  if(occ->output != NULL)
+    fftwf_free(occ->output);
+  FREE(occ->window);
+  FREE(occ->samples);
+  FREE(occ->power);
+  memset(occ,0,sizeof(*occ));
+}
+
+// Start a new clip
+void occupancy_reset(struct occupancy *occ){
+  assert(occ != NULL);
+  occ->fill = 0;
+  occ->blocks = 0;
+  if(occ->power != NULL)
+    memset(occ->power,0,(occ->fftsize/2 + 1) * sizeof(*occ->power));
+}
+
+// Add 16-bit big-endian (network order) samples as they come from RTP
+// Only the first channel of a multichannel stream is used
+void occupancy_s16be(struct occupancy *occ,int16_t const *samples,int count,int channels){
+  assert(occ != NULL);
+  if(occ->plan == NULL)
+    return;
+  if(channels < 1)
+    channels = 1;
+  for(int i = 0; i < count; i += channels){
+    occ->samples[occ->fill] = (int16_t)ntohs(samples[i]);
+    if(++occ->fill < occ->fftsize)
+      continue;
+    for(int j = 0; j < occ->fftsize; j++)
+      occ->input[j] = occ->window[j] * occ->samples[j];
+    fftwf_execute(occ->plan);
+    for(int k = occ->low_bin; k <= occ->high_bin; k++)
+      occ->power[k] += cnrmf(occ->output[k]);
+    occ->blocks++;
+    // Overlap by half; more nearly independent noise in the sums lowers the noise-only readings
+    int const half = occ->fftsize / 2;
+    memmove(occ->samples,occ->samples + half,half * sizeof(*occ->samples));
+    occ->fill = half;
+  }
+}
+
+static int dcompare(void const *a,void const *b){
+  double const x = *(double const *)a;
+  double const y = *(double const *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Peak to noise ratio in the passband, dB; NAN if there isn't enough data to say
+float occupancy_snr(struct occupancy const *occ){
+  assert(occ != NULL);
+  if(occ->plan == NULL || occ->blocks < Min_blocks)
+    return NAN;
+
+  // Sum over the width of one signal, so it counts all of its energy even when its tones
+  // fall in different bins, while the noise in the sum averages down
+  int const nbins = occ->high_bin - occ->low_bin + 2 - occ->width;
+  double sorted[nbins];
+  double sum = 0;
+  for(int k = 0; k < occ->width; k++)
+    sum += occ->power[occ->low_bin + k];
+  for(int i = 0; i < nbins; i++){
+    sorted[i] = sum;
+    if(i + 1 < nbins)
+      sum += occ->power[occ->low_bin + i + occ->width] - occ->power[occ->low_bin + i];
+  }
+  qsort(sorted,nbins,sizeof(*sorted),dcompare);
+  double const noise = sorted[(int)(Noise_quantile * (nbins - 1))];
+  double const peak = sorted[nbins-1];
+  if(noise <= 0)
+    return peak > 0 ? INFINITY : NAN; // Silence
+  return 10 * log10(peak / noise);
+}
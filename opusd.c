@@ -1,10 +1,12 @@
 // Opus transcoder
 // Read PCM audio from one or more multicast groups, compress with Opus and retransmit on another with same SSRC
-// Currently subject to memory leaks as old group states aren't yet aged out
 
 // Major rewrite Nov 2020 for multithreaded encoding with one Opus encoder per thread
 // Makes better use of multicore CPUs under heavy load (like encoding the entire 2m band at once)
-// Copyright Jan 2018-2023 Phil Karn, KA9Q
+// Now a fixed pool of encoder threads takes sessions with queued packets from a ready list,
+// so hundreds of SSRCs don't mean hundreds of threads. Idle sessions are aged out and their
+// encoders kept for reuse. Each thread batches its output packets into one sendmmsg() call.
+// Copyright Jan 2018-2024 Phil Karn, KA9Q
 
 #define _GNU_SOURCE 1
 #include <assert.h>
@@ -30,28 +32,31 @@
 #include <sched.h>
 #include <sysexits.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
 
 #include "misc.h"
 #include "multicast.h"
 #include "status.h"
 #include "iir.h"
 #include "avahi.h"
+#include "sessions.h"
 
 #define BUFFERSIZE 16384  // Big enough for 120 ms @ 48 kHz stereo (11,520 16-bit samples)
+#define BATCH 32          // Output packets per sendmmsg() call
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next;
+  struct session_entry entry; // In Sessions table, keyed on sender and SSRC
   int type;                 // input RTP type (10,11)
 
-  struct sockaddr sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
-  pthread_t thread;
-  pthread_mutex_t qmutex;
-  pthread_cond_t qcond;
-  struct packet *queue;
+  // Protected by Ready_mutex
+  struct packet *queue;     // Waiting to be encoded, sorted by sequence number
+  bool scheduled;           // On the ready list or being encoded; only one thread at a time
+  struct session *ready_next;
 
   struct rtp_state rtp_state_in; // RTP input state
   int samprate; // PCM sample rate Hz
@@ -66,6 +71,22 @@ struct session {
 
   unsigned long underruns;  // Callback count of underruns (stereo samples) replaced with silence
   uint64_t packets;
+
+  // Encode latency: arrival of the packet completing a frame to the encoded frame being ready to send
+  int64_t latency_sum;      // ns, since last report
+  int64_t latency_max;
+  unsigned long frames;     // since last report
+  int64_t report_time;
+};
+
+// Encoded packets waiting to go out, one per encoder thread
+struct batch {
+  int count;
+  struct iovec iov[BATCH];
+#if defined(linux)
+  struct mmsghdr msgs[BATCH];
+#endif
+  uint8_t buffers[BATCH][PKTSIZE];
 };
 
 
@@ -82,25 +103,42 @@ int Opus_blocktime = 20;      // Minimum frame size 20 ms, a reasonable default
 bool Fec_enable = false;                  // Use forward error correction
 int Application = OPUS_APPLICATION_AUDIO; // Encoder optimization mode
 const float Latency = 0.02;    // chunk size for audio output callback
+int Nthreads;                  // Encoder threads, default number of CPUs
+
+int64_t const Idle_timeout = 10 * (int64_t)BILLION; // Close sessions idle this long
+int64_t const Report_interval = 60 * (int64_t)BILLION; // With -v, log encode latency this often
+#define MAX_SPARE_ENCODERS 32
 
 // Global variables
 int Status_fd = -1;           // Reading from radio status
 int Input_fd = -1;            // Multicast receive socket
 int Output_fd = -1;           // Multicast receive socket
-struct session *Sessions;
-pthread_mutex_t Session_protect = PTHREAD_MUTEX_INITIALIZER;
-uint64_t Output_packets;
+struct session_table Sessions; // Used only by the main thread
+pthread_mutex_t Ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Ready_cond = PTHREAD_COND_INITIALIZER;
+struct session *Ready_head;    // Sessions with packets to encode
+struct session *Ready_tail;
+
+// Idle encoders kept for reuse; all are configured alike, so only rate and channels matter
+pthread_mutex_t Encoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct {
+  OpusEncoder *opus;
+  int samprate;
+  int channels;
+} Spare_encoders[MAX_SPARE_ENCODERS];
+int Nspare_encoders;
+_Atomic uint64_t Output_packets; // Updated by every encoder thread
 char const *Name;
 char const *Output;
 char const *Input;
 
 void closedown(int);
 struct session *lookup_session(const struct sockaddr *,uint32_t);
-struct session *create_session(void);
+struct session *create_session(struct sockaddr const *,uint32_t);
 int close_session(struct session **);
-int send_samples(struct session *sp);
-void *input(void *arg);
+int send_samples(struct session *sp,struct batch *batch);
 void *encode(void *arg);
+static void expire_sessions(int64_t now);
 
 struct option Options[] =
   {
@@ -123,12 +161,13 @@ struct option Options[] =
    {"tos", required_argument, NULL, 'p'},
    {"iptos", required_argument, NULL, 'p'},
    {"ip-tos", required_argument, NULL, 'p'},
+   {"threads", required_argument, NULL, 'j'},
    {"version", no_argument, NULL, 'V'},
    {NULL, 0, NULL, 0},
 
   };
 
-char const Optstring[] = "A:B:I:N:R:T:fo:vxp:V";
+char const Optstring[] = "A:B:I:N:R:T:fj:o:vxp:V";
 
 struct sockaddr_storage PCM_in_socket;
 struct sockaddr_storage Metadata_in_socket;
@@ -167,6 +206,9 @@ int main(int argc,char * const argv[]){
     case 'f':
       Fec_enable = true;
       break;
+    case 'j':
+      Nthreads = strtol(optarg,NULL,0);
+      break;
     case 'o':
       Opus_bitrate = strtol(optarg,NULL,0);
       break;
@@ -187,7 +229,7 @@ int main(int argc,char * const argv[]){
       exit(EX_OK);
     default:
       fprintf(stderr,"Usage: %s [-V|--version] [-l |--lowdelay|--low-delay |-s | --speech | --voice] \
-[-x|--discontinuous] [-v|--verbose] [-f|--fec] [-p|--iptos|--tos|--ip-tos tos|] \
+[-x|--discontinuous] [-v|--verbose] [-f|--fec] [-j|--threads threads] [-p|--iptos|--tos|--ip-tos tos|] \
 [-o|--bitrate|--bit-rate bitrate] [-B|--blocktime|--block-time --blocktime] [-N|--name name] \
 [-T|--ttl ttl] [-A|--iface iface] [-I|--pcm-in input_mcast_address ] \
 -R|--opus-out output_mcast_address\n",argv[0]);
@@ -205,6 +247,10 @@ int main(int argc,char * const argv[]){
   }
   if(Opus_bitrate < 500)
     Opus_bitrate *= 1000; // Assume it was given in kb/s
+  if(Nthreads <= 0){
+    long const ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    Nthreads = ncpu > 0 ? ncpu : 1;
+  }
 
   if(!Output){
     fprintf(stderr,"Must specify --opus-out\n");
@@ -266,12 +312,24 @@ int main(int argc,char * const argv[]){
   signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
+  session_table_init(&Sessions,Idle_timeout,BILLION,gps_time_ns());
   realtime();
 
+  // Encoder pool; threads inherit our scheduling
+  for(int i = 0; i < Nthreads; i++){
+    pthread_t thread;
+    if(pthread_create(&thread,NULL,encode,NULL) != 0){
+      perror("pthread_create");
+      exit(EX_OSERR);
+    }
+    pthread_detach(thread);
+  }
   // Loop forever processing and dispatching incoming PCM and status packets
 
   struct packet *pkt = NULL;
   while(true){
+    expire_sessions(gps_time_ns());
+
     struct pollfd fds[2];
     fds[0].fd = Input_fd;
     fds[0].events = POLLIN;
@@ -279,11 +337,11 @@ int main(int argc,char * const argv[]){
     fds[1].fd = Status_fd;
     fds[1].events = POLLIN;
     fds[1].revents = 0;
-    int n = poll(fds,2,-1); // Wait indefinitely for either stat or pcm data
+    int n = poll(fds,2,1000); // Wake up now and then to age out idle sessions
     if(n < 0)
       break; // Error of some kind
     if(n == 0)
-      continue; // Possible with 0 timeout?
+      continue; // Timeout
 
     if(fds[1].revents & POLLIN){
       // Simply copy status on output
@@ -296,27 +354,23 @@ int main(int argc,char * const argv[]){
     }
     if(fds[0].revents & POLLIN){
       // Process incoming RTP packets, demux to per-SSRC thread
-      // Need a new packet buffer?
-      if(!pkt)
-	pkt = malloc(sizeof(*pkt));
-      // Zero these out to catch any uninitialized derefs
-      pkt->next = NULL;
-      pkt->data = NULL;
-      pkt->len = 0;
+      // Return the last one to the pool if it wasn't queued
+      packet_free(&pkt);
 
       struct sockaddr_storage sender;
       socklen_t socksize = sizeof(sender);
-      int size = recvfrom(Input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+      int size = packet_recv(Input_fd,&pkt,(struct sockaddr *)&sender,&socksize);
 
       if(size == -1){
 	if(errno != EINTR){ // Happens routinely, e.g., when window resized
 	  perror("recvfrom");
 	  usleep(1000);
 	}
-	continue;  // Reuse current buffer
+	continue;
       }
       if(size <= RTP_MIN_SIZE)
 	continue; // Must be big enough for RTP header and at least some data
+      pkt->arrival = gps_time_ns();
 
       // Extract and convert RTP header to host format
       uint8_t const *dp = ntoh_rtp(&pkt->rtp,pkt->content);
@@ -340,31 +394,25 @@ int main(int argc,char * const argv[]){
 	if(channels == 0)
 	  continue; // Unknown channels
 
-	sp = create_session();
+	sp = create_session((struct sockaddr *)&sender,pkt->rtp.ssrc);
 	assert(sp != NULL);
 	// Initialize
 	getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-	memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
 	sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = pkt->rtp.ssrc;
 	sp->rtp_state_in.seq = pkt->rtp.seq; // Can cause a spurious drop indication if # pcm pkts != # opus pkts
 	sp->rtp_state_in.timestamp = pkt->rtp.timestamp;
 	sp->samprate = samprate;
 	sp->channels = channels;
-
-	// Span per-SSRC thread, each with its own instance of opus encoder
-	if(pthread_create(&sp->thread,NULL,encode,sp) == -1){
-	  perror("pthread_create");
-	  close_session(&sp);
-	  continue;
-	}
+	sp->report_time = pkt->arrival;
       }
+      session_touch(&sp->entry,pkt->arrival);
 
-      // Insert onto queue sorted by sequence number, wake up thread
+      // Insert onto queue sorted by sequence number, put session on ready list if it isn't already
       struct packet *q_prev = NULL;
       struct packet *qe = NULL;
       { // Mutex-protected segment
-	pthread_mutex_lock(&sp->qmutex);
+	pthread_mutex_lock(&Ready_mutex);
 	for(qe = sp->queue; qe && pkt->rtp.seq >= qe->rtp.seq; q_prev = qe,qe = qe->next)
 	  ;
 
@@ -374,183 +422,257 @@ int main(int argc,char * const argv[]){
 	else
 	  sp->queue = pkt; // Front of list
 	pkt = NULL;        // force new packet to be allocated
-	// wake up decoder thread
-	pthread_cond_signal(&sp->qcond);
-	pthread_mutex_unlock(&sp->qmutex);
+	if(!sp->scheduled){
+	  sp->scheduled = true;
+	  sp->ready_next = NULL;
+	  if(Ready_tail)
+	    Ready_tail->ready_next = sp;
+	  else
+	    Ready_head = sp;
+	  Ready_tail = sp;
+	  // wake up an encoder thread
+	  pthread_cond_signal(&Ready_cond);
+	}
+	pthread_mutex_unlock(&Ready_mutex);
       }
     }
   }
 }
 
-// Per-SSRC thread - does actual Opus encoding
-// Warning! do not use "continue" within the loop as this will cause a memory leak.
-// Jump to "endloop" instead
-void *encode(void *arg){
-  struct session * sp = (struct session *)arg;
-  assert(sp != NULL);
-  {
-    char threadname[16];
-    snprintf(threadname,sizeof(threadname),"op enc %u",sp->rtp_state_out.ssrc);
-    pthread_setname(threadname);
+// Close sessions that have been idle too long. Main thread only, like all table access
+static void expire_sessions(int64_t now){
+  struct session_entry *entry;
+  while((entry = session_expire(&Sessions,now)) != NULL){
+    struct session *sp = entry->owner;
+    pthread_mutex_lock(&Ready_mutex);
+    bool const busy = sp->scheduled;
+    pthread_mutex_unlock(&Ready_mutex);
+    if(busy){
+      // Still working through a backlog; not really idle
+      session_insert(&Sessions,&sp->entry,(struct sockaddr *)&sp->entry.sender,sp->entry.ssrc,sp,now);
+      continue;
+    }
+    if(Verbose)
+      fprintf(stdout,"ssrc %u (%s:%s) idle, closing after %'llu packets\n",
+	      sp->rtp_state_out.ssrc,sp->addr,sp->port,(unsigned long long)sp->packets);
+    close_session(&sp);
   }
-  // We will exit after 10 sec of idleness so detach ourselves to ensure resource recovery
-  // Not doing this caused a nasty memory leak
-  pthread_detach(pthread_self());
+}
+
+// Configure a new encoder, or reuse a spare one
+static OpusEncoder *get_encoder(int samprate,int channels){
+  OpusEncoder *opus = NULL;
+  pthread_mutex_lock(&Encoder_mutex);
+  for(int i = 0; i < Nspare_encoders; i++){
+    if(Spare_encoders[i].samprate == samprate && Spare_encoders[i].channels == channels){
+      opus = Spare_encoders[i].opus;
+      Spare_encoders[i] = Spare_encoders[--Nspare_encoders];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Encoder_mutex);
+  if(opus != NULL)
+    return opus;
 
   int error = 0;
-  sp->opus = opus_encoder_create(sp->samprate,sp->channels,Application,&error);
-  assert(error == OPUS_OK && sp);
+  opus = opus_encoder_create(samprate,channels,Application,&error);
+  assert(error == OPUS_OK && opus);
 
-  error = opus_encoder_ctl(sp->opus,OPUS_SET_DTX(Discontinuous));
+  error = opus_encoder_ctl(opus,OPUS_SET_DTX(Discontinuous));
   assert(error == OPUS_OK);
 
-  error = opus_encoder_ctl(sp->opus,OPUS_SET_BITRATE(Opus_bitrate));
+  error = opus_encoder_ctl(opus,OPUS_SET_BITRATE(Opus_bitrate));
   assert(error == OPUS_OK);
 
   if(Fec_enable){
-    error = opus_encoder_ctl(sp->opus,OPUS_SET_INBAND_FEC(1));
+    error = opus_encoder_ctl(opus,OPUS_SET_INBAND_FEC(1));
     assert(error == OPUS_OK);
-    error = opus_encoder_ctl(sp->opus,OPUS_SET_PACKET_LOSS_PERC(Fec_enable));
+    error = opus_encoder_ctl(opus,OPUS_SET_PACKET_LOSS_PERC(Fec_enable));
     assert(error == OPUS_OK);
   }
 
 #if 0 // Is this even necessary?
       // Always seems to return error -5 even when OK??
-  error = opus_encoder_ctl(sp->opus,OPUS_FRAMESIZE_ARG,Opus_blocktime);
+  error = opus_encoder_ctl(opus,OPUS_FRAMESIZE_ARG,Opus_blocktime);
   assert(1 || error == OPUS_OK);
 #endif
+  return opus;
+}
 
-  while(true){
-    struct packet *pkt = NULL;
-    {
-      struct timespec waittime;
-      clock_gettime(CLOCK_REALTIME,&waittime);
-      waittime.tv_sec += 10;      // wait 10 seconds for a new packet
-      { // Mutex-protected segment
-	pthread_mutex_lock(&sp->qmutex);
-	while(!sp->queue){      // Wait for packet to appear on queue
-	  int ret = pthread_cond_timedwait(&sp->qcond,&sp->qmutex,&waittime);
-	  assert(ret != EINVAL);
-	  if(ret == ETIMEDOUT){
-	    // Idle timeout after 10 sec; close session and terminate thread
-	    pthread_mutex_unlock(&sp->qmutex);
-	    close_session(&sp);
-	    return NULL; // exit thread
-	  }
-	}
-	pkt = sp->queue;
-	sp->queue = pkt->next;
-	pkt->next = NULL;
-	pthread_mutex_unlock(&sp->qmutex);
-      } // End of mutex protected segment
-    }
+// Keep an encoder for another session, or destroy it if we have enough
+static void put_encoder(OpusEncoder *opus,int samprate,int channels){
+  if(opus == NULL)
+    return;
+  opus_encoder_ctl(opus,OPUS_RESET_STATE);
+  pthread_mutex_lock(&Encoder_mutex);
+  if(Nspare_encoders < MAX_SPARE_ENCODERS){
+    Spare_encoders[Nspare_encoders].opus = opus;
+    Spare_encoders[Nspare_encoders].samprate = samprate;
+    Spare_encoders[Nspare_encoders].channels = channels;
+    Nspare_encoders++;
+    opus = NULL;
+  }
+  pthread_mutex_unlock(&Encoder_mutex);
+  if(opus != NULL)
+    opus_encoder_destroy(opus);
+}
 
-    sp->packets++; // Count all packets, regardless of type
-    int const frame_size = pkt->len / (sizeof(int16_t) * sp->channels); // PCM sample times
-    if(frame_size <= 0)
-      goto endloop; // garbled packet?
+// Send everything in the batch. Output socket is non-blocking, so anything it won't take is dropped
+static void flush_batch(struct batch *batch){
+  if(batch->count == 0)
+    return;
+#if defined(linux)
+  for(int i = 0; i < batch->count; i++){
+    struct msghdr * const mh = &batch->msgs[i].msg_hdr;
+    memset(mh,0,sizeof(*mh));
+    mh->msg_name = &Opus_out_socket;
+    mh->msg_namelen = sizeof(struct sockaddr);
+    mh->msg_iov = &batch->iov[i];
+    mh->msg_iovlen = 1;
+  }
+  int sent = 0;
+  while(sent < batch->count){
+    int const r = sendmmsg(Output_fd,&batch->msgs[sent],batch->count - sent,0);
+    if(r <= 0)
+      break;
+    sent += r;
+  }
+#else
+  int sent = 0;
+  for(int i = 0; i < batch->count; i++)
+    if(sendto(Output_fd,batch->iov[i].iov_base,batch->iov[i].iov_len,0,(struct sockaddr *)&Opus_out_socket,sizeof(struct sockaddr)) >= 0)
+      sent++;
+#endif
+  atomic_fetch_add_explicit(&Output_packets,sent,memory_order_relaxed); // all sessions
+  batch->count = 0;
+}
 
-    int const samples_skipped = rtp_process(&sp->rtp_state_in,&pkt->rtp,frame_size);
-    if(samples_skipped < 0)
-      goto endloop; // Old dupe
+// Encode one PCM packet's worth of audio, sending whatever Opus frames that completes
+// Called only by the thread that took the session off the ready list
+static void encode_packet(struct session *sp,struct packet *pkt,struct batch *batch){
+  sp->packets++; // Count all packets, regardless of type
+  int const frame_size = pkt->len / (sizeof(int16_t) * sp->channels); // PCM sample times
+  if(frame_size <= 0)
+    return; // garbled packet?
 
-    if(sp->type != pkt->rtp.type){ // Handle transitions both ways
-      sp->type = pkt->rtp.type;
-    }
-    if(sp->channels != channels_from_pt(pkt->rtp.type) || sp->samprate != samprate_from_pt(pkt->rtp.type)){
-      // channels or sample rate changed; Re-create encoder
-      sp->channels = channels_from_pt(pkt->rtp.type);
-      sp->samprate = samprate_from_pt(pkt->rtp.type);
-      opus_encoder_destroy(sp->opus);
-      int error = 0;
-      sp->opus = opus_encoder_create(sp->samprate,sp->channels,Application,&error);
-      assert(error == OPUS_OK && sp);
-
-      error = opus_encoder_ctl(sp->opus,OPUS_SET_DTX(Discontinuous));
-      assert(error == OPUS_OK);
-
-      error = opus_encoder_ctl(sp->opus,OPUS_SET_BITRATE(Opus_bitrate));
-      assert(error == OPUS_OK);
-
-      if(Fec_enable){
-	error = opus_encoder_ctl(sp->opus,OPUS_SET_INBAND_FEC(1));
-	assert(error == OPUS_OK);
-	error = opus_encoder_ctl(sp->opus,OPUS_SET_PACKET_LOSS_PERC(Fec_enable));
-	assert(error == OPUS_OK);
-      }
+  int const samples_skipped = rtp_process(&sp->rtp_state_in,&pkt->rtp,frame_size);
+  if(samples_skipped < 0)
+    return; // Old dupe
 
-#if 0 // Is this even necessary?
-      // Always seems to return error -5 even when OK??
-      error = opus_encoder_ctl(sp->opus,OPUS_FRAMESIZE_ARG,Opus_blocktime);
-      assert(1 || error == OPUS_OK);
-#endif
+  if(sp->type != pkt->rtp.type){ // Handle transitions both ways
+    sp->type = pkt->rtp.type;
+  }
+  if(sp->channels != channels_from_pt(pkt->rtp.type) || sp->samprate != samprate_from_pt(pkt->rtp.type)){
+    // channels or sample rate changed; swap encoder
+    put_encoder(sp->opus,sp->samprate,sp->channels);
+    sp->channels = channels_from_pt(pkt->rtp.type);
+    sp->samprate = samprate_from_pt(pkt->rtp.type);
+    sp->opus = get_encoder(sp->samprate,sp->channels);
+  }
+  if(pkt->rtp.marker || samples_skipped > 4 * 48000 * Opus_blocktime){ // Opus works on 48 kHz virtual samples
+    // reset encoder state after 4 seconds of skip or a RTP marker bit
+    opus_encoder_ctl(sp->opus,OPUS_RESET_STATE);
+    sp->silence = true;
+  }
+  int16_t const *samples = (int16_t *)pkt->data;
+
+  for(int i=0; i < frame_size;i++){
+    float left = SCALE * (int16_t)ntohs(*samples++);
+    sp->audio_buffer[sp->audio_write_index++] = left;
+    if(sp->channels == 2){
+      float right = SCALE * (int16_t)ntohs(*samples++);
+      sp->audio_buffer[sp->audio_write_index++] = right;
     }
+  }
+  // send however many opus frames we can
+  if(send_samples(sp,batch) > 0){
+    int64_t const latency = gps_time_ns() - pkt->arrival;
+    sp->latency_sum += latency;
+    if(latency > sp->latency_max)
+      sp->latency_max = latency;
+    sp->frames++;
+  }
+}
 
-    if(pkt->rtp.marker || samples_skipped > 4 * 48000 * Opus_blocktime){ // Opus works on 48 kHz virtual samples
-      // reset encoder state after 4 seconds of skip or a RTP marker bit
-      opus_encoder_ctl(sp->opus,OPUS_RESET_STATE);
-      sp->silence = true;
-    }
-    int16_t const *samples = (int16_t *)pkt->data;
-
-    for(int i=0; i < frame_size;i++){
-      float left = SCALE * (int16_t)ntohs(*samples++);
-      sp->audio_buffer[sp->audio_write_index++] = left;
-      if(sp->channels == 2){
-	float right = SCALE * (int16_t)ntohs(*samples++);
-	sp->audio_buffer[sp->audio_write_index++] = right;
+// Encoder thread. Takes a session off the ready list, encodes everything queued on it,
+// and puts it back on the end of the list if more arrived in the meantime
+void *encode(void *arg){
+  (void)arg;
+  pthread_setname("opus enc");
+
+  struct batch * const batch = calloc(1,sizeof(*batch));
+  assert(batch != NULL);
+
+  while(true){
+    struct session *sp;
+    struct packet *queue;
+    { // Mutex-protected segment
+      pthread_mutex_lock(&Ready_mutex);
+      if(Ready_head == NULL){
+	// Nothing more to do right now; send what we have before sleeping
+	pthread_mutex_unlock(&Ready_mutex);
+	flush_batch(batch);
+	pthread_mutex_lock(&Ready_mutex);
+	while(Ready_head == NULL)
+	  pthread_cond_wait(&Ready_cond,&Ready_mutex);
       }
+      sp = Ready_head;
+      Ready_head = sp->ready_next;
+      if(Ready_head == NULL)
+	Ready_tail = NULL;
+      sp->ready_next = NULL;
+      queue = sp->queue;
+      sp->queue = NULL;
+      pthread_mutex_unlock(&Ready_mutex);
+    }
+    if(sp->opus == NULL)
+      sp->opus = get_encoder(sp->samprate,sp->channels);
+
+    int64_t last_arrival = 0;
+    while(queue != NULL){
+      struct packet *pkt = queue;
+      queue = pkt->next;
+      encode_packet(sp,pkt,batch);
+      last_arrival = pkt->arrival;
+      packet_free(&pkt);
+    }
+    if(Verbose && sp->frames > 0 && last_arrival - sp->report_time >= Report_interval){
+      fprintf(stdout,"ssrc %u (%s:%s): %'lu frames, encode latency mean %.2f max %.2f ms\n",
+	      sp->rtp_state_out.ssrc,sp->addr,sp->port,sp->frames,
+	      1e-6 * sp->latency_sum / sp->frames,1e-6 * sp->latency_max);
+      sp->report_time = last_arrival;
+      sp->latency_sum = sp->latency_max = 0;
+      sp->frames = 0;
+    }
+    { // Mutex-protected segment
+      pthread_mutex_lock(&Ready_mutex);
+      if(sp->queue != NULL){
+	// More arrived while we worked; go to the back of the line
+	sp->ready_next = NULL;
+	if(Ready_tail)
+	  Ready_tail->ready_next = sp;
+	else
+	  Ready_head = sp;
+	Ready_tail = sp;
+      } else
+	sp->scheduled = false; // From here on the main thread may close it
+      pthread_mutex_unlock(&Ready_mutex);
     }
-  endloop:;
-    FREE(pkt);
-
-    // send however many opus frames we can
-    send_samples(sp);
   }
+  return NULL;
 }
 
 struct session *lookup_session(struct sockaddr const * const sender,const uint32_t ssrc){
-  struct session *sp;
-  pthread_mutex_lock(&Session_protect);
-  for(sp = Sessions; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc
-       && address_match(&sp->sender,sender)){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Sessions;
-	Sessions->prev = sp;
-	Sessions = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Session_protect);
-  return sp;
+  struct session_entry const * const entry = session_lookup(&Sessions,sender,ssrc);
+  return entry != NULL ? entry->owner : NULL;
 }
 // Create a new session, partly initialize
-struct session *create_session(void){
+struct session *create_session(struct sockaddr const * const sender,uint32_t const ssrc){
 
   struct session * const sp = calloc(1,sizeof(*sp));
   assert(sp != NULL); // Shouldn't happen on modern machines!
 
-  // Initialize entry
-  pthread_mutex_init(&sp->qmutex,NULL);
-  pthread_cond_init(&sp->qcond,NULL);
-
-  // Put at head of list
-  pthread_mutex_lock(&Session_protect);
-  sp->prev = NULL;
-  sp->next = Sessions;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Sessions = sp;
-  pthread_mutex_unlock(&Session_protect);
+  session_insert(&Sessions,&sp->entry,sender,ssrc,sp,gps_time_ns());
   return sp;
 }
 
@@ -561,53 +683,32 @@ int close_session(struct session ** p){
   if(sp == NULL)
     return -1;
 
-  if(sp->opus != NULL){
-    opus_encoder_destroy(sp->opus);
-    sp->opus = NULL;
-  }
+  put_encoder(sp->opus,sp->samprate,sp->channels);
+  sp->opus = NULL;
 
-  // packet queue should be empty, but just in case
-  pthread_mutex_lock(&sp->qmutex);
+  // packet queue should be empty (we don't close scheduled sessions), but just in case
   while(sp->queue){
     struct packet *pkt = sp->queue->next;
-    FREE(sp->queue);
+    packet_free(&sp->queue);
     sp->queue = pkt;
   }
-  pthread_mutex_unlock(&sp->qmutex);
-  pthread_mutex_destroy(&sp->qmutex);
-
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Session_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  pthread_mutex_unlock(&Session_protect);
+  // Remove from table of sessions
+  session_remove(&Sessions,&sp->entry);
   FREE(sp);
   *p = NULL;
   return 0;
 }
 void closedown(int s){
-#if 0
-  // Causes deadlock when we get called from a section where Session_protect is already locked
-  // Which is the usual case
-  // Not really necessary anyway, since we're exiting
-  pthread_mutex_lock(&Session_protect);
-  while(Sessions != NULL)
-    close_session(Sessions);
-  pthread_mutex_unlock(&Session_protect);
-#endif
-
-  pthread_mutex_destroy(&Session_protect);
+  (void)s;
+  // Not really necessary to close sessions, since we're exiting, and encoder threads may be using them
   exit(EX_OK);
 }
-// Encode and send one or more Opus frames when we have enough
-int send_samples(struct session * const sp){
-  assert(sp != NULL);
+// Encode one or more Opus frames when we have enough, queue them on the batch for sending
+// Returns the number of frames encoded
+int send_samples(struct session * const sp,struct batch * const batch){
+  assert(sp != NULL && batch != NULL);
 
-  int pcm_samples_written = 0;
+  int frames = 0;
   while(true){
     float const ms_in_buffer = 1000.0 * sp->audio_write_index / (sp->channels * sp->samprate);
     if(ms_in_buffer < Opus_blocktime)
@@ -652,7 +753,9 @@ int send_samples(struct session * const sp){
     } else
       rtp.marker = false;
 
-    uint8_t output_buffer[PKTSIZE]; // to hold RTP header + Opus-encoded frame
+    if(batch->count == BATCH)
+      flush_batch(batch);
+    uint8_t * const output_buffer = batch->buffers[batch->count]; // to hold RTP header + Opus-encoded frame
     uint8_t * const opus_write_pointer = hton_rtp(output_buffer,&rtp);
     int packet_bytes_written = opus_write_pointer - output_buffer;
 
@@ -660,14 +763,17 @@ int send_samples(struct session * const sp){
 						    sp->audio_buffer,
 						    frame_size,  // Number of uncompressed *stereo* samples per frame
 						    opus_write_pointer,
-						    sizeof(output_buffer) - packet_bytes_written); // Max # bytes in compressed output buffer
+						    PKTSIZE - packet_bytes_written); // Max # bytes in compressed output buffer
+    if(opus_output_bytes < 0)
+      return -1;
     packet_bytes_written += opus_output_bytes;
+    frames++;
 
     if(!Discontinuous || opus_output_bytes > 2){
-      // ship it
-      if(sendto(Output_fd,output_buffer,packet_bytes_written,0,(struct sockaddr *)&Opus_out_socket,sizeof(struct sockaddr)) < 0)
-	return -1;
-      Output_packets++; // all sessions
+      // ship it with the next batch
+      batch->iov[batch->count].iov_base = output_buffer;
+      batch->iov[batch->count].iov_len = packet_bytes_written;
+      batch->count++;
       sp->rtp_state_out.seq++; // Increment only if packet is sent
       sp->rtp_state_out.bytes += opus_output_bytes;
       sp->rtp_state_out.packets++;
@@ -679,7 +785,6 @@ int send_samples(struct session * const sp){
     assert(remaining_bytes >= 0);
     memmove(sp->audio_buffer,&sp->audio_buffer[sp->channels * frame_size],remaining_bytes);
     sp->audio_write_index -= frame_size * sp->channels;
-    pcm_samples_written += frame_size * sp->channels;
   }
-  return pcm_samples_written;
+  return frames;
 }
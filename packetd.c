@@ -1,5 +1,8 @@
 // AFSK/FM packet demodulator
 // Reads RTP PCM audio stream, emits decoded frames in multicast RTP
+// The input thread drops each stream's samples into an in-memory ring of blocks;
+// a fixed pool of decoder threads takes sessions with complete blocks from a ready list,
+// so hundreds of channels don't need hundreds of threads and pipes
 // Copyright 2018, Phil Karn, KA9Q
 
 #define _GNU_SOURCE 1
@@ -15,6 +18,8 @@
 #include <netdb.h>
 #include <getopt.h>
 #include <sysexits.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "osc.h"
 #include "filter.h"
@@ -23,41 +28,99 @@
 #include "ax25.h"
 #include "status.h"
 #include "avahi.h"
+#include "sessions.h"
 
 struct hdlc {
-  uint8_t frame[16384];
+  uint8_t frame[2048];     // Far more than any AX.25 frame
   int frame_bits;
   int flag_seen;
   int last_bits;
 };
 static int hdlc_process(struct hdlc *hp,int bit);
 
+// The demodulator runs several hypotheses side by side over the same filtered audio:
+// every combination of starting bit timing and twist (relative weight of the space tone)
+// gets its own clock recovery loop and HDLC deframer. Weak or distorted frames are often
+// recovered by one and not the others. Identical frames are suppressed by FCS.
+#define MAX_TIMINGS 4
+#define MAX_TWISTS 3
+#define MAX_HYPOTHESES (MAX_TIMINGS * MAX_TWISTS)
+#define RECENT_FRAMES 16
+
+struct hypothesis {
+  int next;               // Sample index in current block where the current bit ends
+  float last_val;         // Last on-time symbol
+  struct hdlc hdlc;
+  unsigned long frames;   // Valid frames, including those also found by others
+  unsigned long only;     // Frames nobody else found
+};
+
+// Recently decoded frame, to recognize the same one from another hypothesis
+struct recent_frame {
+  int bytes;
+  uint16_t fcs;
+  int64_t when;           // Sample count when decoded
+  unsigned int who;       // Bit mask of hypotheses that found it, 0 = slot free
+};
+
 // Needs to be redone with common RTP receiver module
 struct session {
-  struct session *next; 
+  struct session_entry entry; // In Sessions table, keyed on sender and SSRC
   
   struct rtp_state rtp_state_in;
   struct rtp_state rtp_state_out;
   int samprate;
-  int write_fd,read_fd;
 
-  pthread_t decode_thread;
+  // Ring of sample blocks, filled by the input thread and drained by whichever decoder has the session
+  int16_t *ring;                  // RING_BLOCKS * AL samples, network byte order
+  int wfill;                      // Samples in block being filled; input thread only
+  _Atomic unsigned int head;      // Blocks completed
+  _Atomic unsigned int tail;      // Blocks demodulated
+  unsigned long overruns;         // Blocks dropped because the decoders fell behind
+
+  // Protected by Ready_mutex
+  bool scheduled;                 // On the ready list or being decoded; only one thread at a time
+  struct session *ready_next;
+
+  // Demodulator state, used only by the decoder that has the session
+  bool demod_ready;
+  struct filter_in filter_in;
+  struct filter_out filter_out;
+  struct osc mark;
+  struct osc space;
+  int samppbit;
+  int history;                    // Products kept from the previous block
+  float complex *mark_prod;       // history + AL each
+  float complex *space_prod;
+  float complex *mark_sum;        // history + AL + 1 each
+  float complex *space_sum;
+
   unsigned int decoded_packets;
-  struct hdlc hdlc;
+  unsigned long dupes;            // Frames suppressed because another hypothesis got them first
+  struct hypothesis hyp[MAX_HYPOTHESES];
+  struct recent_frame recent[RECENT_FRAMES];
+  int64_t samples;                // Total processed
+  int64_t last_report;            // Sample count of last statistics report
+  int64_t cpu_time;               // Demodulator thread CPU, ns
 };
 
 // Config constants
 #define MAX_MCAST 20          // Maximum number of multicast addresses
 static float const SCALE = 1./32768;
-static int const AL = 960; // 20 ms @ 48 kHz = 1x 20 ms blocks = 24 bit times @ 1200 bps
-static int const AM = 961;
+#define AL 960 // 20 ms @ 48 kHz = 1x 20 ms blocks = 24 bit times @ 1200 bps
+#define AM 961
 static float Bitrate = 1200;
+static int Timings = 3;       // Starting bit phases, 1...MAX_TIMINGS
+static int Twists = 3;        // Entries used from Twist_table, 1...MAX_TWISTS
+static int const Report_interval = 600; // Seconds of audio between statistics reports when verbose
+#define RING_BLOCKS 16        // Per-session input ring; 320 ms at 48 kHz, 1.28 s at 12 kHz
 
 // Command line params
 const char *App_path;
 int Verbose;
 int IP_tos = 0;
 int Mcast_ttl = 10;           // Very low intensity output
+static int Decoders;          // Decoder threads, default number of CPUs
 
 // Global variables
 static int Nfds;          // Number of PCM streams
@@ -71,20 +134,25 @@ static int Status_fd = -1;
 #if 0
 static int Status_out_fd = -1; // Not used yet
 #endif
-static struct session *Session;
+static struct session_table Sessions;
 static pthread_mutex_t Output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t Ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Ready_cond = PTHREAD_COND_INITIALIZER;
+static struct session *Ready_head;    // Sessions with blocks to demodulate
+static struct session *Ready_tail;
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
 struct sockaddr_storage Local_status_source_address;
 struct sockaddr_storage PCM_dest_address; // From incoming status messages (max 1)
 
-static struct session *lookup_session(const uint32_t ssrc);
-static struct session *create_session(uint32_t ssrc);
+static struct session *lookup_session(struct sockaddr const *sender,uint32_t ssrc);
+static struct session *create_session(struct sockaddr const *sender,uint32_t ssrc);
 #if 0
 static int close_session(struct session *sp);
 #endif
 static void *input(void *arg);
 static void *decode_task(void *arg);
+static void put_samples(struct session *sp,int16_t const *samples,int count);
 static void printtime(FILE *fp);
 
 static struct option Options[] =
@@ -96,6 +164,9 @@ static struct option Options[] =
    {"status-in", required_argument, NULL, 'S'},
    {"ttl", required_argument, NULL, 'T'},
    {"verbose", no_argument, NULL, 'v'},
+   {"threads", required_argument, NULL, 'j'},
+   {"timings", required_argument, NULL, 't'},
+   {"twists", required_argument, NULL, 'w'},
 #if 0
    {"samprate",required_argument,NULL,'r'},
    {"samplerate",required_argument,NULL,'r'},
@@ -107,7 +178,7 @@ static struct option Options[] =
    {NULL, 0, NULL, 0},
   };
 
-static char const Optstring[] = "A:I:N:R:S:T:vp:V";
+static char const Optstring[] = "A:I:j:N:R:S:T:t:vw:p:V";
 char const *Name;
 char const *Output;
 char const *Input[MAX_MCAST];
@@ -188,16 +259,37 @@ int main(int argc,char *argv[]){
       Verbose++;
       break;
       break;
+    case 'j':
+      Decoders = strtol(optarg,NULL,0);
+      break;
+    case 't':
+      Timings = strtol(optarg,NULL,0);
+      if(Timings < 1 || Timings > MAX_TIMINGS){
+	fprintf(stdout,"--timings must be 1-%d\n",MAX_TIMINGS);
+	exit(EX_USAGE);
+      }
+      break;
+    case 'w':
+      Twists = strtol(optarg,NULL,0);
+      if(Twists < 1 || Twists > MAX_TWISTS){
+	fprintf(stdout,"--twists must be 1-%d\n",MAX_TWISTS);
+	exit(EX_USAGE);
+      }
+      break;
     case 'V':
       VERSION();
       exit(EX_OK);
     default:
-      fprintf(stdout,"Usage: %s [-V|--version] [--verbose|-v] [--ttl|-T mcast_ttl] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",App_path);
+      fprintf(stdout,"Usage: %s [-V|--version] [--verbose|-v] [--ttl|-T mcast_ttl] [--threads|-j threads] [--timings|-t 1-%d] [--twists|-w 1-%d] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",App_path,MAX_TIMINGS,MAX_TWISTS);
       exit(EX_USAGE);
     }
   }
   if(Name == NULL)
     Name = App_path; // Give it a default
+  if(Decoders <= 0){
+    long const ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    Decoders = ncpu > 0 ? ncpu : 1;
+  }
 
 
   // Also accept groups without -I option
@@ -241,6 +333,15 @@ int main(int argc,char *argv[]){
     exit(EX_USAGE);
   }
 
+  session_table_init(&Sessions,0,BILLION,gps_time_ns()); // Sessions never close (yet)
+  for(int i = 0; i < Decoders; i++){
+    pthread_t thread;
+    if(pthread_create(&thread,NULL,decode_task,NULL) != 0){
+      perror("pthread_create");
+      exit(EX_OSERR);
+    }
+    pthread_detach(thread);
+  }
   if(Nfds > 0)
     pthread_create(&Input_thread,NULL,input,NULL);
 
@@ -371,10 +472,10 @@ static void *input(void *arg){
       if(channels_from_pt(rtp_hdr.type) != 1)
 	continue; // Only mono PCM for now
       
-      struct session *sp = lookup_session(rtp_hdr.ssrc);
+      struct session *sp = lookup_session(&sender,rtp_hdr.ssrc);
       if(sp == NULL){
 	// Not found
-	if((sp = create_session(rtp_hdr.ssrc)) == NULL){
+	if((sp = create_session(&sender,rtp_hdr.ssrc)) == NULL){
 	  printtime(stdout);
 	  fprintf(stdout," No room for new session ssrc %u\n",rtp_hdr.ssrc);
 	  fflush(stdout);
@@ -383,15 +484,6 @@ static void *input(void *arg){
 	sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = rtp_hdr.ssrc;
 	// Extract sample rate (what it if later changes??)
 	sp->samprate = samprate_from_pt(rtp_hdr.type);
-	int fildes[2];
-	if(pipe(fildes) != 0){
-	  if(Verbose)
-	    perror("pipe() failed");
-	  continue;
-	}
-	sp->read_fd = fildes[0]; sp->write_fd = fildes[1];
-
-	pthread_create(&sp->decode_thread,NULL,decode_task,sp); // One decode thread per stream
 	if(Verbose){
 	  printtime(stdout);
 	  fprintf(stdout," New session from %s, ssrc %u\n",formatsock(&sender),sp->rtp_state_in.ssrc);
@@ -414,13 +506,9 @@ static void *input(void *arg){
 	// Don't worry too much about skipped samples right now
 	// There's no FEC, and enough are probably dropped that sync wouldn't be maintained anyway
 	int max_skip = min(skipped_samples,1920); // Pad only a short interruption, max
-	int16_t zeroes[max_skip];
-	memset(zeroes,0,sizeof(zeroes));
-	if(write(sp->write_fd,zeroes,sizeof(zeroes)) != sizeof(zeroes))
-	  perror("write zeroes");
+	put_samples(sp,NULL,max_skip);
       }
-      if(write(sp->write_fd,dp,sample_count * sizeof(int16_t)) != sample_count * sizeof(int16_t))
-	perror("write samples");
+      put_samples(sp,(int16_t const *)dp,sample_count);
     }
   }
   return NULL; // Never gets here
@@ -429,28 +517,24 @@ static void *input(void *arg){
 
 
 // Find existing session in table, if it exists
-static struct session *lookup_session(const uint32_t ssrc){
-  struct session *sp;
-  for(sp = Session; sp != NULL; sp = sp->next){
-    if(sp->rtp_state_in.ssrc == ssrc)
-      // Found it
-      return sp;
-  }
-  return NULL;
+static struct session *lookup_session(struct sockaddr const *sender,const uint32_t ssrc){
+  struct session_entry const * const entry = session_lookup(&Sessions,sender,ssrc);
+  return entry != NULL ? entry->owner : NULL;
 }
 
 // Create a new session, partly initialize
-static struct session *create_session(uint32_t ssrc){
+static struct session *create_session(struct sockaddr const *sender,uint32_t ssrc){
   struct session *sp;
 
   if((sp = calloc(1,sizeof(*sp))) == NULL)
     return NULL; // Shouldn't happen on modern machines!
+  if((sp->ring = malloc(RING_BLOCKS * AL * sizeof(*sp->ring))) == NULL){
+    FREE(sp);
+    return NULL;
+  }
   
   sp->rtp_state_in.ssrc = ssrc;
-
-  // Put at head of bucket chain
-  sp->next = Session;
-  Session = sp;
+  session_insert(&Sessions,&sp->entry,sender,ssrc,sp,gps_time_ns());
   return sp;
 }
 
@@ -460,19 +544,7 @@ static int close_session(struct session *sp){
   if(sp == NULL)
     return -1;
   
-  // Remove from linked list
-  struct session *se,*se_prev = NULL;
-  for(se = Session; se && se != sp; se_prev = se,se = se->next)
-    ;
-  if(!se)
-    return -1;
-  
-  if(se == sp){
-    if(se_prev)
-      se_prev->next = sp->next;
-    else
-      Session = se_prev;
-  }
+  session_remove(&Sessions,&sp->entry);
   return 0;
 }
 #endif
@@ -480,152 +552,339 @@ static int close_session(struct session *sp){
 const float mark_tone = 1200;
 const float space_tone = 2200;
 
-// AFSK demod
-static void *decode_task(void *arg){
-  float const twist = mark_tone/space_tone; // Scale back upper tone from FM demod
+// Twist hypotheses: space tone scaled back as for pre-emphasized audio without de-emphasis (the original single value),
+// flat audio, and space tone scaled up as for audio de-emphasized without pre-emphasis
+// Read by every decoder thread, so it's constant; the tone ratios are spelled out for the initializer
+static float const Twist_table[MAX_TWISTS] = {
+  1200./2200., // mark_tone/space_tone: scale back upper tone from FM demod
+  1.0,
+  2200./1200., // space_tone/mark_tone
+};
 
-  pthread_setname("afsk");
-  struct session *sp = (struct session *)arg;
-  assert(sp != NULL);
+static void send_frame(struct session *sp,uint8_t const *frame,int bytes);
+static void frame_found(struct session *sp,int h,int bytes);
+static void age_frames(struct session *sp,bool all);
+static void report_stats(struct session *sp);
 
-  struct filter_in filter_in;
-  create_filter_input(&filter_in,AL,AM,REAL);
-  struct filter_out filter_out;
-  create_filter_output(&filter_out,&filter_in,NULL,AL,COMPLEX);
+// Set up filter, oscillators and hypotheses. Done by the first decoder to get the session,
+// so building filter plans doesn't hold up the input thread
+static int demod_init(struct session *sp){
+  if(create_filter_input(&sp->filter_in,AL,AM,REAL) == NULL)
+    return -1;
+  if(create_filter_output(&sp->filter_out,&sp->filter_in,NULL,AL,COMPLEX) == NULL){
+    delete_filter_input(&sp->filter_in);
+    return -1;
+  }
   const float filter_low = min(mark_tone,space_tone) - Bitrate/4;
   const float filter_high = max(mark_tone,space_tone) + Bitrate/4;
-  set_filter(&filter_out,filter_low/sp->samprate,filter_high/sp->samprate,3.0); // Creates analytic, band-limited signal
+  set_filter(&sp->filter_out,filter_low/sp->samprate,filter_high/sp->samprate,3.0); // Creates analytic, band-limited signal
 
   // Tone replica generators (-1200 and -2200 Hz)
-  struct osc mark;
-  memset(&mark,0,sizeof(mark));
-  set_osc(&mark,-mark_tone/sp->samprate, 0.0);
-  
-  struct osc space;
-  memset(&space,0,sizeof(space));
-  set_osc(&space,-space_tone/sp->samprate, 0.0);  
-    
-  int samppbit = sp->samprate / Bitrate;
-
-  // Tone integrators
-  int symphase = 0;
-  float complex mark_accum = 0; // On-time
-  float complex space_accum = 0;
-  float complex mark_offset_accum = 0; // Straddles previous zero crossing
-  float complex space_offset_accum = 0;
-  float last_val = 0;  // Last on-time symbol
-  float mid_val = 0;   // Last zero crossing symbol
-
-  FILE *fp = fdopen(sp->read_fd,"r");
-  if(fp == NULL){
-    perror("fdopen");
-    return NULL;
+  memset(&sp->mark,0,sizeof(sp->mark));
+  set_osc(&sp->mark,-mark_tone/sp->samprate, 0.0);
+  memset(&sp->space,0,sizeof(sp->space));
+  set_osc(&sp->space,-space_tone/sp->samprate, 0.0);
+
+  sp->samppbit = sp->samprate / Bitrate;
+  // Mark and space products for each block are preceded by enough of the last one for the
+  // longest window lookback (1.5 bits). Running sums over them give any bit window in O(1),
+  // so each extra hypothesis costs a few operations per bit rather than per sample
+  sp->history = 2 * sp->samppbit;
+  sp->mark_prod = calloc(sp->history + AL,sizeof(*sp->mark_prod));
+  sp->space_prod = calloc(sp->history + AL,sizeof(*sp->space_prod));
+  sp->mark_sum = calloc(sp->history + AL + 1,sizeof(*sp->mark_sum));
+  sp->space_sum = calloc(sp->history + AL + 1,sizeof(*sp->space_sum));
+  if(sp->mark_prod == NULL || sp->space_prod == NULL || sp->mark_sum == NULL || sp->space_sum == NULL){
+    // Undo everything so the retry on the next block starts clean instead of leaking
+    FREE(sp->mark_prod);
+    FREE(sp->space_prod);
+    FREE(sp->mark_sum);
+    FREE(sp->space_sum);
+    delete_filter_output(&sp->filter_out);
+    delete_filter_input(&sp->filter_in);
+    return -1;
   }
 
-  int pad = 0;
+  for(int h = 0; h < Timings * Twists; h++){
+    int const timing = h / Twists;
+    sp->hyp[h].next = sp->samppbit + timing * sp->samppbit / Timings;
+  }
+  sp->demod_ready = true;
+  return 0;
+}
 
-  while(true){
-    int16_t samples[AL];
-
-    if(pad > 0){
-      pad--;
-      memset(samples,0,sizeof(samples));
-    } else {
-      if(fread(samples,sizeof(samples[0]),AL,fp) != AL){
-	fprintf(stderr,"pipe read error, exiting thread\n");
-	fclose(fp);
- 	break;
-      }
-      // Look for 100 zeroes at end of frame to indicate squelch closing
-      int nonzero = 0;
-      for(int i=AL-100; i < AL; i++)
-	nonzero |= samples[i];
-      if(!nonzero)
-	pad = 5; // flush filters with 5 blocks of padding
+// Run one block of AL samples (network byte order) through all hypotheses
+static void demod_block(struct session *sp,int16_t const *samples){
+  struct timespec start;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&start);
+
+  int const samppbit = sp->samppbit;
+  int const history = sp->history;
+  int const nhyp = Timings * Twists;
+  struct filter_in * const filter_in = &sp->filter_in;
+  struct filter_out * const filter_out = &sp->filter_out;
+  float complex * const mark_prod = sp->mark_prod;
+  float complex * const space_prod = sp->space_prod;
+  float complex * const mark_sum = sp->mark_sum;
+  float complex * const space_sum = sp->space_sum;
+
+  assert(filter_in->ilen == AL);
+  assert(filter_out->olen == AL);
+  for(int n=0; n < AL; n++){
+    if(put_rfilter(filter_in,(int16_t)ntohs(samples[n]) * SCALE) == 0)
+      continue;
+    execute_filter_output(filter_out,0);    // Shouldn't block
+    int const olen = filter_out->olen;
+
+    // Spin down by mark and space frequencies, once for all hypotheses
+    memmove(mark_prod,&mark_prod[olen],history * sizeof(mark_prod[0]));
+    memmove(space_prod,&space_prod[olen],history * sizeof(space_prod[0]));
+    for(int i=0; i < olen; i++){
+      mark_prod[history + i] = step_osc(&sp->mark);
+      space_prod[history + i] = step_osc(&sp->space);
     }
-
-    assert(filter_in.ilen == AL);
-    assert(filter_out.olen == AL);
-    for(int n=0; n < AL; n++){
-      if(put_rfilter(&filter_in,ntohs(samples[n]) * SCALE) == 0)
-	continue;
-      execute_filter_output(&filter_out,0);    // Shouldn't block
-      for(int n=0; n<filter_out.olen; n++){
-	// Spin down by mark and space frequencies, accumulate each in boxcar (comb) filters
-	// Mark and space each have in-phase and offset integrators for timing recovery
-	float complex s;
-	s = filter_out.output.c[n] * step_osc(&mark);
-	mark_accum += s;
-	mark_offset_accum += s;
-	
-	s = filter_out.output.c[n] * step_osc(&space);
-	space_accum += s;
-	space_offset_accum += s;
-	
-	if(++symphase == samppbit/2){
-	  // Finish offset integrator and reset
-	  mid_val = cnrmf(mark_offset_accum) - twist * cnrmf(space_offset_accum);
-	  mark_offset_accum = space_offset_accum = 0;
-	}
-	if(symphase < samppbit)
-	  continue;
-	
-	// Finished whole bit
-	float const cur_val = cnrmf(mark_accum) - twist * cnrmf(space_accum);
-	mark_accum = space_accum = 0;
-	
-	if(cur_val * last_val >= 0){ // cur_val and last_val have same sign; no transition
+    for(int i=0; i < olen; i++){ // Vectorizes
+      mark_prod[history + i] *= filter_out->output.c[i];
+      space_prod[history + i] *= filter_out->output.c[i];
+    }
+    mark_sum[0] = space_sum[0] = 0;
+    for(int i=0; i < history + olen; i++){
+      mark_sum[i+1] = mark_sum[i] + mark_prod[i];
+      space_sum[i+1] = space_sum[i] + space_prod[i];
+    }
+    // Energies in the window of samples [t-samppbit,t) relative to block start
+#define MARK(t) cnrmf(mark_sum[history + (t)] - mark_sum[history + (t) - samppbit])
+#define SPACE(t) cnrmf(space_sum[history + (t)] - space_sum[history + (t) - samppbit])
+
+    for(int h = 0; h < nhyp; h++){
+      struct hypothesis * const hp = &sp->hyp[h];
+      float const twist = Twist_table[h % Twists];
+      while(hp->next <= olen){
+	int const t = hp->next;
+	// On-time integrator, and offset integrator that straddles the previous zero crossing
+	float const cur_val = MARK(t) - twist * SPACE(t);
+	float const mid_val = MARK(t - samppbit/2) - twist * SPACE(t - samppbit/2);
+
+	if(cur_val * hp->last_val >= 0){ // cur_val and last_val have same sign; no transition
 	  // No transition == NRZI one
-	  symphase = 0;
-	  hdlc_process(&sp->hdlc,1); // Frame can't end with 1-bit, so don't check return
+	  hp->next = t + samppbit;
+	  hdlc_process(&hp->hdlc,1); // Frame can't end with 1-bit, so don't check return
 	} else {	// transition occurred --> NRZI zero
-	  symphase = ((cur_val - last_val) * mid_val) > 0 ? +1 : -1;	// Gardner-style clock adjust
-	  int const bytes = hdlc_process(&sp->hdlc,0);
-	  if(Verbose && bytes < 0){
+	  int const symphase = ((cur_val - hp->last_val) * mid_val) > 0 ? +1 : -1;	// Gardner-style clock adjust
+	  hp->next = t + samppbit - symphase;
+	  int const bytes = hdlc_process(&hp->hdlc,0);
+	  if(Verbose && bytes < 0 && h == 0){
 	    // Lock output to prevent intermingled output
 	    pthread_mutex_lock(&Output_mutex);
 	    printtime(stdout);
 	    fprintf(stdout," ssrc %u CRC fail\n",sp->rtp_state_in.ssrc);
 	    fflush(stdout);
 	    pthread_mutex_unlock(&Output_mutex);
-	  } else if(bytes > 0){ // Valid frame
-	    if(Verbose){
-	      pthread_mutex_lock(&Output_mutex);
-	      printtime(stdout);
-	      fprintf(stdout," ssrc %u packet %d len %d:\n",sp->rtp_state_in.ssrc,sp->decoded_packets++,bytes);
-	      dump_frame(stdout,sp->hdlc.frame,bytes);
-	      fflush(stdout);
-	      pthread_mutex_unlock(&Output_mutex);
-	    } // Verbose
-	    struct rtp_header rtp_hdr;
-	    memset(&rtp_hdr,0,sizeof(rtp_hdr));
-	    rtp_hdr.version = 2;
-	    rtp_hdr.type = AX25_pt;
-	    rtp_hdr.seq = sp->rtp_state_out.seq++;
-	    // RTP timestamp??
-	    rtp_hdr.timestamp = sp->rtp_state_out.timestamp;
-	    sp->rtp_state_out.timestamp += bytes;
-	    rtp_hdr.ssrc = sp->rtp_state_out.ssrc;
-	    
-	    int const plen = bytes + 76 + 10; // Max RTP header is 76 bytes; allow a little slack
-	    uint8_t packet[plen],*dp;
-	    dp = packet;
-	    dp = hton_rtp(dp,&rtp_hdr);
-	    memcpy(dp,sp->hdlc.frame,bytes);
-	    sp->hdlc.frame_bits = 0;
-	    dp += bytes;
-	    send(Output_fd,packet,dp - packet,0); // Check return code?
-	    sp->rtp_state_out.packets++;
-	    sp->rtp_state_out.bytes += bytes;
-	  } // if(bytes > 0
+	  } else if(bytes > 0) // Valid frame
+	    frame_found(sp,h,bytes);
 	}
-	last_val = cur_val;
+	hp->last_val = cur_val;
       }
+      hp->next -= olen;
+    }
+#undef MARK
+#undef SPACE
+    sp->samples += olen;
+  }
+  struct timespec stop;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&stop);
+  sp->cpu_time += (stop.tv_sec - start.tv_sec) * BILLION + stop.tv_nsec - start.tv_nsec;
+  age_frames(sp,false);
+  if(Verbose && sp->samples - sp->last_report >= (int64_t)Report_interval * sp->samprate){
+    sp->last_report = sp->samples;
+    report_stats(sp);
+  }
+}
+
+// Called by the input thread: append samples (or zeroes if samples == NULL) to the session's ring
+// and hand each completed block to the decoder pool
+static void put_samples(struct session *sp,int16_t const *samples,int count){
+  while(count > 0){
+    unsigned int const head = atomic_load_explicit(&sp->head,memory_order_relaxed); // We're the only writer
+    if(sp->wfill == 0 && head - atomic_load(&sp->tail) >= RING_BLOCKS){
+      sp->overruns++; // Decoders have fallen behind; drop the rest of this packet
+      return;
+    }
+    int16_t * const block = &sp->ring[(head % RING_BLOCKS) * AL];
+    int const n = min(count,AL - sp->wfill);
+    if(samples != NULL){
+      memcpy(&block[sp->wfill],samples,n * sizeof(*samples));
+      samples += n;
+    } else
+      memset(&block[sp->wfill],0,n * sizeof(*block));
+    sp->wfill += n;
+    count -= n;
+    if(sp->wfill < AL)
+      continue;
+
+    sp->wfill = 0;
+    atomic_store(&sp->head,head + 1);
+    pthread_mutex_lock(&Ready_mutex);
+    if(!sp->scheduled){
+      sp->scheduled = true;
+      sp->ready_next = NULL;
+      if(Ready_tail)
+	Ready_tail->ready_next = sp;
+      else
+	Ready_head = sp;
+      Ready_tail = sp;
+      pthread_cond_signal(&Ready_cond);
+    }
+    pthread_mutex_unlock(&Ready_mutex);
+  }
+}
+
+// AFSK demod
+// Decoder pool thread: take a session off the ready list, demodulate all its complete blocks
+static void *decode_task(void *arg){
+  (void)arg;
+  pthread_setname("afsk");
+  static int16_t const Zeroes[AL];
+
+  while(true){
+    struct session *sp;
+    { // Mutex-protected segment
+      pthread_mutex_lock(&Ready_mutex);
+      while(Ready_head == NULL)
+	pthread_cond_wait(&Ready_cond,&Ready_mutex);
+      sp = Ready_head;
+      Ready_head = sp->ready_next;
+      if(Ready_head == NULL)
+	Ready_tail = NULL;
+      sp->ready_next = NULL;
+      pthread_mutex_unlock(&Ready_mutex);
+    }
+    if(!sp->demod_ready && demod_init(sp) != 0){
+      fprintf(stdout,"ssrc %u: demodulator setup failed\n",sp->rtp_state_in.ssrc);
+      atomic_store(&sp->tail,atomic_load(&sp->head)); // Discard; it'll be tried again on the next block
+    }
+    unsigned int tail;
+    while(sp->demod_ready && (tail = atomic_load(&sp->tail)) != atomic_load(&sp->head)){
+      int16_t const * const samples = &sp->ring[(tail % RING_BLOCKS) * AL];
+      demod_block(sp,samples);
+      // Look for 100 zeroes at end of block to indicate squelch closing
+      int nonzero = 0;
+      for(int i=AL-100; i < AL; i++)
+	nonzero |= samples[i];
+      atomic_store(&sp->tail,tail + 1); // Input thread may now reuse it
+      if(!nonzero){
+	for(int i=0; i < 5; i++)
+	  demod_block(sp,Zeroes); // flush filters with 5 blocks of padding
+      }
+    }
+    { // Mutex-protected segment
+      pthread_mutex_lock(&Ready_mutex);
+      if(atomic_load(&sp->tail) != atomic_load(&sp->head)){
+	// More arrived while we worked; go to the back of the line
+	sp->ready_next = NULL;
+	if(Ready_tail)
+	  Ready_tail->ready_next = sp;
+	else
+	  Ready_head = sp;
+	Ready_tail = sp;
+      } else
+	sp->scheduled = false;
+      pthread_mutex_unlock(&Ready_mutex);
     }
   }
   return NULL;
 }
 
+// Hypothesis h has a valid frame in its deframer; emit it unless another one already did
+static void frame_found(struct session *sp,int h,int bytes){
+  struct hypothesis * const hp = &sp->hyp[h];
+  uint8_t * const frame = hp->hdlc.frame;
+  uint16_t const fcs = frame[bytes-2] | frame[bytes-1] << 8;
+  hp->frames++;
+  hp->hdlc.frame_bits = 0;
+
+  struct recent_frame *free_slot = NULL;
+  for(int i=0; i < RECENT_FRAMES; i++){
+    struct recent_frame * const rp = &sp->recent[i];
+    if(rp->who == 0){
+      if(free_slot == NULL)
+	free_slot = rp;
+      continue;
+    }
+    if(rp->bytes == bytes && rp->fcs == fcs){
+      rp->who |= 1 << h;
+      sp->dupes++;
+      return;
+    }
+  }
+  if(free_slot == NULL){
+    age_frames(sp,true); // Unlikely; make room
+    free_slot = &sp->recent[0];
+  }
+  free_slot->bytes = bytes;
+  free_slot->fcs = fcs;
+  free_slot->when = sp->samples;
+  free_slot->who = 1 << h;
+
+  if(Verbose){
+    pthread_mutex_lock(&Output_mutex);
+    printtime(stdout);
+    fprintf(stdout," ssrc %u packet %d len %d timing %d twist %.2f:\n",sp->rtp_state_in.ssrc,sp->decoded_packets++,bytes,
+	    h / Twists,Twist_table[h % Twists]);
+    dump_frame(stdout,frame,bytes);
+    fflush(stdout);
+    pthread_mutex_unlock(&Output_mutex);
+  } // Verbose
+  send_frame(sp,frame,bytes);
+}
+
+// Retire recent frames old enough that no other hypothesis will still find them (1 sec),
+// or all of them, crediting any hypothesis that found one alone
+static void age_frames(struct session *sp,bool all){
+  for(int i=0; i < RECENT_FRAMES; i++){
+    struct recent_frame * const rp = &sp->recent[i];
+    if(rp->who == 0 || (!all && sp->samples - rp->when < sp->samprate))
+      continue;
+    if((rp->who & (rp->who - 1)) == 0) // Only one bit set
+      sp->hyp[__builtin_ctz(rp->who)].only++;
+    rp->who = 0;
+  }
+}
+
+static void report_stats(struct session *sp){
+  pthread_mutex_lock(&Output_mutex);
+  printtime(stdout);
+  fprintf(stdout," ssrc %u: %u frames, %lu duplicates suppressed, %lu input overruns, demod CPU %.2f%% of real time\n",
+	  sp->rtp_state_in.ssrc,sp->decoded_packets,sp->dupes,sp->overruns,
+	  sp->samples > 0 ? 100. * sp->cpu_time * sp->samprate / ((double)sp->samples * BILLION) : 0.);
+  for(int h = 0; h < Timings * Twists; h++)
+    fprintf(stdout,"  timing %d twist %.2f: %lu decoded, %lu only\n",h / Twists,Twist_table[h % Twists],sp->hyp[h].frames,sp->hyp[h].only);
+  fflush(stdout);
+  pthread_mutex_unlock(&Output_mutex);
+}
+
+static void send_frame(struct session *sp,uint8_t const *frame,int bytes){
+  struct rtp_header rtp_hdr;
+  memset(&rtp_hdr,0,sizeof(rtp_hdr));
+  rtp_hdr.version = 2;
+  rtp_hdr.type = AX25_pt;
+  rtp_hdr.seq = sp->rtp_state_out.seq++;
+  // RTP timestamp??
+  rtp_hdr.timestamp = sp->rtp_state_out.timestamp;
+  sp->rtp_state_out.timestamp += bytes;
+  rtp_hdr.ssrc = sp->rtp_state_out.ssrc;
+
+  int const plen = bytes + 76 + 10; // Max RTP header is 76 bytes; allow a little slack
+  uint8_t packet[plen],*dp;
+  dp = packet;
+  dp = hton_rtp(dp,&rtp_hdr);
+  memcpy(dp,frame,bytes);
+  dp += bytes;
+  send(Output_fd,packet,dp - packet,0); // Check return code?
+  sp->rtp_state_out.packets++;
+  sp->rtp_state_out.bytes += bytes;
+}
+
 // Process incoming HDLC bit
 // Return nonzero byte count if there's a complete valid frame
 // Caller recovers frame (including 2-byte CRC) in hp->frame, must set hp->frame_bits = 0 when done
@@ -20,14 +20,26 @@
 #include <sysexits.h>
 #include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <FLAC/stream_encoder.h>
+#include <opus/opus.h>
 
 #include "misc.h"
 #include "attr.h"
 #include "multicast.h"
+#include "sessions.h"
 
-// size of stdio buffer for disk I/O
-// This should be large to minimize write calls, but how big?
+// Size of each per-session write buffer
+// Large and aligned so the writer thread issues a few big writes instead of many small interleaved ones
 #define BUFFERSIZE (1<<20)
+#define BUFFERALIGN 4096
+
+// Ogg pages are written when they reach this much data, so twice this holds any page but
+// one with an unusually large packet
+#define OGG_PAGE_TARGET 8192
+
+// Packets read from the socket per system call
+#define BATCH 16
 
 // Simplified .wav file header
 // http://soundfile.sapp.org/doc/WaveFormat/
@@ -76,9 +88,7 @@ struct wav {
 
 // One for each session being recorded
 struct session {
-  struct session *prev;
-  struct session *next;
-  struct sockaddr sender;      // Sender's IP address and source port
+  struct session_entry entry;  // In Sessions table, keyed on sender address/port and SSRC
 
   char filename[PATH_MAX];
   struct wav header;
@@ -87,12 +97,31 @@ struct session {
   struct rtp_state rtp_state;
 
   int type;                    // RTP payload type (with marker stripped)
+  enum encoding encoding;      // S16BE, S16LE, F32LE or OPUS
   int channels;                // 1 (PCM_MONO) or 2 (PCM_STEREO)
   unsigned int samprate;       // implicitly 48 kHz in PCM
 
-  FILE *fp;                    // File being recorded
-  void *iobuffer;              // Big buffer to reduce write rate
-  int64_t last_active;         // gps time of last activity
+  int fd;                      // File being recorded; a placeholder until the writer has created it
+  struct wjob *close_job;      // Allocated up front so closing can't fail
+  uint8_t *iobuffer;           // Buffer being filled, from the writer's pool; NULL if none
+  off_t buffer_start;          // File offset of iobuffer[0]
+  size_t buffer_len;           // Bytes used in iobuffer
+  off_t file_offset;           // Where the next in-sequence sample goes
+  off_t file_size;             // Highest byte written (or queued) so far
+  off_t allocated;             // File space preallocated so far
+  uint64_t overflows;          // Bytes dropped because the writer fell too far behind
+  struct flac_stream *flac;    // FLAC encoder state, if writing FLAC; owned by the encoder pool once closed
+  struct fblock *block;        // FLAC block being filled
+
+  // Ogg Opus page being assembled; Opus packets are copied from RTP without decoding
+  uint32_t ogg_serial;
+  uint32_t ogg_pageno;
+  int64_t granule;             // 48 kHz samples through the last packet added
+  int ogg_segments;
+  uint8_t ogg_lacing[255];
+  int ogg_len;
+  int ogg_size;                // Allocated size of ogg_data
+  uint8_t *ogg_data;           // Only for Opus; grows if a packet won't fit
 
   bool substantial_file;       // At least one substantial segment has been seen
   int64_t current_segment_samples; // total samples in this segment without skips in timestamp
@@ -112,21 +141,140 @@ static bool Subdirs; // Place recordings in subdirectories by SSID
 static char const *Locale;
 static int Samprate;
 static int Channels = 1;
+static enum encoding Encoding = NO_ENCODING; // Override the payload type table
 
 static uint32_t CenterFrequency=1115000;
 
 static int Input_fd;
-static struct session *Sessions;
+static struct session_table Sessions;
 static int64_t Timeout = 20; // 20 seconds max idle time before file close
 
+// Disk writer stage
+// The receive loop only copies data into per-session buffers and queues full ones;
+// a separate thread does all the disk I/O, so packet reception never waits for the disk
+enum wjob_type {
+  OPEN_JOB,     // Create directories and file, set attributes, write WAV header
+  WRITE_JOB,    // pwrite buffer at offset
+  ALLOC_JOB,    // Preallocate file space
+  CLOSE_JOB,    // Rewrite header and close, or delete if not substantial
+  STOP_JOB,     // Writer thread exits
+};
+struct wjob {
+  struct wjob *next;
+  enum wjob_type type;
+  int fd;
+  off_t offset;
+  off_t len;
+  uint8_t *buffer;   // WRITE_JOB data
+  bool pooled;       // buffer came from the pool, otherwise malloc'ed
+  bool keep;         // CLOSE_JOB: keep file, otherwise unlink
+  bool rewrite;      // OPEN_JOB, CLOSE_JOB: write header at offset 0
+  struct wav header; // OPEN_JOB: initial header, CLOSE_JOB: final header
+  char filename[PATH_MAX];
+
+  // OPEN_JOB: extended attributes
+  unsigned int samprate;
+  int channels;
+  uint32_t ssrc;
+  enum encoding encoding;
+  bool flac;
+  char source[NI_MAXHOST];
+  struct timespec start;
+};
+
+static pthread_mutex_t Writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Buffer_cond = PTHREAD_COND_INITIALIZER; // A pool buffer was freed
+static struct wjob *Writer_head;
+static struct wjob *Writer_tail;
+static pthread_t Writer_thread;
+static bool Writer_running;
+static struct wjob Stop_job = { .type = STOP_JOB };
+static int Null_fd = -1;         // Duplicated as a placeholder for each file until the writer opens it
+static volatile bool Create_failed; // Writer couldn't create a file
+static volatile sig_atomic_t Stop_signal; // Set by closedown(); input_loop() returns and exit() runs cleanup()
+static void *Free_buffers;       // Pool of BUFFERSIZE buffers, linked through their first word
+static int Buffers_allocated;
+static int Max_buffers = 512;    // Limit on buffered data, BUFFERSIZE units
+static float Prealloc_time = 60; // Preallocate file space this many seconds ahead
+
+// Optional FLAC compression stage, between the receive loop and the writer
+// The receive loop cuts each session's samples into fixed-size blocks aligned to the start of
+// the file (so block n always starts n * FLAC_BLOCKSIZE samples after the first RTP timestamp),
+// with gaps filled with silence, and queues them. A pool of encoder threads compresses them;
+// each session's blocks go through its own libFLAC encoder strictly in order, but different
+// sessions are encoded in parallel. Compressed output goes to the writer thread as usual.
+#define FLAC_BLOCKSIZE 4096      // Samples per channel per FLAC frame
+struct fblock {
+  struct fblock *next;
+  int64_t frames;    // Sample times in this block, <= FLAC_BLOCKSIZE unless silent
+  bool silent;       // All zeroes, no data attached; may be a run of many whole blocks
+  bool finish;       // End of stream: finish encoder, close file
+  int32_t data[];    // frames * channels, interleaved
+};
+struct flac_stream {
+  struct flac_stream *next;   // On ready queue
+  FLAC__StreamEncoder *encoder;
+  bool initialized;           // Header written
+  int channels;
+  unsigned int samprate;
+  int fd;
+  char filename[PATH_MAX];
+  bool keep;                  // Set with finish
+  struct wjob *close_job;     // Taken from the session
+
+  // Protected by Encoder_mutex
+  struct fblock *head;
+  struct fblock *tail;
+  int pending;                // Blocks queued
+  bool busy;                  // On ready queue or being encoded
+
+  // Used only by the encoder thread that currently owns the stream
+  uint8_t *iobuffer;
+  off_t buffer_start;
+  size_t buffer_len;
+  off_t offset;               // Encoder's current output position
+  off_t size;                 // Highest byte written
+};
+static bool Flac;                // Write FLAC instead of WAV
+static int Flac_level = 5;       // libFLAC compression level, 0-8
+static int Encoder_threads = 2;
+static int Max_blocks = 256;     // Limit on queued blocks per session before we substitute silence
+static pthread_mutex_t Encoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Encoder_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Idle_cond = PTHREAD_COND_INITIALIZER;     // A stream went idle; see flac_close()
+static struct flac_stream *Ready_head;  // Streams with blocks to encode and no thread working on them
+static struct flac_stream *Ready_tail;
+static bool Encoders_stop;
+static pthread_t *Encoders;
+static int32_t const Zeroes[FLAC_BLOCKSIZE * 2];
+
 static void closedown(int a);
 static void input_loop(void);
+static void process_packet(uint8_t *buffer,int size,struct sockaddr const *sender);
 static void cleanup(void);
-static struct session *create_session(struct rtp_header const *, struct sockaddr const *sender);
+static struct session *create_session(struct rtp_header const *, struct sockaddr const *sender,enum encoding,uint8_t const *data,int len);
 static int close_file(struct session **spp);
+static void session_write(struct session *sp,void const *data,size_t len,bool swap);
+static void flush_buffer(struct session *sp);
+static void queue_job(struct wjob *job);
+static void *writer(void *arg);
+static void stop_writer(void);
+static struct flac_stream *flac_start(struct session const *sp);
+static void flac_samples(struct session *sp,int16_t const *samples,int count);
+static void flac_silence(struct session *sp,int64_t frames);
+static void flac_close(struct session *sp);
+static void flac_encode(struct flac_stream *fs,struct fblock const *block);
+static void *encoder(void *arg);
+static void stop_encoders(void);
+static void ogg_start(struct session *sp);
+static void ogg_packet(struct session *sp,uint8_t const *data,int len,int samples);
+static void ogg_silence(struct session *sp,int64_t samples);
+static void ogg_flush(struct session *sp,bool eos);
 
 static struct option Options[] = {
   {"channels", required_argument, NULL, 'c'},
+  {"encoding", required_argument, NULL, 'e'},
   {"directory", required_argument, NULL, 'd'},
   {"locale", required_argument, NULL, 'l'},
   {"minfiletime", required_argument, NULL, 'm'},
@@ -139,10 +287,14 @@ static struct option Options[] = {
   {"lengthlimit", required_argument, NULL, 'L'},
   {"limit", required_argument, NULL, 'L'},
   {"frequency", required_argument, NULL, 'f'},
+  {"buffers", required_argument, NULL, 'b'},
+  {"flac", no_argument, NULL, 'F'},
+  {"compression", required_argument, NULL, 'C'},
+  {"threads", required_argument, NULL, 'j'},
   {"version", no_argument, NULL, 'V'},
   {NULL, no_argument, NULL, 0},
 };
-static char Optstring[] = "c:d:l:m:r:st:vL:f:V";
+static char Optstring[] = "b:c:d:e:l:m:r:st:vL:f:FC:j:V";
 
 int main(int argc,char *argv[]){
   App_path = argv[0];
@@ -154,12 +306,18 @@ int main(int argc,char *argv[]){
   char *ptr;
   while((c = getopt_long(argc,argv,Optstring,Options,NULL)) != EOF){
     switch(c){
+    case 'b':
+      Max_buffers = strtol(optarg,&ptr,0);
+      break;
     case 'c':
       Channels = strtol(optarg,&ptr,0);
       break;
     case 'd':
       Recordings = optarg;
       break;
+    case 'e':
+      Encoding = parse_encoding(optarg);
+      break;
     case 'l':
       Locale = optarg;
       break;
@@ -189,11 +347,20 @@ int main(int argc,char *argv[]){
     case 'f':
        CenterFrequency = strtoul(optarg,NULL,0);
       break;
+    case 'F':
+      Flac = true;
+      break;
+    case 'C':
+      Flac_level = strtol(optarg,&ptr,0);
+      break;
+    case 'j':
+      Encoder_threads = strtol(optarg,&ptr,0);
+      break;
     case 'V':
       VERSION();
       exit(EX_OK);
     default:
-      fprintf(stderr,"Usage: %s [-c 1|2] [-s] [-d directory] [-l locale] [-L maxtime] [-t timeout] [-v] [-m sec] [-f freq] PCM_multicast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-c 1|2] [-e encoding] [-s] [-d directory] [-l locale] [-L maxtime] [-t timeout] [-v] [-m sec] [-f freq] [-b buffers] [-F [-C level] [-j threads]] PCM_multicast_address\n",argv[0]);
       exit(EX_USAGE);
       break;
     }
@@ -235,156 +402,229 @@ int main(int argc,char *argv[]){
   signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
+  if((Null_fd = open("/dev/null",O_RDWR)) == -1){
+    fprintf(stderr,"Can't open /dev/null: %s\n",strerror(errno));
+    exit(EX_OSFILE);
+  }
+  session_table_init(&Sessions,Timeout * BILLION,BILLION,gps_time_ns());
   atexit(cleanup);
 
-  input_loop(); // Doesn't return
+  Writer_running = true;
+  pthread_create(&Writer_thread,NULL,writer,NULL);
+  if(Flac){
+    if(Encoder_threads < 1)
+      Encoder_threads = 1;
+    Encoders = calloc(Encoder_threads,sizeof(*Encoders));
+    for(int i = 0; i < Encoder_threads; i++)
+      pthread_create(&Encoders[i],NULL,encoder,NULL);
+  }
+
+  input_loop(); // Returns on a signal or error
 
-  exit(EX_OK);
+  if(Stop_signal != 0 && Verbose)
+    fprintf(stderr,"%s: caught signal %d: %s\n",App_path,(int)Stop_signal,strsignal(Stop_signal));
+  exit(EX_OK); // Will call cleanup()
 }
 
+// Flushing and closing files takes locks and joins threads, so that's left to the main thread
 static void closedown(int a){
-  if(Verbose)
-    fprintf(stderr,"%s: caught signal %d: %s\n",App_path,a,strsignal(a));
-
-  cleanup();
-  exit(EX_OK);  // Will call cleanup()
+  Stop_signal = a;
 }
 
 // Read from RTP network socket, assemble blocks of samples
 static void input_loop(){
+  // Static because PKTSIZE is big
+  static uint8_t buffers[BATCH][PKTSIZE];
+  static struct sockaddr_storage senders[BATCH];
+#if defined(linux)
+  static struct mmsghdr msgs[BATCH];
+  static struct iovec iovecs[BATCH];
+#endif
 
-  struct sockaddr sender;
-  while(true){
-    int64_t current_time = gps_time_ns();
-
+  while(Stop_signal == 0){
     // Receive data
     struct pollfd pfd[1];
     pfd[0].fd = Input_fd;
     pfd[0].events = POLLIN;
     pfd[0].revents = 0;
-    int const n = poll(pfd,sizeof(pfd)/sizeof(pfd[0]),1000); // Wait 1 sec max so we can scan active session list
-    if(n < 0)
+    int const n = poll(pfd,sizeof(pfd)/sizeof(pfd[0]),1000); // Wait 1 sec max so idle sessions get closed
+    if(n < 0 && errno != EINTR)
       break; // error of some kind
     if(pfd[0].revents & (POLLIN|POLLPRI)){
-      uint8_t buffer[PKTSIZE];
-      socklen_t socksize = sizeof(sender);
-      int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&sender,&socksize);
+#if defined(linux)
+      // Take everything that's waiting (up to BATCH) in one system call
+      for(int i = 0; i < BATCH; i++){
+	iovecs[i].iov_base = buffers[i];
+	iovecs[i].iov_len = sizeof(buffers[i]);
+	memset(&msgs[i].msg_hdr,0,sizeof(msgs[i].msg_hdr));
+	msgs[i].msg_hdr.msg_name = &senders[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+	msgs[i].msg_hdr.msg_iov = &iovecs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      int const count = recvmmsg(Input_fd,msgs,BATCH,MSG_DONTWAIT,NULL);
+      if(count <= 0){
+	if(count < 0 && (errno == EAGAIN || errno == EINTR))
+	  continue;
+	perror("recvmmsg");
+	break; // Some sort of error, quit
+      }
+      for(int i = 0; i < count; i++)
+	process_packet(buffers[i],msgs[i].msg_len,(struct sockaddr *)&senders[i]);
+#else
+      socklen_t socksize = sizeof(senders[0]);
+      int const size = recvfrom(Input_fd,buffers[0],sizeof(buffers[0]),0,(struct sockaddr *)&senders[0],&socksize);
       if(size <= 0){    // ??
 	perror("recvfrom");
 	break; // Some sort of error, quit
       }
-      if(size < RTP_MIN_SIZE)
-	continue; // Too small for RTP, ignore
-
-      struct rtp_header rtp;
-      uint8_t const * const dp = ntoh_rtp(&rtp,buffer);
-      if(rtp.pad){
-	// Remove padding
-	size -= dp[size-1];
-	rtp.pad = 0;
-      }
-      if(size <= 0)
-	continue; // Bogus RTP header
-
-      int16_t const * const samples = (int16_t *)dp;
-      size -= (dp - buffer);
-
-      struct session *sp;
-      for(sp = Sessions;sp != NULL;sp=sp->next){
-	if(sp->ssrc == rtp.ssrc
-	   && rtp.type == sp->type
-	   && address_match(&sp->sender,&sender)
-	   && getportnumber(&sp->sender) == getportnumber(&sender))
-	  break;
-      }
-      if(sp == NULL){ // Not found; create new one
-	// Repeat this each time we create a session to ensure we're in the right directory.
-	// This might have failed on earlier attempts should we start before the fs is successfully mounted
-	if(strlen(Recordings) > 0 && chdir(Recordings) != 0){
-	  fprintf(stderr,"Can't change to directory %s: %s, exiting\n",Recordings,strerror(errno));
-	  exit(EX_CANTCREAT);
-	}
-	sp = create_session(&rtp,&sender);
-      }
-      if(sp == NULL || sp->fp == NULL)
+      process_packet(buffers[0],size,(struct sockaddr *)&senders[0]);
+#endif
+    } // end of packet processing
+
+    // Close idle sessions. The timer wheel only looks at sessions that might have expired
+    struct session_entry *entry;
+    while((entry = session_expire(&Sessions,gps_time_ns())) != NULL){
+      struct session *sp = entry->owner;
+      close_file(&sp); // sp will be NULL
+    }
+  }
+}
+
+static void process_packet(uint8_t *buffer,int size,struct sockaddr const *sender){
+  if(size < RTP_MIN_SIZE)
+    return; // Too small for RTP, ignore
+
+  struct rtp_header rtp;
+  uint8_t const * const dp = ntoh_rtp(&rtp,buffer);
+  if(rtp.pad){
+    // Remove padding
+    size -= dp[size-1];
+    rtp.pad = 0;
+  }
+  if(size <= 0)
+    return; // Bogus RTP header
+
+  size -= (dp - buffer);
+
+  // The encoding comes from the payload type unless overridden; plain 16-bit PCM is the traditional default
+  enum encoding encoding = Encoding != NO_ENCODING ? Encoding : encoding_from_pt(rtp.type);
+  switch(encoding){
+  case NO_ENCODING:
+    encoding = S16BE;
+    break;
+  case S16BE:
+  case S16LE:
+  case F32LE:
+  case OPUS:
+    break;
+  default:
+    return; // Can't record this
+  }
+
+  struct session *sp = NULL;
+  struct session_entry * const entry = session_lookup(&Sessions,sender,rtp.ssrc);
+  if(entry != NULL){
+    sp = entry->owner;
+    if(sp->type != rtp.type || sp->encoding != encoding){
+      // Payload type changed, so the sample rate or channel count may have too; start a new file
+      close_file(&sp);
+    }
+  }
+  if(sp == NULL) // Not found; create new one
+    sp = create_session(&rtp,sender,encoding,dp,size);
+
+  if(sp == NULL || Create_failed)
 #if 1
-	// Let systemd restart us after a delay instead of rapidly filling the log with, e.g., disk full errors
-	exit(EX_CANTCREAT);
+    // Let systemd restart us after a delay instead of rapidly filling the log with, e.g., disk full errors
+    exit(EX_CANTCREAT);
 #else
-	continue; // Couldn't create new session
+    return; // Couldn't create new session
 #endif
 
-      // A "sample" is a single audio sample, usually 16 bits.
-      // A "frame" is the same as a sample for mono. It's two audio samples for stereo
-      int const samp_count = size / sizeof(*samples); // number of individual audio samples (not frames)
-      int const frame_count = samp_count / sp->channels; // 1 every sample period (e.g., 4 for stereo 16-bit)
-      off_t const offset = rtp_process(&sp->rtp_state,&rtp,frame_count); // rtp timestamps refer to frames
-
-      // The seek offset relative to the current position in the file is the signed (modular) difference between
-      // the actual and expected RTP timestamps. This should automatically handle
-      // 32-bit RTP timestamp wraps, which occur every ~1 days at 48 kHz and only 6 hr @ 192 kHz
-      // Should I limit the range on this?
-      if(offset != 0){
-	fseeko(sp->fp,offset * sizeof(*samples) * sp->channels,SEEK_CUR); // offset is in bytes
-	if(offset > 0)
-	  sp->current_segment_samples = 0;
-      }
-      sp->total_file_samples += samp_count + offset;
-      sp->current_segment_samples += samp_count;
-      sp->samples_written += samp_count;
-      if(sp->current_segment_samples >= SubstantialFileTime * sp->samprate)
-	sp->substantial_file = true;
+  // A "sample" is a single audio sample, usually 16 bits.
+  // A "frame" is the same as a sample for mono. It's two audio samples for stereo
+  int const sample_size = sp->encoding == F32LE ? sizeof(float) : sizeof(int16_t);
+  int samp_count,frame_count;
+  if(sp->encoding == OPUS){
+    // Opus RTP timestamps always count 48 kHz samples, regardless of the audio bandwidth
+    frame_count = opus_packet_get_nb_samples(dp,size,48000);
+    if(frame_count <= 0)
+      return; // Garbled
+    samp_count = frame_count * sp->channels;
+  } else {
+    samp_count = size / sample_size; // number of individual audio samples (not frames)
+    frame_count = samp_count / sp->channels; // 1 every sample period (e.g., 4 for stereo 16-bit)
+  }
+  off_t const offset = rtp_process(&sp->rtp_state,&rtp,frame_count); // rtp timestamps refer to frames
 
-      // Flip endianness from big-endian on network to little endian wanted by .wav
-      // byteswap.h is linux-specific; need to find a portable way to get the machine instructions
-      uint16_t wbuffer[samp_count];
-      for(int n = 0; n < samp_count; n++)
-	wbuffer[n] = bswap_16((uint16_t)samples[n]);
-      fwrite(wbuffer,sizeof(*wbuffer),samp_count,sp->fp);
-      sp->last_active = gps_time_ns();
-
-      if(sp->samples_remaining > 0 && (sp->samples_remaining -= samp_count) <= 0){
-	cleanup(); // Close all files
-	exit(EX_OK);
-      }
-    } // end of packet processing
+  // The offset relative to the current position in the file is the signed (modular) difference between
+  // the actual and expected RTP timestamps. This should automatically handle
+  // 32-bit RTP timestamp wraps, which occur every ~1 days at 48 kHz and only 6 hr @ 192 kHz
+  // Negative offsets are old or duplicate packets; drop them
+  // Positive offsets skip ahead, leaving silence (or a hole) in the file
+  // Should I limit the range on this?
+  if(offset < 0)
+    return;
+  if(offset > 0){
+    if(sp->encoding == OPUS)
+      ogg_silence(sp,offset);
+    else if(sp->flac != NULL)
+      flac_silence(sp,offset);
+    else
+      sp->file_offset += offset * sample_size * sp->channels; // offset is in frames
+    sp->current_segment_samples = 0;
+  }
+  sp->total_file_samples += samp_count + offset;
+  sp->current_segment_samples += samp_count;
+  sp->samples_written += samp_count;
+  if(sp->current_segment_samples >= SubstantialFileTime * sp->samprate)
+    sp->substantial_file = true;
 
-    // Walk through list, close idle sessions
-    // should we do this on every packet? seems inefficient
-    // Could be in a separate thread, but that creates synchronization issues
-    struct session *next;
-    for(struct session *sp = Sessions;sp != NULL; sp = next){
-      next = sp->next; // save in case sp is closed
-      int64_t idle = current_time - sp->last_active;
-      if(idle > Timeout * BILLION){
-	close_file(&sp); // sp will be NULL
-	// Close idle session
-      }
-    }
+  if(sp->encoding == OPUS){
+    ogg_packet(sp,dp,size,frame_count); // Never blocks
+  } else if(sp->flac != NULL){
+    flac_samples(sp,(int16_t const *)dp,samp_count); // Never blocks
+  } else {
+    // S16LE and F32LE go into the file as is; S16BE is flipped to the little endian wanted by .wav
+    session_write(sp,dp,samp_count * sample_size,sp->encoding == S16BE); // Never blocks
+  }
+  session_touch(&sp->entry,gps_time_ns());
+
+  if(sp->samples_remaining > 0 && (sp->samples_remaining -= samp_count) <= 0){
+    cleanup(); // Close all files
+    exit(EX_OK);
   }
 }
 
 static void cleanup(void){
-  while(Sessions){
-    // Flush and close each write stream
-    // Be anal-retentive about freeing and clearing stuff even though we're about to exit
-    struct session *next_s = Sessions->next;
-    close_file(&Sessions); // Sessions will be NULL
-    Sessions = next_s;
+  // Flush and close each write stream
+  // Be anal-retentive about freeing and clearing stuff even though we're about to exit
+  struct session_entry *entry;
+  while((entry = session_first(&Sessions)) != NULL){
+    struct session *sp = entry->owner;
+    close_file(&sp); // Removes it from the table
   }
+  stop_encoders(); // Finish compressing everything
+  stop_writer(); // Wait for everything to reach the disk
 }
-static struct session *create_session(struct rtp_header const *rtp,struct sockaddr const *sender){
+// data/len is the first packet's payload, needed to tell whether an Opus stream is stereo
+static struct session *create_session(struct rtp_header const *rtp,struct sockaddr const *sender,enum encoding encoding,uint8_t const *data,int len){
 
   struct session *sp = calloc(1,sizeof(*sp));
   if(sp == NULL)
     return NULL; // unlikely
 
-  memcpy(&sp->sender,sender,sizeof(sp->sender));
   sp->type = rtp->type;
   sp->ssrc = rtp->ssrc;
 
+  sp->encoding = encoding;
   sp->channels = Channels ? Channels : channels_from_pt(sp->type);
   sp->samprate = Samprate ? Samprate : samprate_from_pt(sp->type);
+  if(encoding == OPUS){
+    sp->samprate = 48000;
+    sp->channels = (len > 0 && (data[0] & 0x4)) ? 2 : 1; // TOC byte stereo flag
+  }
   if(sp->channels == 0 || sp->samprate == 0){
     fprintf(stderr,"Unknown payload type %d and channels/samprate not specified on command line\n",sp->type);
     FREE(sp);
@@ -397,33 +637,12 @@ static struct session *create_session(struct rtp_header const *rtp,struct sockad
   clock_gettime(CLOCK_REALTIME,&now);
   struct tm const * const tm = gmtime(&now.tv_sec);
   // yyyy-mm-dd-hh:mm:ss so it will sort properly
+  bool const flac = Flac && (encoding == S16BE || encoding == S16LE); // FLAC is integer only
+  char const * const suffix = encoding == OPUS ? "opus" : flac ? "flac" : "wav";
 
-  sp->fp = NULL;
   if(Subdirs){
-    // Create directory path
-    char dir[PATH_MAX];
-    snprintf(dir,sizeof(dir),"%u",sp->ssrc);
-    if(mkdir(dir,0777) == -1 && errno != EEXIST){
-      fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
-      return NULL;
-    }
-    snprintf(dir,sizeof(dir),"%u/%d",sp->ssrc,tm->tm_year+1900);
-    if(mkdir(dir,0777) == -1 && errno != EEXIST){
-      fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
-      return NULL;
-    }
-    snprintf(dir,sizeof(dir),"%u/%d/%d",sp->ssrc,tm->tm_year+1900,tm->tm_mon+1);
-    if(mkdir(dir,0777) == -1 && errno != EEXIST){
-      fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
-      return NULL;
-    }
-    snprintf(dir,sizeof(dir),"%u/%d/%d/%d",sp->ssrc,tm->tm_year+1900,tm->tm_mon+1,tm->tm_mday);
-    if(mkdir(dir,0777) == -1 && errno != EEXIST){
-      fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
-      FREE(sp);
-      return NULL;
-    }
-    snprintf(sp->filename,sizeof(sp->filename),"%u/%d/%d/%d/%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.wav",
+    // Subdirectories by SSRC and date; the writer creates them
+    snprintf(sp->filename,sizeof(sp->filename),"%u/%d/%d/%d/%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.%s",
 	     sp->ssrc,
 	     tm->tm_year+1900,
 	     tm->tm_mon+1,
@@ -435,10 +654,11 @@ static struct session *create_session(struct rtp_header const *rtp,struct sockad
 	     tm->tm_hour,
 	     tm->tm_min,
 	     tm->tm_sec,
-	     (int)(now.tv_nsec / 100000000)); // 100 million, i.e., convert to tenths of a sec
+	     (int)(now.tv_nsec / 100000000), // 100 million, i.e., convert to tenths of a sec
+	     suffix);
   } else {
     // create file in current directory
-    snprintf(sp->filename,sizeof(sp->filename),"%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.wav",
+    snprintf(sp->filename,sizeof(sp->filename),"%uk%4d-%02d-%02dT%02d:%02d:%02d.%dZ.%s",
 	     sp->ssrc,
 	     tm->tm_year+1900,
 	     tm->tm_mon+1,
@@ -446,51 +666,61 @@ static struct session *create_session(struct rtp_header const *rtp,struct sockad
 	     tm->tm_hour,
 	     tm->tm_min,
 	     tm->tm_sec,
-	     (int)(now.tv_nsec / 100000000));
+	     (int)(now.tv_nsec / 100000000),
+	     suffix);
   }
-  sp->fp = fopen(sp->filename,"w+");
-  if(sp->fp == NULL){
-    fprintf(stderr,"can't create/write file %s: %s\n",sp->filename,strerror(errno));
+  // The writer thread creates the file in order with its other jobs, so a slow or unmounted
+  // filesystem never holds up reception. Until then the session's descriptor is a duplicate
+  // of /dev/null, which the writer replaces with the real file before any data reaches it
+  struct wjob *open_job = calloc(1,sizeof(*open_job));
+  sp->close_job = calloc(1,sizeof(*sp->close_job));
+  if(encoding == OPUS){
+    sp->ogg_size = 2 * OGG_PAGE_TARGET;
+    sp->ogg_data = malloc(sp->ogg_size);
+  }
+  sp->fd = dup(Null_fd);
+  if(open_job == NULL || sp->close_job == NULL || (encoding == OPUS && sp->ogg_data == NULL) || sp->fd == -1){
+    fprintf(stderr,"can't create session for %s: %s\n",sp->filename,strerror(errno));
+    if(sp->fd != -1)
+      close(sp->fd);
+    FREE(open_job);
+    FREE(sp->close_job);
+    FREE(sp->ogg_data);
     FREE(sp);
     return NULL;
-
   }
-  // file create succeded, now put us at top of list
-  sp->prev = NULL;
-  sp->next = Sessions;
-
-  if(sp->next)
-    sp->next->prev = sp;
-
-  Sessions = sp;
+  if(flac){
+    if((sp->flac = flac_start(sp)) == NULL){
+      close(sp->fd);
+      FREE(open_job);
+      FREE(sp->close_job);
+      FREE(sp);
+      return NULL;
+    }
+    // The encoder closes the file
+    sp->flac->close_job = sp->close_job;
+    sp->close_job = NULL;
+  }
+  // file create succeded, now put us in the table
+  session_insert(&Sessions,&sp->entry,sender,sp->ssrc,sp,gps_time_ns());
 
   if(Verbose)
     fprintf(stdout,"creating %s\n",sp->filename);
 
-  sp->iobuffer = malloc(BUFFERSIZE);
-  setbuffer(sp->fp,sp->iobuffer,BUFFERSIZE);
-
-  int const fd = fileno(sp->fp);
-  fcntl(fd,F_SETFL,O_NONBLOCK); // Let's see if this keeps us from losing data
-
-  attrprintf(fd,"samplerate","%lu",(unsigned long)sp->samprate);
-  attrprintf(fd,"channels","%d",sp->channels);
-  attrprintf(fd,"ssrc","%u",rtp->ssrc);
-  attrprintf(fd,"sampleformat","s16le");
-
   // Write .wav header, skipping size fields
   memcpy(sp->header.ChunkID,"RIFF", 4);
   sp->header.ChunkSize = 0xffffffff; // Temporary
   memcpy(sp->header.Format,"WAVE",4);
   memcpy(sp->header.Subchunk1ID,"fmt ",4);
   sp->header.Subchunk1Size = 16;
-  sp->header.AudioFormat = 1;
+  int const sample_size = encoding == F32LE ? sizeof(float) : sizeof(int16_t);
+  sp->header.AudioFormat = encoding == F32LE ? 3 : 1; // WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM
   sp->header.NumChannels = sp->channels;
   sp->header.SampleRate = sp->samprate;
 
-  sp->header.ByteRate = sp->samprate * sp->channels * 16/8;
-  sp->header.BlockAlign = sp->channels * 16/8;
-  sp->header.BitsPerSample = 16;
+  sp->header.ByteRate = sp->samprate * sp->channels * sample_size;
+  sp->header.BlockAlign = sp->channels * sample_size;
+  sp->header.BitsPerSample = 8 * sample_size;
   memcpy(sp->header.SubChunk2ID,"data",4);
   sp->header.Subchunk2Size = 0xffffffff; // Temporary
 
@@ -508,39 +738,125 @@ static struct session *create_session(struct rtp_header const *rtp,struct sockad
   sp->header.CenterFrequency=CenterFrequency;
   memset(sp->header.AuxUknown, 0, 128);
 
-  fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-  fflush(sp->fp); // get at least the header out there
-
-  char sender_text[NI_MAXHOST];
+  open_job->type = OPEN_JOB;
+  open_job->fd = sp->fd;
+  strlcpy(open_job->filename,sp->filename,sizeof(open_job->filename));
+  open_job->samprate = sp->samprate;
+  open_job->channels = sp->channels;
+  open_job->ssrc = sp->ssrc;
+  open_job->encoding = encoding;
+  open_job->flac = flac;
+  open_job->start = now;
   // Don't wait for an inverse resolve that might cause us to lose data
-  getnameinfo((struct sockaddr *)sender,sizeof(*sender),sender_text,sizeof(sender_text),NULL,0,NI_NOFQDN|NI_DGRAM|NI_NUMERICHOST);
-  attrprintf(fd,"source","%s",sender_text);
-  attrprintf(fd,"multicast","%s",PCM_mcast_address_text);
+  getnameinfo((struct sockaddr *)sender,sizeof(*sender),open_job->source,sizeof(open_job->source),NULL,0,NI_NOFQDN|NI_DGRAM|NI_NUMERICHOST);
+  if(encoding != OPUS && !flac){
+    // Get at least the header out there; audio starts right after it
+    open_job->rewrite = true;
+    memcpy(&open_job->header,&sp->header,sizeof(open_job->header));
+    sp->file_offset = sp->file_size = sizeof(sp->header);
+  }
+  queue_job(open_job); // Ahead of everything else for this file
+
+  if(encoding == OPUS)
+    ogg_start(sp);
 
-  attrprintf(fd,"unixstarttime","%ld.%09ld",(long)now.tv_sec,(long)now.tv_nsec);
   return sp;
 }
 
+// Writer side of create_session()
+static void open_file(struct wjob const *job){
+  // Repeat this for each file to ensure we're in the right directory.
+  // This might have failed on earlier attempts should we start before the fs is successfully mounted
+  if(strlen(Recordings) > 0 && chdir(Recordings) != 0){
+    fprintf(stderr,"Can't change to directory %s: %s, exiting\n",Recordings,strerror(errno));
+    Create_failed = true;
+    return;
+  }
+  // Create any directories in the path
+  char dir[PATH_MAX];
+  strlcpy(dir,job->filename,sizeof(dir));
+  for(char *cp = strchr(dir,'/'); cp != NULL; cp = strchr(cp + 1,'/')){
+    *cp = '\0';
+    if(mkdir(dir,0777) == -1 && errno != EEXIST){
+      fprintf(stderr,"can't create directory %s: %s\n",dir,strerror(errno));
+      Create_failed = true;
+      return;
+    }
+    *cp = '/';
+  }
+  int const fd = open(job->filename,O_RDWR|O_CREAT|O_TRUNC,0666);
+  if(fd == -1){
+    fprintf(stderr,"can't create/write file %s: %s\n",job->filename,strerror(errno));
+    Create_failed = true;
+    return;
+  }
+  // Replace the placeholder; the jobs already queued for this file refer to it by that number
+  if(dup2(fd,job->fd) == -1){
+    fprintf(stderr,"can't create/write file %s: %s\n",job->filename,strerror(errno));
+    close(fd);
+    unlink(job->filename);
+    Create_failed = true;
+    return;
+  }
+  close(fd);
+  attrprintf(job->fd,"samplerate","%lu",(unsigned long)job->samprate);
+  attrprintf(job->fd,"channels","%d",job->channels);
+  attrprintf(job->fd,"ssrc","%u",job->ssrc);
+  attrprintf(job->fd,"sampleformat","%s",job->encoding == F32LE ? "f32le" : "s16le");
+  if(job->encoding == OPUS)
+    attrprintf(job->fd,"encoding","opus");
+  else if(job->flac)
+    attrprintf(job->fd,"encoding","flac");
+  attrprintf(job->fd,"source","%s",job->source);
+  attrprintf(job->fd,"multicast","%s",PCM_mcast_address_text);
+  attrprintf(job->fd,"unixstarttime","%ld.%09ld",(long)job->start.tv_sec,(long)job->start.tv_nsec);
+
+  if(job->rewrite && pwrite(job->fd,&job->header,sizeof(job->header),0) != sizeof(job->header))
+    fprintf(stdout,"header write to %s failed: %s\n",job->filename,strerror(errno));
+}
+
 // Close a session, update .wav header, remove from session table
 // If the file is not "substantial", just delete it
+// The writer thread does the actual work after any data still queued for the file
 static int close_file(struct session **spp){
   struct session *sp = *spp;
 
+  if(sp->flac != NULL){
+    // The encoder pool finishes the stream and has the writer close the file
+    if(Verbose)
+      fprintf(stdout,"%s %s %'.1f/%'.1f sec\n",sp->substantial_file ? "closing" : "deleting",sp->filename,
+	      (float)sp->samples_written / (sp->samprate * Channels),
+	      (float)sp->total_file_samples / (sp->samprate * Channels));
+    if(sp->overflows != 0)
+      fprintf(stdout,"file %s: %'llu bytes replaced with silence, encoding too slow\n",sp->filename,(long long unsigned)sp->overflows);
+    flac_close(sp);
+    sp->fd = -1;
+    session_remove(&Sessions,&sp->entry);
+    FREE(sp);
+    *spp = NULL;
+    return 0;
+  }
+  if(sp->encoding == OPUS)
+    ogg_flush(sp,true); // Last page, marked end of stream
+  flush_buffer(sp);
+  struct wjob * const job = sp->close_job;
+  sp->close_job = NULL;
+  job->type = CLOSE_JOB;
+  job->fd = sp->fd;
+  job->len = sp->file_size;
+  job->keep = sp->substantial_file;
+  job->rewrite = sp->encoding != OPUS;
+  strlcpy(job->filename,sp->filename,sizeof(job->filename));
+
   if(sp->substantial_file){ // Don't bother for non-substantial files
     if(Verbose){
       fprintf(stdout,"closing %s %'.1f/%'.1f sec\n",sp->filename,
             (float)sp->samples_written / (sp->samprate * Channels),
             (float)sp->total_file_samples / (sp->samprate *Channels));
     }
-    // Get final file size, write .wav header with sizes
-    fflush(sp->fp);
-    struct stat statbuf;
-    if(fstat(fileno(sp->fp),&statbuf) != 0){
-      printf("fstat(%d) [%s] failed! %s\n",fileno(sp->fp),sp->filename,strerror(errno));
-      abort();
-    }
-    sp->header.ChunkSize = statbuf.st_size - 8;
-    sp->header.Subchunk2Size = statbuf.st_size - sizeof(sp->header);
+    // Final file size is known without waiting for the writer
+    sp->header.ChunkSize = sp->file_size - 8;
+    sp->header.Subchunk2Size = sp->file_size - sizeof(sp->header);
 
     // write end time into the auxi chunk
     struct timespec now;
@@ -554,29 +870,687 @@ static int close_file(struct session **spp){
     sp->header.StopMinute=tm->tm_min;
     sp->header.StopSecond=tm->tm_sec;
     sp->header.StopMillis=(int16_t)(now.tv_nsec / 1000000);
+    memcpy(&job->header,&sp->header,sizeof(job->header));
 
-    rewind(sp->fp);
-    fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
-    fflush(sp->fp);
     if(Verbose && (sp->rtp_state.dupes != 0 || sp->rtp_state.drops != 0))
       printf("file %s dupes %llu drops %llu\n",sp->filename,(long long unsigned)sp->rtp_state.dupes,(long long unsigned)sp->rtp_state.drops);
   } else {
-    unlink(sp->filename);
     if(Verbose)
       printf("deleting %s %'.1f/%'.1f sec\n",sp->filename,
             (float)sp->samples_written / (sp->samprate * Channels),
             (float)sp->total_file_samples / (sp->samprate * Channels));
   }
-  fclose(sp->fp);
-  sp->fp = NULL;
-  FREE(sp->iobuffer);
-  if(sp->prev)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  if(sp->next)
-    sp->next->prev = sp->prev;
+  if(sp->overflows != 0)
+    fprintf(stdout,"file %s: %'llu bytes lost, disk writes too slow\n",sp->filename,(long long unsigned)sp->overflows);
+  queue_job(job);
+  sp->fd = -1;
+  session_remove(&Sessions,&sp->entry);
+  FREE(sp->ogg_data);
   FREE(sp);
-  
+  *spp = NULL;
+
   return 0;
 }
+
+// Get a buffer from the pool without blocking; NULL if the writer is too far behind
+// Caller holds Writer_mutex
+static uint8_t *take_buffer(void){
+  uint8_t *buffer = NULL;
+  if(Free_buffers != NULL){
+    buffer = Free_buffers;
+    Free_buffers = *(void **)buffer;
+  } else if(Buffers_allocated < Max_buffers){
+    if(posix_memalign((void **)&buffer,BUFFERALIGN,BUFFERSIZE) == 0)
+      Buffers_allocated++;
+    else
+      buffer = NULL;
+  }
+  return buffer;
+}
+static uint8_t *get_buffer(void){
+  pthread_mutex_lock(&Writer_mutex);
+  uint8_t * const buffer = take_buffer();
+  pthread_mutex_unlock(&Writer_mutex);
+  return buffer;
+}
+// Blocking version for the encoder threads, which can afford to wait for the disk
+// They never hold a pool buffer while waiting, and release any partial one between passes,
+// so buffers always come back no matter how many streams there are
+static uint8_t *get_buffer_wait(void){
+  uint8_t *buffer;
+  pthread_mutex_lock(&Writer_mutex);
+  while((buffer = take_buffer()) == NULL)
+    pthread_cond_wait(&Buffer_cond,&Writer_mutex);
+  pthread_mutex_unlock(&Writer_mutex);
+  return buffer;
+}
+
+// Return a buffer to the pool. Caller holds Writer_mutex
+static void put_buffer(uint8_t *buffer){
+  *(void **)buffer = Free_buffers;
+  Free_buffers = buffer;
+  pthread_cond_signal(&Buffer_cond);
+}
+
+static void queue_job(struct wjob *job){
+  job->next = NULL;
+  pthread_mutex_lock(&Writer_mutex);
+  if(Writer_tail != NULL)
+    Writer_tail->next = job;
+  else
+    Writer_head = job;
+  Writer_tail = job;
+  pthread_cond_signal(&Writer_cond);
+  pthread_mutex_unlock(&Writer_mutex);
+}
+
+// Hand the session's current buffer to the writer
+static void flush_buffer(struct session *sp){
+  if(sp->iobuffer == NULL)
+    return;
+  struct wjob * const job = sp->buffer_len != 0 ? calloc(1,sizeof(*job)) : NULL;
+  if(job == NULL){
+    sp->overflows += sp->buffer_len; // Nonzero only if out of memory
+    pthread_mutex_lock(&Writer_mutex);
+    put_buffer(sp->iobuffer);
+    pthread_mutex_unlock(&Writer_mutex);
+  } else {
+    job->type = WRITE_JOB;
+    job->fd = sp->fd;
+    job->offset = sp->buffer_start;
+    job->len = sp->buffer_len;
+    job->buffer = sp->iobuffer;
+    job->pooled = true;
+    queue_job(job);
+  }
+  sp->iobuffer = NULL;
+  sp->buffer_len = 0;
+}
+
+// Append to the session's file at sp->file_offset, which the caller may have advanced past a gap
+// Short gaps within a buffer become explicit silence, longer ones leave holes (which also read as zeroes)
+// With swap set, data is 16-bit samples whose bytes are swapped as they're copied in
+static void session_write(struct session *sp,void const *data,size_t len,bool swap){
+  uint8_t const *dp = data;
+  while(len > 0){
+    if(sp->iobuffer != NULL && sp->file_offset >= sp->buffer_start + BUFFERSIZE)
+      flush_buffer(sp); // Gap runs past the end of this buffer
+    if(sp->iobuffer == NULL){
+      if((sp->iobuffer = get_buffer()) == NULL){
+	// Writer is hopelessly behind. Drop the data rather than stall reception, but keep the timing
+	sp->overflows += len;
+	sp->file_offset += len;
+	break;
+      }
+      sp->buffer_start = sp->file_offset;
+      sp->buffer_len = 0;
+    }
+    size_t const pos = sp->file_offset - sp->buffer_start;
+    if(pos > sp->buffer_len)
+      memset(sp->iobuffer + sp->buffer_len,0,pos - sp->buffer_len);
+    size_t const chunk = min(len,(size_t)(BUFFERSIZE - pos));
+    if(swap){
+      // byteswap.h is linux-specific; need to find a portable way to get the machine instructions
+      uint16_t const * const in = (uint16_t const *)dp;
+      uint16_t * const out = (uint16_t *)(sp->iobuffer + pos); // Whole samples at even offsets, so pos and chunk are even
+      for(size_t n = 0; n < chunk / 2; n++)
+	out[n] = bswap_16(in[n]);
+    } else
+      memcpy(sp->iobuffer + pos,dp,chunk);
+    sp->buffer_len = pos + chunk;
+    sp->file_offset += chunk;
+    dp += chunk;
+    len -= chunk;
+    if(sp->buffer_len == BUFFERSIZE)
+      flush_buffer(sp);
+  }
+  if(sp->file_offset > sp->file_size)
+    sp->file_size = sp->file_offset;
+
+  // Keep file space preallocated ahead of the data so the file stays contiguous on disk
+  if(Prealloc_time > 0 && sp->file_size + BUFFERSIZE > sp->allocated){
+    off_t const rate = sp->encoding == OPUS ? 16000 : sp->header.ByteRate; // Generous for Opus (128 kb/s)
+    off_t const chunk = max((off_t)BUFFERSIZE,(off_t)(Prealloc_time * rate));
+    struct wjob * const job = calloc(1,sizeof(*job));
+    if(job != NULL){ // Only an optimization, skip it if out of memory
+      job->type = ALLOC_JOB;
+      job->fd = sp->fd;
+      job->offset = sp->allocated;
+      job->len = chunk;
+      queue_job(job);
+      sp->allocated += chunk;
+    }
+  }
+}
+
+// Disk writer thread; executes jobs in order, so each file's close follows its writes
+static void *writer(void *arg){
+  (void)arg;
+  pthread_setname("pcmwrite");
+  while(true){
+    pthread_mutex_lock(&Writer_mutex);
+    while(Writer_head == NULL)
+      pthread_cond_wait(&Writer_cond,&Writer_mutex);
+    struct wjob *job = Writer_head;
+    if((Writer_head = job->next) == NULL)
+      Writer_tail = NULL;
+    pthread_mutex_unlock(&Writer_mutex);
+
+    switch(job->type){
+    case OPEN_JOB:
+      open_file(job);
+      break;
+    case WRITE_JOB:
+      for(off_t done = 0; done < job->len;){
+	ssize_t const r = pwrite(job->fd,job->buffer + done,job->len - done,job->offset + done);
+	if(r <= 0){
+	  if(r < 0 && errno == EINTR)
+	    continue;
+	  fprintf(stdout,"pwrite(%d) failed: %s\n",job->fd,strerror(errno));
+	  break;
+	}
+	done += r;
+      }
+      if(job->pooled){
+	pthread_mutex_lock(&Writer_mutex);
+	put_buffer(job->buffer);
+	pthread_mutex_unlock(&Writer_mutex);
+      } else
+	FREE(job->buffer);
+      break;
+    case ALLOC_JOB:
+#if defined(linux)
+      // Reserve space without changing the file size; failures (e.g., unsupported fs) are harmless
+      fallocate(job->fd,FALLOC_FL_KEEP_SIZE,job->offset,job->len);
+#endif
+      break;
+    case CLOSE_JOB:
+      if(job->keep){
+	if(job->rewrite && pwrite(job->fd,&job->header,sizeof(job->header),0) != sizeof(job->header))
+	  fprintf(stdout,"header write to %s failed: %s\n",job->filename,strerror(errno));
+	// Set the final size (in case it ends in a hole) and release unused preallocated space
+	if(ftruncate(job->fd,job->len) != 0)
+	  fprintf(stdout,"ftruncate(%s) failed: %s\n",job->filename,strerror(errno));
+      } else
+	unlink(job->filename);
+      close(job->fd);
+      break;
+    case STOP_JOB:
+      return NULL; // Static, not freed
+    }
+    FREE(job);
+  }
+}
+
+// Drain the queue and stop the writer thread
+static void stop_writer(void){
+  if(!Writer_running)
+    return;
+  Writer_running = false;
+  queue_job(&Stop_job);
+  pthread_join(Writer_thread,NULL);
+}
+
+// FLAC compression stage
+
+// Create the encoder for a new session. It isn't initialized (header written) until the
+// first block reaches an encoder thread, so the receive loop never runs libFLAC
+static struct flac_stream *flac_start(struct session const *sp){
+  struct flac_stream *fs = calloc(1,sizeof(*fs));
+  if(fs == NULL)
+    return NULL;
+  if((fs->encoder = FLAC__stream_encoder_new()) == NULL){
+    FREE(fs);
+    return NULL;
+  }
+  fs->channels = sp->channels;
+  fs->samprate = sp->samprate;
+  fs->fd = sp->fd;
+  strlcpy(fs->filename,sp->filename,sizeof(fs->filename));
+  FLAC__stream_encoder_set_channels(fs->encoder,sp->channels);
+  FLAC__stream_encoder_set_bits_per_sample(fs->encoder,16);
+  FLAC__stream_encoder_set_sample_rate(fs->encoder,sp->samprate);
+  FLAC__stream_encoder_set_compression_level(fs->encoder,Flac_level);
+  FLAC__stream_encoder_set_blocksize(fs->encoder,FLAC_BLOCKSIZE);
+  FLAC__stream_encoder_set_streamable_subset(fs->encoder,sp->samprate <= 655350); // Subset limits the sample rate
+  return fs;
+}
+
+// Hand a block to the encoder pool
+static void flac_submit(struct session *sp,struct fblock *block){
+  struct flac_stream * const fs = sp->flac;
+  block->next = NULL;
+  pthread_mutex_lock(&Encoder_mutex);
+  if(!block->finish && !block->silent && fs->pending >= Max_blocks){
+    // Encoders hopelessly behind. Substitute silence, which costs almost nothing to encode,
+    // rather than block reception or lose our place in time
+    pthread_mutex_unlock(&Encoder_mutex);
+    sp->overflows += block->frames * fs->channels * sizeof(int16_t);
+    struct fblock * const silence = calloc(1,sizeof(*silence));
+    if(silence != NULL){
+      silence->frames = block->frames;
+      silence->silent = true;
+      FREE(block);
+      block = silence;
+    } else
+      block->silent = true; // Keep the original; its data just isn't encoded
+    pthread_mutex_lock(&Encoder_mutex);
+  }
+  if(fs->tail != NULL)
+    fs->tail->next = block;
+  else
+    fs->head = block;
+  fs->tail = block;
+  fs->pending++;
+  if(!fs->busy){
+    // Nobody's working on this stream; put it on the ready queue
+    fs->busy = true;
+    fs->next = NULL;
+    if(Ready_tail != NULL)
+      Ready_tail->next = fs;
+    else
+      Ready_head = fs;
+    Ready_tail = fs;
+    pthread_cond_signal(&Encoder_cond);
+  }
+  pthread_mutex_unlock(&Encoder_mutex);
+}
+
+// Send off the partially filled block, if any
+static void flac_flush(struct session *sp){
+  if(sp->block != NULL && sp->block->frames > 0)
+    flac_submit(sp,sp->block);
+  else
+    FREE(sp->block);
+  sp->block = NULL;
+}
+
+static struct fblock *new_block(int channels){
+  struct fblock * const block = malloc(sizeof(*block) + FLAC_BLOCKSIZE * channels * sizeof(int32_t));
+  assert(block != NULL);
+  block->next = NULL;
+  block->frames = 0;
+  block->silent = false;
+  block->finish = false;
+  return block;
+}
+
+// Append 16-bit samples, big or little endian per the session encoding (count includes all channels)
+static void flac_samples(struct session *sp,int16_t const *samples,int count){
+  int const channels = sp->channels;
+  while(count >= channels){
+    if(sp->block == NULL)
+      sp->block = new_block(channels);
+    struct fblock * const block = sp->block;
+    int const n = min(count / channels,FLAC_BLOCKSIZE - (int)block->frames) * channels;
+    int32_t * const dp = &block->data[block->frames * channels];
+    if(sp->encoding == S16LE){
+      for(int i = 0; i < n; i++)
+	dp[i] = samples[i];
+    } else {
+      for(int i = 0; i < n; i++)
+	dp[i] = (int16_t)ntohs((uint16_t)samples[i]);
+    }
+    block->frames += n / channels;
+    samples += n;
+    count -= n;
+    if(block->frames == FLAC_BLOCKSIZE){
+      flac_submit(sp,block);
+      sp->block = NULL;
+    }
+  }
+}
+
+// Fill a gap in the RTP timestamps with silence, keeping blocks aligned
+// Whole blocks of silence carry no data and encode to a few bytes each. However long the gap,
+// they go out as one run that the encoder feeds to libFLAC a block at a time
+static void flac_silence(struct session *sp,int64_t frames){
+  int const channels = sp->channels;
+  if(sp->block != NULL){
+    struct fblock * const block = sp->block;
+    int const n = min(frames,(int64_t)(FLAC_BLOCKSIZE - block->frames));
+    memset(&block->data[block->frames * channels],0,n * channels * sizeof(int32_t));
+    block->frames += n;
+    frames -= n;
+    if(block->frames == FLAC_BLOCKSIZE){
+      flac_submit(sp,block);
+      sp->block = NULL;
+    }
+  }
+  if(frames >= FLAC_BLOCKSIZE){
+    struct fblock * const silence = calloc(1,sizeof(*silence));
+    assert(silence != NULL);
+    silence->frames = frames - frames % FLAC_BLOCKSIZE;
+    silence->silent = true;
+    flac_submit(sp,silence);
+    frames %= FLAC_BLOCKSIZE;
+  }
+  if(frames > 0){
+    sp->block = new_block(channels);
+    memset(sp->block->data,0,frames * channels * sizeof(int32_t));
+    sp->block->frames = frames;
+  }
+}
+
+// Queue the last partial block and the end of stream
+// The encoder thread that handles the end frees the flac_stream
+static void flac_close(struct session *sp){
+  flac_flush(sp);
+  struct flac_stream *fs = sp->flac;
+  fs->keep = sp->substantial_file;
+  struct fblock * const finish = calloc(1,sizeof(*finish));
+  if(finish != NULL){
+    finish->finish = true;
+    flac_submit(sp,finish);
+  } else {
+    // Out of memory. Let the encoders finish what's queued, then end the stream here
+    pthread_mutex_lock(&Encoder_mutex);
+    while(fs->busy)
+      pthread_cond_wait(&Idle_cond,&Encoder_mutex);
+    pthread_mutex_unlock(&Encoder_mutex);
+    struct fblock const last = { .finish = true };
+    flac_encode(fs,&last);
+    FREE(fs);
+  }
+  sp->flac = NULL;
+}
+
+// Encoder output; buffered and passed to the writer thread like WAV data
+static void flac_out_flush(struct flac_stream *fs){
+  if(fs->iobuffer == NULL)
+    return;
+  struct wjob * const job = calloc(1,sizeof(*job));
+  if(job == NULL){
+    fprintf(stdout,"%s: out of memory, %'zu bytes lost\n",fs->filename,fs->buffer_len);
+    pthread_mutex_lock(&Writer_mutex);
+    put_buffer(fs->iobuffer);
+    pthread_mutex_unlock(&Writer_mutex);
+    fs->iobuffer = NULL;
+    fs->buffer_len = 0;
+    return;
+  }
+  job->type = WRITE_JOB;
+  job->fd = fs->fd;
+  job->offset = fs->buffer_start;
+  job->len = fs->buffer_len;
+  job->buffer = fs->iobuffer;
+  job->pooled = true;
+  queue_job(job);
+  fs->iobuffer = NULL;
+  fs->buffer_len = 0;
+}
+
+static FLAC__StreamEncoderWriteStatus flac_write(FLAC__StreamEncoder const *encoder,FLAC__byte const buffer[],size_t bytes,unsigned samples,unsigned current_frame,void *client){
+  (void)encoder; (void)samples; (void)current_frame;
+  struct flac_stream * const fs = client;
+  while(bytes > 0){
+    if(fs->iobuffer != NULL && fs->offset != fs->buffer_start + (off_t)fs->buffer_len)
+      flac_out_flush(fs); // Encoder seeked
+    if(fs->iobuffer == NULL){
+      fs->iobuffer = get_buffer_wait();
+      fs->buffer_start = fs->offset;
+      fs->buffer_len = 0;
+    }
+    size_t const chunk = min(bytes,BUFFERSIZE - fs->buffer_len);
+    memcpy(fs->iobuffer + fs->buffer_len,buffer,chunk);
+    fs->buffer_len += chunk;
+    fs->offset += chunk;
+    buffer += chunk;
+    bytes -= chunk;
+    if(fs->buffer_len == BUFFERSIZE)
+      flac_out_flush(fs);
+  }
+  if(fs->offset > fs->size)
+    fs->size = fs->offset;
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+// libFLAC seeks back to rewrite STREAMINFO (length, MD5, etc) when it finishes
+// Until then the header says the length is unknown, so the file is readable while it grows
+static FLAC__StreamEncoderSeekStatus flac_seek(FLAC__StreamEncoder const *encoder,FLAC__uint64 offset,void *client){
+  (void)encoder;
+  struct flac_stream * const fs = client;
+  fs->offset = offset;
+  return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamEncoderTellStatus flac_tell(FLAC__StreamEncoder const *encoder,FLAC__uint64 *offset,void *client){
+  (void)encoder;
+  struct flac_stream * const fs = client;
+  *offset = fs->offset;
+  return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+static void flac_encode(struct flac_stream *fs,struct fblock const *block){
+  if(!fs->initialized){
+    fs->initialized = true;
+    FLAC__StreamEncoderInitStatus const status = FLAC__stream_encoder_init_stream(fs->encoder,flac_write,flac_seek,flac_tell,NULL,fs);
+    if(status != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+      fprintf(stdout,"%s: FLAC encoder init failed: %s\n",fs->filename,FLAC__StreamEncoderInitStatusString[status]);
+  }
+  if(block->finish){
+    FLAC__stream_encoder_finish(fs->encoder);
+    FLAC__stream_encoder_delete(fs->encoder);
+    fs->encoder = NULL;
+    flac_out_flush(fs);
+    struct wjob * const job = fs->close_job;
+    fs->close_job = NULL;
+    job->type = CLOSE_JOB;
+    job->fd = fs->fd;
+    job->len = fs->size;
+    job->keep = fs->keep;
+    strlcpy(job->filename,fs->filename,sizeof(job->filename));
+    queue_job(job);
+    return;
+  }
+  if(!block->silent){
+    if(block->frames > 0 && !FLAC__stream_encoder_process_interleaved(fs->encoder,block->data,block->frames) && Verbose)
+      fprintf(stdout,"%s: FLAC encode failed: %s\n",fs->filename,
+	      FLAC__stream_encoder_get_resolved_state_string(fs->encoder));
+    return;
+  }
+  for(int64_t frames = block->frames; frames > 0; frames -= FLAC_BLOCKSIZE){
+    if(!FLAC__stream_encoder_process_interleaved(fs->encoder,Zeroes,min(frames,(int64_t)FLAC_BLOCKSIZE))){
+      if(Verbose)
+	fprintf(stdout,"%s: FLAC encode failed: %s\n",fs->filename,
+		FLAC__stream_encoder_get_resolved_state_string(fs->encoder));
+      break;
+    }
+  }
+}
+
+// Encoder pool thread
+// Takes a stream off the ready queue and encodes everything queued for it, so each stream's
+// blocks are encoded in order by one thread at a time
+static void *encoder(void *arg){
+  (void)arg;
+  pthread_setname("flacenc");
+  pthread_mutex_lock(&Encoder_mutex);
+  while(true){
+    while(Ready_head == NULL && !Encoders_stop)
+      pthread_cond_wait(&Encoder_cond,&Encoder_mutex);
+    if(Ready_head == NULL)
+      break; // Stopping and nothing left to do
+    struct flac_stream *fs = Ready_head;
+    if((Ready_head = fs->next) == NULL)
+      Ready_tail = NULL;
+    fs->next = NULL;
+
+    bool finished = false;
+    while(!finished){
+      if(fs->head == NULL){
+	if(fs->iobuffer == NULL)
+	  break;
+	// Don't sit on a pool buffer while idle; enough idle streams would starve everyone else
+	pthread_mutex_unlock(&Encoder_mutex);
+	flac_out_flush(fs);
+	pthread_mutex_lock(&Encoder_mutex);
+	continue; // More may have been queued meanwhile
+      }
+      struct fblock *block = fs->head;
+      if((fs->head = block->next) == NULL)
+	fs->tail = NULL;
+      fs->pending--;
+      pthread_mutex_unlock(&Encoder_mutex);
+      flac_encode(fs,block);
+      finished = block->finish;
+      FREE(block);
+      pthread_mutex_lock(&Encoder_mutex);
+    }
+    if(finished){
+      FREE(fs); // Nothing can be queued after the finish block
+    } else {
+      fs->busy = false; // Next block queued will put it back on the ready list
+      pthread_cond_broadcast(&Idle_cond);
+    }
+  }
+  pthread_mutex_unlock(&Encoder_mutex);
+  return NULL;
+}
+
+// Let the encoders drain their queues and exit
+static void stop_encoders(void){
+  if(Encoders == NULL)
+    return;
+  pthread_mutex_lock(&Encoder_mutex);
+  Encoders_stop = true;
+  pthread_cond_broadcast(&Encoder_cond);
+  pthread_mutex_unlock(&Encoder_mutex);
+  for(int i = 0; i < Encoder_threads; i++)
+    pthread_join(Encoders[i],NULL);
+  FREE(Encoders);
+}
+
+// Ogg Opus (RFC 7845) output
+// RTP Opus payloads are complete Opus packets, so they're simply packed into Ogg pages
+
+static uint32_t Ogg_crc_table[256];
+
+static void ogg_crc_init(void){
+  for(int i = 0; i < 256; i++){
+    uint32_t r = (uint32_t)i << 24;
+    for(int j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : r << 1;
+    Ogg_crc_table[i] = r;
+  }
+}
+
+static uint32_t ogg_crc(uint32_t crc,uint8_t const *data,int len){
+  while(len-- > 0)
+    crc = (crc << 8) ^ Ogg_crc_table[((crc >> 24) ^ *data++) & 0xff];
+  return crc;
+}
+
+static void put32le(uint8_t *p,uint32_t x){
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+// Write out the packets collected so far as one page
+static void ogg_page(struct session *sp,bool bos,bool eos){
+  uint8_t header[27 + 255];
+  memcpy(header,"OggS",4);
+  header[4] = 0; // Version
+  header[5] = (bos ? 0x2 : 0) | (eos ? 0x4 : 0);
+  put32le(header + 6,(uint32_t)sp->granule);
+  put32le(header + 10,(uint32_t)(sp->granule >> 32));
+  put32le(header + 14,sp->ogg_serial);
+  put32le(header + 18,sp->ogg_pageno++);
+  put32le(header + 22,0); // CRC, computed with this field zero
+  header[26] = sp->ogg_segments;
+  memcpy(header + 27,sp->ogg_lacing,sp->ogg_segments);
+  int const hlen = 27 + sp->ogg_segments;
+  uint32_t crc = ogg_crc(0,header,hlen);
+  crc = ogg_crc(crc,sp->ogg_data,sp->ogg_len);
+  put32le(header + 22,crc);
+  session_write(sp,header,hlen,false);
+  session_write(sp,sp->ogg_data,sp->ogg_len,false);
+  sp->ogg_segments = 0;
+  sp->ogg_len = 0;
+}
+
+// Add a packet to the current page; never split across pages
+static void ogg_add(struct session *sp,uint8_t const *data,int len){
+  int const segments = len / 255 + 1;
+  if(sp->ogg_segments + segments > 255 || sp->ogg_len + len > sp->ogg_size)
+    ogg_page(sp,false,false);
+  if(len > sp->ogg_size){
+    // Gets a page to itself
+    uint8_t * const bigger = realloc(sp->ogg_data,len);
+    if(bigger == NULL)
+      return; // Lost, like a dropped RTP packet
+    sp->ogg_data = bigger;
+    sp->ogg_size = len;
+  }
+  for(int i = 0; i < segments - 1; i++)
+    sp->ogg_lacing[sp->ogg_segments++] = 255;
+  sp->ogg_lacing[sp->ogg_segments++] = len % 255;
+  memcpy(sp->ogg_data + sp->ogg_len,data,len);
+  sp->ogg_len += len;
+}
+
+// Write the identification and comment headers, each on its own page as required
+static void ogg_start(struct session *sp){
+  if(Ogg_crc_table[1] == 0)
+    ogg_crc_init();
+  sp->ogg_serial = sp->ssrc;
+  sp->ogg_pageno = 0;
+  sp->granule = 0;
+  sp->file_offset = sp->file_size = 0;
+
+  uint8_t head[19];
+  memcpy(head,"OpusHead",8);
+  head[8] = 1; // Version
+  head[9] = sp->channels;
+  // Pre-skip: we don't know the sender's encoder lookahead; this is libopus's at 48 kHz
+  head[10] = 312 & 0xff;
+  head[11] = 312 >> 8;
+  put32le(head + 12,48000); // Original sample rate, informational only
+  head[16] = 0; head[17] = 0; // Output gain
+  head[18] = 0; // Channel mapping family 0: mono or stereo
+  ogg_add(sp,head,sizeof(head));
+  ogg_page(sp,true,false);
+
+  char const vendor[] = "ka9q-radio pcmrecord";
+  uint8_t tags[8 + 4 + sizeof(vendor) - 1 + 4];
+  memcpy(tags,"OpusTags",8);
+  put32le(tags + 8,sizeof(vendor) - 1);
+  memcpy(tags + 12,vendor,sizeof(vendor) - 1);
+  put32le(tags + 12 + sizeof(vendor) - 1,0); // No user comments
+  ogg_add(sp,tags,sizeof(tags));
+  ogg_page(sp,false,false);
+}
+
+// Pages of about a second each keep the overhead small; the file is valid after every page
+static void ogg_packet(struct session *sp,uint8_t const *data,int len,int samples){
+  ogg_add(sp,data,len);
+  sp->granule += samples;
+  if(sp->ogg_len >= OGG_PAGE_TARGET || sp->ogg_segments >= 50)
+    ogg_page(sp,false,false);
+}
+
+// Cover a gap in the RTP timestamps with empty Opus frames, which decoders treat as lost
+// (concealed, fading to silence). Each costs a byte or two, so the timing stays exact
+static void ogg_silence(struct session *sp,int64_t samples){
+  uint8_t const stereo = sp->channels == 2 ? 0x4 : 0;
+  while(samples >= 5760){
+    // Code 3 packet, six empty 20 ms CELT frames
+    uint8_t const packet[2] = { (31 << 3) | stereo | 3, 6 };
+    ogg_packet(sp,packet,sizeof(packet),5760);
+    samples -= 5760;
+  }
+  // CELT configs 28-31 are 2.5, 5, 10 and 20 ms
+  for(int config = 31; config >= 28; config--){
+    int const frame = 120 << (config - 28);
+    while(samples >= frame){
+      uint8_t const packet = (config << 3) | stereo;
+      ogg_packet(sp,&packet,1,frame);
+      samples -= frame;
+    }
+  }
+  // Anything under 2.5 ms is dropped
+}
+
+static void ogg_flush(struct session *sp,bool eos){
+  if(sp->ogg_segments > 0 || eos)
+    ogg_page(sp,false,eos);
+}
@@ -1,5 +1,31 @@
 // Receive and demux RTP PCM streams into a command pipeline
 // Copyright 2023 Phil Karn, KA9Q
+//
+// By default each new stream (sender, SSRC, payload type) gets its own copy of the command,
+// run as "command addr:port ssrc type samprate channels" with raw big-endian PCM on its stdin.
+// The pipe is closed after --timeout seconds of inactivity.
+//
+// With --workers N, up to N long-lived copies of the command (run with no extra arguments)
+// are shared by all streams. Each stream is assigned to the least loaded worker, and a new
+// worker is only started when every running one is busy. Workers left idle for --linger seconds
+// are closed. A worker's stdin carries a sequence of frames, each a 16-byte header followed by
+// 'length' bytes; all header fields are big-endian:
+//
+//   0  type       1 = start, 2 = data, 3 = end
+//   1  channels
+//   2  RTP payload type
+//   3  (zero)
+//   4  SSRC
+//   8  sample rate, Hz
+//  12  length of what follows
+//
+// A start frame carries the sender as "addr:port" text. Data frames carry 16-bit PCM exactly
+// as the per-stream command would see it, including silence inserted for lost packets.
+// An end frame (no data) follows the last data frame for a stream.
+//
+// Each command's stdin is written by a thread of its own, so a command that's slow to read holds up
+// only its own streams. If one falls more than a few seconds behind, data for it is discarded
+// (whole data frames with --workers) and the loss is logged when the stream or worker is closed.
 #define _GNU_SOURCE 1
 #include <assert.h>
 #include <errno.h>
@@ -20,24 +46,61 @@
 #include <signal.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sysexits.h>
 
 #include "misc.h"
 #include "multicast.h"
 #include "status.h"
 #include "iir.h"
+#include "sessions.h"
+
+enum frame_type {
+  FRAME_START = 1,
+  FRAME_DATA,
+  FRAME_END,
+};
+#define FRAME_HEADER 16
+
+// Output to one command. Only the writer thread writes to the pipe, never the receive loop
+struct chunk {
+  struct chunk *next;
+  size_t len;
+  uint8_t data[];
+};
+struct writer {
+  FILE *pipe;               // NULL when not running
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct chunk *head;       // Waiting to be written
+  struct chunk *tail;
+  size_t queued;            // Bytes waiting
+  bool stop;                // Exit when the queue is empty
+  bool failed;              // Write error; the command is gone
+  int error;                // errno of the failure
+  uint64_t dropped;         // Data bytes discarded because the command fell behind
+};
+
+struct worker {
+  struct writer out;
+  int sessions;             // Streams currently assigned
+  int64_t idle_since;       // When sessions last dropped to zero
+  uint64_t frames;
+};
 
 struct session {
-  struct session *prev;       // Linked list pointers
-  struct session *next; 
+  struct session_entry entry; // In Sessions table, keyed on sender address/port and SSRC
   int type;                 // input RTP type (10,11)
+  int samprate;
+  int channels;
   
-  struct sockaddr sender;
+  struct sockaddr_storage sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
   char port[NI_MAXSERV];    // RTP Sender source port
 
-  FILE *pipe;
-  int64_t last_active;
+  struct writer out;        // Per-stream command
+  struct worker *worker;    // or shared worker
  
   struct rtp_state rtp_state; // RTP input state
 
@@ -50,6 +113,10 @@ struct session {
 // Command line params
 char const *App_path;
 int Verbose;                  // Verbosity flag (currently unused)
+static int64_t Timeout = 20;  // Seconds of inactivity before a stream is ended
+static int Max_workers = 0;   // 0 = one command per stream
+static int64_t Linger = 60;   // Seconds an idle worker is kept around
+static size_t const Queue_limit = 1 << 22; // Bytes queued for one command before its data is dropped, ~20 s of a 48 kHz stereo stream
 
 // Global variables
 pthread_t Status_thread;
@@ -59,17 +126,24 @@ pthread_cond_t Input_ready_cond = PTHREAD_COND_INITIALIZER;
 int Status_fd = -1;           // Reading from radio status
 int Status_out_fd = -1;       // Writing to radio status
 int Input_fd = -1;            // Multicast receive socket
-struct session *Sessions;
-pthread_mutex_t Session_protect = PTHREAD_MUTEX_INITIALIZER;
+static struct session_table Sessions;
+static struct worker *Workers; // Max_workers entries; out.pipe == NULL when not running
+static volatile sig_atomic_t Exit_requested;
 char const *Command;
 char const *Input;
 char const *Status;
 
 void closedown(int);
-struct session *lookup_session(const struct sockaddr *,uint32_t,int);
-struct session *create_session(void);
-int close_session(struct session *);
-int send_samples(struct session *sp);
+static void process_packet(struct packet *pkt,struct sockaddr const *sender);
+static struct session *create_session(struct packet const *pkt,struct sockaddr const *sender);
+static void close_session(struct session **spp);
+static int session_write(struct session *sp,enum frame_type type,void const *data,size_t len);
+static void close_worker(struct worker *wp);
+static void reap_workers(int64_t now);
+static int writer_start(struct writer *w,char const *command);
+static void writer_stop(struct writer *w);
+static int writer_queue(struct writer *w,void const *header,size_t hlen,void const *data,size_t len,bool droppable);
+static void *writer_thread(void *arg);
 void *status(void *);
 static int send_poll(int fd,int ssrc);
 
@@ -77,15 +151,18 @@ struct option Options[] =
   {
    {"iface", required_argument, NULL, 'A'},
    {"pcm-in", required_argument, NULL, 'I'},
+   {"linger", required_argument, NULL, 'l'},
    {"name", required_argument, NULL, 'N'},
    {"status-in", required_argument, NULL, 'S'},
+   {"timeout", required_argument, NULL, 't'},
+   {"workers", required_argument, NULL, 'w'},
    {"verbose", no_argument, NULL, 'v'},
    {"version", no_argument, NULL, 'V'},
    {NULL, 0, NULL, 0},
 
   };
    
-char Optstring[] = "A:I:N:S:vV";
+char Optstring[] = "A:I:l:N:S:t:vVw:";
 
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
@@ -116,11 +193,25 @@ int main(int argc,char * const argv[]){
     case 'S':
       Status = optarg;
       break;
+    case 'l':
+      Linger = strtoll(optarg,NULL,0);
+      break;
+    case 't':
+      {
+	char *ptr;
+	int64_t x = strtoll(optarg,&ptr,0);
+	if(ptr != optarg && x > 0)
+	  Timeout = x;
+      }
+      break;
+    case 'w':
+      Max_workers = strtol(optarg,NULL,0);
+      break;
     case 'v':
       Verbose++;
       break;
     default:
-      fprintf(stderr,"Usage: \n");
+      fprintf(stderr,"Usage: %s [-v] [-t timeout] [-w workers [-l linger]] --pcm-in|--status-in mcast_address command\n",argv[0]);
       exit(EX_USAGE);
     }
   }
@@ -157,6 +248,12 @@ int main(int argc,char * const argv[]){
 
   assert(Input_fd != -1);
 
+  if(Max_workers > 0){
+    Workers = calloc(Max_workers,sizeof(*Workers));
+    assert(Workers != NULL);
+  }
+  session_table_init(&Sessions,Timeout * BILLION,BILLION,gps_time_ns());
+
   // Graceful signal catch
   signal(SIGPIPE,closedown);
   signal(SIGINT,closedown);
@@ -165,112 +262,381 @@ int main(int argc,char * const argv[]){
   signal(SIGTERM,closedown);
   signal(SIGPIPE,SIG_IGN);
 
-  // Loop forever processing and dispatching incoming PCM packets
-  // Process incoming RTP packets, demux to per-SSRC thread
+  // Loop processing and dispatching incoming PCM packets until told to stop
   struct packet *pkt = NULL;
-  while(true){
-    // Need a new packet buffer?
-    if(!pkt)
-      pkt = malloc(sizeof(*pkt));
-    // Zero these out to catch any uninitialized derefs
-    pkt->next = NULL;
-    pkt->data = NULL;
-    pkt->len = 0;
+  int status = EX_OK; // Also for a requested exit (SIGTERM/SIGINT)
+  while(!Exit_requested){
+    // Return the last one to the pool if it wasn't queued
+    packet_free(&pkt);
+
+    struct pollfd pfd;
+    pfd.fd = Input_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int const n = poll(&pfd,1,1000); // Wait 1 sec max so idle sessions and workers get closed
+    if(n < 0 && errno != EINTR){
+      perror("poll");
+      status = EX_OSERR;
+      break;
+    }
+    if(pfd.revents & (POLLIN|POLLPRI)){
+      struct sockaddr_storage sender;
+      socklen_t socksize = sizeof(sender);
+      int size = packet_recv(Input_fd,&pkt,(struct sockaddr *)&sender,&socksize);
     
-    struct sockaddr_storage sender;
-    socklen_t socksize = sizeof(sender);
-    int size = recvfrom(Input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+      if(size == -1){
+	if(errno != EINTR){ // Happens routinely, e.g., when window resized
+	  perror("recvfrom");
+	  usleep(1000);
+	}
+	continue;
+      }
+      if(size <= RTP_MIN_SIZE)
+	continue; // Must be big enough for RTP header and at least some data
     
-    if(size == -1){
-      if(errno != EINTR){ // Happens routinely, e.g., when window resized
-	perror("recvfrom");
-	usleep(1000);
+      // Extract and convert RTP header to host format
+      uint8_t const *dp = ntoh_rtp(&pkt->rtp,pkt->content);
+      pkt->data = dp;
+      pkt->len = size - (dp - pkt->content);
+      if(pkt->rtp.pad){
+	pkt->len -= dp[pkt->len-1];
+	pkt->rtp.pad = 0;
       }
-      continue;  // Reuse current buffer
+      if(pkt->len <= 0)
+	continue; // Used to be an assert, but would be triggered by bogus packets
+      process_packet(pkt,(struct sockaddr *)&sender);
     }
-    if(size <= RTP_MIN_SIZE)
-      continue; // Must be big enough for RTP header and at least some data
-    
-    // Extract and convert RTP header to host format
-    uint8_t const *dp = ntoh_rtp(&pkt->rtp,pkt->content);
-    pkt->data = dp;
-    pkt->len = size - (dp - pkt->content);
-    if(pkt->rtp.pad){
-      pkt->len -= dp[pkt->len-1];
-      pkt->rtp.pad = 0;
+    // End idle streams. The timer wheel only looks at sessions that might have expired
+    int64_t const now = gps_time_ns();
+    struct session_entry *entry;
+    while((entry = session_expire(&Sessions,now)) != NULL){
+      struct session *sp = entry->owner;
+      if(Verbose)
+	fprintf(stderr,"Session %s:%s ssrc %u idle, closing\n",sp->addr,sp->port,sp->rtp_state.ssrc);
+      close_session(&sp);
     }
-    if(pkt->len <= 0)
-      continue; // Used to be an assert, but would be triggered by bogus packets
-    
-    // Find appropriate session; create new one if necessary
-    struct session *sp = lookup_session((const struct sockaddr *)&sender,pkt->rtp.ssrc,pkt->rtp.type);
-    if(!sp){
-      // Not found; create new session
-      sp = create_session();
-      assert(sp != NULL);
-      // Initialize
-      getnameinfo((struct sockaddr *)&sender,sizeof(sender),sp->addr,sizeof(sp->addr),
-		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      memcpy(&sp->sender,&sender,sizeof(struct sockaddr));
-      sp->rtp_state.ssrc = pkt->rtp.ssrc;
-      sp->rtp_state.seq = pkt->rtp.seq; // Can cause a spurious drop indication if # pcm pkts != # opus pkts
-      sp->rtp_state.timestamp = pkt->rtp.timestamp;
-      sp->type = pkt->rtp.type;
-
-      // Spawn per-SSRC command
-      // Command needs to be a macro-substituted string with params:
-      // Channels
-      // sample rate
-      // sending IP address & port
-      
-      char command_line[4096]; // I think that's the longest shell command
-      int const samprate = samprate_from_pt(sp->type);
-      int const channels = channels_from_pt(sp->type);
-
-      snprintf(command_line,sizeof(command_line),"%s %s:%s %d %d %d %d",
-	       Command,sp->addr,sp->port,sp->rtp_state.ssrc,sp->type,samprate,channels);
-      fprintf(stderr,"New session, %s\n",command_line);
-
-      if((sp->pipe = popen(command_line,"w")) == NULL){
-	fprintf(stderr,"popen(%s) failed: %s\n",command_line,strerror(errno));
-	close_session(sp);
-	continue;
+    reap_workers(now);
+  }
+  packet_free(&pkt);
+  // Let the commands see the ends of their streams
+  struct session_entry *entry;
+  while((entry = session_first(&Sessions)) != NULL){
+    struct session *sp = entry->owner;
+    close_session(&sp);
+  }
+  for(int i = 0; i < Max_workers; i++)
+    close_worker(&Workers[i]);
+  exit(status);
+}
+
+static void process_packet(struct packet *pkt,struct sockaddr const *sender){
+  // Find appropriate session; create new one if necessary
+  struct session_entry * const entry = session_lookup(&Sessions,sender,pkt->rtp.ssrc);
+  struct session *sp = entry != NULL ? entry->owner : NULL;
+  if(sp != NULL && sp->type != pkt->rtp.type)
+    close_session(&sp); // Format changed; start over as a new stream
+
+  if(sp == NULL && (sp = create_session(pkt,sender)) == NULL)
+    return;
+
+  sp->packets++; // Count all packets, regardless of type
+  session_touch(&sp->entry,gps_time_ns()); // for reaping long-idle sessions
+
+  int const channels = sp->channels;
+  int const frame_size = pkt->len / (sizeof(int16_t) * channels); // PCM sample times
+  if(frame_size <= 0)
+    return; // garbled packet?
+
+  int const samples_skipped = rtp_process(&sp->rtp_state,&pkt->rtp,frame_size);
+  if(samples_skipped < 0)
+    return; // Old dupe
+
+  if(samples_skipped){
+    if(samples_skipped < 4 * 48000){ // 4 sec @ 48kHz is arbitrary
+      sp->dropped_samples += samples_skipped;
+      if(session_write(sp,FRAME_DATA,NULL,sizeof(int16_t) * channels * samples_skipped) != 0){
+	close_session(&sp);
+	return;
       }
+    } else {
+      sp->resets++;
     }
-    sp->packets++; // Count all packets, regardless of type
-    sp->last_active = gps_time_ns(); // for reaping long-idle sessions
-
-    int const channels = channels_from_pt(sp->type);
-    int const frame_size = pkt->len / (sizeof(int16_t) * channels); // PCM sample times
-    if(frame_size <= 0)
-      goto endloop; // garbled packet?
-
-    int const samples_skipped = rtp_process(&sp->rtp_state,&pkt->rtp,frame_size);
-    if(samples_skipped < 0)
-      goto endloop; // Old dupe
-
-    if(samples_skipped){
-      if(samples_skipped < 4 * 48000){ // 4 sec @ 48kHz is arbitrary
-	sp->dropped_samples += samples_skipped;
-	int const padding = 2 * channels * samples_skipped;
-	
-	for(int i=0; i < padding; i++)
-	  fputc(0,sp->pipe);
-      } else {
-	sp->resets++;
-      }
+  }
+  // raw copy, probably in network byte order
+  if(session_write(sp,FRAME_DATA,pkt->data,pkt->len) != 0)
+    close_session(&sp); // Error to pipe
+}
+
+// Pick a worker for a new stream, starting one if every running worker is busy and we're under the cap
+static struct worker *assign_worker(void){
+  struct worker *best = NULL;
+  struct worker *unused = NULL;
+  for(int i = 0; i < Max_workers; i++){
+    struct worker * const wp = &Workers[i];
+    if(wp->out.pipe == NULL){
+      // A dead worker's slot is reused only after its orphaned streams have been closed
+      if(unused == NULL && wp->sessions == 0)
+	unused = wp;
+    } else if(best == NULL || wp->sessions < best->sessions)
+      best = wp;
+  }
+  if(unused != NULL && (best == NULL || best->sessions > 0)){
+    if(writer_start(&unused->out,Command) != 0)
+      return best; // Make do with the ones we have
+    unused->sessions = 0;
+    unused->frames = 0;
+    if(Verbose)
+      fprintf(stderr,"Started worker %d\n",(int)(unused - Workers));
+    return unused;
+  }
+  return best;
+}
+
+static void close_worker(struct worker *wp){
+  if(wp == NULL || wp->out.pipe == NULL)
+    return;
+  writer_stop(&wp->out);
+  if(wp->out.dropped != 0)
+    fprintf(stderr,"Worker %d fell behind, %llu bytes dropped\n",(int)(wp - Workers),(unsigned long long)wp->out.dropped);
+  if(Verbose)
+    fprintf(stderr,"Closed worker %d after %llu frames\n",(int)(wp - Workers),(unsigned long long)wp->frames);
+}
+
+// Close workers that have had nothing to do for Linger seconds
+static void reap_workers(int64_t now){
+  for(int i = 0; i < Max_workers; i++){
+    struct worker * const wp = &Workers[i];
+    if(wp->out.pipe != NULL && wp->sessions == 0 && now - wp->idle_since >= Linger * BILLION)
+      close_worker(wp);
+  }
+}
+
+static struct session *create_session(struct packet const *pkt,struct sockaddr const *sender){
+  int const samprate = samprate_from_pt(pkt->rtp.type);
+  int const channels = channels_from_pt(pkt->rtp.type);
+  if(channels <= 0 || samprate <= 0)
+    return NULL; // Not a PCM type we know about
+
+  struct session *sp = calloc(1,sizeof(*sp));
+  assert(sp != NULL); // Shouldn't happen on modern machines!
+  getnameinfo(sender,sizeof(struct sockaddr_storage),sp->addr,sizeof(sp->addr),
+	      sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
+  memcpy(&sp->sender,sender,sizeof(sp->sender));
+  sp->rtp_state.ssrc = pkt->rtp.ssrc;
+  sp->rtp_state.seq = pkt->rtp.seq; // Can cause a spurious drop indication if # pcm pkts != # opus pkts
+  sp->rtp_state.timestamp = pkt->rtp.timestamp;
+  sp->type = pkt->rtp.type;
+  sp->samprate = samprate;
+  sp->channels = channels;
+
+  if(Max_workers > 0){
+    if((sp->worker = assign_worker()) == NULL){
+      FREE(sp);
+      return NULL;
+    }
+    sp->worker->sessions++;
+    char text[NI_MAXHOST + NI_MAXSERV + 2];
+    int const len = snprintf(text,sizeof(text),"%s:%s",sp->addr,sp->port);
+    if(Verbose)
+      fprintf(stderr,"New session %s ssrc %u type %d on worker %d\n",text,sp->rtp_state.ssrc,sp->type,(int)(sp->worker - Workers));
+    if(session_write(sp,FRAME_START,text,len) != 0){
+      close_session(&sp);
+      return NULL;
     }
-    // raw copy, probably in network byte order
-    if(fwrite(pkt->data,1,pkt->len,sp->pipe) != pkt->len){
-      // Error to pipe
-      close_session(sp);
-      sp = NULL;
+  } else {
+    // Spawn per-SSRC command
+    // Command needs to be a macro-substituted string with params:
+    // Channels
+    // sample rate
+    // sending IP address & port
+    char command_line[4096]; // I think that's the longest shell command
+    snprintf(command_line,sizeof(command_line),"%s %s:%s %d %d %d %d",
+	     Command,sp->addr,sp->port,sp->rtp_state.ssrc,sp->type,samprate,channels);
+    fprintf(stderr,"New session, %s\n",command_line);
+
+    if(writer_start(&sp->out,command_line) != 0){
+      FREE(sp);
+      return NULL;
     }
-  endloop:;
-    FREE(pkt);
   }
+  session_insert(&Sessions,&sp->entry,sender,sp->rtp_state.ssrc,sp,gps_time_ns());
+  return sp;
+}
+
+// Send to the stream's command, or frame it for its worker
+// data == NULL means len bytes of silence
+// Never blocks; the writer thread does the actual output
+static int session_write(struct session *sp,enum frame_type type,void const *data,size_t len){
+  struct writer * const w = sp->worker != NULL ? &sp->worker->out : &sp->out;
+  uint8_t header[FRAME_HEADER];
+  size_t hlen = 0;
+  if(sp->worker != NULL){
+    uint8_t *bp = header;
+    *bp++ = type;
+    *bp++ = sp->channels;
+    *bp++ = sp->type;
+    *bp++ = 0;
+    bp = put32(bp,sp->rtp_state.ssrc);
+    bp = put32(bp,sp->samprate);
+    bp = put32(bp,len);
+    hlen = sizeof(header);
+  }
+  // Data may be dropped if the command is too far behind, but never the start and end of a stream
+  if(writer_queue(w,header,hlen,data,len,type == FRAME_DATA) != 0){
+    if(sp->worker != NULL){
+      // The worker is gone; every stream on it will be restarted on another worker with its next packet
+      fprintf(stderr,"Worker %d write error: %s\n",(int)(sp->worker - Workers),strerror(w->error));
+      close_worker(sp->worker);
+    }
+    return -1;
+  }
+  if(sp->worker != NULL)
+    sp->worker->frames++;
+  return 0;
+}
+
+static void close_session(struct session **spp){
+  if(spp == NULL || *spp == NULL)
+    return;
+  struct session *sp = *spp;
+  session_remove(&Sessions,&sp->entry);
+  if(sp->worker != NULL){
+    if(sp->worker->out.pipe != NULL)
+      session_write(sp,FRAME_END,NULL,0);
+    if(--sp->worker->sessions == 0)
+      sp->worker->idle_since = gps_time_ns();
+  } else if(sp->out.pipe != NULL){
+    writer_stop(&sp->out);
+    if(sp->out.dropped != 0)
+      fprintf(stderr,"Session %s:%s ssrc %u: command fell behind, %llu bytes dropped\n",
+	      sp->addr,sp->port,sp->rtp_state.ssrc,(unsigned long long)sp->out.dropped);
+  }
+  FREE(sp);
+  *spp = NULL;
+}
+
+// Start a command and the thread that feeds it
+static int writer_start(struct writer *w,char const *command){
+  memset(w,0,sizeof(*w));
+  if((w->pipe = popen(command,"w")) == NULL){
+    fprintf(stderr,"popen(%s) failed: %s\n",command,strerror(errno));
+    return -1;
+  }
+  pthread_mutex_init(&w->mutex,NULL);
+  pthread_cond_init(&w->cond,NULL);
+  if(pthread_create(&w->thread,NULL,writer_thread,w) != 0){
+    fprintf(stderr,"can't start writer for %s\n",command);
+    pclose(w->pipe);
+    w->pipe = NULL;
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+    return -1;
+  }
+  return 0;
+}
+
+// Write out what's queued, then close the command's stdin and wait for it to exit
+static void writer_stop(struct writer *w){
+  if(w->pipe == NULL)
+    return;
+  pthread_mutex_lock(&w->mutex);
+  w->stop = true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread,NULL);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+  pclose(w->pipe);
+  w->pipe = NULL;
+}
+
+// Queue header and data (or len bytes of silence if data == NULL) as one unit
+// Returns -1 if the command has failed
+static int writer_queue(struct writer *w,void const *header,size_t hlen,void const *data,size_t len,bool droppable){
+  if(w->pipe == NULL)
+    return -1;
+  pthread_mutex_lock(&w->mutex);
+  bool const failed = w->failed;
+  bool const full = w->queued + hlen + len > Queue_limit;
+  pthread_mutex_unlock(&w->mutex);
+  if(failed)
+    return -1;
+  if(full && droppable){
+    w->dropped += len; // Only touched by this thread
+    return 0;
+  }
+  struct chunk * const cp = malloc(sizeof(*cp) + hlen + len);
+  if(cp == NULL){
+    w->dropped += len;
+    return droppable ? 0 : -1;
+  }
+  cp->next = NULL;
+  cp->len = hlen + len;
+  if(hlen > 0)
+    memcpy(cp->data,header,hlen);
+  if(data != NULL)
+    memcpy(cp->data + hlen,data,len);
+  else
+    memset(cp->data + hlen,0,len);
+
+  pthread_mutex_lock(&w->mutex);
+  if(w->tail != NULL)
+    w->tail->next = cp;
+  else
+    w->head = cp;
+  w->tail = cp;
+  w->queued += cp->len;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  return 0;
 }
 
+static void *writer_thread(void *arg){
+  struct writer * const w = arg;
+  pthread_setname("pcmspawn-out");
+  int const fd = fileno(w->pipe);
+  pthread_mutex_lock(&w->mutex);
+  while(true){
+    while(w->head == NULL && !w->stop)
+      pthread_cond_wait(&w->cond,&w->mutex);
+    struct chunk *cp = w->head;
+    if(cp == NULL)
+      break; // Stopping, and everything's written
+    if((w->head = cp->next) == NULL)
+      w->tail = NULL;
+    pthread_mutex_unlock(&w->mutex);
+
+    int error = 0;
+    for(size_t done = 0; done < cp->len;){
+      ssize_t const r = write(fd,cp->data + done,cp->len - done);
+      if(r < 0 && errno == EINTR)
+	continue;
+      if(r <= 0){
+	error = r < 0 ? errno : EPIPE;
+	break;
+      }
+      done += r;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->queued -= cp->len;
+    FREE(cp);
+    if(error != 0){
+      // Command is gone; discard the rest
+      w->failed = true;
+      w->error = error;
+      while(w->head != NULL){
+	struct chunk *next = w->head->next;
+	w->queued -= w->head->len;
+	FREE(w->head);
+	w->head = next;
+      }
+      w->tail = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
 
 // Monitor and report to radio status channel (only if specified)
 void * status(void *p){
@@ -385,77 +751,10 @@ void * status(void *p){
 
 
 
-struct session *lookup_session(const struct sockaddr * const sender,const uint32_t ssrc,int type){
-  struct session *sp;
-  pthread_mutex_lock(&Session_protect);
-  for(sp = Sessions; sp != NULL; sp = sp->next){
-    if(sp->rtp_state.ssrc == ssrc && address_match(&sp->sender,sender) && sp->type == type){
-      // Found it
-      if(sp->prev != NULL){
-	// Not at top of list; move it there
-	if(sp->next != NULL)
-	  sp->next->prev = sp->prev;
-
-	sp->prev->next = sp->next;
-	sp->prev = NULL;
-	sp->next = Sessions;
-	Sessions->prev = sp;
-	Sessions = sp;
-      }
-      break;
-    }
-  }
-  pthread_mutex_unlock(&Session_protect);
-  return sp;
-}
-// Create a new session, partly initialize
-struct session *create_session(void){
-
-  struct session * const sp = calloc(1,sizeof(*sp));
-  assert(sp != NULL); // Shouldn't happen on modern machines!
-  
-  // Initialize entry
-
-  // Put at head of list
-  pthread_mutex_lock(&Session_protect);
-  sp->prev = NULL;
-  sp->next = Sessions;
-  if(sp->next != NULL)
-    sp->next->prev = sp;
-  Sessions = sp;
-  pthread_mutex_unlock(&Session_protect);
-  return sp;
-}
-
-int close_session(struct session *sp){
-  assert(sp != NULL);
-  
-  // Remove from linked list of sessions
-  pthread_mutex_lock(&Session_protect);
-  if(sp->next != NULL)
-    sp->next->prev = sp->prev;
-  if(sp->prev != NULL)
-    sp->prev->next = sp->next;
-  else
-    Sessions = sp->next;
-  pthread_mutex_unlock(&Session_protect);
-  pclose(sp->pipe);
-  FREE(sp);
-  return 0;
-}
+// Only set a flag; the main loop closes the streams and workers
 void closedown(int s){
-#if 0
-  // Causes deadlock when we get called from a section where Session_protect is already locked
-  // Which is the usual case
-  // Not really necessary anyway, since we're exiting
-  pthread_mutex_lock(&Session_protect);
-  while(Sessions != NULL)
-    close_session(Sessions);
-  pthread_mutex_unlock(&Session_protect);
-#endif
-
-  pthread_mutex_destroy(&Session_protect);
-  exit(EX_SOFTWARE);
+  (void)s;
+  Exit_requested = 1;
 }
 // Send empty poll command on specified descriptor
 static int send_poll(int fd,int ssrc){
@@ -0,0 +1,161 @@
+// Pool of RTP packet buffers shared by all receivers
+//
+// A struct packet used to embed a PKTSIZE (64 KiB) buffer and was malloc'ed for every
+// datagram, though nearly all are under 1500 bytes. Now packets come in a few size classes,
+// carved out of large slabs that are never freed. Free packets sit on a lock-free stack per
+// class (a Treiber stack with a generation count against ABA), so allocation on the receive
+// path and freeing on another thread need neither malloc nor a lock.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "misc.h"
+#include "multicast.h"
+
+#define SLAB_BYTES (256*1024)  // Roughly; at least one packet per slab
+#define MAX_SLABS 4096         // Per class
+
+// Precedes each packet in a slab
+struct slot {
+  _Atomic uint32_t next;       // Free list link: index + 1 of next free slot, 0 = end
+  uint32_t index;
+  int class;
+};
+#define SLOT_HEADER ((sizeof(struct slot) + 15) & ~(size_t)15)
+#define SLOT_PACKET(s) ((struct packet *)((uint8_t *)(s) + SLOT_HEADER))
+
+static struct pool_class {
+  int size;                    // Capacity of content[]
+  size_t stride;               // Bytes per slot
+  unsigned int per_slab;
+  _Atomic uint64_t head;       // Generation << 32 | (index + 1) of first free slot
+  _Atomic unsigned int nslabs;
+  uint8_t *slabs[MAX_SLABS];
+  pthread_mutex_t grow_mutex;
+} Classes[] = {
+  { .size = 1536, .grow_mutex = PTHREAD_MUTEX_INITIALIZER },   // Ethernet MTU
+  { .size = 9216, .grow_mutex = PTHREAD_MUTEX_INITIALIZER },   // Jumbo frames
+  { .size = PKTSIZE, .grow_mutex = PTHREAD_MUTEX_INITIALIZER },// Anything, e.g., over loopback
+};
+#define NCLASSES (sizeof(Classes)/sizeof(Classes[0]))
+
+static inline struct slot *slot_at(struct pool_class *c,uint32_t index){
+  return (struct slot *)(c->slabs[index / c->per_slab] + (size_t)(index % c->per_slab) * c->stride);
+}
+
+// Push the chain first..last (already linked) onto the free list
+static void push_chain(struct pool_class *c,struct slot *first,struct slot *last){
+  uint64_t head = atomic_load_explicit(&c->head,memory_order_relaxed);
+  uint64_t newhead;
+  do {
+    atomic_store_explicit(&last->next,(uint32_t)head,memory_order_relaxed);
+    newhead = ((head >> 32) + 1) << 32 | (first->index + 1);
+  } while(!atomic_compare_exchange_weak_explicit(&c->head,&head,newhead,memory_order_release,memory_order_relaxed));
+}
+
+// Add a slab of free slots to a class; slabs are never returned
+static int grow(struct pool_class *c){
+  pthread_mutex_lock(&c->grow_mutex);
+  if(c->stride == 0){
+    c->stride = (SLOT_HEADER + sizeof(struct packet) + c->size + 15) & ~(size_t)15;
+    c->per_slab = SLAB_BYTES / c->stride > 0 ? SLAB_BYTES / c->stride : 1;
+  }
+  // Someone else may have just done it
+  if((uint32_t)atomic_load_explicit(&c->head,memory_order_acquire) != 0){
+    pthread_mutex_unlock(&c->grow_mutex);
+    return 0;
+  }
+  unsigned int const n = atomic_load_explicit(&c->nslabs,memory_order_relaxed);
+  uint8_t *slab;
+  if(n >= MAX_SLABS || (slab = aligned_alloc(64,(c->per_slab * c->stride + 63) & ~(size_t)63)) == NULL){
+    pthread_mutex_unlock(&c->grow_mutex);
+    return -1;
+  }
+  c->slabs[n] = slab;
+  atomic_store_explicit(&c->nslabs,n+1,memory_order_release);
+  struct slot *prev = NULL;
+  for(unsigned int i = 0; i < c->per_slab; i++){
+    struct slot * const s = (struct slot *)(slab + (size_t)i * c->stride);
+    s->index = n * c->per_slab + i;
+    s->class = c - Classes;
+    SLOT_PACKET(s)->size = c->size;
+    if(prev != NULL)
+      atomic_store_explicit(&prev->next,s->index + 1,memory_order_relaxed);
+    prev = s;
+  }
+  push_chain(c,(struct slot *)slab,prev);
+  pthread_mutex_unlock(&c->grow_mutex);
+  return 0;
+}
+
+// Get a packet with room for at least size bytes of content; NULL only if out of memory
+struct packet *packet_alloc(int size){
+  unsigned int k;
+  for(k = 0; k < NCLASSES - 1 && Classes[k].size < size; k++)
+    ;
+  if(size > Classes[k].size)
+    return NULL;
+  struct pool_class * const c = &Classes[k];
+
+  uint64_t head = atomic_load_explicit(&c->head,memory_order_acquire);
+  while(true){
+    uint32_t const first = (uint32_t)head;
+    if(first == 0){
+      if(grow(c) == -1)
+	return NULL;
+      head = atomic_load_explicit(&c->head,memory_order_acquire);
+      continue;
+    }
+    // Slots are never freed, so this is safe to read even if another thread takes it first;
+    // the generation count then makes our exchange fail
+    struct slot * const s = slot_at(c,first - 1);
+    uint32_t const next = atomic_load_explicit(&s->next,memory_order_relaxed);
+    uint64_t const newhead = ((head >> 32) + 1) << 32 | next;
+    if(atomic_compare_exchange_weak_explicit(&c->head,&head,newhead,memory_order_acquire,memory_order_acquire)){
+      struct packet * const pkt = SLOT_PACKET(s);
+      pkt->next = NULL;
+      pkt->data = NULL;
+      pkt->len = 0;
+      pkt->arrival = 0;
+      return pkt;
+    }
+  }
+}
+
+// Return a packet to the pool, like FREE() sets the pointer to NULL
+void packet_free(struct packet **pkt){
+  if(pkt == NULL || *pkt == NULL)
+    return;
+  struct slot * const s = (struct slot *)((uint8_t *)*pkt - SLOT_HEADER);
+  assert(s->class >= 0 && s->class < (int)NCLASSES);
+  push_chain(&Classes[s->class],s,s);
+  *pkt = NULL;
+}
+
+// Receive one datagram into a new packet from the pool; same return value as recvfrom()
+// *pkt is set only when a datagram was received
+int packet_recv(int fd,struct packet **pkt,struct sockaddr *sender,socklen_t *socksize){
+  assert(pkt != NULL);
+  static __thread uint8_t buffer[PKTSIZE];
+  int const size = recvfrom(fd,buffer,sizeof(buffer),0,sender,socksize);
+  if(size <= 0)
+    return size;
+  struct packet * const p = packet_alloc(size);
+  if(p == NULL){
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(p->content,buffer,size);
+  *pkt = p;
+  return size;
+}
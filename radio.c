@@ -32,7 +32,8 @@
 #include "status.h"
 
 extern float Blocktime;
-struct frontend Frontend;
+struct frontend Frontends[MAX_FRONTENDS];
+int Nfrontends;
 
 pthread_mutex_t Channel_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 int const Channelalloc_quantum = 1000;
@@ -119,7 +120,7 @@ static float estimate_noise(struct channel *chan,int shift){
     for(int i=0; i < master->bins; i++)
       total_energy += cnrmf(fdomain[i]);
     // Compute average power per sample, should match input level calculated in time domain
-    chan->tp1 = power2dB(total_energy) - voltage2dB((float)master->bins + Frontend.reference);
+    chan->tp1 = power2dB(total_energy) - voltage2dB((float)master->bins + chan->frontend->reference);
   }
 #endif
 
@@ -173,7 +174,7 @@ static float estimate_noise(struct channel *chan,int shift){
 
   // For real mode the sample rate is double for the same power, but there are
   // only half as many bins so it cancels
-  return min_bin_energy / Frontend.samprate; // Scale to 1 Hz
+  return min_bin_energy / chan->frontend->samprate; // Scale to 1 Hz
 }
 
 
@@ -278,19 +279,19 @@ double set_freq(struct channel * const chan,double const f){
     return f;
 
   // Determine new IF
-  double new_if = f - Frontend.frequency;
+  double new_if = f - chan->frontend->frequency;
 
   // Flip sign to convert LO2 frequency to IF carrier frequency
   // Tune an extra kHz to account for front end roundoff
   // Ideally the front end would just round in a preferred direction
   // but it doesn't know where our IF will be so it can't make the right choice
   double const fudge = 1000;
-  if(new_if > Frontend.max_IF - chan->filter.max_IF){
+  if(new_if > chan->frontend->max_IF - chan->filter.max_IF){
     // Retune LO1 as little as possible
-    new_if = Frontend.max_IF - chan->filter.max_IF - fudge;
-  } else if(new_if < Frontend.min_IF - chan->filter.min_IF){
+    new_if = chan->frontend->max_IF - chan->filter.max_IF - fudge;
+  } else if(new_if < chan->frontend->min_IF - chan->filter.min_IF){
     // Also retune LO1 as little as possible
-    new_if = Frontend.min_IF - chan->filter.min_IF + fudge;
+    new_if = chan->frontend->min_IF - chan->filter.min_IF + fudge;
   } else
     return f; // OK where it is
 
@@ -310,19 +311,61 @@ double set_first_LO(struct channel const * const chan,double const first_LO){
   if(chan == NULL)
     return NAN;
 
-  double const current_lo1 = Frontend.frequency;
+  double const current_lo1 = chan->frontend->frequency;
 
   // Just return actual frequency without changing anything
   if(first_LO == current_lo1 || first_LO <= 0)
     return first_LO;
 
   // Direct tuning through local module if available
-  if(Frontend.tune != NULL)
-    return (*Frontend.tune)(&Frontend,first_LO);
+  if(chan->frontend->tune != NULL)
+    return (*chan->frontend->tune)(chan->frontend,first_LO);
 
   return first_LO;
 }
 
+// Find front end by the name of its [hardware] section
+struct frontend *lookup_frontend(char const * const name){
+  if(name == NULL)
+    return NULL;
+  for(int i=0; i < Nfrontends; i++){
+    if(Frontends[i].name != NULL && strcasecmp(Frontends[i].name,name) == 0)
+      return &Frontends[i];
+  }
+  return NULL;
+}
+
+// Does the front end's current tuning already cover the channel's passband at frequency f?
+static bool frontend_covers(struct frontend const * const frontend,struct channel const * const chan,double const f){
+  double const new_if = f - frontend->frequency;
+  return new_if + chan->filter.min_IF >= frontend->min_IF && new_if + chan->filter.max_IF <= frontend->max_IF;
+}
+
+// Choose the front end for a channel on frequency f
+// 1. One whose current coverage already includes the channel passband, preferring the current one
+// 2. A tunable, unlocked one whose configured tuning range (min-freq, max-freq) includes f
+// 3. Otherwise leave it where it is (or on the default front end)
+struct frontend *select_frontend(struct channel const * const chan,double const f){
+  assert(chan != NULL);
+  struct frontend * const current = chan->frontend != NULL ? chan->frontend : &Frontends[0];
+  if(chan->frontend_fixed || Nfrontends <= 1 || f == 0)
+    return current;
+
+  if(frontend_covers(current,chan,f))
+    return current;
+
+  for(int i=0; i < Nfrontends; i++){
+    if(frontend_covers(&Frontends[i],chan,f))
+      return &Frontends[i];
+  }
+  for(int i=0; i < Nfrontends; i++){
+    struct frontend * const fe = &Frontends[i];
+    if(fe->tune != NULL && !fe->lock && f >= fe->min_freq && f <= fe->max_freq)
+      return fe;
+  }
+  return current;
+}
+
 // Compute FFT bin shift and time-domain fine tuning offset for specified LO frequency
 // N = input fft length
 // M = input buffer overlap
@@ -421,12 +464,12 @@ void *sap_send(void *p){
     }
 
     // s= (session name)
-    len = snprintf(wp,space,"s=radio %s\r\n",Frontend.description);
+    len = snprintf(wp,space,"s=radio %s\r\n",chan->frontend->description);
     wp += len;
     space -= len;
 
     // i= (human-readable session information)
-    len = snprintf(wp,space,"i=PCM output stream from ka9q-radio on %s\r\n",Frontend.description);
+    len = snprintf(wp,space,"i=PCM output stream from ka9q-radio on %s\r\n",chan->frontend->description);
     wp += len;
     space -= len;
 
@@ -487,6 +530,8 @@ void *sap_send(void *p){
 
 // Baseband samples placed in chan->filter.out->output.c
 int downconvert(struct channel *chan){
+  struct frontend * const frontend = chan->frontend;
+  assert(frontend != NULL);
   int shift = 0;
   double remainder = 0;
 
@@ -494,6 +539,12 @@ int downconvert(struct channel *chan){
     // Should we die?
     // Will be slower if 0 Hz is outside front end coverage because of slow timed wait below
     // But at least it will eventually go away
+    if(chan->terminate){
+      chan->demod_type = -1;
+      if(Verbose > 1)
+	fprintf(stdout,"chan %d terminate requested\n",chan->output.rtp.ssrc);
+      return -1;
+    }
     if(chan->tune.freq == 0 && chan->lifetime > 0){
       if(--chan->lifetime <= 0){
 	chan->demod_type = -1;  // No demodulator
@@ -512,23 +563,23 @@ int downconvert(struct channel *chan){
     // Look on the single-entry command queue and grab it atomically
     if(chan->status.command != NULL){
       restart_needed = decode_radio_commands(chan,chan->status.command,chan->status.length);
-      send_radio_status((struct sockaddr *)&Metadata_dest_socket,&Frontend,chan); // Send status in response
+      send_radio_status((struct sockaddr *)&Metadata_dest_socket,chan->frontend,chan); // Send status in response
       chan->status.global_timer = 0; // Just sent one
       // Also send to output stream
-      send_radio_status((struct sockaddr *)&chan->status.dest_socket,&Frontend,chan);
+      send_radio_status((struct sockaddr *)&chan->status.dest_socket,chan->frontend,chan);
       chan->status.output_timer = chan->status.output_interval; // Reload
       FREE(chan->status.command);
       reset_radio_status(chan); // After both are sent
     } else if(chan->status.global_timer != 0 && --chan->status.global_timer <= 0){
       // Delayed status request, used mainly by all-channel polls to avoid big bursts
-      send_radio_status((struct sockaddr *)&Metadata_dest_socket,&Frontend,chan); // Send status in response
+      send_radio_status((struct sockaddr *)&Metadata_dest_socket,chan->frontend,chan); // Send status in response
       chan->status.global_timer = 0; // to make sure
       reset_radio_status(chan);
     } else if(chan->status.output_interval != 0 && chan->status.output_timer > 0){
       // Timer is running for status on output stream
       if(--chan->status.output_timer == 0){
 	// Timer has expired; send status on output channel
-	send_radio_status((struct sockaddr *)&chan->status.dest_socket,&Frontend,chan);
+	send_radio_status((struct sockaddr *)&chan->status.dest_socket,chan->frontend,chan);
 	reset_radio_status(chan);
 	if(!chan->output.silent)
 	  chan->status.output_timer = chan->status.output_interval; // Restart timer only if channel is active
@@ -543,15 +594,15 @@ int downconvert(struct channel *chan){
     }
     // To save CPU time when the front end is completely tuned away from us, block (with timeout) until the front
     // end status changes rather than process zeroes. We must still poll the terminate flag.
-    pthread_mutex_lock(&Frontend.status_mutex);
+    pthread_mutex_lock(&frontend->status_mutex);
 
-    chan->tune.second_LO = Frontend.frequency - chan->tune.freq;
+    chan->tune.second_LO = frontend->frequency - chan->tune.freq;
     double const freq = chan->tune.doppler + chan->tune.second_LO; // Total logical oscillator frequency
-    if(compute_tuning(Frontend.in.ilen + Frontend.in.impulse_length - 1,
-		      Frontend.in.impulse_length,
-		      Frontend.samprate,
+    if(compute_tuning(frontend->in.ilen + frontend->in.impulse_length - 1,
+		      frontend->in.impulse_length,
+		      frontend->samprate,
 		      &shift,&remainder,freq) == 0){
-      pthread_mutex_unlock(&Frontend.status_mutex);
+      pthread_mutex_unlock(&frontend->status_mutex);
       break;
     }
     // No front end coverage of our carrier; wait one block time for it to retune
@@ -566,8 +617,8 @@ int downconvert(struct channel *chan){
       timeout.tv_sec += 1; // 1 sec in the future
       timeout.tv_nsec -= BILLION;
     }
-    pthread_cond_timedwait(&Frontend.status_cond,&Frontend.status_mutex,&timeout);
-    pthread_mutex_unlock(&Frontend.status_mutex);
+    pthread_cond_timedwait(&frontend->status_cond,&frontend->status_mutex,&timeout);
+    pthread_mutex_unlock(&frontend->status_mutex);
   }
   // Reasonable parameters?
   assert(isfinite(chan->tune.doppler_rate));
@@ -588,7 +639,7 @@ int downconvert(struct channel *chan){
     // (b) second term keeps the phase continuous when shift changes; found empirically, dunno yet why it works!
     // Be sure to Initialize chan->filter.bin_shift at startup to something bizarre to force this inequality on first call
     if(shift != chan->filter.bin_shift){
-      const int V = 1 + (Frontend.in.ilen / (Frontend.in.impulse_length - 1)); // Overlap factor
+      const int V = 1 + (frontend->in.ilen / (frontend->in.impulse_length - 1)); // Overlap factor
       chan->filter.phase_adjust = cispi(-2.0f*(shift % V)/(double)V); // Amount to rotate on each block for shifts not divisible by V
       chan->fine.phasor *= cispi((shift - chan->filter.bin_shift) / (2.0f * (V-1))); // One time adjust for shift change
     }
@@ -614,9 +665,9 @@ int downconvert(struct channel *chan){
   // because the transmitted noise is enough to severely increase the estimate even before it begins to transmit
   // enough power to saturate the A/D. I still need a better, more general way of adjusting N0 smoothing rate,
   // e.g. for when the channel is retuned by a lot
-  float maxpower = (1 << (Frontend.bitspersample - 1));
+  float maxpower = (1 << (frontend->bitspersample - 1));
   maxpower *= maxpower * 0.5; // 0 dBFS
-  if(Frontend.if_power < maxpower)
+  if(frontend->if_power < maxpower)
     chan->sig.n0 = estimate_noise(chan,-shift); // Negative, just like compute_tuning. Note: must follow execute_filter_output()
   return 0;
 }
@@ -41,8 +41,45 @@ extern int Ndemod;
 char const *demod_name_from_type(enum demod_type type);
 int demod_type_from_name(char const *name);
 
-// Only one off these per radiod instance, shared with all channels
+// DC offset and I/Q imbalance correction state for complex front ends (iqcorr.c)
+struct iq_corr {
+  bool enable;
+  int decimate;       // Estimate errors on every decimate'th sample
+  float dc_tc;        // Smoothing time constants, sec
+  float iq_tc;
+  // Smoothed error estimates
+  complex float DC;   // DC offset
+  float imbalance;    // Ratio of I power to Q power
+  float sinphi;       // I/Q phase error
+  // Corrections currently being applied
+  float gain_i;
+  float gain_q;
+  float secphi;
+  float tanphi;
+};
+
+// Front end sample continuity and timing health (health.c)
+struct fe_health {
+  bool zero_fill;         // Replace lost samples with zeroes to keep downstream timing
+  float gap_threshold;    // Deficits longer than this are declared gaps, ms
+  double rate;            // Estimated true A/D sample rate, Hz
+  float timing_error;     // Smoothed lag of sample count behind system clock, sec
+  uint64_t gaps;          // Count of detected or reported gaps
+  uint64_t gap_samples;   // Total samples lost
+  uint64_t fill_samples;  // Zero samples inserted
+  int64_t missing;        // Lost samples not zero-filled
+  int64_t fill_pending;   // Zeroes to insert ahead of the next callback's samples
+  // Internal prediction state
+  int64_t anchor_time;
+  int64_t anchor_count;
+  int64_t rate_time;
+  int64_t rate_count;
+  double offset;
+};
+
+// One of these per [hardware] section in radiod, each shared by all the channels bound to it
 struct frontend {
+  char *name;           // Name of the config file section that created it
 
   // Stuff we maintain about our upstream source
   uint64_t samples;     // Count of raw I/Q samples received
@@ -68,9 +105,13 @@ struct frontend {
   bool rf_agc;            // Front end AGC of some sort is active
   float rf_level_cal;      // adjust to make 0 dBm give 0 dBFS: when zero, 0dBm gives "rf_gain_cal" dBFS
   bool direct_conversion; // Try to avoid DC spike if set
+  struct iq_corr iq;      // DC and I/Q imbalance correction, complex front ends only
+  struct fe_health health; // Sample continuity and timing
   bool isreal;            // Use real->complex FFT (otherwise complex->complex)
   int bitspersample;      // 1, 8, 12 or 16
   bool lock;              // Tuning is locked; clients cannot change
+  double min_freq;        // Tuning range used to bind channels to front ends, Hz
+  double max_freq;
 
   // Limits on usable IF due to aliasing, filtering, etc
   // Less than or equal to +/- samprate/2
@@ -105,9 +146,12 @@ struct frontend {
   float (*gain)(struct frontend *,float);
   float (*atten)(struct frontend *,float);
   struct filter_in in; // Input half of fast convolver, shared with all channels
+  struct capture *capture; // Triggered raw capture state (capture.c), NULL when disabled
 };
 
-extern struct frontend Frontend; // Only one per radio instance
+#define MAX_FRONTENDS 8
+extern struct frontend Frontends[MAX_FRONTENDS]; // One per [hardware] section; Frontends[0] is the default
+extern int Nfrontends;
 
 // Channel state block; there can be many of these
 // This is primarily for radiod, but it is also used by 'control' and 'monitor' to shadow
@@ -120,6 +164,17 @@ extern struct frontend Frontend; // Only one per radio instance
 struct channel {
   bool inuse;
   int lifetime;          // Remaining lifetime, frames
+  struct frontend *frontend; // Front end feeding this channel
+  bool frontend_fixed;   // Bound by 'hardware =' in its section; don't move it when retuned
+  bool terminate;        // Set by another thread to make the channel close itself
+  // Static channels only: where in the config file this channel came from, so a reload can find it
+  struct {
+    char section[64];    // Empty for dynamic channels
+    uint32_t hash;       // config_hash() of its section less the freq keys, plus its preset's name and section
+                         // [global] defaults it inherits are read only at startup, or arrive via the preset name
+    double freq;         // As listed in the config file
+    unsigned int generation; // Last config load that kept it
+  } config;
   // Tuning parameters
   struct {
     double freq;         // Desired carrier frequency (settable)
@@ -223,6 +278,7 @@ struct channel {
     float deemph_state_right;
     uint64_t samples;
     bool pacing;     // Pace output packets
+    bool capture;    // Trigger a raw front end capture when output unmutes (e.g., squelch opens)
     enum encoding encoding;
     OpusEncoder *opus;
     int opus_channels;
@@ -280,6 +336,8 @@ int loadpreset(struct channel *chan,dictionary const *table,char const *preset);
 int start_demod(struct channel * restrict chan);
 double set_freq(struct channel * restrict ,double);
 double set_first_LO(struct channel const * restrict, double);
+struct frontend *lookup_frontend(char const *name);
+struct frontend *select_frontend(struct channel const *chan,double f);
 
 // Routines common to the internals of all channel demods
 int compute_tuning(int N, int M, int samprate,int *shift,double *remainder, double freq);
@@ -307,4 +365,28 @@ bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length
 int decode_radio_status(struct frontend *frontend,struct channel *channel,uint8_t const *buffer,int length);
 
 int round_samprate(int x);
+
+// DC offset and I/Q imbalance correction for complex front ends (iqcorr.c)
+void iq_corr_setup(struct frontend *frontend,dictionary const *table,char const *section);
+void iq_correct(struct frontend *frontend,complex float *buf,int n);
+
+// A/D sample conversion for the front end drivers (convert.c)
+float convert_s16(struct frontend *frontend,float *out,int16_t const *in,int n,float scale,bool randomized);
+float convert_packed12(struct frontend *frontend,float *out,uint32_t const *in,int n,float scale);
+float convert_u8_iq(struct frontend *frontend,complex float *out,uint8_t const *in,int n,float scale);
+
+// Front end sample continuity and timing health (health.c)
+void health_setup(struct frontend *frontend,dictionary const *table,char const *section);
+void health_input(struct frontend *frontend,int n);
+void health_drop(struct frontend *frontend,int64_t n);
+
+// Triggered capture of raw front end input to SigMF files (capture.c)
+size_t capture_setup(struct frontend *frontend,dictionary const *table,char const *section);
+int capture_start(struct frontend *frontend);
+int capture_trigger(struct frontend *frontend,uint32_t ssrc,float post);
+
+// Snapshot and restore of dynamic channels across restarts (chanstate.c)
+int chanstate_setup(dictionary const *table,char const *section,char const *name);
+int chanstate_restore(void);
+int chanstate_save(void);
 #endif
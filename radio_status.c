@@ -89,7 +89,7 @@ void *radio_status(void *arg){
 	  } else {
 	    chan->output.rtp.type = pt_from_info(chan->output.samprate,chan->output.channels,chan->output.encoding); // make sure it's initialized
 	    decode_radio_commands(chan,buffer+1,length-1);
-	    send_radio_status((struct sockaddr *)&Metadata_dest_socket,&Frontend,chan); // Send status in response
+	    send_radio_status((struct sockaddr *)&Metadata_dest_socket,chan->frontend,chan); // Send status in response
 	    reset_radio_status(chan);
 	    chan->status.global_timer = 0; // Just sent one
 	    start_demod(chan);
@@ -179,6 +179,13 @@ bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length
 	  if(Verbose > 1)
 	    fprintf(stdout,"set ssrc %u freq = %'.3lf\n",ssrc,f);
 
+	  struct frontend * const frontend = select_frontend(chan,f);
+	  if(frontend != chan->frontend){
+	    if(Verbose)
+	      fprintf(stdout,"ssrc %u moved to front end [%s]\n",ssrc,frontend->name);
+	    chan->frontend = frontend;
+	    restart_needed = true; // Reattach filter to the new front end
+	  }
 	  set_freq(chan,f);
 	}
       }
@@ -252,7 +259,10 @@ bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length
 
 	  if(Verbose > 1)
 	    fprintf(stdout,"command loadpreset(ssrc=%u) mode=%s\n",ssrc,chan->preset);
-	  if(loadpreset(chan,Preset_table,chan->preset) != 0){
+	  pthread_mutex_lock(&Channel_list_mutex); // reload_config() replaces Preset_table under it
+	  int const r = loadpreset(chan,Preset_table,chan->preset);
+	  pthread_mutex_unlock(&Channel_list_mutex);
+	  if(r != 0){
 	    if(Verbose)
 	      fprintf(stdout,"command loadpreset(ssrc=%u) mode=%sfailed!\n",ssrc,chan->preset);
 	    break;
@@ -425,15 +435,22 @@ bool decode_radio_commands(struct channel *chan,uint8_t const *buffer,int length
     case RF_ATTEN:
       {
 	float x = decode_float(cp,optlen);
-	if(!isnan(x) && Frontend.atten != NULL)
-	  (*Frontend.atten)(&Frontend,x);
+	if(!isnan(x) && chan->frontend->atten != NULL)
+	  (*chan->frontend->atten)(chan->frontend,x);
       }
       break;
     case RF_GAIN:
       {
 	float x = decode_float(cp,optlen);
-	if(!isnan(x) && Frontend.gain != NULL)
-	  (*Frontend.gain)(&Frontend,x);
+	if(!isnan(x) && chan->frontend->gain != NULL)
+	  (*chan->frontend->gain)(chan->frontend,x);
+      }
+      break;
+    case CAPTURE_TRIGGER:
+      {
+	float x = decode_float(cp,optlen);
+	if(capture_trigger(chan->frontend,ssrc,isfinite(x) ? x : 0) != 0 && Verbose)
+	  fprintf(stdout,"ssrc %u: capture requested but capture-window not configured\n",ssrc);
       }
       break;
     default:
@@ -496,6 +513,13 @@ static int encode_radio_status(struct frontend const *frontend,struct channel co
   encode_float(&bp,FE_LOW_EDGE,frontend->min_IF);
   encode_float(&bp,FE_HIGH_EDGE,frontend->max_IF);
   encode_int32(&bp,AD_BITS_PER_SAMPLE,frontend->bitspersample);
+  if(frontend->iq.enable){
+    // DC offset and I/Q imbalance estimates from iqcorr.c
+    encode_float(&bp,DC_I_OFFSET,crealf(frontend->iq.DC));
+    encode_float(&bp,DC_Q_OFFSET,cimagf(frontend->iq.DC));
+    encode_float(&bp,IQ_IMBALANCE,power2dB(frontend->iq.imbalance));
+    encode_float(&bp,IQ_PHASE,frontend->iq.sinphi);
+  }
 
   // Tuning
   encode_double(&bp,RADIO_FREQUENCY,chan->tune.freq); // Hz
@@ -514,6 +538,11 @@ static int encode_radio_status(struct frontend const *frontend,struct channel co
   }
   encode_int64(&bp,AD_OVER,frontend->overranges);
   encode_int64(&bp,SAMPLES_SINCE_OVER,frontend->samp_since_over);
+  encode_double(&bp,INPUT_SAMPRATE_MEASURED,frontend->health.rate);
+  encode_int64(&bp,INPUT_GAPS,frontend->health.gaps);
+  encode_int64(&bp,INPUT_GAP_SAMPLES,frontend->health.gap_samples);
+  encode_int64(&bp,INPUT_FILL_SAMPLES,frontend->health.fill_samples);
+  encode_float(&bp,INPUT_TIMING_ERROR,frontend->health.timing_error);
   encode_float(&bp,NOISE_DENSITY,power2dB(chan->sig.n0));
 
   // Modulation mode
@@ -26,6 +26,7 @@
 #include "filter.h"
 #include "iir.h"
 #include "avahi.h"
+#include "fmbcast.h"
 
 struct session {
   struct session *prev;       // Linked list pointers
@@ -44,6 +45,7 @@ struct session {
   struct rtp_state rtp_state_out; // RTP output state
 
   uint64_t packets;
+  char ps[9];               // Program service name, assembled from type 0 groups
 };
 
 
@@ -82,6 +84,7 @@ int close_session(struct session *);
 int send_samples(struct session *sp);
 void *input(void *arg);
 void *decode(void *arg);
+static void rds_group(struct session *sp,uint16_t const group[4]);
 
 static struct option Options[] =
   {
@@ -290,24 +293,19 @@ void *input(void *arg){
   // Main loop begins here
   struct packet *pkt = NULL;
   while(true){
-    // Need a new packet buffer?
-    if(!pkt)
-      pkt = malloc(sizeof(*pkt));
-    // Zero these out to catch any uninitialized derefs
-    pkt->next = NULL;
-    pkt->data = NULL;
-    pkt->len = 0;
+    // Return the last one to the pool if it wasn't queued
+    packet_free(&pkt);
     
     struct sockaddr_storage sender;
     socklen_t socksize = sizeof(sender);
-    int size = recvfrom(Input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+    int size = packet_recv(Input_fd,&pkt,(struct sockaddr *)&sender,&socksize);
     
     if(size == -1){
       if(errno != EINTR){ // Happens routinely, e.g., when window resized
 	perror("recvfrom");
 	usleep(1000);
       }
-      continue;  // Reuse current buffer
+      continue;
     }
     if(size <= RTP_MIN_SIZE)
       continue; // Must be big enough for RTP header and at least some data
@@ -382,38 +380,15 @@ void *decode(void *arg){
   // Not doing this caused a nasty memory leak
   pthread_detach(pthread_self());
 
-  // Set up audio filters: mono, pilot & stereo difference
-  // These blocksizes depend on front end sample rate and blocksize
-  // At Blocktime = 5ms and 384 kHz, L = 1920, M = 1921, N = 3840
-  int const L = roundf(In_samprate * Blocktime * .001); // Number of input samples in Blocktime
-  int const M = L + 1;
-  int const N = L + M - 1;
-
-  // 'audio_L' stereo samples must fit in an output packet
-  // At Blocktime = 5 ms, audio_N = 240
-  int const audio_L = (L * Out_samprate) / In_samprate;
-
-  // Baseband signal 50 Hz - 15 kHz contains mono (L+R) signal
-  struct filter_in baseband;
-  create_filter_input(&baseband,L,M,REAL);
-  // Baseband filters, decimate from 384 Khz to 48 KHz
-
-  // Narrow filter at 19 kHz for stereo pilot
-  struct filter_out pilot;
-  create_filter_output(&pilot,&baseband,NULL,audio_L, COMPLEX);
-  set_filter(&pilot,-100./Out_samprate, 100./Out_samprate, Kaiser_beta);
-
-  // RDS info at 57 kHz = 19 kHz * 3
-  struct filter_out rds;
-  create_filter_output(&rds,&baseband,NULL,audio_L, COMPLEX);
-  set_filter(&rds,-2000./Out_samprate, 2000./Out_samprate, Kaiser_beta);
-
-  // Assume the remainder is zero, as it is for clean sample rates @ 200 Hz multiples
-  // If not, then a mop-up oscillator has to be provided
-  double const hzperbin = In_samprate / N;              // 100 hertz per FFT bin @ 384 kHz and 5 ms
-  int const quantum = N / (M - 1);       // rotate by multiples of (2) bins due to overlap-save (100 * 2 = 200 Hz)
-  int const pilot_rotate = quantum * round(19000./(hzperbin * quantum));
-  int const subc_rotate = quantum * round(57000./(hzperbin * quantum));
+  // Composite filters and pilot PLL; RDS subcarrier spun down to 0 Hz at 48 kHz
+  // At Blocktime = 5ms, 1920 composite samples give 240 RDS baseband samples
+  struct fmbcast fb;
+  if(fmbcast_init(&fb,In_samprate,Out_samprate,Blocktime,Kaiser_beta,FMBCAST_RDS) != 0){
+    fprintf(stderr,"Can't set up RDS decoder\n");
+    close_session(sp);
+    return NULL;
+  }
+  int const audio_L = fb.audio_L;
 
   int const payload_type = pt_from_info(Out_samprate,2,S16BE);
   if(payload_type < 0){
@@ -437,6 +412,7 @@ void *decode(void *arg){
 	  if(ret == ETIMEDOUT){
 	    // Idle timeout after 10 sec; close session and terminate thread
 	    pthread_mutex_unlock(&sp->qmutex);
+	    fmbcast_free(&fb);
 	    close_session(sp); 
 	    return NULL; // exit thread
 	  }
@@ -465,12 +441,23 @@ void *decode(void *arg){
     
     int16_t const * const samples = (int16_t *)pkt->data;
     
-    for(int i=0; i<frame_size; i++){
-      float const s = SCALE * (int16_t)ntohs(samples[i]);
-      if(put_rfilter(&baseband,s) == 0)
+    float composite[PKTSIZE / sizeof(int16_t)];
+    for(int i=0; i < frame_size; i++)
+      composite[i] = SCALE * (int16_t)ntohs(samples[i]);
+
+    int i = 0;
+    while(i < frame_size){
+      int const n = fmbcast_write(&fb,&composite[i],frame_size - i);
+      if(n < 0)
+	break;
+      i += n;
+      if(!fb.ready)
 	continue;
-      // Filter input buffer full
-      // Decimate to audio sample rate, do stereo processing
+      // Composite block complete
+      float audio[audio_L];
+      fmbcast_decode(&fb,audio,1.0); // Only the RDS results are used
+      if(fb.rds_state.group_ready)
+	rds_group(sp,fb.rds_state.group);
 
       // ensure output pkt big enough for output filter buffer size
       uint8_t packet[PKTSIZE],*dp;
@@ -488,17 +475,10 @@ void *decode(void *arg){
       sp->rtp_state_out.bytes += 2 * sizeof(int16_t) * audio_L;
       sp->rtp_state_out.packets++;
 
-      execute_filter_output(&pilot,pilot_rotate); // pilot spun down to 0 Hz, 48 kHz rate
-      execute_filter_output(&rds,subc_rotate); // L-R baseband spun down to 0 Hz, 48 kHz rate
-
+      // RDS baseband as I/Q, carrier referenced to the pilot; silent when there's no pilot
       int16_t *wp = (int16_t *)dp;
       for(int n= 0; n < audio_L; n++){
-	//	complex float subc_phasor = pilot->output.c[n]; // 19 kHz pilot
-	//	subc_phasor *= subc_phasor * subc_phasor;       // triple to 57 kHz
-	//	subc_phasor /= approx_magf(subc_phasor);  // and normalize
-	//	float complex subc_info = conjf(subc_phasor) * rds->output.c[n];
-	float complex subc_info = rds.output.c[n];
-	// Need to add de-emphasis!
+	float complex const subc_info = fb.pilot_lock ? fb.rds_baseband[n] : 0;
 	*wp++ = htons(scaleclip(__real__ subc_info));
 	*wp++ = htons(scaleclip(__imag__ subc_info));
       }
@@ -511,7 +491,7 @@ void *decode(void *arg){
       }
     }
   endloop:;
-    FREE(pkt);
+    packet_free(&pkt);
   }
 }
 
@@ -566,7 +546,7 @@ int close_session(struct session *sp){
   pthread_mutex_lock(&sp->qmutex);
   while(sp->queue){
     struct packet *pkt = sp->queue->next;
-    FREE(sp->queue);
+    packet_free(&sp->queue);
     sp->queue = pkt;
   }
   pthread_mutex_unlock(&sp->qmutex);
@@ -601,3 +581,24 @@ void closedown(int s){
   exit(0);
 }
 
+
+// Handle a complete RDS group
+// Only the program service name (8 characters, two per type 0A/0B group) is decoded for now
+static void rds_group(struct session *sp,uint16_t const group[4]){
+  int const type = group[1] >> 12;
+  bool const version_b = (group[1] >> 11) & 1;
+  if(Verbose)
+    fprintf(stdout,"ssrc %u PI %04x group %d%c %04x %04x %04x %04x\n",
+	    sp->rtp_state_in.ssrc,group[0],type,version_b ? 'B' : 'A',group[0],group[1],group[2],group[3]);
+  if(type != 0)
+    return;
+
+  int const segment = group[1] & 3;
+  char const c0 = group[3] >> 8;
+  char const c1 = group[3] & 0xff;
+  bool changed = sp->ps[2*segment] != c0 || sp->ps[2*segment+1] != c1;
+  sp->ps[2*segment] = c0;
+  sp->ps[2*segment+1] = c1;
+  if(changed && segment == 3 && memchr(sp->ps,'\0',8) == NULL)
+    fprintf(stdout,"ssrc %u PI %04x PS \"%.8s\"\n",sp->rtp_state_in.ssrc,group[0],sp->ps);
+}
@@ -0,0 +1,200 @@
+// Polyphase sample rate converter between any two integer rates
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "resample.h"
+
+static float const Kaiser_beta = 8.0;  // ~80 dB stopband
+static float const Passband = 0.45;     // Cutoff (-6 dB) as fraction of the lower rate
+
+static pthread_mutex_t Bank_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct resample_bank *Banks;
+
+static unsigned int gcd(unsigned int a,unsigned int b){
+  while(b != 0){
+    unsigned int const t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Design a windowed-sinc lowpass at the upsampled rate and split it into phases
+static struct resample_bank *make_bank(unsigned int in_rate,unsigned int out_rate){
+  struct resample_bank *bank = calloc(1,sizeof(*bank));
+  if(bank == NULL)
+    return NULL;
+  unsigned int const g = gcd(in_rate,out_rate);
+  bank->in_rate = in_rate;
+  bank->out_rate = out_rate;
+  bank->L = out_rate / g;
+  bank->M = in_rate / g;
+  bank->phases = bank->L <= RESAMPLE_MAX_PHASES ? bank->L : RESAMPLE_MAX_PHASES;
+
+  // When decimating the cutoff is lower relative to the input rate, so the filter must be longer
+  int taps = RESAMPLE_TAPS;
+  if(in_rate > out_rate)
+    taps = (RESAMPLE_TAPS * in_rate + out_rate - 1) / out_rate;
+  taps = (taps + 7) & ~7; // Keep the inner loop in whole vectors
+  bank->taps = taps;
+
+  int const P = bank->phases;
+  int const N = P * taps;
+  // Cutoff in cycles per sample at the upsampled rate
+  double const fc = Passband * (in_rate < out_rate ? in_rate : out_rate) / ((double)in_rate * P);
+  double const inv_i0 = 1. / i0(Kaiser_beta);
+
+  bank->coeffs = malloc(sizeof(*bank->coeffs) * N);
+  if(bank->coeffs == NULL){
+    FREE(bank);
+    return NULL;
+  }
+  for(int p = 0; p < P; p++){
+    float * const c = &bank->coeffs[p * taps];
+    double sum = 0;
+    for(int j = 0; j < taps; j++){
+      // c[j] multiplies the j'th oldest sample of the window, so each phase is stored time-reversed
+      int const n = p + (taps - 1 - j) * P;
+      double const t = n - (N - 1) / 2.0;
+      double const w = 2.0 * n / (N - 1) - 1;
+      double h = (t == 0) ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+      h *= i0(Kaiser_beta * sqrt(fmax(0,1 - w * w))) * inv_i0; // fmax guards against rounding at the ends
+      c[j] = h;
+      sum += h;
+    }
+    // Unity gain at DC on every phase, so there's no ripple at the output rate
+    for(int j = 0; j < taps; j++)
+      c[j] /= sum;
+  }
+  return bank;
+}
+
+// Find or create the filter bank for this pair of rates
+static struct resample_bank const *get_bank(unsigned int in_rate,unsigned int out_rate){
+  pthread_mutex_lock(&Bank_mutex);
+  struct resample_bank *bank;
+  for(bank = Banks; bank != NULL; bank = bank->next)
+    if(bank->in_rate == in_rate && bank->out_rate == out_rate)
+      break;
+
+  if(bank == NULL && (bank = make_bank(in_rate,out_rate)) != NULL){
+    bank->next = Banks;
+    Banks = bank;
+  }
+  pthread_mutex_unlock(&Bank_mutex);
+  return bank;
+}
+
+int resampler_init(struct resampler *rs,unsigned int in_rate,unsigned int out_rate,int channels){
+  assert(rs != NULL);
+  memset(rs,0,sizeof(*rs));
+  if(in_rate == 0 || out_rate == 0 || channels <= 0)
+    return -1;
+  rs->bank = get_bank(in_rate,out_rate);
+  if(rs->bank == NULL)
+    return -1;
+  rs->channels = channels;
+  resampler_reset(rs);
+  return 0;
+}
+
+void resampler_free(struct resampler *rs){
+  if(rs == NULL)
+    return;
+  FREE(rs->buffer);
+  memset(rs,0,sizeof(*rs)); // The bank stays for the next user
+}
+
+// Start over with silence in the filter
+void resampler_reset(struct resampler *rs){
+  assert(rs != NULL && rs->bank != NULL);
+  rs->phase = 0;
+  rs->skip = 0;
+  rs->hist = rs->bank->taps - 1;
+  if(rs->buffer != NULL)
+    memset(rs->buffer,0,sizeof(*rs->buffer) * rs->buffer_size * rs->channels);
+}
+
+// Most output frames that 'frames' input frames can produce
+int resample_max_output(struct resampler const *rs,int frames){
+  assert(rs != NULL && rs->bank != NULL);
+  return (int)(((long long)frames * rs->bank->L) / rs->bank->M) + 2;
+}
+
+// Convert interleaved input frames, returns number of interleaved output frames written
+// output must have room for resample_max_output(rs,frames) frames
+int resample(struct resampler *rs,float *output,float const *input,int frames){
+  assert(rs != NULL && rs->bank != NULL && output != NULL && input != NULL);
+  struct resample_bank const * const bank = rs->bank;
+  int const taps = bank->taps;
+  int const channels = rs->channels;
+
+  // Drop whatever the last window stepped over
+  if(rs->skip > 0){
+    int const n = rs->skip < frames ? rs->skip : frames;
+    input += n * channels;
+    frames -= n;
+    rs->skip -= n;
+  }
+  int const len = rs->hist + frames;
+  if(len > rs->buffer_size){
+    // Grow the buffer, keeping the history at the front of each channel
+    int const size = len + 64;
+    float *buffer = calloc((size_t)size * channels,sizeof(*buffer));
+    if(buffer == NULL)
+      return 0;
+    if(rs->buffer != NULL)
+      for(int ch = 0; ch < channels; ch++)
+	memcpy(&buffer[ch * size],&rs->buffer[ch * rs->buffer_size],sizeof(*buffer) * rs->hist);
+    FREE(rs->buffer);
+    rs->buffer = buffer;
+    rs->buffer_size = size;
+  }
+  // Deinterleave so each channel's window is contiguous
+  for(int ch = 0; ch < channels; ch++){
+    float * const b = &rs->buffer[ch * rs->buffer_size + rs->hist];
+    for(int i = 0; i < frames; i++)
+      b[i] = input[i * channels + ch];
+  }
+  unsigned int const L = bank->L;
+  unsigned int const M = bank->M;
+  unsigned int const P = bank->phases;
+  unsigned int phase = rs->phase;
+  int idx = 0; // Start of current window
+  int out = 0;
+  while(idx + taps <= len){
+    unsigned int const p = (P == L) ? phase : (unsigned int)(((unsigned long long)phase * P) / L);
+    float const * const restrict c = &bank->coeffs[p * taps];
+    for(int ch = 0; ch < channels; ch++){
+      float const * const restrict x = &rs->buffer[ch * rs->buffer_size + idx];
+      float sum = 0;
+      for(int j = 0; j < taps; j++) // Vectorizes with -O3 -funsafe-math-optimizations
+	sum += c[j] * x[j];
+      output[out * channels + ch] = sum;
+    }
+    out++;
+    phase += M;
+    idx += phase / L;
+    phase %= L;
+  }
+  rs->phase = phase;
+  if(idx >= len){
+    rs->skip = idx - len;
+    rs->hist = 0;
+  } else {
+    // Keep the partial window for next time
+    rs->hist = len - idx;
+    for(int ch = 0; ch < channels; ch++){
+      float * const b = &rs->buffer[ch * rs->buffer_size];
+      memmove(b,&b[idx],sizeof(*b) * rs->hist);
+    }
+  }
+  return out;
+}
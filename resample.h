@@ -0,0 +1,47 @@
+// Polyphase sample rate converter between any two integer rates
+// Used by monitor to bring every stream to the audio device rate before mixing
+//
+// The ratio out/in is reduced to L/M. Conceptually the input is upsampled by L,
+// lowpass filtered and decimated by M; only the filter phases actually needed are computed.
+// If L is too large to tabulate every phase, the nearest of RESAMPLE_MAX_PHASES is used;
+// output timing is still exact.
+//
+// Filter banks depend only on the two rates, so they're shared by all resamplers
+// with the same ratio and kept for the life of the program.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H 1
+
+#define RESAMPLE_TAPS 32          // Input samples per output sample when interpolating; more when decimating
+#define RESAMPLE_MAX_PHASES 1024
+
+struct resample_bank {
+  struct resample_bank *next;
+  unsigned int in_rate;
+  unsigned int out_rate;
+  unsigned int L;                 // Upsample ratio
+  unsigned int M;                 // Downsample ratio
+  unsigned int phases;            // Tabulated phases, L unless L > RESAMPLE_MAX_PHASES
+  int taps;                       // Per phase, multiple of 8
+  float *coeffs;                  // phases * taps, each phase time-reversed and normalized to unity DC gain
+};
+
+struct resampler {
+  struct resample_bank const *bank;
+  int channels;
+  unsigned int phase;             // 0...L-1: position of next output between input samples, units of 1/L
+  int skip;                       // Input samples to discard before the next window (decimation only)
+  int hist;                       // Input samples carried over from last call, per channel
+  int buffer_size;                // Allocated per channel
+  float *buffer;                  // Per channel (planar) input history + new input
+};
+
+int resampler_init(struct resampler *rs,unsigned int in_rate,unsigned int out_rate,int channels);
+void resampler_free(struct resampler *rs);
+void resampler_reset(struct resampler *rs);
+int resample_max_output(struct resampler const *rs,int frames);
+int resample(struct resampler *rs,float *output,float const *input,int frames);
+
+#endif
@@ -20,8 +20,6 @@
 // here assuming an R820 tuner (the most common)
 #undef USE_NEW_LIBRTLSDR
 
-//#define REMOVE_DC 1
-
 // Internal clock is 28.8 MHz, and 1.8 MHz * 16 = 28.8 MHz
 #define DEFAULT_SAMPRATE (1800000)
 
@@ -31,7 +29,6 @@ static int const HOLDOFF_TIME = 2;
 #if 0 // Reimplement this someday
 // Configurable parameters
 // decibel limits for power
-static float const DC_alpha = 1.0e-6;  // high pass filter coefficient for DC offset estimates, per sample
 static float const AGC_upper = -20;
 static float const AGC_lower = -40;
 #endif
@@ -57,10 +54,6 @@ struct sdr {
   int gain;      // Gain passed to manual gain setting
   float scale;         // Scale samples for #bits and front end gain
 
-  // Sample statistics
-  //  int clips;  // Sample clips since last reset
-  //  float DC;      // DC offset for real samples
-
   pthread_t read_thread;
 };
 
@@ -236,29 +229,12 @@ int rtlsdr_startup(struct frontend * const frontend){
 // Callback called with incoming receiver data from A/D
 static void rx_callback(uint8_t * const buf, uint32_t len, void * const ctx){
   int sampcount = len/2;
-  float energy = 0;
   struct frontend *frontend = ctx;
   struct sdr *sdr = (struct sdr *)frontend->context;
+  health_input(frontend,sampcount);
   float complex * const wptr = frontend->in.input_write_pointer.c;
-
-  for(int i=0; i < sampcount; i++){
-    float complex samp;
-    if(buf[2*i] == 0 || buf[2*i] == 255){
-      frontend->overranges++;
-      frontend->samp_since_over = 0;
-    } else
-      frontend->samp_since_over++;
-
-    if(buf[2*i+1] == 0 || buf[2*i+1] == 255){
-      frontend->overranges++;
-      frontend->samp_since_over = 0;
-    } else
-      frontend->samp_since_over++;
-    __real__ samp = (int)buf[2*i] - 128; // Excess-128
-    __imag__ samp = (int)buf[2*i+1] - 128;
-    energy += cnrmf(samp);
-    wptr[i] = sdr->scale * samp;
-  }
+  float const energy = convert_u8_iq(frontend,wptr,buf,sampcount,sdr->scale);
+  iq_correct(frontend,wptr,sampcount); // Optional DC and I/Q imbalance removal (iq-correct = yes)
   frontend->timestamp = gps_time_ns();
   write_cfilter(&frontend->in,NULL,sampcount); // Update write pointer, invoke FFT
   frontend->if_power_instant = energy / sampcount;
@@ -467,35 +467,10 @@ static void rx_callback(struct libusb_transfer * const transfer){
   sdr->success_count++;
 
   // Feed directly into FFT input buffer, accumulate energy
-  float in_energy = 0; // A/D energy accumulator
   int16_t const * const samples = (int16_t *)transfer->buffer;
-  float * const wptr = frontend->in.input_write_pointer.r;
   int const sampcount = size / sizeof(int16_t);
-  if(sdr->randomizer){
-    for(int i=0; i < sampcount; i++){
-      int32_t s = samples[i];
-      s ^= (s << 31) >> 30; // Put LSB in sign bit, then shift back by one less bit to make ..ffffe or 0
-      if(s == 32767 || s <= -32767){
-	frontend->overranges++;
-	frontend->samp_since_over = 0;
-      } else {
-	frontend->samp_since_over++;
-      }
-      in_energy += s * s;
-      wptr[i] = s * sdr->scale;
-    }
-  } else {
-    for(int i=0; i < sampcount; i++){
-      if(samples[i] == 32767 || samples[i] <= -32767){
-	frontend->overranges++;
-	frontend->samp_since_over = 0;
-      } else {
-	frontend->samp_since_over++;
-      }
-      wptr[i] = sdr->scale * samples[i];
-      in_energy += samples[i] * samples[i];
-    }
-  }
+  health_input(frontend,sampcount); // Check for lost transfers before writing
+  float const in_energy = convert_s16(frontend,frontend->in.input_write_pointer.r,samples,sampcount,sdr->scale,sdr->randomizer);
   frontend->timestamp = now;
   write_rfilter(&frontend->in,NULL,sampcount); // Update write pointer, invoke FFT if block is complete
 
@@ -0,0 +1,233 @@
+// Table of RTP receive sessions keyed on (sender socket address, SSRC)
+// Hash table for lookup, timer wheel for idle expiry
+// Copyright 2024, Phil Karn, KA9Q
+
+#define _GNU_SOURCE 1
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "misc.h"
+#include "multicast.h"
+#include "sessions.h"
+
+static unsigned int const Initial_buckets = 64;
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t h,void const *data,size_t len){
+  uint8_t const *dp = data;
+  while(len-- > 0){
+    h ^= *dp++;
+    h *= 16777619;
+  }
+  return h;
+}
+
+static uint32_t session_hash(struct sockaddr const *sender,uint32_t ssrc){
+  uint32_t h = hash_bytes(2166136261U,&ssrc,sizeof(ssrc));
+  switch(sender->sa_family){
+  case AF_INET:
+    {
+      struct sockaddr_in const *sin = (struct sockaddr_in *)sender;
+      h = hash_bytes(h,&sin->sin_addr,sizeof(sin->sin_addr));
+      h = hash_bytes(h,&sin->sin_port,sizeof(sin->sin_port));
+    }
+    break;
+  case AF_INET6:
+    {
+      struct sockaddr_in6 const *sin6 = (struct sockaddr_in6 *)sender;
+      h = hash_bytes(h,&sin6->sin6_addr,sizeof(sin6->sin6_addr));
+      h = hash_bytes(h,&sin6->sin6_port,sizeof(sin6->sin6_port));
+    }
+    break;
+  default:
+    break;
+  }
+  return h;
+}
+
+static size_t sockaddr_size(struct sockaddr const *sa){
+  switch(sa->sa_family){
+  case AF_INET:
+    return sizeof(struct sockaddr_in);
+  case AF_INET6:
+    return sizeof(struct sockaddr_in6);
+  default:
+    return sizeof(struct sockaddr);
+  }
+}
+
+// Doubly linked list primitives, using pointer-to-previous-next so no list head is needed to unlink
+static void hash_link(struct session_entry **head,struct session_entry *entry){
+  entry->hnext = *head;
+  if(entry->hnext != NULL)
+    entry->hnext->hprev = &entry->hnext;
+  entry->hprev = head;
+  *head = entry;
+}
+static void hash_unlink(struct session_entry *entry){
+  if(entry->hprev == NULL)
+    return;
+  *entry->hprev = entry->hnext;
+  if(entry->hnext != NULL)
+    entry->hnext->hprev = entry->hprev;
+  entry->hnext = NULL;
+  entry->hprev = NULL;
+}
+static void timer_link(struct session_entry **head,struct session_entry *entry){
+  entry->tnext = *head;
+  if(entry->tnext != NULL)
+    entry->tnext->tprev = &entry->tnext;
+  entry->tprev = head;
+  *head = entry;
+}
+static void timer_unlink(struct session_entry *entry){
+  if(entry->tprev == NULL)
+    return;
+  *entry->tprev = entry->tnext;
+  if(entry->tnext != NULL)
+    entry->tnext->tprev = entry->tprev;
+  entry->tnext = NULL;
+  entry->tprev = NULL;
+}
+
+// Put entry in the wheel slot for the tick when it will expire if it stays idle
+// Deadlines beyond one revolution just get looked at (and rescheduled) early
+static void schedule(struct session_table *table,struct session_entry *entry){
+  if(table->timeout <= 0)
+    return;
+  int64_t deadline = (entry->last_active + table->timeout) / table->resolution;
+  if(deadline <= table->tick)
+    deadline = table->tick + 1;
+  timer_link(&table->wheel[deadline & (SESSION_WHEEL_SLOTS-1)],entry);
+}
+
+// Double the number of hash buckets
+static void grow(struct session_table *table){
+  unsigned int const nbuckets = 2 * table->nbuckets;
+  struct session_entry **buckets = calloc(nbuckets,sizeof(*buckets));
+  if(buckets == NULL)
+    return; // Keep going with longer chains
+  for(unsigned int i = 0; i < table->nbuckets; i++){
+    struct session_entry *entry;
+    while((entry = table->buckets[i]) != NULL){
+      hash_unlink(entry);
+      hash_link(&buckets[entry->hash & (nbuckets-1)],entry);
+    }
+  }
+  FREE(table->buckets);
+  table->buckets = buckets;
+  table->nbuckets = nbuckets;
+}
+
+// timeout: idle time before expiry, 0 = never; resolution: granularity of expiry, both in ns
+int session_table_init(struct session_table *table,int64_t timeout,int64_t resolution,int64_t now){
+  assert(table != NULL);
+  memset(table,0,sizeof(*table));
+  table->buckets = calloc(Initial_buckets,sizeof(*table->buckets));
+  if(table->buckets == NULL)
+    return -1;
+  table->nbuckets = Initial_buckets;
+  table->timeout = timeout;
+  table->resolution = resolution > 0 ? resolution : BILLION;
+  table->tick = now / table->resolution;
+  return 0;
+}
+
+// Entries belong to the caller and are not freed
+void session_table_free(struct session_table *table){
+  if(table == NULL)
+    return;
+  FREE(table->buckets);
+  memset(table,0,sizeof(*table));
+}
+
+struct session_entry *session_lookup(struct session_table *table,struct sockaddr const *sender,uint32_t ssrc){
+  assert(table != NULL && sender != NULL);
+  uint32_t const hash = session_hash(sender,ssrc);
+  for(struct session_entry *entry = table->buckets[hash & (table->nbuckets-1)]; entry != NULL; entry = entry->hnext){
+    if(entry->hash == hash
+       && entry->ssrc == ssrc
+       && address_match(&entry->sender,sender)
+       && getportnumber(&entry->sender) == getportnumber(sender))
+      return entry;
+  }
+  return NULL;
+}
+
+void session_insert(struct session_table *table,struct session_entry *entry,struct sockaddr const *sender,uint32_t ssrc,void *owner,int64_t now){
+  assert(table != NULL && entry != NULL && sender != NULL);
+  assert(!entry->in_table);
+  memset(&entry->sender,0,sizeof(entry->sender));
+  memcpy(&entry->sender,sender,sockaddr_size(sender));
+  entry->ssrc = ssrc;
+  entry->hash = session_hash(sender,ssrc);
+  entry->owner = owner;
+  entry->last_active = now;
+  entry->hnext = entry->tnext = NULL;
+  entry->hprev = entry->tprev = NULL;
+
+  if(table->count >= 2 * table->nbuckets)
+    grow(table);
+  hash_link(&table->buckets[entry->hash & (table->nbuckets-1)],entry);
+  schedule(table,entry);
+  entry->in_table = true;
+  table->count++;
+}
+
+// OK to call on an entry that has already been removed (e.g., by session_expire)
+void session_remove(struct session_table *table,struct session_entry *entry){
+  assert(table != NULL);
+  if(entry == NULL || !entry->in_table)
+    return;
+  hash_unlink(entry);
+  timer_unlink(entry);
+  entry->in_table = false;
+  table->count--;
+}
+
+// Return one session idle longer than the timeout, removed from the table, or NULL if none
+// Call repeatedly until it returns NULL. Work is proportional to the wheel ticks elapsed
+// since the last call and the sessions in those slots, not to the total number of sessions
+struct session_entry *session_expire(struct session_table *table,int64_t now){
+  assert(table != NULL);
+  if(table->timeout <= 0)
+    return NULL;
+
+  int64_t const tick = now / table->resolution;
+  if(tick - table->tick > SESSION_WHEEL_SLOTS)
+    table->tick = tick - SESSION_WHEEL_SLOTS; // Every slot gets looked at once
+
+  while(table->tick < tick){
+    table->tick++;
+    struct session_entry *list = table->wheel[table->tick & (SESSION_WHEEL_SLOTS-1)];
+    table->wheel[table->tick & (SESSION_WHEEL_SLOTS-1)] = NULL;
+    if(list != NULL)
+      list->tprev = &list; // Detach the chain from the slot
+    while(list != NULL){
+      struct session_entry * const entry = list;
+      timer_unlink(entry);
+      if(now - entry->last_active >= table->timeout)
+	timer_link(&table->expired,entry);
+      else
+	schedule(table,entry); // Active since it was scheduled
+    }
+  }
+  struct session_entry * const entry = table->expired;
+  if(entry != NULL)
+    session_remove(table,entry);
+  return entry;
+}
+
+// Any session in the table, or NULL if it's empty. For closing everything down:
+//   while((entry = session_first(table)) != NULL) { session_remove(table,entry); ... }
+struct session_entry *session_first(struct session_table const *table){
+  assert(table != NULL);
+  if(table->count == 0)
+    return NULL;
+  for(unsigned int i = 0; i < table->nbuckets; i++)
+    if(table->buckets[i] != NULL)
+      return table->buckets[i];
+  return NULL;
+}
@@ -0,0 +1,60 @@
+// Table of RTP receive sessions keyed on (sender socket address, SSRC)
+// Shared by programs that demultiplex many incoming streams (pcmrecord, opusd, packetd)
+//
+// Lookups are O(1) through a hash table that grows as needed.
+// Idle sessions are found with a timer wheel, so expiring them doesn't mean scanning every session.
+// Each program embeds a struct session_entry in its own session structure;
+// 'owner' points back to the containing structure.
+// There is no internal locking; callers that share a table between threads must provide their own.
+//
+// Copyright 2024, Phil Karn, KA9Q
+
+#ifndef _SESSIONS_H
+#define _SESSIONS_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#define SESSION_WHEEL_SLOTS 64 // Must be a power of 2
+
+struct session_entry {
+  struct session_entry *hnext;   // Hash chain
+  struct session_entry **hprev;  // Points to whatever points to us
+  struct session_entry *tnext;   // Timer wheel slot (or expired) list
+  struct session_entry **tprev;
+  bool in_table;
+
+  struct sockaddr_storage sender; // Key part 1: sender address and port
+  uint32_t ssrc;                  // Key part 2: RTP SSRC
+  uint32_t hash;
+  int64_t last_active;            // ns, same time base as 'now' arguments; update with session_touch()
+  void *owner;                    // Containing structure
+};
+
+struct session_table {
+  struct session_entry **buckets;
+  unsigned int nbuckets;           // Power of 2
+  unsigned int count;              // Number of sessions in table
+
+  int64_t timeout;                 // Idle time before expiry, ns; 0 = never expire
+  int64_t resolution;              // Timer wheel tick, ns
+  int64_t tick;                    // Last tick processed
+  struct session_entry *wheel[SESSION_WHEEL_SLOTS];
+  struct session_entry *expired;   // Found idle, not yet returned by session_expire()
+};
+
+int session_table_init(struct session_table *table,int64_t timeout,int64_t resolution,int64_t now);
+void session_table_free(struct session_table *table);
+struct session_entry *session_lookup(struct session_table *table,struct sockaddr const *sender,uint32_t ssrc);
+void session_insert(struct session_table *table,struct session_entry *entry,struct sockaddr const *sender,uint32_t ssrc,void *owner,int64_t now);
+void session_remove(struct session_table *table,struct session_entry *entry);
+struct session_entry *session_expire(struct session_table *table,int64_t now);
+struct session_entry *session_first(struct session_table const *table);
+
+// Called on every packet, so it's just a store; the wheel re-examines the entry when its slot comes up
+static inline void session_touch(struct session_entry *entry,int64_t now){
+  entry->last_active = now;
+}
+
+#endif
@@ -38,14 +38,14 @@ void *demod_spectrum(void *arg){
 
   // Parameters set by system input side
   float const blockrate = 1000.0f / Blocktime; // Width in Hz of frequency bins (greater than FFT bin spacing due to forward FFT overlap)
-  int const N = Frontend.L + Frontend.M - 1;
-  float const fft_bin_spacing = blockrate * (float)Frontend.L/N; // Hz between FFT bins (less than actual FFT bin width due to FFT overlap)
+  int const N = chan->frontend->L + chan->frontend->M - 1;
+  float const fft_bin_spacing = blockrate * (float)chan->frontend->L/N; // Hz between FFT bins (less than actual FFT bin width due to FFT overlap)
 
   // Still need to clean up code to force radio freq to be multiple of FFT bin spacing
   int old_bins = -1;
 
   // experiment - make array largest possible to temp avoid memory corruption
-  chan->spectrum.bin_data = calloc(Frontend.in.bins,sizeof(*chan->spectrum.bin_data));
+  chan->spectrum.bin_data = calloc(chan->frontend->in.bins,sizeof(*chan->spectrum.bin_data));
 
   do {
     int bin_count = chan->spectrum.bin_count <= 0 ? 64 : chan->spectrum.bin_count;
@@ -56,9 +56,9 @@ void *demod_spectrum(void *arg){
     int const binsperbin = (t == 0) ? 1 : t;  // Force reasonable value
     bin_bw = binsperbin * fft_bin_spacing; // Force to integer multiple of fft_bin_spacing
     int fft_bins = bin_count * binsperbin;
-    if(fft_bins > Frontend.in.bins){
+    if(fft_bins > chan->frontend->in.bins){
       // Too many, limit to total available
-      fft_bins = Frontend.in.bins;
+      fft_bins = chan->frontend->in.bins;
       bin_count = fft_bins / binsperbin;
     }
     if(fft_bins != old_bins){
@@ -69,7 +69,7 @@ void *demod_spectrum(void *arg){
       old_bins = fft_bins;
 
       // Special filter without a response curve or IFFT
-      if(create_filter_output(&chan->filter.out,&Frontend.in,NULL,fft_bins,SPECTRUM) == NULL)
+      if(create_filter_output(&chan->filter.out,&chan->frontend->in,NULL,fft_bins,SPECTRUM) == NULL)
 	assert(0);
 
       // Although we don't use filter_output, chan->filter.min_IF and max_IF still need to be set
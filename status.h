@@ -155,6 +155,12 @@ enum status_type {
   SAMPLES_SINCE_OVER, // Samples since last A/D overrange
   PLL_WRAPS,          // Count of complete linear mode PLL rotations
   RF_LEVEL_CAL,        // Adjustment relating dBm to dBFS
+  CAPTURE_TRIGGER,     // Command: save raw front end input around now, arg = post-trigger seconds (0 = default)
+  INPUT_SAMPRATE_MEASURED, // Front end sample rate measured against the system clock, Hz (double)
+  INPUT_GAPS,          // Count of gaps detected in front end input
+  INPUT_GAP_SAMPLES,   // Total front end samples lost in gaps
+  INPUT_FILL_SAMPLES,  // Zero samples inserted in place of lost ones
+  INPUT_TIMING_ERROR,  // Smoothed lag of front end samples behind the system clock, sec
 };
 
 int encode_string(uint8_t **bp,enum status_type type,void const *buf,unsigned int buflen);
@@ -27,6 +27,7 @@
 #include "filter.h"
 #include "iir.h"
 #include "avahi.h"
+#include "fmbcast.h"
 
 #define BUFFERSIZE 16384  // Tune this
 
@@ -45,9 +46,6 @@ struct session {
  
   struct rtp_state rtp_state_in; // RTP input state
   struct rtp_state rtp_state_out; // RTP output state
-
-  float deemph_state_left;
-  float deemph_state_right;
   uint64_t packets;
 };
 
@@ -211,7 +209,7 @@ int main(int argc,char * const argv[]){
 
   // Initialize de-emphasis with 75 microseconds
   Deemph_gain = 4; // Check this later empirically
-  Deemph_rate = expf(-1.0 / (Deemph_tc * Audio_samprate));
+  Deemph_rate = -expm1f(-1.0 / (Deemph_tc * Audio_samprate));
 
   signal(SIGPIPE,SIG_IGN);
   
@@ -224,24 +222,19 @@ int main(int argc,char * const argv[]){
   // Main loop begins here
   struct packet *pkt = NULL;
   while(true){
-    // Need a new packet buffer?
-    if(!pkt)
-      pkt = malloc(sizeof(*pkt));
-    // Zero these out to catch any uninitialized derefs
-    pkt->next = NULL;
-    pkt->data = NULL;
-    pkt->len = 0;
+    // Return the last one to the pool if it wasn't queued
+    packet_free(&pkt);
     
     struct sockaddr_storage sender;
     socklen_t socksize = sizeof(sender);
-    int size = recvfrom(Input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+    int size = packet_recv(Input_fd,&pkt,(struct sockaddr *)&sender,&socksize);
     
     if(size == -1){
       if(errno != EINTR){ // Happens routinely, e.g., when window resized
 	perror("recvfrom");
 	usleep(1000);
       }
-      continue;  // Reuse current buffer
+      continue;
     }
     if(size <= RTP_MIN_SIZE)
       continue; // Must be big enough for RTP header and at least some data
@@ -367,45 +360,23 @@ void *decode(void *arg){
   // Not doing this caused a nasty memory leak
   pthread_detach(pthread_self());
 
-  // Set up audio filters: mono, pilot & stereo difference
-  // These blocksizes depend on front end sample rate and blocksize
-  // At Blocktime = 5ms and 384 kHz, L = 1920, M = 1921, N = 3840
-  int const L = roundf(Composite_samprate * Blocktime * .001); // Number of input samples in Blocktime
-  int const M = L + 1;
-  int const N = L + M - 1;
-
-  // 'audio_L' stereo samples must fit in an output packet
-  // At Blocktime = 5 ms, audio_N = 240
-  int const audio_L = (L * Audio_samprate) / Composite_samprate;
-
-  // Baseband signal 50 Hz - 15 kHz contains mono (L+R) signal
-  struct filter_in baseband;
-  create_filter_input(&baseband,L,M,REAL);
-
-  // Baseband filters, decimate from 384 Khz to 48 KHz
-  struct filter_out mono;
-  create_filter_output(&mono,&baseband,NULL,audio_L, REAL);
-  // 50 Hz to 15 kHz
-  set_filter(&mono,50.0/Audio_samprate, 15000.0/Audio_samprate, Kaiser_beta);
-
-  // Narrow filter at 19 kHz for stereo pilot
-  struct filter_out pilot;
-  create_filter_output(&pilot,&baseband,NULL,audio_L, COMPLEX);
-  // FCC says +/- 2 Hz, with +/- 20 Hz protected (73.322)
-  set_filter(&pilot,-20./Audio_samprate, 20./Audio_samprate, Kaiser_beta);
-
-  // Stereo difference (L-R) information on DSBSC carrier at 38 kHz
-  // Extends +/- 15 kHz around 38 kHz
-  struct filter_out stereo;
-  create_filter_output(&stereo,&baseband,NULL,audio_L, COMPLEX);
-  set_filter(&stereo,-15000./Audio_samprate, 15000./Audio_samprate, Kaiser_beta);
-
-  // Assume the remainder is zero, as it is for clean sample rates @ 200 Hz multiples
-  // If not, then a mop-up oscillator has to be provided
-  double const hzperbin = Composite_samprate / N;              // 100 hertz per FFT bin @ 384 kHz and 5 ms
-  int const quantum = N / (M - 1);       // rotate by multiples of (2) bins due to overlap-save (100 * 2 = 200 Hz)
-  int const pilot_rotate = quantum * round(19000./(hzperbin * quantum));
-  int const subc_rotate = quantum * round(38000./(hzperbin * quantum));
+  // Composite filters, pilot PLL and stereo matrix, decimating from 384 kHz to 48 kHz
+  // At Blocktime = 5ms, 1920 composite samples give 240 stereo frames
+  struct fmbcast fb;
+  if(fmbcast_init(&fb,Composite_samprate,Audio_samprate,Blocktime,Kaiser_beta,FMBCAST_STEREO) != 0){
+    fprintf(stderr,"Can't set up stereo decoder\n");
+    close_session(&sp);
+    return NULL;
+  }
+  fb.deemph_rate = Deemph_rate;
+  fb.deemph_gain = Deemph_gain;
+  int const audio_L = fb.audio_L;
+
+  int rtp_type = pt_from_info(Audio_samprate,2,S16BE); // 48 kHz stereo PCM
+  if(rtp_type < 0){
+    fprintf(stderr,"Can't allocate RTP payload type for samprate = %'d, channels = %d\n",Audio_samprate,2);
+    exit(EX_SOFTWARE);
+  }
 
   while(true){
     struct packet *pkt = NULL;
@@ -423,6 +394,7 @@ void *decode(void *arg){
 	  if(ret == ETIMEDOUT){
 	    // Idle timeout after 10 sec; close session and terminate thread
 	    pthread_mutex_unlock(&sp->qmutex);
+	    fmbcast_free(&fb);
 	    close_session(&sp); 
 	    return NULL; // exit thread
 	  }
@@ -451,18 +423,23 @@ void *decode(void *arg){
     
     int16_t const * const samples = (int16_t *)pkt->data;
     
-    int rtp_type = pt_from_info(Audio_samprate,2,S16BE); // 48 kHz stereo PCM
-    if(rtp_type < 0){
-      fprintf(stderr,"Can't allocate RTP payload type for samprate = %'d, channels = %d\n",Audio_samprate,2);
-      exit(EX_SOFTWARE);
-    }
-
-    for(int i=0; i<frame_size; i++){
-      float const s = SCALE * (int16_t)ntohs(samples[i]);
-      if(put_rfilter(&baseband,s) == 0)
+    float composite[PKTSIZE / sizeof(int16_t)];
+    for(int i=0; i < frame_size; i++)
+      composite[i] = SCALE * (int16_t)ntohs(samples[i]);
+
+    int i = 0;
+    while(i < frame_size){
+      int const n = fmbcast_write(&fb,&composite[i],frame_size - i);
+      if(n < 0)
+	break;
+      i += n;
+      if(!fb.ready)
 	continue;
-      // Filter input buffer full
+      // Composite block complete
       // Decimate to audio sample rate, do stereo processing
+      float audio[2 * audio_L];
+      int const channels = fmbcast_decode(&fb,audio,1.0);
+
       // ensure output pkt big enough for output filter buffer size
       uint8_t packet[PKTSIZE],*dp;
       dp = packet;
@@ -479,37 +456,12 @@ void *decode(void *arg){
       sp->rtp_state_out.bytes += 2 * sizeof(int16_t) * audio_L;
       sp->rtp_state_out.packets++;
 
-      execute_filter_output(&mono,0);    // L+R baseband output at 48 kHz
-      execute_filter_output(&pilot,pilot_rotate); // pilot spun down to 0 Hz, 48 kHz rate
-      execute_filter_output(&stereo,subc_rotate); // L-R baseband spun down to 0 Hz, 48 kHz rate
-
-      /* Should have a stereo pilot detector to squelch difference channel in mono mode
-       * But virtually every FM station is stereo anyway, except for KPBS-FM which is long and strong */
+      // Output is always stereo; without a pilot both channels carry the mono signal
       int16_t *wp = (int16_t *)dp;
-      for(int n= 0; n < audio_L; n++){
-	complex float subc_phasor = pilot.output.c[n]; // 19 kHz pilot
-	subc_phasor *= subc_phasor;       // double to 38 kHz
-
-	float const a = approx_magf(subc_phasor);  // and normalize
-	float left_minus_right = 0;
-	if(a > 0){
-	  // zero PCM input would cause a divide-by-zero and a NAN result
-	  // that would poison the de-emphasis integrators if we didn't check for it
-	  subc_phasor /= a;
-	  left_minus_right = __imag__ (conjf(subc_phasor) * stereo.output.c[n]); // Carrier is in quadrature with modulation
-	}
-	  
-	float left = mono.output.r[n] + left_minus_right; // left channel = L+R + L-R
-	assert(!isnan(sp->deemph_state_left));
-	left = sp->deemph_state_left = sp->deemph_state_left * Deemph_rate
-	  + Deemph_gain * (1 - Deemph_rate) * left;
-	*wp++ = htons(scaleclip(left));
-
-	float right =  mono.output.r[n] - left_minus_right; // right channel = L+R - (L-R)
-	assert(!isnan(sp->deemph_state_right));
-	right = sp->deemph_state_right = sp->deemph_state_right * Deemph_rate
-	  + Deemph_gain * (1 - Deemph_rate) * right;
-	*wp++ = htons(scaleclip(right));
+      for(int n = 0; n < audio_L; n++){
+	assert(!isnan(audio[n * channels]));
+	*wp++ = htons(scaleclip(audio[n * channels]));
+	*wp++ = htons(scaleclip(audio[n * channels + channels - 1]));
       }
       dp = (uint8_t *)wp;
       int const r = send(Output_fd,&packet,dp - packet,0);
@@ -519,7 +471,7 @@ void *decode(void *arg){
       }
     }
   endloop:;
-    FREE(pkt);
+    packet_free(&pkt);
   }
 }
 
@@ -578,7 +530,7 @@ int close_session(struct session ** p){
   pthread_mutex_lock(&sp->qmutex);
   while(sp->queue){
     struct packet *pkt = sp->queue->next;
-    FREE(sp->queue);
+    packet_free(&sp->queue);
     sp->queue = pkt;
   }
   pthread_mutex_unlock(&sp->qmutex);
@@ -44,16 +44,18 @@ enum encoding Encoding = NO_ENCODING;
 float RFgain = INFINITY;
 float RFatten = INFINITY;
 int Agc_enable = -1;
+float Capture = INFINITY;
 
 struct sockaddr_storage Control_address;
 int Status_sock = -1;
 int Control_sock = -1;
 
-char Optstring[] = "aA:e:f:g:G:H:hi:L:l:m:qr:R:s:vV";
+char Optstring[] = "aA:C:e:f:g:G:H:hi:L:l:m:qr:R:s:vV";
 struct option Options[] = {
   {"agc", no_argument, NULL, 'a'},
   {"rfatten", required_argument, NULL, 'A'},
   {"featten", required_argument, NULL, 'A'},
+  {"capture", required_argument, NULL, 'C'},
   {"encoding", required_argument, NULL, 'e'},
   {"frequency", required_argument, NULL, 'f'},
   {"gain", required_argument, NULL, 'g'},
@@ -96,6 +98,9 @@ int main(int argc,char *argv[]){
       case 'G':
 	RFgain = strtod(optarg,NULL);
 	break;
+      case 'C':
+	Capture = strtod(optarg,NULL);
+	break;
       case 'e':
 	Encoding = parse_encoding(optarg);
 	if(Encoding == NO_ENCODING){
@@ -254,6 +259,8 @@ int main(int argc,char *argv[]){
 	encode_float(&bp,RF_GAIN,RFgain);
       if(RFatten != INFINITY)
 	encode_float(&bp,RF_GAIN,RFatten);
+      if(Capture != INFINITY)
+	encode_float(&bp,CAPTURE_TRIGGER,Capture);
 
       encode_eol(&bp);
       int cmd_len = bp - cmd_buffer;
@@ -414,5 +421,5 @@ int main(int argc,char *argv[]){
 
 void usage(void){
   fprintf(stdout,"Usage: %s [-h|--help] [-v|--verbose] -r/--radio RADIO -s/--ssrc SSRC [-R|--samprate <sample_rate>] [-i|--iface <iface>] [-l|--locale LOCALE]  \
-[-f|--frequency <frequency>] [-L|--low <low-edge>] [-H|--high <high-edge>] [[-a|--agc] [-g|--gain <gain dB>]] [-m|--mode <mode>] [--rfgain <gain dB>] [--rfatten <atten dB>]\n" ,App_path);
+[-f|--frequency <frequency>] [-L|--low <low-edge>] [-H|--high <high-edge>] [[-a|--agc] [-g|--gain <gain dB>]] [-m|--mode <mode>] [--rfgain <gain dB>] [--rfatten <atten dB>] [-C|--capture <post-trigger sec>]\n" ,App_path);
 }
@@ -41,6 +41,7 @@ char const * wd_record_version = "This is wd-record version 0.3 which recovers f
 #include "misc.h"
 #include "attr.h"
 #include "multicast.h"
+#include "occupancy.h"
 
 // size of stdio buffer for disk I/O
 // This should be large to minimize write calls, but how big?
@@ -88,6 +89,7 @@ struct session {
   int64_t SamplesWritten;
   int64_t TotalFileSamples;
   uint32_t first_sample_number;
+  struct occupancy occupancy;  // Signal presence in the WSPR passband, saved as an attribute for the decoder side
 };
 
 int          Searching_for_first_minute = 1;    // 1 => don't write to wav file until transition from second 59 to second zero.  
@@ -510,6 +512,7 @@ void input_loop(){
                     fputc(samples[n] >> 8,sp->fp);
                     fputc(samples[n],sp->fp);
                 }
+                occupancy_s16be(&sp->occupancy,samples,samp_count,sp->channels);
             }
         } // end of packet processing
     }     // end of forever loop
@@ -524,6 +527,7 @@ void cleanup(void){
     fclose(Sessions->fp);
     Sessions->fp = NULL;
     FREE(Sessions->iobuffer);
+    occupancy_free(&Sessions->occupancy);
     FREE(Sessions);
     Sessions = next_s;
   }
@@ -610,6 +614,7 @@ struct session *create_session(
 
     sp->iobuffer = malloc(BUFFERSIZE);
     setbuffer(sp->fp,sp->iobuffer,BUFFERSIZE);
+    occupancy_init(&sp->occupancy,sp->samprate,1400,1600,6);
 
     fcntl(fd,F_SETFL,O_NONBLOCK); // Let's see if this keeps us from losing data
 
@@ -687,9 +692,17 @@ void close_session(struct session **p){
     rewind(sp->fp);
     fwrite(&sp->header,sizeof(sp->header),1,sp->fp);
     fflush(sp->fp);
+    // Peak to noise in the WSPR passband, so the decoder side can skip empty files
+    float const snr = occupancy_snr(&sp->occupancy);
+    if(!isnan(snr)){
+      attrprintf(fileno(sp->fp),"peaksnr","%.1f",snr);
+      if(verbosity > 1)
+        fprintf(stderr,"close_session(): %s peak/noise %.1f dB\n",sp->filename,snr);
+    }
     fclose(sp->fp);
     sp->fp = NULL;
   }
+  occupancy_free(&sp->occupancy);
   FREE(sp->iobuffer);
   if(sp->prev)
     sp->prev->next = sp->next;
@@ -14,6 +14,7 @@
 #include "iir.h"
 #include "radio.h"
 #include "status.h"
+#include "fmbcast.h"
 
 // Forced sample rates; config file values are ignored for now
 // The audio output sample rate can probably eventually be made configurable,
@@ -46,14 +47,11 @@ void *demod_wfm(void *arg){
 
   int const blocksize = chan->output.samprate * Blocktime / 1000;
   delete_filter_output(&chan->filter.out);
-  create_filter_output(&chan->filter.out,&Frontend.in,NULL,blocksize,COMPLEX);
+  create_filter_output(&chan->filter.out,&chan->frontend->in,NULL,blocksize,COMPLEX);
   pthread_mutex_unlock(&chan->status.lock);
 
-  // Set null here in case we quit early and try to free them
-  struct filter_in composite;
-  struct filter_out mono;
-  struct filter_out lminusr;
-  struct filter_out pilot;
+  struct fmbcast fb;
+  bool fb_init = false;
 
   float phase_memory = 0;  // Demodulator input phase memory
 
@@ -71,53 +69,14 @@ void *demod_wfm(void *arg){
 
   int squelch_state = 0; // Number of blocks for which squelch remains open
 
-  // Make these blocksizes depend on front end sample rate and blocksize
-  int const composite_L = roundf(chan->output.samprate * Blocktime * .001); // Intermediate sample rate
-  int const composite_M = composite_L + 1; // 2:1 overlap (50%)
-  int const composite_N = composite_L + composite_M - 1;
-
+  // Composite is filtered and decimated to 48 kHz for the pilot, stereo and de-emphasis processing
   // output forced to 48 kHz for now
-  const int audio_L = roundf(Audio_samprate * Blocktime * .001);
-
-  // Composite signal 50 Hz - 15 kHz contains mono (L+R) signal
-  create_filter_input(&composite,composite_L,composite_M,REAL);
-
-  assert(composite.ilen == chan->filter.out.olen);
-
-  if(composite_L < audio_L)
-    goto quit; // Front end sample rate is too low - should probably fix filter to allow interpolation
-
-  // Composite filters, decimate from 384 Khz to 48 KHz
-  create_filter_output(&mono,&composite,NULL,audio_L, REAL);
-
-  set_filter(&mono,50.0/Audio_samprate, 15000.0/Audio_samprate, chan->filter.kaiser_beta);
-
-  // Narrow filter at 19 kHz for stereo pilot
-  create_filter_output(&pilot,&composite,NULL,audio_L, COMPLEX);
-
-  // FCC says +/- 2 Hz, with +/- 20 Hz protected (73.322)
-  set_filter(&pilot,-20./Audio_samprate, 20./Audio_samprate, chan->filter.kaiser_beta);
-
-  // Stereo difference (L-R) information on DSBSC carrier at 38 kHz
-  // Extends +/- 15 kHz around 38 kHz
-  create_filter_output(&lminusr,&composite,NULL,audio_L, COMPLEX);
-
-  set_filter(&lminusr,-15000./Audio_samprate, 15000./Audio_samprate, chan->filter.kaiser_beta);
-
-  // The asserts should be valid for clean sample rates multiples of 50/100 Hz (20/10 ms)
-  // If not, then a mop-up oscillator has to be provided
-  int pilot_shift;
-  double pilot_remainder;
-  compute_tuning(composite_N,composite_M,Composite_samprate,&pilot_shift,&pilot_remainder,19000.);
-  assert((pilot_shift % 4) == 0 && pilot_remainder == 0);
-
-  int subc_shift;
-  double subc_remainder;
-  compute_tuning(composite_N,composite_M,Composite_samprate,&subc_shift,&subc_remainder,38000.);
-  assert((subc_shift % 4) == 0 && subc_remainder == 0);
-
-  complex float stereo_deemph = 0;
-  float mono_deemph = 0;
+  if(fmbcast_init(&fb,Composite_samprate,Audio_samprate,Blocktime,chan->filter.kaiser_beta,FMBCAST_STEREO) != 0)
+    goto quit; // Front end sample rate is too low, or block time doesn't fit the pilot
+  fb_init = true;
+  int const composite_L = fb.composite_L;
+  int const audio_L = fb.audio_L;
+  assert(composite_L == chan->filter.out.olen);
 
   realtime();
 
@@ -170,13 +129,14 @@ void *demod_wfm(void *arg){
       send_output(chan,NULL,audio_L,true); // Keep track of timestamps and mute state
       continue;
     }
-    // Actual FM chanulation
+    // Actual FM chanulation, directly into the composite filter input
+    float * const composite = fb.composite.input_write_pointer.r;
     for(int n=0; n < composite_L; n++){
       // Although deviation can be zero, argf() is defined as returning 0, not NAN
       float np = M_1_PIf * cargf(buffer[n]); // -1 to +1
       float x = np - phase_memory;
       phase_memory = np;
-      composite.input_write_pointer.r[n] = x > 1 ? x - 2 : x < -1 ? x + 2 : x; // reduce difference to -1 to +1
+      composite[n] = x > 1 ? x - 2 : x < -1 ? x + 2 : x; // reduce difference to -1 to +1
     } // for(int n=0; n < composite_L; n++){
     if(squelch_state == squelch_state_max){
       // Squelch fully open; look at deviation peaks
@@ -185,11 +145,11 @@ void *demod_wfm(void *arg){
       float frequency_offset = 0;
       
       for(int n=0; n < composite_L; n++){
-	frequency_offset += composite.input_write_pointer.r[n];
-	if(composite.input_write_pointer.r[n] > peak_positive_deviation)
-	  peak_positive_deviation = composite.input_write_pointer.r[n];
-	else if(composite.input_write_pointer.r[n] < peak_negative_deviation)
-	  peak_negative_deviation = composite.input_write_pointer.r[n];
+	frequency_offset += composite[n];
+	if(composite[n] > peak_positive_deviation)
+	  peak_positive_deviation = composite[n];
+	else if(composite[n] < peak_negative_deviation)
+	  peak_negative_deviation = composite[n];
       }
       frequency_offset *= chan->output.samprate * 0.5f / composite_L;  // scale to Hz
       // Update frequency offset and peak deviation, with smoothing to attenuate PL tones
@@ -206,88 +166,39 @@ void *demod_wfm(void *arg){
       chan->fm.pdeviation = max(peak_positive_deviation,-peak_negative_deviation);
     }
     // Filter & decimate to audio output sample rate
-    execute_filter_input(&composite);  // Composite at 384 kHz
-    execute_filter_output(&mono,0);    // L+R composite at 48 kHz
+    // A whole block always fits, so anything else means the composite filter is broken
+    if(fmbcast_write(&fb,NULL,composite_L) != composite_L)  // Composite at 384 kHz
+      continue;
     // Compute audio output level
     // Constant gain used by FM only; automatically adjusted by AGC in linear modes
     // We do this in the loop because headroom and BW can change
     // Force reasonable parameters if they get messed up or aren't initialized
     chan->output.gain = (2 * chan->output.headroom * chan->output.samprate) / fabsf(chan->filter.min_IF - chan->filter.max_IF);
-
-    bool pilot_present = false;
-    if(chan->output.channels == 2){
-      // See if a subcarrier is present
-      // shift signs for pilot and subcarrier don't matter because the filters are real input with symmetric spectra
-      execute_filter_output(&pilot,pilot_shift); // pilot spun to 0 Hz, 48 kHz rate
-      // I really need a better pilot detector here so we'll switch back to mono without it
-      // Probably lock a PLL to it and look at the inphase/quadrature power ratio
-      float subc_amp = 0;
-      for(int n=0; n < audio_L; n++)
-	subc_amp += cnrmf(pilot.output.c[n]);
-
-      subc_amp /= audio_L;
-      if(subc_amp > 1e-6) // empirical constant, test this some more
-	pilot_present = true;
-    }
-    if(pilot_present){
-      // Stereo multiplex processing
-      execute_filter_output(&lminusr,subc_shift); // L-R composite spun down to 0 Hz, 48 kHz rate
-
-      float complex stereo_buffer[audio_L];
-      float output_level = 0;
-      for(int n = 0; n < audio_L; n++){
-	complex float subc_phasor = pilot.output.c[n]; // 19 kHz pilot
-	subc_phasor = (subc_phasor * subc_phasor) / cnrmf(subc_phasor); // square to 38 kHz and normalize
-	float subc_info = __imag__ (conjf(subc_phasor) * lminusr.output.c[n]); // Carrier is in quadrature
-	assert(!isnan(subc_info));
-	assert(!isnan(mono.output.r[n]));
-	// demultiplex: 2L = (L+R) + (L-R); 2R = (L+R) - (L-R)
-	// L+R = mono.output.r[n]; L-R = subc_info
-	// real(s) = L, imag(s) = R
-	float complex s = mono.output.r[n] + subc_info + I * (mono.output.r[n] - subc_info);
-	if(chan->fm.rate != 0)
-	  s = stereo_deemph += chan->fm.rate * (chan->fm.gain * s - stereo_deemph);
-
-	stereo_buffer[n] = s * chan->output.gain;
-	output_level += cnrmf(stereo_buffer[n]);
-      }
-      output_level /= (2 * audio_L); // Halve power to get level per channel
-      chan->output.energy += output_level;
-      assert(chan->output.channels == 2); // Has to be, to get here
-      if(send_output(chan,(const float *)stereo_buffer,audio_L,false) < 0)
-	break; // No output stream! Terminate
-    } else { // pilot_present == false
-      // Mono processing
-      float output_level = 0;
-      if(chan->fm.rate != 0){
-	// Apply deemphasis
-	for(int n=0; n < audio_L; n++){
-	  float s = mono_deemph += chan->fm.rate * (chan->fm.gain * mono.output.r[n] - mono_deemph);
-	  mono.output.r[n] = s;
-	  output_level += s * s;
-	}
-      } else {
-	for(int n=0; n < audio_L; n++){
-	  float s = mono.output.r[n] *= chan->output.gain;
-	  output_level += s * s;
-	}
-      }
-      output_level /= audio_L;
-      chan->output.energy += output_level;
-
-      // stash channel count in case user is requesting stereo when it's not available
-      int channels_save = chan->output.channels;
-      chan->output.channels = 1;
-      if(send_output(chan,mono.output.r,audio_L,false) < 0)
-	break; // No output stream! Terminate
-      chan->output.channels = channels_save;
-    }
+    fb.deemph_rate = chan->fm.rate;
+    fb.deemph_gain = chan->fm.gain;
+    fb.flags = chan->output.channels == 2 ? FMBCAST_STEREO : 0;
+
+    float audio[2 * audio_L];
+    int const channels = fmbcast_decode(&fb,audio,chan->output.gain);
+    if(channels <= 0)
+      continue; // No block was ready; nothing to send
+    float output_level = 0;
+    for(int n = 0; n < channels * audio_L; n++)
+      output_level += audio[n] * audio[n];
+    output_level /= channels * audio_L; // Level per channel
+    chan->output.energy += output_level;
+
+    // stash channel count in case user is requesting stereo when it's not available
+    int const channels_save = chan->output.channels;
+    chan->output.channels = channels;
+    int const r = send_output(chan,audio,audio_L,false);
+    chan->output.channels = channels_save;
+    if(r < 0)
+      break; // No output stream! Terminate
   }
  quit:;
-  delete_filter_output(&mono);
-  delete_filter_output(&lminusr);
-  delete_filter_output(&pilot);
-  delete_filter_input(&composite);
+  if(fb_init)
+    fmbcast_free(&fb);
 
   return NULL;
 }